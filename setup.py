@@ -21,14 +21,14 @@ setup(
     author='Yelp',
     author_email='yelplabs@yelp.com',
     cmdclass={'build': YBinlogPBuild},
-    data_files=[('lib', ['build/libybinlogp.so', 'build/libybinlogp.so.1']),
+    data_files=[('lib', ['build/libybinlogp.so', 'build/libybinlogp.so.2']),
                 ('include', ['src/ybinlogp.h'])],
     description='Library, program, and python bindings for parsing MySQL binlogs',
     license='BSD',
     name='YBinlogP',
     package_dir={'': 'src'},
     packages=['ybinlogp'],
-    scripts=['build/ybinlogp'],
+    scripts=['build/ybinlogp', 'build/ybinlogpd'],
     url='http://github.com/Yelp/ybinlogp',
     version=about['__version__']
 )
@@ -19,22 +19,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <math.h>
 #include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
 
 #include "debugs.h"
 #include "ybinlogp.h"
 
 /******* binlog parameters ********/
 #define MIN_TYPE_CODE 0
-#define MAX_TYPE_CODE 27
 #define MIN_EVENT_LENGTH 19
-#define MAX_EVENT_LENGTH 16*1048576	/* Max statement len is generally 16MB */
 #define MAX_SERVER_ID 4294967295	   /* 0 <= server_id  <= 2**32 */
 #define TIMESTAMP_FUDGE_FACTOR 3600	  /* seconds */
 
@@ -53,9 +61,16 @@
 /******* predeclarations of ybpi functions *******/
 static int ybpi_read_fde(struct ybp_binlog_parser* restrict);
 static int ybpi_read_event(struct ybp_binlog_parser* restrict, off_t, struct ybp_event* restrict);
+static int ybpi_read_event_prefix(struct ybp_binlog_parser* restrict, off_t, struct ybp_event* restrict, size_t);
 static bool ybpi_check_event(struct ybp_event*, struct ybp_binlog_parser*);
 static off64_t ybpi_next_after(struct ybp_event* restrict);
-static off64_t ybpi_nearest_offset(struct ybp_binlog_parser* restrict, off64_t, struct ybp_event* restrict, int);
+static off64_t ybpi_nearest_offset(struct ybp_binlog_parser* restrict, off64_t, struct ybp_event* restrict);
+static void ybpi_gtid_index_observe(struct ybp_gtid_index* restrict, struct ybp_event* restrict);
+static void ybpi_bloom_index_observe(struct ybp_binlog_parser* restrict, struct ybp_event* restrict);
+static void ybpi_event_index_observe(struct ybp_event_index* restrict, struct ybp_event* restrict);
+static size_t ybpi_checksum_len(const struct ybp_binlog_parser*);
+static void ybpi_choose_decoders(struct ybp_binlog_parser*);
+static bool ybpi_is_ident_char(char);
 
 /******** implementation begins here ********/
 
@@ -67,12 +82,30 @@ struct ybp_binlog_parser* ybp_get_binlog_parser(int fd)
 	}
 	result->fd = fd;
 	result->offset = 4;
+	result->file_size = 0;
 	result->enforce_server_id = false;
 	result->slave_server_id = 0;
 	result->master_server_id = 0;
 	result->min_timestamp = 0;
 	result->max_timestamp = time(NULL) + TIMESTAMP_FUDGE_FACTOR;
 	result->has_read_fde = false;
+	result->first_event_offset = 4;
+	result->checksum_alg = YBP_CHECKSUM_OFF;
+	result->max_event_length = YBP_DEFAULT_MAX_EVENT_LENGTH;
+	result->read_limit = 0;
+	result->common_header_len = EVENT_HEADER_SIZE;
+	memcpy(result->post_header_len, ybpi_default_post_header_len, sizeof(result->post_header_len));
+	ybpi_choose_decoders(result);
+	result->gtid_set_offset = 0;
+	result->gtid_index = NULL;
+	result->bloom_index = NULL;
+	result->event_index = NULL;
+	result->search_fanout = 1;
+	result->num_time_probes = 0;
+	result->boundaries = NULL;
+	result->num_boundaries = 0;
+	result->boundaries_size = 0;
+	result->boundaries_end = 0;
 	ybp_update_bp(result);
 	ybpi_read_fde(result);
 	return result;
@@ -92,13 +125,36 @@ void ybp_update_bp(struct ybp_binlog_parser* p)
 {
 	struct stat stbuf;
 	fstat(p->fd, &stbuf);
+	/* Binlogs only grow; if this one shrank, what we learned is stale */
+	if (stbuf.st_size < p->file_size) {
+		p->num_time_probes = 0;
+		p->num_boundaries = 0;
+		if (p->event_index != NULL) {
+			p->event_index->count = 0;
+			p->event_index->scanned_to = p->first_event_offset;
+		}
+		if (p->bloom_index != NULL) {
+			memset(p->bloom_index->filters, 0, p->bloom_index->num_blocks * p->bloom_index->filter_bytes);
+			p->bloom_index->num_blocks = 0;
+			p->bloom_index->scanned_to = p->first_event_offset;
+		}
+	}
 	p->file_size = stbuf.st_size;
 }
 
+static void ybpi_dispose_gtid_index(struct ybp_gtid_index*);
+static void ybpi_dispose_bloom_index(struct ybp_bloom_index*);
+static void ybpi_dispose_event_index(struct ybp_event_index*);
+
 void ybp_dispose_binlog_parser(struct ybp_binlog_parser* p)
 {
-	if (p != NULL)
-		free(p);
+	if (p == NULL)
+		return;
+	ybpi_dispose_gtid_index(p->gtid_index);
+	ybpi_dispose_bloom_index(p->bloom_index);
+	ybpi_dispose_event_index(p->event_index);
+	free(p->boundaries);
+	free(p);
 }
 
 void ybp_init_event(struct ybp_event* evbuf)
@@ -130,13 +186,13 @@ int ybp_copy_event(struct ybp_event *dest, struct ybp_event *source)
 	Dprintf("About to copy 0x%p to 0x%p\n", (void*)source, (void*)dest);
 	memmove(dest, source, sizeof(struct ybp_event));
 	if (source->data != 0) {
-		Dprintf("mallocing %d bytes for the target\n", source->length - EVENT_HEADER_SIZE);
-		if ((dest->data = malloc(source->length - EVENT_HEADER_SIZE)) == NULL) {
+		Dprintf("mallocing %d bytes for the target\n", source->data_len);
+		if ((dest->data = malloc(source->data_len)) == NULL) {
 			perror("malloc:");
 			return -1;
 		}
 		Dprintf("copying extra data from 0x%p to 0x%p\n", source->data, dest->data);
-		memmove(dest->data, source->data, source->length - EVENT_HEADER_SIZE);
+		memmove(dest->data, source->data, source->data_len);
 	}
 	return 0;
 }
@@ -170,9 +226,9 @@ static bool ybpi_check_event(struct ybp_event* e, struct ybp_binlog_parser* p)
 				 (e->server_id == p->slave_server_id) ||
 				 (e->server_id == p->master_server_id)) &&
 			e->type_code > MIN_TYPE_CODE &&
-			e->type_code < MAX_TYPE_CODE &&
+			ybpi_event_types[e->type_code] != NULL &&
 			e->length >= MIN_EVENT_LENGTH &&
-			e->length < MAX_EVENT_LENGTH);
+			e->length <= p->max_event_length);
 }
 
 /**
@@ -194,90 +250,306 @@ static off64_t ybpi_next_after(struct ybp_event *evbuf) {
  */
 off64_t ybp_nearest_offset(struct ybp_binlog_parser* p, off64_t starting_offset)
 {
-	return ybpi_nearest_offset(p, starting_offset, NULL, 1);
+	return ybpi_nearest_offset(p, starting_offset, NULL);
+}
+
+#define RESYNC_BLOCK_SIZE 65536
+#define RESYNC_CHAIN_DEPTH 2	/* how many successors must look sane too */
+
+/**
+ * A header that merely looks sane isn't enough to call something an event
+ * boundary: statement text is full of bytes that make plausible type codes.
+ * Also require that the next few events in the chain look sane (or that
+ * the chain runs exactly up to the end of the file), and that their
+ * next_position fields advance by exactly their lengths, which is true of
+ * both binlogs and relay logs but not of a header-shaped run of text.
+ **/
+static bool ybpi_chain_continues(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict candidate, const char* block, off64_t block_start, ssize_t block_len)
+{
+	struct ybp_event next;
+	off64_t next_offset = candidate->offset + candidate->length;
+	uint32_t last_position = candidate->next_position;
+	int depth;
+	for (depth = 0; depth < RESYNC_CHAIN_DEPTH; ++depth) {
+		if (next_offset > p->file_size)
+			return false;
+		if (next_offset + EVENT_HEADER_SIZE > p->file_size)
+			return true;
+		if (next_offset + EVENT_HEADER_SIZE <= block_start + block_len) {
+			memcpy(&next, block + (next_offset - block_start), EVENT_HEADER_SIZE);
+		} else if (pread(p->fd, &next, EVENT_HEADER_SIZE, next_offset) != EVENT_HEADER_SIZE) {
+			return false;
+		}
+		next.offset = next_offset;
+		next.data = NULL;
+		if (!ybpi_check_event(&next, p))
+			return false;
+		if (last_position != 0 && next.next_position != 0 && next.next_position - last_position != next.length)
+			return false;
+		last_position = next.next_position;
+		next_offset += next.length;
+	}
+	return true;
 }
 
-off64_t ybpi_nearest_offset(struct ybp_binlog_parser* restrict p, off64_t starting_offset, struct ybp_event* restrict outbuf, int direction)
+off64_t ybpi_nearest_offset(struct ybp_binlog_parser* restrict p, off64_t starting_offset, struct ybp_event* restrict outbuf)
 {
-	unsigned int num_increments = 0;
-	off64_t offset;
-	struct ybp_event *evbuf = ybp_get_event();
-	offset = starting_offset;
-	Dprintf("In nearest offset mode, got fd=%d, starting_offset=%llu, direction=%d\n", p->fd, (long long)starting_offset, direction);
-	while ((num_increments < MAX_RETRIES) && (offset >= 0) && (offset <= p->file_size - EVENT_HEADER_SIZE) )
+	off64_t block_start = starting_offset;
+	off64_t scanned = 0;
+	char* block;
+	Dprintf("In nearest offset mode, got fd=%d, starting_offset=%llu\n", p->fd, (long long)starting_offset);
+	if ((block = malloc(RESYNC_BLOCK_SIZE)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	while ((scanned < MAX_RETRIES) && (block_start >= 0) && (block_start <= p->file_size - EVENT_HEADER_SIZE))
 	{
-		ybp_reset_event(evbuf);
-		if (ybpi_read_event(p, offset, evbuf) == -1) {
-			ybp_dispose_event(evbuf);
+		ssize_t i, block_len = pread(p->fd, block, RESYNC_BLOCK_SIZE, block_start);
+		if (block_len < 0) {
+			fprintf(stderr, "Error reading at %lld: %s\n", (long long) block_start, strerror(errno));
+			free(block);
 			return -1;
 		}
-		if (ybpi_check_event(evbuf, p)) {
-			if (outbuf != NULL)
-				ybp_copy_event(outbuf, evbuf);
-			ybp_dispose_event(evbuf);
-			return offset;
-		}
-		else {
-			Dprintf("incrementing offset from %zd to %zd\n", offset, offset + direction);
-			offset += direction;
-			++num_increments;
+		if (block_len < EVENT_HEADER_SIZE)
+			break;
+		for (i = 0; i + EVENT_HEADER_SIZE <= block_len; ++i) {
+			struct ybp_event candidate;
+			memcpy(&candidate, block + i, EVENT_HEADER_SIZE);
+			candidate.offset = block_start + i;
+			candidate.data = NULL;
+			if (ybpi_check_event(&candidate, p) && ybpi_chain_continues(p, &candidate, block, block_start, block_len)) {
+				free(block);
+				if (outbuf != NULL && ybpi_read_event(p, candidate.offset, outbuf) < 0)
+					return -1;
+				return candidate.offset;
+			}
 		}
+		/* Overlap by a header so we don't miss one straddling blocks */
+		scanned += block_len - (EVENT_HEADER_SIZE - 1);
+		block_start += block_len - (EVENT_HEADER_SIZE - 1);
 	}
-	ybp_dispose_event(evbuf);
-	Dprintf("Unable to find anything (offset=%llu)\n",(long long) offset);
+	free(block);
+	Dprintf("Unable to find anything (offset=%llu)\n",(long long) block_start);
 	return -2;
 }
 
+/******** time search ********/
+
+#define LINEAR_SCAN_BYTES 65536		/* below this, just walk the chain */
+#define PROBE_READAHEAD 65536		/* how much to prefetch per probe */
+#define MAX_SEARCH_FANOUT 16
+
+void ybp_set_max_event_length(struct ybp_binlog_parser* p, uint32_t length)
+{
+	if (length < MIN_EVENT_LENGTH)
+		length = MIN_EVENT_LENGTH;
+	p->max_event_length = length;
+}
+
+void ybp_set_read_limit(struct ybp_binlog_parser* p, size_t limit)
+{
+	if (limit > 0 && limit < YBP_MIN_READ_LIMIT)
+		limit = YBP_MIN_READ_LIMIT;
+	p->read_limit = limit;
+}
+
+ssize_t ybp_read_event_body(struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, size_t pos, char* restrict buf, size_t len)
+{
+	size_t body_len = e->length - EVENT_HEADER_SIZE;
+	ssize_t amt_read;
+	if (pos >= body_len)
+		return 0;
+	if (len > body_len - pos)
+		len = body_len - pos;
+	/* What's already in memory needn't be read again */
+	if (e->data != NULL && pos + len <= e->data_len) {
+		memcpy(buf, e->data + pos, len);
+		return len;
+	}
+	do {
+		amt_read = pread(p->fd, buf, len, e->offset + EVENT_HEADER_SIZE + pos);
+	} while (amt_read < 0 && errno == EINTR);
+	if (amt_read < 0)
+		perror("pread");
+	return amt_read;
+}
+
+void ybp_set_search_fanout(struct ybp_binlog_parser* p, unsigned int k)
+{
+	if (k < 1)
+		k = 1;
+	if (k > MAX_SEARCH_FANOUT)
+		k = MAX_SEARCH_FANOUT;
+	p->search_fanout = k;
+}
+
+/**
+ * Remember a sample. The cache is kept sorted by offset; when it's full
+ * we drop the sample closest to its left neighbour, since that one tells
+ * us the least.
+ **/
+static void ybpi_remember_probe(struct ybp_binlog_parser* p, off64_t offset, uint32_t timestamp)
+{
+	struct ybp_time_probe* probes = p->time_probes;
+	size_t i, pos = 0;
+	while (pos < p->num_time_probes && probes[pos].offset < offset)
+		++pos;
+	if (pos < p->num_time_probes && probes[pos].offset == offset)
+		return;
+	if (p->num_time_probes == YBP_TIME_PROBE_CACHE_SIZE) {
+		size_t victim = 1;
+		for (i = 2; i < p->num_time_probes; ++i) {
+			if (probes[i].offset - probes[i-1].offset < probes[victim].offset - probes[victim-1].offset)
+				victim = i;
+		}
+		memmove(&probes[victim], &probes[victim+1], (p->num_time_probes - victim - 1) * sizeof(struct ybp_time_probe));
+		p->num_time_probes--;
+		if (victim < pos)
+			pos--;
+	}
+	memmove(&probes[pos+1], &probes[pos], (p->num_time_probes - pos) * sizeof(struct ybp_time_probe));
+	probes[pos].offset = offset;
+	probes[pos].timestamp = timestamp;
+	p->num_time_probes++;
+}
+
 /**
- * Binary-search to find the record closest to the requested time
+ * Where to put the probes for one round of the search, given the bracket
+ * [lo, hi) in which the first event at target must start. Interpolates
+ * when we trust the timestamps, bisects otherwise; extra probes (fanout >
+ * 1) are spread evenly across the bracket around the main guess.
  **/
+static unsigned int ybpi_plan_probes(off64_t lo, uint32_t lo_time, off64_t hi, uint32_t hi_time, bool hi_known,
+		time_t target, bool interpolate, unsigned int fanout, off64_t* positions)
+{
+	off64_t span = hi - lo;
+	off64_t guess = lo + span / 2;
+	unsigned int i, n = 0;
+	if (interpolate && hi_known && hi_time > lo_time) {
+		double fraction = (double)(target - lo_time) / (double)(hi_time - lo_time);
+		guess = lo + (off64_t)(fraction * span);
+		/* Don't let a skewed sample pin us against one end */
+		if (guess < lo + span / 16)
+			guess = lo + span / 16;
+		if (guess > hi - span / 16)
+			guess = hi - span / 16;
+	}
+	positions[n++] = guess;
+	for (i = 1; i < fanout; ++i) {
+		off64_t pos = lo + (span * i) / fanout;
+		if (pos != guess && pos > lo && pos < hi)
+			positions[n++] = pos;
+	}
+	return n;
+}
+
 off64_t ybp_nearest_time(struct ybp_binlog_parser* restrict p, time_t target)
 {
-	off64_t file_size = p->file_size;
 	struct ybp_event *evbuf = ybp_get_event();
-	off64_t offset = file_size / 2;
-	off64_t next_increment = file_size / 4;
-	int directionality = 1;
-	off64_t found, last_found = 0;
-	Dprintf("Starting nearest_time with next_increment=%d\n", next_increment);
-	while (next_increment > 2) {
-		long long delta;
-		ybp_reset_event(evbuf);
-		found = ybpi_nearest_offset(p, offset, evbuf, directionality);
-		Dprintf("Looking for nearest offset to %zd, got %d\n", offset, found);
-		if (found == -1) {
-			return found;
+	off64_t lo, hi, positions[MAX_SEARCH_FANOUT];
+	uint32_t lo_time = 0, hi_time = 0;
+	bool hi_known = false;
+	bool interpolate = true;
+	unsigned int rounds = 0;
+	size_t i;
+
+	if (evbuf == NULL)
+		return -1;
+	if (!p->has_read_fde)
+		ybpi_read_fde(p);
+
+	/* Anchor the bracket on the first event */
+	lo = p->first_event_offset;
+	if (ybpi_read_event(p, lo, evbuf) < 0) {
+		ybp_dispose_event(evbuf);
+		return -1;
+	}
+	ybpi_remember_probe(p, lo, evbuf->timestamp);
+	lo_time = evbuf->timestamp;
+	if (evbuf->timestamp >= target) {
+		ybp_dispose_event(evbuf);
+		return lo;
+	}
+	hi = p->file_size;
+
+	/* Tighten it with whatever earlier searches learned */
+	for (i = 0; i < p->num_time_probes; ++i) {
+		struct ybp_time_probe* probe = &p->time_probes[i];
+		if (probe->timestamp < target && probe->offset > lo && probe->offset < hi) {
+			lo = probe->offset;
+			lo_time = probe->timestamp;
 		}
-		else if (found == -2) {
-			fprintf(stderr, "Ran off the end of the file, probably going to have a bad match\n");
-			last_found = found;
+	}
+	for (i = 0; i < p->num_time_probes; ++i) {
+		struct ybp_time_probe* probe = &p->time_probes[i];
+		if (probe->timestamp >= target && probe->offset > lo && probe->offset < hi) {
+			hi = probe->offset;
+			hi_time = probe->timestamp;
+			hi_known = true;
 			break;
 		}
-		last_found = found;
-		delta = (evbuf->timestamp - target);
-		if (delta > 0) {
-			directionality = -1;
+	}
+	Dprintf("nearest_time: starting with [%lld, %lld) from %zd cached probes\n", (long long)lo, (long long)hi, p->num_time_probes);
+
+	while (hi - lo > LINEAR_SCAN_BYTES) {
+		off64_t old_span = hi - lo;
+		unsigned int num_positions, fanout = p->search_fanout ? p->search_fanout : 1;
+		num_positions = ybpi_plan_probes(lo, lo_time, hi, hi_time, hi_known, target, interpolate, fanout, positions);
+		/* Get the kernel reading all of them at once */
+		if (num_positions > 1) {
+			for (i = 0; i < num_positions; ++i)
+				posix_fadvise(p->fd, positions[i], PROBE_READAHEAD, POSIX_FADV_WILLNEED);
 		}
-		else if (delta < 0) {
-			directionality = 1;
+		for (i = 0; i < num_positions; ++i) {
+			off64_t found;
+			ybp_reset_event(evbuf);
+			found = ybpi_nearest_offset(p, positions[i], evbuf);
+			if (found == -1) {
+				ybp_dispose_event(evbuf);
+				return -1;
+			}
+			if (found == -2 || found >= hi) {
+				/* No event starts between here and hi */
+				if (positions[i] < hi) {
+					hi = positions[i];
+				}
+				continue;
+			}
+			ybpi_remember_probe(p, found, evbuf->timestamp);
+			if (evbuf->timestamp < target && found > lo) {
+				lo = found;
+				lo_time = evbuf->timestamp;
+			}
+			else if (evbuf->timestamp >= target && found < hi && found > lo) {
+				hi = found;
+				hi_time = evbuf->timestamp;
+				hi_known = true;
+			}
 		}
-		Dprintf("delta=%lld at %llu, directionality=%d, next_increment=%lld\n", (long long)delta, (unsigned long long)found, directionality, (long long)next_increment);
-		if (delta == 0) {
+		if (hi < lo)
+			hi = lo;
+		rounds++;
+		/* If interpolating didn't at least halve the bracket, the
+		 * timestamps are lying to us; bisect for a round */
+		interpolate = (hi - lo) * 2 <= old_span;
+		Dprintf("nearest_time: round %u, [%lld, %lld), interpolate=%d\n", rounds, (long long)lo, (long long)hi, interpolate);
+	}
+
+	/* Walk forward from the last event known to be too early */
+	while (lo + EVENT_HEADER_SIZE <= p->file_size) {
+		ybp_reset_event(evbuf);
+		if (ybpi_read_event(p, lo, evbuf) < 0 || evbuf->length < MIN_EVENT_LENGTH)
 			break;
+		if (evbuf->timestamp >= target) {
+			ybp_dispose_event(evbuf);
+			return lo;
 		}
-	  	if (directionality == -1) {
-			offset += (next_increment  * directionality);
-		}
-		else {
-			offset += (next_increment * directionality);
-		}
-		next_increment /= 2;
+		lo = ybpi_next_after(evbuf);
 	}
 	ybp_dispose_event(evbuf);
-	return last_found;
+	return -2;
 }
 
-
 /**
  * Read an event from the parser parser, at offset offet, storing it in
  * event evbuf (which should be already init'd)
@@ -285,6 +557,15 @@ off64_t ybp_nearest_time(struct ybp_binlog_parser* restrict p, time_t target)
  * Returns -1 for system errors (seek, malloc) and -2 for format errors
  */
 static int ybpi_read_event(struct ybp_binlog_parser* restrict p, off_t offset, struct ybp_event* restrict evbuf)
+{
+	return ybpi_read_event_prefix(p, offset, evbuf, 0);
+}
+
+/**
+ * Like ybpi_read_event, but only read the first limit bytes of the body
+ * (all of it if limit is 0)
+ **/
+static int ybpi_read_event_prefix(struct ybp_binlog_parser* restrict p, off_t offset, struct ybp_event* restrict evbuf, size_t limit)
 {
 	ssize_t amt_read;
 	Dprintf("Reading event at offset %zd\n", offset);
@@ -296,32 +577,44 @@ static int ybpi_read_event(struct ybp_binlog_parser* restrict p, off_t offset, s
 	amt_read = read(p->fd, (void*)evbuf, EVENT_HEADER_SIZE);
 	evbuf->offset = offset;
 	evbuf->data = NULL;
+	evbuf->data_len = 0;
 	if (amt_read < 0) {
 		fprintf(stderr, "Error reading event at %lld: %s\n", (long long) offset, strerror(errno));
 		return -1;
 	} else if ((size_t)amt_read != EVENT_HEADER_SIZE) {
+		/* Even the header runs off the end of the file: torn, like below */
 		Dprintf("read %zd bytes, expected to read %d bytes in ybpi_read_event", amt_read, EVENT_HEADER_SIZE);
-		return -1;
+		return -2;
 	}
 	if (evbuf->length + evbuf->offset > p->file_size) {
 		return -2;
 	}
 	if (ybpi_check_event(evbuf, p)) {
-		Dprintf("mallocing %d bytes\n", evbuf->length - EVENT_HEADER_SIZE);
-		if ((evbuf->data = malloc(evbuf->length - EVENT_HEADER_SIZE)) == NULL) {
+		evbuf->data_len = evbuf->length - EVENT_HEADER_SIZE;
+		if (limit > 0 && evbuf->data_len > limit)
+			evbuf->data_len = limit;
+		Dprintf("mallocing %d bytes\n", evbuf->data_len);
+		if ((evbuf->data = malloc(evbuf->data_len)) == NULL) {
 			perror("malloc:");
 			return -1;
 		}
 		amt_read = 0;
-		Dprintf("malloced %d bytes at 0x%p for a %s\n", evbuf->length - EVENT_HEADER_SIZE, evbuf->data, ybpi_event_types[evbuf->type_code]);
-		while (amt_read < evbuf->length - EVENT_HEADER_SIZE) {
-			ssize_t remaining = evbuf->length - EVENT_HEADER_SIZE - amt_read;
+		Dprintf("malloced %d bytes at 0x%p for a %s\n", evbuf->data_len, evbuf->data, ybp_event_type(evbuf));
+		while (amt_read < evbuf->data_len) {
+			ssize_t remaining = evbuf->data_len - amt_read;
 			char* target = evbuf->data + amt_read;
 			ssize_t read_this_time = read(p->fd, target, remaining);
 			if (read_this_time < 0) {
 				perror("read extra data");
 				free(evbuf->data);
+				evbuf->data = NULL;
 				return -1;
+			} else if (read_this_time == 0) {
+				/* The file was cut short under us: a torn event */
+				free(evbuf->data);
+				evbuf->data = NULL;
+				evbuf->data_len = 0;
+				return -2;
 			}
 			amt_read += read_this_time;
 		}
@@ -332,6 +625,228 @@ static int ybpi_read_event(struct ybp_binlog_parser* restrict p, off_t offset, s
 	return 0;
 }
 
+/**
+ * Servers from 5.6.1 on end the FDE with the checksum algorithm they use
+ * for the rest of the file (and the FDE's own checksum)
+ **/
+static bool ybpi_fde_has_checksum_alg(struct ybp_event* fde)
+{
+	struct ybp_format_description_event* f = (struct ybp_format_description_event*)fde->data;
+	size_t data_len = fde->length - EVENT_HEADER_SIZE;
+	int major = 0, minor = 0, patch = 0;
+	char version[sizeof(f->server_version) + 1];
+	if (data_len < sizeof(struct ybp_format_description_event) + 1 + YBP_CHECKSUM_LEN)
+		return false;
+	memcpy(version, f->server_version, sizeof(f->server_version));
+	version[sizeof(f->server_version)] = '\0';
+	sscanf(version, "%d.%d.%d", &major, &minor, &patch);
+	return major * 10000 + minor * 100 + patch >= 50601;
+}
+
+static uint8_t ybpi_fde_checksum_alg(struct ybp_event* fde)
+{
+	if (!ybpi_fde_has_checksum_alg(fde))
+		return YBP_CHECKSUM_OFF;
+	return (uint8_t)fde->data[fde->length - EVENT_HEADER_SIZE - 1 - YBP_CHECKSUM_LEN];
+}
+
+/******** FDE-driven decoding ********/
+
+/**
+ * Find the post-header and body of e. Every decoder starts here, except
+ * the fast paths, which know where they are already.
+ **/
+static int ybpi_decode_frame(const struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	size_t extra = p->common_header_len - EVENT_HEADER_SIZE;
+	size_t post = p->post_header_len[e->type_code];
+	size_t checksum_len = ybpi_checksum_len(p);
+	if (e->data == NULL || e->length < EVENT_HEADER_SIZE + extra + post + checksum_len || e->data_len < extra + post)
+		return -2;
+	d->post_header = e->data + extra;
+	d->post_header_len = post;
+	d->body = d->post_header + post;
+	d->body_len = e->length - EVENT_HEADER_SIZE - extra - post - checksum_len;
+	d->truncated = (extra + post + d->body_len > e->data_len);
+	if (d->truncated)
+		d->body_len = e->data_len - extra - post;
+	return 0;
+}
+
+static int ybpi_decode_opaque(const struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	return ybpi_decode_frame(p, e, d);
+}
+
+/**
+ * The status vars, database and statement after a query event's
+ * post-header, once the lengths in it are known
+ **/
+static int ybpi_decode_query_body(struct ybp_decoded_event* d)
+{
+	struct ybp_query_view* q = &d->u.query;
+	size_t fixed = (size_t)q->status_var_len + q->db_name_len + 1;
+	if (d->body_len < fixed)
+		return -2;
+	q->status_vars = d->body;
+	q->db_name = d->body + q->status_var_len;
+	q->statement = q->db_name + q->db_name_len + 1;
+	q->statement_len = d->body_len - fixed;
+	return 0;
+}
+
+/**
+ * Query events as 5.0 on write them, with the standard common header:
+ * the post-header is struct ybp_query_event
+ **/
+static int ybpi_decode_query_v4(const struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	const struct ybp_query_event* qe = (const struct ybp_query_event*)e->data;
+	struct ybp_query_view* q = &d->u.query;
+	size_t checksum_len = ybpi_checksum_len(p);
+	if (e->data == NULL || e->length < EVENT_HEADER_SIZE + sizeof(struct ybp_query_event) + checksum_len ||
+			e->data_len < sizeof(struct ybp_query_event))
+		return -2;
+	d->post_header = e->data;
+	d->post_header_len = sizeof(struct ybp_query_event);
+	d->body = e->data + sizeof(struct ybp_query_event);
+	d->body_len = e->length - EVENT_HEADER_SIZE - sizeof(struct ybp_query_event) - checksum_len;
+	d->truncated = (sizeof(struct ybp_query_event) + d->body_len > e->data_len);
+	if (d->truncated)
+		d->body_len = e->data_len - sizeof(struct ybp_query_event);
+	q->thread_id = qe->thread_id;
+	q->query_time = qe->query_time;
+	q->db_name_len = qe->db_name_len;
+	q->error_code = qe->error_code;
+	q->status_var_len = qe->status_var_len;
+	return ybpi_decode_query_body(d);
+}
+
+static int ybpi_decode_query(const struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	struct ybp_query_view* q = &d->u.query;
+	const char* ph;
+	if (ybpi_decode_frame(p, e, d) < 0 || d->post_header_len < QUERY_MIN_POST_HEADER_LEN)
+		return -2;
+	ph = d->post_header;
+	memcpy(&q->thread_id, ph, 4);
+	memcpy(&q->query_time, ph + 4, 4);
+	q->db_name_len = (uint8_t)ph[8];
+	memcpy(&q->error_code, ph + 9, 2);
+	q->status_var_len = 0;
+	if (d->post_header_len >= QUERY_MIN_POST_HEADER_LEN + 2)
+		memcpy(&q->status_var_len, ph + 11, 2);
+	return ybpi_decode_query_body(d);
+}
+
+static int ybpi_decode_rotate(const struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	if (ybpi_decode_frame(p, e, d) < 0)
+		return -2;
+	/* Before v4 there was no position; the next binlog started at 4 */
+	d->u.rotate.next_position = 4;
+	if (d->post_header_len >= sizeof(uint64_t))
+		memcpy(&d->u.rotate.next_position, d->post_header, sizeof(uint64_t));
+	d->u.rotate.file_name = d->body;
+	d->u.rotate.file_name_len = d->body_len;
+	return 0;
+}
+
+static int ybpi_decode_xid(const struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	if (ybpi_decode_frame(p, e, d) < 0 || d->body_len < sizeof(uint64_t))
+		return -2;
+	memcpy(&d->u.xid, d->body, sizeof(uint64_t));
+	return 0;
+}
+
+static int ybpi_decode_intvar(const struct ybp_binlog_parser* restrict p, const struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	if (ybpi_decode_frame(p, e, d) < 0 || d->body_len < 1 + sizeof(uint64_t))
+		return -2;
+	d->u.intvar.type = (uint8_t)d->body[0];
+	memcpy(&d->u.intvar.value, d->body + 1, sizeof(uint64_t));
+	return 0;
+}
+
+/**
+ * Pick each type's decoder for the header lengths we now know, so that
+ * decoding an event is one indirect call with nothing left to check
+ **/
+static void ybpi_choose_decoders(struct ybp_binlog_parser* p)
+{
+	size_t i;
+	for (i = 0; i < sizeof(p->decoders) / sizeof(p->decoders[0]); ++i)
+		p->decoders[i] = ybpi_decode_opaque;
+	if (p->common_header_len == EVENT_HEADER_SIZE && p->post_header_len[QUERY_EVENT] == sizeof(struct ybp_query_event))
+		p->decoders[QUERY_EVENT] = ybpi_decode_query_v4;
+	else
+		p->decoders[QUERY_EVENT] = ybpi_decode_query;
+	/* Its post-header is a query's with the file's id and position after */
+	p->decoders[EXECUTE_LOAD_QUERY_EVENT] = ybpi_decode_query;
+	p->decoders[ROTATE_EVENT] = ybpi_decode_rotate;
+	p->decoders[XID_EVENT] = ybpi_decode_xid;
+	p->decoders[INTVAR_EVENT] = ybpi_decode_intvar;
+}
+
+/**
+ * Take the common header length and the post-header lengths (one byte per
+ * type code, from 1) from the FDE, falling back to the defaults for types
+ * it doesn't list
+ **/
+static void ybpi_read_header_lengths(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict fde)
+{
+	struct ybp_format_description_event* f = (struct ybp_format_description_event*)fde->data;
+	size_t data_len = fde->length - EVENT_HEADER_SIZE;
+	size_t i, num_types = 0;
+	memcpy(p->post_header_len, ybpi_default_post_header_len, sizeof(p->post_header_len));
+	p->common_header_len = EVENT_HEADER_SIZE;
+	if (data_len >= sizeof(struct ybp_format_description_event)) {
+		if (f->header_len >= EVENT_HEADER_SIZE)
+			p->common_header_len = f->header_len;
+		num_types = data_len - sizeof(struct ybp_format_description_event);
+		if (ybpi_fde_has_checksum_alg(fde))
+			num_types -= 1 + YBP_CHECKSUM_LEN;
+	}
+	for (i = 0; i < num_types && i + 1 < sizeof(p->post_header_len); ++i)
+		p->post_header_len[i + 1] = (uint8_t)fde->data[sizeof(struct ybp_format_description_event) + i];
+	ybpi_choose_decoders(p);
+}
+
+int ybp_decode_event(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, struct ybp_decoded_event* restrict d)
+{
+	if (!p->has_read_fde && ybpi_read_fde(p) < 0)
+		return -1;
+	return p->decoders[e->type_code](p, e, d);
+}
+
+struct ybp_query_event_safe* ybp_decode_safe_qe(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	struct ybp_query_event_safe* s;
+	if (e->type_code != QUERY_EVENT || ybp_decode_event(p, e, &d) < 0)
+		return NULL;
+	if ((s = malloc(sizeof(struct ybp_query_event_safe))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	s->thread_id = d.u.query.thread_id;
+	s->query_time = d.u.query.query_time;
+	s->db_name_len = d.u.query.db_name_len;
+	s->error_code = d.u.query.error_code;
+	s->status_var_len = d.u.query.status_var_len;
+	s->statement_len = d.u.query.statement_len;
+	s->statement = strndup(d.u.query.statement, d.u.query.statement_len);
+	s->db_name = strndup(d.u.query.db_name, d.u.query.db_name_len);
+	s->status_var = strndup(d.u.query.status_vars, d.u.query.status_var_len);
+	if (s->statement == NULL || s->db_name == NULL || s->status_var == NULL) {
+		perror("strndup");
+		ybp_dispose_safe_qe(s);
+		return NULL;
+	}
+	return s;
+}
+
 /**
  * Read the FDE. It's the first record in ALL binlogs
  **/
@@ -364,14 +879,19 @@ static int ybpi_read_fde(struct ybp_binlog_parser* p)
 	}
 	fde_time = evbuf->timestamp;
 	p->slave_server_id = evbuf->server_id;
+	p->checksum_alg = ybpi_fde_checksum_alg(evbuf);
+	ybpi_read_header_lengths(p, evbuf);
 
 	offset = ybpi_next_after(evbuf);
 	p->offset = offset;
+	p->first_event_offset = offset;
 	ybp_reset_event(evbuf);
 	ybpi_read_event(p, offset, evbuf);
 
 	p->master_server_id = evbuf->server_id;
 	evt_time = evbuf->timestamp;
+	if (evbuf->type_code == PREVIOUS_GTIDS_LOG_EVENT || evbuf->type_code == MARIADB_GTID_LIST_EVENT)
+		p->gtid_set_offset = offset;
 	ybp_dispose_event(evbuf);
 
 	/*
@@ -397,12 +917,20 @@ int ybp_next_event(struct ybp_binlog_parser* restrict parser, struct ybp_event*
 		ybpi_read_fde(parser);
 	}
 	parser->enforce_server_id = false;
-	ret = ybpi_read_event(parser, parser->offset, evbuf);
+	ret = ybpi_read_event_prefix(parser, parser->offset, evbuf, parser->read_limit);
 	parser->enforce_server_id = esi;
 	if (ret < 0) {
 		Dprintf("error in ybp_next_event: %d\n", ret);
 		return ret;
 	} else {
+		/* Truncated events would leave holes in these, so they stop short */
+		bool whole = (evbuf->data_len == evbuf->length - EVENT_HEADER_SIZE);
+		if (parser->gtid_index != NULL && whole)
+			ybpi_gtid_index_observe(parser->gtid_index, evbuf);
+		if (parser->bloom_index != NULL && whole)
+			ybpi_bloom_index_observe(parser, evbuf);
+		if (parser->event_index != NULL)
+			ybpi_event_index_observe(parser->event_index, evbuf);
 		parser->offset = ybpi_next_after(evbuf);
 		if ((parser->offset <= 0) || (evbuf->next_position == evbuf->offset) ||
 			(evbuf->next_position >= parser->file_size) ||
@@ -418,6 +946,156 @@ int ybp_next_event(struct ybp_binlog_parser* restrict parser, struct ybp_event*
 	}
 }
 
+/******** backwards iteration ********/
+
+#define BOUNDARY_CACHE_MAX 1048576	/* offsets, so 8MB */
+
+/**
+ * Find where the last boundary before end is in the cache; false if the
+ * cache doesn't know.
+ **/
+static bool ybpi_lookup_boundary(struct ybp_binlog_parser* p, off64_t end, size_t* index)
+{
+	size_t lo = 0, hi = p->num_boundaries;
+	if (p->num_boundaries == 0)
+		return false;
+	if (end == p->boundaries_end) {
+		*index = p->num_boundaries - 1;
+		return true;
+	}
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (p->boundaries[mid] < end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || lo == p->num_boundaries || p->boundaries[lo] != end)
+		return false;
+	*index = lo - 1;
+	return true;
+}
+
+/**
+ * Find the run of events ending exactly at end (or, at the end of the
+ * file, up to the last complete event) and put it in the cache. Resyncs on
+ * a window before end and walks the chain forward; a window that doesn't
+ * lead to end either resynced onto garbage or is smaller than the event
+ * before end, so go twice as far back.
+ **/
+static int ybpi_find_boundaries(struct ybp_binlog_parser* p, off64_t end)
+{
+	off64_t window = RESYNC_BLOCK_SIZE;
+	off64_t* run = NULL;
+	size_t run_len = 0, run_size = 0;
+	off64_t offset;
+	for (;;) {
+		bool at_start = (end - window <= 4);
+		bool clean_tail = false;
+		off64_t anchor;
+		if (at_start) {
+			anchor = 4;
+		} else if ((anchor = ybpi_nearest_offset(p, end - window, NULL)) == -1) {
+			free(run);
+			return -1;
+		}
+		run_len = 0;
+		offset = anchor;
+		while (anchor >= 0 && offset < end) {
+			struct ybp_event header;
+			if (offset + EVENT_HEADER_SIZE > end) {
+				clean_tail = true;
+				break;
+			}
+			if (pread(p->fd, &header, EVENT_HEADER_SIZE, offset) != EVENT_HEADER_SIZE)
+				break;
+			header.offset = offset;
+			header.data = NULL;
+			if (!ybpi_check_event(&header, p))
+				break;
+			if (offset + header.length > end) {
+				clean_tail = true;
+				break;
+			}
+			if (run_len == run_size) {
+				size_t new_size = run_size ? run_size * 2 : 256;
+				off64_t* new_run = realloc(run, new_size * sizeof(off64_t));
+				if (new_run == NULL) {
+					perror("realloc");
+					free(run);
+					return -1;
+				}
+				run = new_run;
+				run_size = new_size;
+			}
+			run[run_len++] = offset;
+			offset += header.length;
+		}
+		if (run_len > 0 && (offset == end || (clean_tail && end >= p->file_size)))
+			break;
+		if (at_start) {
+			free(run);
+			return -2;
+		}
+		window *= 2;
+	}
+	Dprintf("found %zd boundaries in [%lld, %lld)\n", run_len, (long long)run[0], (long long)offset);
+	/* Walking back from the front of what we already know: extend it */
+	if (p->num_boundaries > 0 && offset == p->boundaries[0] &&
+			run_len + p->num_boundaries <= BOUNDARY_CACHE_MAX) {
+		off64_t* merged = realloc(run, (run_len + p->num_boundaries) * sizeof(off64_t));
+		if (merged == NULL) {
+			perror("realloc");
+			free(run);
+			return -1;
+		}
+		memcpy(merged + run_len, p->boundaries, p->num_boundaries * sizeof(off64_t));
+		free(p->boundaries);
+		p->boundaries = merged;
+		p->num_boundaries += run_len;
+		p->boundaries_size = p->num_boundaries;
+	} else {
+		free(p->boundaries);
+		p->boundaries = run;
+		p->num_boundaries = run_len;
+		p->boundaries_size = run_size;
+		p->boundaries_end = offset;
+	}
+	return 0;
+}
+
+int ybp_prev_event(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict evbuf)
+{
+	off64_t end = p->offset;
+	bool esi = p->enforce_server_id;
+	size_t index;
+	int ret;
+	if (!p->has_read_fde)
+		ybpi_read_fde(p);
+	if (end <= p->first_event_offset)
+		return -2;
+	if (!ybpi_lookup_boundary(p, end, &index)) {
+		/* Like ybp_next_event, don't skip events from other servers */
+		p->enforce_server_id = false;
+		ret = ybpi_find_boundaries(p, end);
+		p->enforce_server_id = esi;
+		if (ret < 0)
+			return ret;
+		/* At the tail of the file, the run ends at the last complete event */
+		if (end >= p->file_size)
+			end = p->boundaries_end;
+		if (!ybpi_lookup_boundary(p, end, &index))
+			return -2;
+	}
+	p->enforce_server_id = false;
+	ret = ybpi_read_event_prefix(p, p->boundaries[index], evbuf, p->read_limit);
+	p->enforce_server_id = esi;
+	if (ret < 0)
+		return ret;
+	p->offset = evbuf->offset;
+	return (evbuf->offset > p->first_event_offset) ? 1 : 0;
+}
+
 struct ybp_format_description_event* ybp_event_as_fde(struct ybp_event* restrict e)
 {
 	if (e->type_code != FORMAT_DESCRIPTION_EVENT) {
@@ -441,6 +1119,7 @@ struct ybp_query_event* ybp_event_as_qe(struct ybp_event* restrict e)
 
 struct ybp_query_event_safe* ybp_event_to_safe_qe(struct ybp_event* restrict e) {
 	struct ybp_query_event_safe* s;
+	size_t statement_start;
 	if (e->type_code != QUERY_EVENT) {
 		fprintf(stderr, "Illegal conversion attempted: %d -> %d\n", e->type_code, QUERY_EVENT);
 		return NULL;
@@ -463,6 +1142,10 @@ struct ybp_query_event_safe* ybp_event_to_safe_qe(struct ybp_event* restrict e)
 			return NULL;
 		}
 		s->statement_len = query_event_statement_len(e);
+		/* Only as much as was read, if the body was cut short */
+		statement_start = query_event_statement(e) - e->data;
+		if (statement_start + s->statement_len > e->data_len)
+			s->statement_len = (e->data_len > statement_start) ? e->data_len - statement_start : 0;
 		s->statement = strndup((const char*)query_event_statement(e), s->statement_len);
 		Dprintf("s->statement_len = %zd\n", s->statement_len);
 		Dprintf("s->statement = %s\n", s->statement);
@@ -516,6 +1199,26 @@ struct ybp_rotate_event_safe* ybp_event_to_safe_re(struct ybp_event* restrict e)
 	return s;
 }
 
+struct ybp_rotate_event_safe* ybp_decode_safe_re(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	struct ybp_rotate_event_safe* s;
+	if (e->type_code != ROTATE_EVENT || ybp_decode_event(p, e, &d) < 0)
+		return NULL;
+	if ((s = malloc(sizeof(struct ybp_rotate_event_safe))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	s->next_position = d.u.rotate.next_position;
+	s->file_name_len = d.u.rotate.file_name_len;
+	if ((s->file_name = strndup(d.u.rotate.file_name, d.u.rotate.file_name_len)) == NULL) {
+		perror("strndup");
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
 struct ybp_xid_event* ybp_event_to_safe_xe(struct ybp_event* restrict e) {
 	struct ybp_xid_event* s;
 	if (e->type_code != XID_EVENT) {
@@ -538,9 +1241,51 @@ void ybp_dispose_safe_xe(struct ybp_xid_event* xe)
 
 const char* ybp_event_type(struct ybp_event* restrict evbuf) {
 	Dprintf("Looking up type string for %d\n", evbuf->type_code);
+	if (ybpi_event_types[evbuf->type_code] == NULL)
+		return ybpi_event_types[UNKNOWN_EVENT];
 	return ybpi_event_types[evbuf->type_code];
 }
 
+/**
+ * How many bytes the status var with the given code takes after its code
+ * byte, or -1 for codes whose length can't be known (anything newer than
+ * we are), after which nothing more of the status vars can be read.
+ **/
+static ssize_t ybpi_status_var_len(uint8_t code, const unsigned char* p, const unsigned char* end)
+{
+	ssize_t var_len;
+	if (code == Q_HRNOW)
+		return Q_HRNOW_LEN;
+	if (code == Q_XID)
+		return Q_XID_LEN;
+	if (code >= YBPI_NUM_STATUS_VARS)
+		return -1;
+	switch (ybpi_status_var_data_len_by_type[code]) {
+		case -1:
+			var_len = (p < end) ? 1 + p[0] : 1;
+			break;
+		case -2:
+			var_len = (p < end) ? 2 + p[0] : 1;
+			break;
+		case -3:
+			var_len = (p < end) ? 1 + p[0] : 1;
+			var_len += (p + var_len < end) ? 1 + p[var_len] : 1;
+			break;
+		case -4:
+			var_len = 1;
+			if (p < end && p[0] != OVER_MAX_DBS_IN_EVENT_MTS) {
+				int names = p[0];
+				while (names-- > 0 && p + var_len < end)
+					var_len += strnlen((const char*)p + var_len, end - p - var_len) + 1;
+			}
+			break;
+		default:
+			var_len = ybpi_status_var_data_len_by_type[code];
+			break;
+	}
+	return var_len;
+}
+
 void ybp_print_event_simple(struct ybp_event* restrict e,
 		struct ybp_binlog_parser* restrict p,
 		FILE* restrict stream)
@@ -570,7 +1315,7 @@ void ybp_print_event(struct ybp_event* restrict e,
 	fprintf(stream, "BYTE OFFSET %llu\n", (long long)e->offset);
 	fprintf(stream, "------------------------\n");
 	fprintf(stream, "timestamp:    		 %d = %s", e->timestamp, ctime(&t));
-	fprintf(stream, "type_code:    		 %s\n", ybpi_event_types[e->type_code]);
+	fprintf(stream, "type_code:    		 %s\n", ybp_event_type(e));
 	if (q_mode > 1)
 		return;
 	fprintf(stream, "server id:          %u\n", e->server_id);
@@ -595,16 +1340,25 @@ void ybp_print_event(struct ybp_event* restrict e,
 	switch ((enum ybp_event_types)e->type_code) {
 		case QUERY_EVENT:
 			{
-			struct ybp_query_event* q = ybp_event_as_qe(e);
-			char* db_name = query_event_db_name(e);
-			size_t statement_len = query_event_statement_len(e);
-			/* Duplicate the statement because the binlog
-			 * doesn't NUL-terminate it. */
+			struct ybp_decoded_event d;
+			struct ybp_query_view* q = &d.u.query;
+			size_t statement_len;
+			/* Duplicate the statement and database because the
+			 * binlog doesn't NUL-terminate them. */
 			char* statement;
-			if ((database_limit != NULL) && (strncmp(db_name, database_limit, strlen(database_limit)) != 0))
+			char* db_name;
+			if (ybp_decode_event(p, e, &d) < 0)
+				return;
+			statement_len = q->statement_len;
+			if ((database_limit != NULL) && (strncmp(q->db_name, database_limit, strlen(database_limit)) != 0))
+				return;
+			if ((statement = strndup(q->statement, statement_len)) == NULL) {
+				perror("strndup");
 				return;
-			if ((statement = strndup((const char*)query_event_statement(e), statement_len)) == NULL) {
+			}
+			if ((db_name = strndup(q->db_name, q->db_name_len)) == NULL) {
 				perror("strndup");
+				free(statement);
 				return;
 			}
 			fprintf(stream, "thread id:          %d\n", q->thread_id);
@@ -621,17 +1375,22 @@ void ybp_print_event(struct ybp_event* restrict e,
 				fprintf(stream, "status var length:  %d\n", q->status_var_len);
 			}
 			if (q->status_var_len > 0) {
-				char* status_var_start = query_event_status_vars(e);
-				char* status_var_ptr = status_var_start;
-				while((status_var_ptr - status_var_start) < q->status_var_len) {
-					enum ybpi_e_status_var_types status_var_type = *status_var_ptr;
-					status_var_ptr++;
-					assert(status_var_type < 10);
+				const unsigned char* status_var_ptr = (const unsigned char*)q->status_vars;
+				const unsigned char* status_var_end = status_var_ptr + q->status_var_len;
+				while (status_var_ptr < status_var_end) {
+					uint8_t status_var_type = *status_var_ptr++;
+					ssize_t var_len = ybpi_status_var_len(status_var_type, status_var_ptr, status_var_end);
+					if (var_len < 0 || status_var_ptr + var_len > status_var_end) {
+						/* Newer than we are, or cut short; either way the
+						 * rest can't be told apart */
+						fprintf(stream, "unknown status var %hhu; not showing the rest\n", status_var_type);
+						break;
+					}
 					switch (status_var_type) {
 						case Q_FLAGS2_CODE:
 							{
-							uint32_t val = *((uint32_t*)status_var_ptr);
-							status_var_ptr += 4;
+							uint32_t val;
+							memcpy(&val, status_var_ptr, 4);
 							fprintf(stream, "Q_FLAGS2:           ");
 							for(i=32; i > 0; --i)
 							{
@@ -647,116 +1406,93 @@ void ybp_print_event(struct ybp_event* restrict e,
 							}
 						case Q_SQL_MODE_CODE:
 							{
-							uint64_t val = *((uint64_t*)status_var_ptr);
-							status_var_ptr += 8;
+							uint64_t val;
+							memcpy(&val, status_var_ptr, 8);
 							fprintf(stream, "Q_SQL_MODE:         0x%0llu\n", (unsigned long long)val);
 							break;
 							}
 						case Q_CATALOG_CODE:
-							{
-							uint8_t size = *(status_var_ptr++);
-							char* str = strndup(status_var_ptr, size+1);
-							status_var_ptr += size + 1;
-							fprintf(stream, "Q_CATALOG:          %s\n", str);
-							free(str);
+							fprintf(stream, "Q_CATALOG:          %.*s\n", (int)status_var_ptr[0], status_var_ptr + 1);
 							break;
-							}
 						case Q_AUTO_INCREMENT:
 							{
-							uint16_t byte_1 = *(uint16_t*)status_var_ptr;
-							status_var_ptr += 2;
-							uint16_t byte_2 = *(uint16_t*)status_var_ptr;
-							status_var_ptr += 2;
+							uint16_t byte_1, byte_2;
+							memcpy(&byte_1, status_var_ptr, 2);
+							memcpy(&byte_2, status_var_ptr + 2, 2);
 							fprintf(stream, "Q_AUTO_INCREMENT:   (%hu,%hu)\n", byte_1, byte_2);
 							break;
 							}
 						case Q_CHARSET_CODE:
 							{
-							uint16_t byte_1 = *(uint16_t*)status_var_ptr;
-							status_var_ptr += 2;
-							uint16_t byte_2 = *(uint16_t*)status_var_ptr;
-							status_var_ptr += 2;
-							uint16_t byte_3 = *(uint16_t*)status_var_ptr;
-							status_var_ptr += 2;
+							uint16_t byte_1, byte_2, byte_3;
+							memcpy(&byte_1, status_var_ptr, 2);
+							memcpy(&byte_2, status_var_ptr + 2, 2);
+							memcpy(&byte_3, status_var_ptr + 4, 2);
 							fprintf(stream, "Q_CHARSET:          (%hu,%hu,%hu)\n", byte_1, byte_2, byte_3);
 							break;
 							}
 						case Q_TIME_ZONE_CODE:
-							{
-							uint8_t size = *(status_var_ptr++);
-							char* str = strndup(status_var_ptr, size);
-							status_var_ptr += size;
-							fprintf(stream, "Q_TIME_ZONE:        %s\n", str);
-							free(str);
+							fprintf(stream, "Q_TIME_ZONE:        %.*s\n", (int)status_var_ptr[0], status_var_ptr + 1);
 							break;
-							}
 						case Q_CATALOG_NZ_CODE:
-							{
-							uint8_t size = *(status_var_ptr++);
-							char* str = strndup(status_var_ptr, size);
-							status_var_ptr += size;
-							fprintf(stream, "Q_CATALOG_NZ:       %s\n", str);
-							free(str);
+							fprintf(stream, "Q_CATALOG_NZ:       %.*s\n", (int)status_var_ptr[0], status_var_ptr + 1);
 							break;
-							}
 						case Q_LC_TIME_NAMES_CODE:
 							{
-							uint16_t code = *(uint16_t*)status_var_ptr;
-							status_var_ptr += 2;
+							uint16_t code;
+							memcpy(&code, status_var_ptr, 2);
 							fprintf(stream, "Q_LC_TIME_NAMES:    %hu\n", code);
 							break;
 							}
 						case Q_CHARSET_DATABASE_CODE:
 							{
-							uint16_t code = *(uint16_t*)status_var_ptr;
-							status_var_ptr += 2;
+							uint16_t code;
+							memcpy(&code, status_var_ptr, 2);
 							fprintf(stream, "Q_CHARSET_DATABASE: %hu\n", code);
 							break;
 							}
+						case Q_HRNOW:
+							fprintf(stream, "Q_HRNOW\n");
+							break;
+						case Q_XID:
+							fprintf(stream, "Q_XID\n");
+							break;
 						default:
-							{
-							int incr = ybpi_status_var_data_len_by_type[status_var_type];
 							fprintf(stream, "%s\n", ybpi_variable_types[status_var_type]);
-							if (incr > 0) {
-								status_var_ptr += incr;
-							}
-							else if (incr == -1) {
-								uint8_t size = *status_var_ptr;
-								status_var_ptr += size + 1;
-							}
-							else if (incr == -2) {
-								uint8_t size = *status_var_ptr;
-								status_var_ptr += size + 2;
-							}
-							else {
-								assert(0);
-							}
-							fprintf(stream, "                        %s\n", ybpi_status_var_types[status_var_type]);
 							break;
-							}
 					}
+					status_var_ptr += var_len;
 				}
 			}
 			fprintf(stream, "statement length:   %zd\n", statement_len);
+			if (d.truncated)
+				fprintf(stream, "STATEMENT TRUNCATED after %u of %u bytes of the event\n",
+						e->data_len + EVENT_HEADER_SIZE, e->length);
 			if (q_mode == 0)
 				fprintf(stream, "statement:          %s\n", statement);
 			free(statement);
+			free(db_name);
 			}
 			break;
 		case ROTATE_EVENT:
 			{
-			struct ybp_rotate_event *r = (struct ybp_rotate_event*)e->data;
-			char *file_name = strndup((const char*)rotate_event_file_name(e), rotate_event_file_name_len(e));
-			fprintf(stream, "next log position:  %llu\n", (unsigned long long)r->next_position);
+			struct ybp_decoded_event d;
+			char *file_name;
+			if (ybp_decode_event(p, e, &d) < 0)
+				break;
+			file_name = strndup(d.u.rotate.file_name, d.u.rotate.file_name_len);
+			fprintf(stream, "next log position:  %llu\n", (unsigned long long)d.u.rotate.next_position);
 			fprintf(stream, "next file name:     %s\n", file_name);
 			free(file_name);
 			}
 			break;
 		case INTVAR_EVENT:
 			{
-			struct ybp_intvar_event *i = (struct ybp_intvar_event*)e->data;
-			fprintf(stream, "variable type:      %s\n", ybpi_intvar_types[i->type]);
-			fprintf(stream, "value:              %llu\n", (unsigned long long) i->value);
+			struct ybp_decoded_event d;
+			if (ybp_decode_event(p, e, &d) < 0 || d.u.intvar.type > 2)
+				break;
+			fprintf(stream, "variable type:      %s\n", ybpi_intvar_types[d.u.intvar.type]);
+			fprintf(stream, "value:              %llu\n", (unsigned long long)d.u.intvar.value);
 			}
 			break;
 		case RAND_EVENT:
@@ -775,8 +1511,25 @@ void ybp_print_event(struct ybp_event* restrict e,
 			break;
 		case XID_EVENT:
 			{
-			struct ybp_xid_event *x = (struct ybp_xid_event*)e->data;
-			fprintf(stream, "xid id:             %llu\n", (unsigned long long)x->id);
+			struct ybp_decoded_event d;
+			if (ybp_decode_event(p, e, &d) == 0)
+				fprintf(stream, "xid id:             %llu\n", (unsigned long long)d.u.xid);
+			}
+			break;
+		case GTID_LOG_EVENT:
+		case ANONYMOUS_GTID_LOG_EVENT:
+		case MARIADB_GTID_EVENT:
+			{
+			struct ybp_gtid gtid;
+			char gtid_str[YBP_GTID_STR_LEN];
+			if (ybp_event_to_gtid(e, &gtid) < 0)
+				break;
+			ybp_format_gtid(&gtid, gtid_str);
+			fprintf(stream, "gtid:               %s\n", gtid_str);
+			if (v_mode && gtid.flavor == YBP_GTID_MYSQL) {
+				fprintf(stream, "last committed:     %llu\n", (unsigned long long)gtid.last_committed);
+				fprintf(stream, "sequence number:    %llu\n", (unsigned long long)gtid.sequence_number);
+			}
 			}
 			break;
 		default:
@@ -785,4 +1538,8311 @@ void ybp_print_event(struct ybp_event* restrict e,
 	}
 }
 
+/******** SQL output ********/
+
+#define OPTION_AUTO_IS_NULL				0x4000
+#define OPTION_NOT_AUTOCOMMIT			0x80000
+#define OPTION_NO_FOREIGN_KEY_CHECKS	0x4000000
+#define OPTION_RELAXED_UNIQUE_CHECKS	0x8000000
+
+/* ybp_event.flags: the statement must not run in its db (CREATE DATABASE) */
+#define LOG_EVENT_SUPPRESS_USE			0x0008
+
+/* Bits of ybp_sql_writer.written */
+#define SQL_DB				0x001
+#define SQL_TIMESTAMP		0x002
+#define SQL_THREAD_ID		0x004
+#define SQL_FLAGS2			0x008
+#define SQL_SQL_MODE		0x010
+#define SQL_AUTO_INCREMENT	0x020
+#define SQL_CHARSET			0x040
+#define SQL_TIME_ZONE		0x080
+#define SQL_LC_TIME_NAMES	0x100
+#define SQL_COLLATION_DB	0x200
+
+#define SQL_DELIMITER "/*!*/;"
+
+enum ybpi_user_var_types {
+	STRING_RESULT=0,
+	REAL_RESULT=1,
+	INT_RESULT=2,
+	ROW_RESULT=3,
+	DECIMAL_RESULT=4
+};
+
+/**
+ * The settings a query event's status vars carry, where present (the
+ * SQL_* bits in has)
+ **/
+struct ybpi_status_vars {
+	uint32_t	has;
+	uint32_t	flags2;
+	uint64_t	sql_mode;
+	uint16_t	auto_increment_increment;
+	uint16_t	auto_increment_offset;
+	uint16_t	charset_client;
+	uint16_t	collation_connection;
+	uint16_t	collation_server;
+	uint16_t	lc_time_names;
+	uint16_t	collation_database;
+	uint32_t	microseconds;
+	char		time_zone[64];
+};
+
+static void ybpi_parse_status_vars(const unsigned char* p, size_t len, struct ybpi_status_vars* sv)
+{
+	const unsigned char* end = p + len;
+	memset(sv, 0, sizeof(*sv));
+	while (p < end) {
+		uint8_t code = *p++;
+		ssize_t var_len = ybpi_status_var_len(code, p, end);
+		if (var_len < 0) {
+			/* Can't know how long it is, so can't go on */
+			Dprintf("unknown status var %d\n", code);
+			return;
+		}
+		if (p + var_len > end)
+			return;
+		switch (code) {
+			case Q_FLAGS2_CODE:
+				memcpy(&sv->flags2, p, 4);
+				sv->has |= SQL_FLAGS2;
+				break;
+			case Q_SQL_MODE_CODE:
+				memcpy(&sv->sql_mode, p, 8);
+				sv->has |= SQL_SQL_MODE;
+				break;
+			case Q_AUTO_INCREMENT:
+				memcpy(&sv->auto_increment_increment, p, 2);
+				memcpy(&sv->auto_increment_offset, p + 2, 2);
+				sv->has |= SQL_AUTO_INCREMENT;
+				break;
+			case Q_CHARSET_CODE:
+				memcpy(&sv->charset_client, p, 2);
+				memcpy(&sv->collation_connection, p + 2, 2);
+				memcpy(&sv->collation_server, p + 4, 2);
+				sv->has |= SQL_CHARSET;
+				break;
+			case Q_TIME_ZONE_CODE:
+				snprintf(sv->time_zone, sizeof(sv->time_zone), "%.*s", (int)p[0], p + 1);
+				sv->has |= SQL_TIME_ZONE;
+				break;
+			case Q_LC_TIME_NAMES_CODE:
+				memcpy(&sv->lc_time_names, p, 2);
+				sv->has |= SQL_LC_TIME_NAMES;
+				break;
+			case Q_CHARSET_DATABASE_CODE:
+				memcpy(&sv->collation_database, p, 2);
+				sv->has |= SQL_COLLATION_DB;
+				break;
+			case Q_MICROSECONDS:
+				sv->microseconds = p[0] | (p[1] << 8) | (p[2] << 16);
+				break;
+			default:
+				break;
+		}
+		p += var_len;
+	}
+}
+
+/**
+ * Enough of the collation table to tell the mysql client (with \C) how
+ * statement text is encoded
+ **/
+static const char* ybpi_charset_name(uint16_t collation)
+{
+	switch (collation) {
+		case 5: case 8: case 15: case 31: case 47: case 48: case 49: case 94:
+			return "latin1";
+		case 11: case 65:
+			return "ascii";
+		case 33: case 76: case 83: case 223:
+			return "utf8";
+		case 45: case 46:
+			return "utf8mb4";
+		case 63:
+			return "binary";
+	}
+	if (collation >= 192 && collation <= 215)
+		return "utf8";
+	if ((collation >= 224 && collation <= 247) || (collation >= 255 && collation <= 323))
+		return "utf8mb4";
+	return NULL;
+}
+
+static void ybpi_sql_quote_name(FILE* out, const char* name, size_t len)
+{
+	size_t i;
+	fputc('`', out);
+	for (i = 0; i < len; ++i) {
+		if (name[i] == '`')
+			fputc('`', out);
+		fputc(name[i], out);
+	}
+	fputc('`', out);
+}
+
+static void ybpi_sql_hex(FILE* out, const unsigned char* data, size_t len)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	size_t i;
+	fputs("0x", out);
+	for (i = 0; i < len; ++i) {
+		fputc(digits[data[i] >> 4], out);
+		fputc(digits[data[i] & 0xf], out);
+	}
+}
+
+static void ybpi_sql_base64(FILE* out, const unsigned char* data, size_t len)
+{
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+	for (i = 0; i + 2 < len; i += 3) {
+		uint32_t v = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
+		fputc(digits[(v >> 18) & 0x3f], out);
+		fputc(digits[(v >> 12) & 0x3f], out);
+		fputc(digits[(v >> 6) & 0x3f], out);
+		fputc(digits[v & 0x3f], out);
+	}
+	if (i < len) {
+		uint32_t v = data[i] << 16;
+		if (i + 1 < len)
+			v |= data[i+1] << 8;
+		fputc(digits[(v >> 18) & 0x3f], out);
+		fputc(digits[(v >> 12) & 0x3f], out);
+		fputc((i + 1 < len) ? digits[(v >> 6) & 0x3f] : '=', out);
+		fputc('=', out);
+	}
+}
+
+/**
+ * Print a DECIMAL in MySQL's binary format: nine decimal digits to every
+ * four bytes, big-endian, sign in the top bit and negatives inverted
+ **/
+static bool ybpi_sql_decimal(FILE* out, const unsigned char* data, size_t len)
+{
+	static const int dig2bytes[10] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+	unsigned char buf[64];
+	int precision, scale, intg, intg0, intg0x, frac0, frac0x, size, i, j;
+	size_t pos = 2;
+	unsigned char mask;
+	bool printed = false;
+	if (len < 2)
+		return false;
+	precision = data[0];
+	scale = data[1];
+	intg = precision - scale;
+	intg0 = intg / 9;
+	intg0x = intg % 9;
+	frac0 = scale / 9;
+	frac0x = scale % 9;
+	size = intg0 * 4 + dig2bytes[intg0x] + frac0 * 4 + dig2bytes[frac0x];
+	if (intg < 0 || size <= 0 || (size_t)size > sizeof(buf) || len < 2 + (size_t)size)
+		return false;
+	memcpy(buf, data + pos, size);
+	mask = (buf[0] & 0x80) ? 0 : 0xff;
+	buf[0] ^= 0x80;
+	for (i = 0; i < size; ++i)
+		buf[i] ^= mask;
+	if (mask)
+		fputc('-', out);
+	pos = 0;
+	/* The integer part: a short group, then whole ones */
+	for (j = -1; j < intg0; ++j) {
+		int bytes = (j < 0) ? dig2bytes[intg0x] : 4;
+		uint32_t v = 0;
+		for (i = 0; i < bytes; ++i)
+			v = (v << 8) | buf[pos++];
+		if (bytes == 0)
+			continue;
+		if (printed)
+			fprintf(out, "%09u", v);
+		else if (v != 0) {
+			fprintf(out, "%u", v);
+			printed = true;
+		}
+	}
+	if (!printed)
+		fputc('0', out);
+	if (scale > 0) {
+		fputc('.', out);
+		for (j = 0; j <= frac0; ++j) {
+			int bytes = (j < frac0) ? 4 : dig2bytes[frac0x];
+			int digits = (j < frac0) ? 9 : frac0x;
+			uint32_t v = 0;
+			for (i = 0; i < bytes; ++i)
+				v = (v << 8) | buf[pos++];
+			if (digits > 0)
+				fprintf(out, "%0*u", digits, v);
+		}
+	}
+	return true;
+}
+
+/**
+ * The "# at" and summary comment mysqlbinlog puts before every event
+ **/
+static void ybpi_sql_comment(struct ybp_sql_writer* restrict w, struct ybp_event* restrict e)
+{
+	time_t t = e->timestamp;
+	struct tm tm;
+	localtime_r(&t, &tm);
+	fprintf(w->out, "# at %lld\n#%02d%02d%02d %2d:%02d:%02d server id %u  end_log_pos %u \t%s",
+			(long long)e->offset, tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+			tm.tm_sec, e->server_id, e->next_position, ybp_event_type(e));
+}
+
+static void ybpi_sql_session(struct ybp_sql_writer* restrict w, struct ybp_event* restrict e, const struct ybp_query_view* restrict q, const struct ybpi_status_vars* restrict sv)
+{
+	FILE* out = w->out;
+	if (!(w->written & SQL_TIMESTAMP) || w->timestamp != e->timestamp || w->microseconds != sv->microseconds) {
+		if (sv->microseconds)
+			fprintf(out, "SET TIMESTAMP=%u.%06u" SQL_DELIMITER "\n", e->timestamp, sv->microseconds);
+		else
+			fprintf(out, "SET TIMESTAMP=%u" SQL_DELIMITER "\n", e->timestamp);
+		w->timestamp = e->timestamp;
+		w->microseconds = sv->microseconds;
+		w->written |= SQL_TIMESTAMP;
+	}
+	if (!(w->written & SQL_THREAD_ID) || w->thread_id != q->thread_id) {
+		fprintf(out, "SET @@session.pseudo_thread_id=%u" SQL_DELIMITER "\n", q->thread_id);
+		w->thread_id = q->thread_id;
+		w->written |= SQL_THREAD_ID;
+	}
+	if ((sv->has & SQL_FLAGS2) && (!(w->written & SQL_FLAGS2) || w->flags2 != sv->flags2)) {
+		fprintf(out, "SET @@session.foreign_key_checks=%d, @@session.sql_auto_is_null=%d, "
+				"@@session.unique_checks=%d, @@session.autocommit=%d" SQL_DELIMITER "\n",
+				!(sv->flags2 & OPTION_NO_FOREIGN_KEY_CHECKS), !!(sv->flags2 & OPTION_AUTO_IS_NULL),
+				!(sv->flags2 & OPTION_RELAXED_UNIQUE_CHECKS), !(sv->flags2 & OPTION_NOT_AUTOCOMMIT));
+		w->flags2 = sv->flags2;
+		w->written |= SQL_FLAGS2;
+	}
+	if ((sv->has & SQL_SQL_MODE) && (!(w->written & SQL_SQL_MODE) || w->sql_mode != sv->sql_mode)) {
+		fprintf(out, "SET @@session.sql_mode=%llu" SQL_DELIMITER "\n", (unsigned long long)sv->sql_mode);
+		w->sql_mode = sv->sql_mode;
+		w->written |= SQL_SQL_MODE;
+	}
+	if ((sv->has & SQL_AUTO_INCREMENT) && (!(w->written & SQL_AUTO_INCREMENT) ||
+				w->auto_increment_increment != sv->auto_increment_increment ||
+				w->auto_increment_offset != sv->auto_increment_offset)) {
+		fprintf(out, "SET @@session.auto_increment_increment=%u, @@session.auto_increment_offset=%u" SQL_DELIMITER "\n",
+				sv->auto_increment_increment, sv->auto_increment_offset);
+		w->auto_increment_increment = sv->auto_increment_increment;
+		w->auto_increment_offset = sv->auto_increment_offset;
+		w->written |= SQL_AUTO_INCREMENT;
+	}
+	if ((sv->has & SQL_CHARSET) && (!(w->written & SQL_CHARSET) ||
+				w->charset_client != sv->charset_client ||
+				w->collation_connection != sv->collation_connection ||
+				w->collation_server != sv->collation_server)) {
+		const char* name = ybpi_charset_name(sv->charset_client);
+		if (name != NULL)
+			fprintf(out, "/*!\\C %s */" SQL_DELIMITER "\n", name);
+		fprintf(out, "SET @@session.character_set_client=%u,@@session.collation_connection=%u,"
+				"@@session.collation_server=%u" SQL_DELIMITER "\n",
+				sv->charset_client, sv->collation_connection, sv->collation_server);
+		w->charset_client = sv->charset_client;
+		w->collation_connection = sv->collation_connection;
+		w->collation_server = sv->collation_server;
+		w->written |= SQL_CHARSET;
+	}
+	if ((sv->has & SQL_TIME_ZONE) && (!(w->written & SQL_TIME_ZONE) || strcmp(w->time_zone, sv->time_zone) != 0)) {
+		fprintf(out, "SET @@session.time_zone='%s'" SQL_DELIMITER "\n", sv->time_zone);
+		memcpy(w->time_zone, sv->time_zone, sizeof(w->time_zone));
+		w->written |= SQL_TIME_ZONE;
+	}
+	if ((sv->has & SQL_LC_TIME_NAMES) && (!(w->written & SQL_LC_TIME_NAMES) || w->lc_time_names != sv->lc_time_names)) {
+		fprintf(out, "SET @@session.lc_time_names=%u" SQL_DELIMITER "\n", sv->lc_time_names);
+		w->lc_time_names = sv->lc_time_names;
+		w->written |= SQL_LC_TIME_NAMES;
+	}
+	if ((sv->has & SQL_COLLATION_DB) && (!(w->written & SQL_COLLATION_DB) || w->collation_database != sv->collation_database)) {
+		if (sv->collation_database)
+			fprintf(out, "SET @@session.collation_database=%u" SQL_DELIMITER "\n", sv->collation_database);
+		else
+			fprintf(out, "SET @@session.collation_database=DEFAULT" SQL_DELIMITER "\n");
+		w->collation_database = sv->collation_database;
+		w->written |= SQL_COLLATION_DB;
+	}
+}
+
+/**
+ * A query event, with statement in place of its own if that isn't NULL
+ **/
+static void ybpi_sql_query(struct ybp_sql_writer* restrict w, struct ybp_event* restrict e, const char* statement, size_t statement_len)
+{
+	struct ybp_decoded_event d;
+	const struct ybp_query_view* q = &d.u.query;
+	struct ybpi_status_vars sv;
+	const char* db_name;
+	if (ybp_decode_event(w->parser, e, &d) < 0)
+		return;
+	fprintf(w->out, "\tthread_id=%u\texec_time=%u\terror_code=%u\n", q->thread_id, q->query_time, q->error_code);
+	db_name = q->db_name;
+	if (q->db_name_len > 0 && !(e->flags & LOG_EVENT_SUPPRESS_USE) && (!(w->written & SQL_DB) || strlen(w->db) != q->db_name_len ||
+				memcmp(w->db, db_name, q->db_name_len) != 0)) {
+		fputs("use ", w->out);
+		ybpi_sql_quote_name(w->out, db_name, q->db_name_len);
+		fputs(SQL_DELIMITER "\n", w->out);
+		memcpy(w->db, db_name, q->db_name_len);
+		w->db[q->db_name_len] = '\0';
+		w->written |= SQL_DB;
+	}
+	ybpi_parse_status_vars((const unsigned char*)q->status_vars, q->status_var_len, &sv);
+	ybpi_sql_session(w, e, q, &sv);
+	if (statement == NULL) {
+		statement = q->statement;
+		statement_len = q->statement_len;
+	}
+	fwrite(statement, 1, statement_len, w->out);
+	fputs("\n" SQL_DELIMITER "\n", w->out);
+}
+
+static void ybpi_sql_user_var(struct ybp_sql_writer* restrict w, struct ybp_event* restrict e)
+{
+	const unsigned char* data = (const unsigned char*)e->data;
+	size_t len = e->length - EVENT_HEADER_SIZE - w->checksum_len;
+	uint32_t name_len, charset, value_len;
+	const unsigned char* value;
+	uint8_t type;
+	fputc('\n', w->out);
+	if (len < 4)
+		return;
+	memcpy(&name_len, data, 4);
+	if (len < 4 + (size_t)name_len + 1)
+		return;
+	fputs("SET @", w->out);
+	ybpi_sql_quote_name(w->out, (const char*)data + 4, name_len);
+	fputs(":=", w->out);
+	data += 4 + name_len;
+	len -= 4 + name_len;
+	if (data[0] != 0 || len < 10) {
+		fputs("NULL" SQL_DELIMITER "\n", w->out);
+		return;
+	}
+	type = data[1];
+	memcpy(&charset, data + 2, 4);
+	memcpy(&value_len, data + 6, 4);
+	value = data + 10;
+	if (len < 10 + (size_t)value_len) {
+		fputs("NULL" SQL_DELIMITER "\n", w->out);
+		return;
+	}
+	switch (type) {
+		case STRING_RESULT:
+			{
+			const char* name = ybpi_charset_name(charset);
+			fprintf(w->out, "_%s ", (name != NULL) ? name : "binary");
+			ybpi_sql_hex(w->out, value, value_len);
+			}
+			break;
+		case REAL_RESULT:
+			{
+			double d = 0;
+			memcpy(&d, value, (value_len < sizeof(d)) ? value_len : sizeof(d));
+			fprintf(w->out, "%.17g", d);
+			}
+			break;
+		case INT_RESULT:
+			{
+			int64_t i = 0;
+			bool is_unsigned = (len > 10 + (size_t)value_len) && (value[value_len] & 1);
+			memcpy(&i, value, (value_len < sizeof(i)) ? value_len : sizeof(i));
+			if (is_unsigned)
+				fprintf(w->out, "%llu", (unsigned long long)i);
+			else
+				fprintf(w->out, "%lld", (long long)i);
+			}
+			break;
+		case DECIMAL_RESULT:
+			if (ybpi_sql_decimal(w->out, value, value_len))
+				break;
+			/* fall through */
+		default:
+			fputs("NULL /* undecodable value */", w->out);
+			break;
+	}
+	fputs(SQL_DELIMITER "\n", w->out);
+}
+
+/**
+ * An event the server has to apply itself: hand it over verbatim
+ **/
+static void ybpi_sql_binlog_statement(struct ybp_sql_writer* restrict w, struct ybp_event* restrict e)
+{
+	unsigned char* raw;
+	if ((raw = malloc(e->length)) == NULL) {
+		perror("malloc");
+		return;
+	}
+	memcpy(raw, e, EVENT_HEADER_SIZE);
+	if (e->data != NULL)
+		memcpy(raw + EVENT_HEADER_SIZE, e->data, e->length - EVENT_HEADER_SIZE);
+	fputs("BINLOG '\n", w->out);
+	ybpi_sql_base64(w->out, raw, e->length);
+	fputs("\n'" SQL_DELIMITER "\n", w->out);
+	free(raw);
+}
+
+/**
+ * Feed a LOAD DATA event to w->loads, replaying the load once its file is
+ * whole
+ **/
+static int ybpi_sql_load(struct ybp_sql_writer* restrict w, struct ybp_event* restrict e)
+{
+	struct ybp_load_statement* load;
+	int ret = ybp_loads_observe(w->loads, w->parser, e, &load);
+	if (ret == -1)
+		return -1;
+	if (ret == 1)
+		ybpi_sql_query(w, e, load->statement, load->statement_len);
+	else if (ret == -2)
+		fputs("\n# (malformed LOAD DATA event; skipped)\n", w->out);
+	else
+		fputc('\n', w->out);
+	return ferror(w->out) ? -1 : 0;
+}
+
+int ybp_sql_begin(struct ybp_sql_writer* restrict w, struct ybp_binlog_parser* restrict p, FILE* restrict out)
+{
+	struct ybp_event* fde;
+	memset(w, 0, sizeof(*w));
+	w->out = out;
+	w->parser = p;
+	if (!p->has_read_fde)
+		ybpi_read_fde(p);
+	w->checksum_len = ybpi_checksum_len(p);
+	fputs("/*!50530 SET @@SESSION.PSEUDO_SLAVE_MODE=1*/;\n"
+			"/*!40019 SET @@session.max_insert_delayed_threads=0*/;\n"
+			"/*!50003 SET @OLD_COMPLETION_TYPE=@@COMPLETION_TYPE,COMPLETION_TYPE=0*/;\n"
+			"DELIMITER " SQL_DELIMITER "\n", out);
+	if ((fde = ybp_get_event()) == NULL)
+		return -1;
+	if (ybpi_read_event(p, 4, fde) < 0 || fde->data == NULL) {
+		ybp_dispose_event(fde);
+		return -1;
+	}
+	ybpi_sql_comment(w, fde);
+	fputc('\n', out);
+	ybpi_sql_binlog_statement(w, fde);
+	ybp_dispose_event(fde);
+	return ferror(out) ? -1 : 0;
+}
+
+int ybp_sql_event(struct ybp_sql_writer* restrict w, struct ybp_event* restrict e)
+{
+	FILE* out = w->out;
+	/* ybp_sql_begin has already written this one */
+	if (e->type_code == FORMAT_DESCRIPTION_EVENT && e->offset == 4)
+		return 0;
+	ybpi_sql_comment(w, e);
+	if (e->data == NULL) {
+		fputc('\n', out);
+		return ferror(out) ? -1 : 0;
+	}
+	/* These copy their blocks straight from the binlog, read or not */
+	if (w->loads != NULL && (e->type_code == BEGIN_LOAD_QUERY_EVENT || e->type_code == APPEND_BLOCK_EVENT ||
+				e->type_code == DELETE_FILE_EVENT || e->type_code == EXECUTE_LOAD_QUERY_EVENT))
+		return ybpi_sql_load(w, e);
+	if (e->data_len < e->length - EVENT_HEADER_SIZE) {
+		/* Replaying part of an event would be worse than not at all */
+		fputs("\n# (only part of this event was read; skipped)\n", out);
+		return ferror(out) ? -1 : 0;
+	}
+	switch (e->type_code) {
+		case QUERY_EVENT:
+			ybpi_sql_query(w, e, NULL, 0);
+			break;
+		case EXECUTE_LOAD_QUERY_EVENT:
+			/* Its INFILE is long gone from the master */
+			fputs("\n# (LOAD DATA whose file wasn't rebuilt; skipped)\n", out);
+			break;
+		case XID_EVENT:
+			{
+			struct ybp_decoded_event d;
+			if (ybp_decode_event(w->parser, e, &d) < 0)
+				break;
+			fprintf(out, "\tXid = %llu\nCOMMIT" SQL_DELIMITER "\n", (unsigned long long)d.u.xid);
+			}
+			break;
+		case INTVAR_EVENT:
+			{
+			struct ybp_decoded_event d;
+			if (ybp_decode_event(w->parser, e, &d) < 0)
+				break;
+			fprintf(out, "\nSET %s=%llu" SQL_DELIMITER "\n", (d.u.intvar.type == 1) ? "LAST_INSERT_ID" : "INSERT_ID",
+					(unsigned long long)d.u.intvar.value);
+			}
+			break;
+		case RAND_EVENT:
+			{
+			struct ybp_rand_event* r = (struct ybp_rand_event*)e->data;
+			fprintf(out, "\nSET @@RAND_SEED1=%llu, @@RAND_SEED2=%llu" SQL_DELIMITER "\n",
+					(unsigned long long)r->seed_1, (unsigned long long)r->seed_2);
+			}
+			break;
+		case USER_VAR_EVENT:
+			ybpi_sql_user_var(w, e);
+			break;
+		case TABLE_MAP_EVENT:
+		case WRITE_ROWS_EVENT:
+		case UPDATE_ROWS_EVENT:
+		case DELETE_ROWS_EVENT:
+		case WRITE_ROWS_EVENT_V2:
+		case UPDATE_ROWS_EVENT_V2:
+		case DELETE_ROWS_EVENT_V2:
+		case PARTIAL_UPDATE_ROWS_EVENT:
+		case WRITE_ROWS_COMPRESSED_EVENT_V1:
+		case UPDATE_ROWS_COMPRESSED_EVENT_V1:
+		case DELETE_ROWS_COMPRESSED_EVENT_V1:
+		case WRITE_ROWS_COMPRESSED_EVENT:
+		case UPDATE_ROWS_COMPRESSED_EVENT:
+		case DELETE_ROWS_COMPRESSED_EVENT:
+			fputc('\n', out);
+			ybpi_sql_binlog_statement(w, e);
+			break;
+		case GTID_LOG_EVENT:
+		case ANONYMOUS_GTID_LOG_EVENT:
+		case MARIADB_GTID_EVENT:
+			{
+			/* Replaying somewhere else; don't drag GTID_NEXT along */
+			struct ybp_gtid gtid;
+			char gtid_str[YBP_GTID_STR_LEN];
+			if (ybp_event_to_gtid(e, &gtid) == 0) {
+				ybp_format_gtid(&gtid, gtid_str);
+				fprintf(out, "\tGTID %s", gtid_str);
+			}
+			fputc('\n', out);
+			}
+			break;
+		default:
+			fputc('\n', out);
+			break;
+	}
+	return ferror(out) ? -1 : 0;
+}
+
+int ybp_sql_end(struct ybp_sql_writer* w)
+{
+	fputs("DELIMITER ;\n"
+			"# End of log file\n"
+			"ROLLBACK /* added by ybinlogp */;\n"
+			"/*!50003 SET COMPLETION_TYPE=@OLD_COMPLETION_TYPE*/;\n"
+			"/*!50530 SET @@SESSION.PSEUDO_SLAVE_MODE=0*/;\n", w->out);
+	if (fflush(w->out) != 0)
+		return -1;
+	return ferror(w->out) ? -1 : 0;
+}
+
+/******** sampling ********/
+
+#define SAMPLE_Z_95 1.96
+
+static int ybpi_off64_cmp(const void* a, const void* b)
+{
+	off64_t x = *(const off64_t*)a;
+	off64_t y = *(const off64_t*)b;
+	return (x > y) - (x < y);
+}
+
+off64_t ybp_sample_span(struct ybp_binlog_parser* p)
+{
+	if (!p->has_read_fde)
+		ybpi_read_fde(p);
+	if (p->file_size <= p->first_event_offset)
+		return 0;
+	return p->file_size - p->first_event_offset;
+}
+
+/**
+ * Hand fn every event starting in [lo, hi). An event torn off at the end
+ * of a live binlog just ends the window.
+ **/
+static int ybpi_sample_range(struct ybp_binlog_parser* restrict p, off64_t lo, off64_t hi, unsigned int sample, ybp_sample_fn fn, void* arg, struct ybp_event* restrict evbuf)
+{
+	off64_t offset = ybpi_nearest_offset(p, lo, NULL);
+	int ret;
+	if (offset == -2)
+		return 0;
+	else if (offset < 0)
+		return -1;
+	while (offset < hi && offset < p->file_size) {
+		if ((ret = ybpi_read_event(p, offset, evbuf)) == -2) {
+			ybp_reset_event(evbuf);
+			return 0;
+		} else if (ret < 0) {
+			return -1;
+		}
+		ret = fn(evbuf, sample, arg);
+		offset = ybpi_next_after(evbuf);
+		ybp_reset_event(evbuf);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+int ybp_sample(struct ybp_binlog_parser* restrict p, unsigned int num_samples, off64_t window, unsigned int seed, ybp_sample_fn fn, void* arg)
+{
+	off64_t span = ybp_sample_span(p);
+	off64_t first = p->first_event_offset;
+	off64_t* starts;
+	struct ybp_event* evbuf;
+	unsigned short xsubi[3];
+	bool esi = p->enforce_server_id;
+	unsigned int i;
+	int ret = 0;
+	if (span == 0 || num_samples == 0)
+		return 0;
+	if (window > span)
+		window = span;
+	if (window < 1)
+		window = 1;
+	if ((starts = malloc(num_samples * sizeof(off64_t))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((evbuf = ybp_get_event()) == NULL) {
+		free(starts);
+		return -1;
+	}
+	xsubi[0] = 0x330e;
+	xsubi[1] = seed & 0xffff;
+	xsubi[2] = seed >> 16;
+	for (i = 0; i < num_samples; ++i)
+		starts[i] = first + (off64_t)(erand48(xsubi) * span);
+	/* In file order, with every window already on its way in */
+	qsort(starts, num_samples, sizeof(off64_t), ybpi_off64_cmp);
+	for (i = 0; i < num_samples; ++i) {
+		off64_t end = min(starts[i] + window, p->file_size);
+		posix_fadvise(p->fd, starts[i], end - starts[i], POSIX_FADV_WILLNEED);
+	}
+	p->enforce_server_id = false;
+	for (i = 0; i < num_samples && ret == 0; ++i) {
+		off64_t end = starts[i] + window;
+		ret = ybpi_sample_range(p, starts[i], min(end, p->file_size), i, fn, arg, evbuf);
+		if (ret == 0 && end > p->file_size)
+			ret = ybpi_sample_range(p, first, first + (end - p->file_size), i, fn, arg, evbuf);
+	}
+	p->enforce_server_id = esi;
+	ybp_dispose_event(evbuf);
+	free(starts);
+	return ret;
+}
+
+void ybp_sample_estimate(const double* restrict part, const double* restrict whole, unsigned int num_samples, double scale, struct ybp_estimate* restrict out)
+{
+	double sum_part = 0, sum_whole = 0, mean, ratio;
+	double var_part = 0, var_ratio = 0;
+	unsigned int i;
+	memset(out, 0, sizeof(*out));
+	if (num_samples == 0)
+		return;
+	for (i = 0; i < num_samples; ++i) {
+		sum_part += part[i];
+		sum_whole += whole[i];
+	}
+	mean = sum_part / num_samples;
+	ratio = (sum_whole > 0) ? sum_part / sum_whole : 0;
+	out->total = scale * mean;
+	out->share = ratio;
+	if (num_samples < 2) {
+		out->total_ci = INFINITY;
+		out->share_ci = INFINITY;
+		return;
+	}
+	for (i = 0; i < num_samples; ++i) {
+		double d = part[i] - mean;
+		double r = part[i] - ratio * whole[i];
+		var_part += d * d;
+		var_ratio += r * r;
+	}
+	var_part /= (num_samples - 1);
+	out->total_ci = SAMPLE_Z_95 * scale * sqrt(var_part / num_samples);
+	if (sum_whole > 0) {
+		double mean_whole = sum_whole / num_samples;
+		var_ratio /= (double)num_samples * (num_samples - 1) * mean_whole * mean_whole;
+		out->share_ci = SAMPLE_Z_95 * sqrt(var_ratio);
+	}
+}
+
+/******** searching statements ********/
+
+static bool ybpi_equal_icase(const char* a, const char* b, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * memmem, ignoring case. Scans with memchr for one byte of the needle, so
+ * it runs at memchr's speed until there is something worth comparing.
+ **/
+static const char* ybpi_memcasemem(const struct ybp_grep* restrict g, const char* restrict s, size_t len)
+{
+	size_t a = g->anchor;
+	const char* end;
+	const char* next_lower;
+	const char* next_upper;
+	int lower, upper;
+	if (len < g->literal_len)
+		return NULL;
+	/* Where the anchor byte can be for the whole needle to fit */
+	end = s + len - g->literal_len + a + 1;
+	lower = tolower((unsigned char)g->literal[a]);
+	upper = toupper((unsigned char)g->literal[a]);
+	next_lower = memchr(s + a, lower, end - (s + a));
+	next_upper = (upper != lower) ? memchr(s + a, upper, end - (s + a)) : NULL;
+	while (next_lower != NULL || next_upper != NULL) {
+		const char* p;
+		if (next_upper == NULL || (next_lower != NULL && next_lower < next_upper)) {
+			p = next_lower;
+			next_lower = memchr(p + 1, lower, end - (p + 1));
+		}
+		else {
+			p = next_upper;
+			next_upper = memchr(p + 1, upper, end - (p + 1));
+		}
+		if (ybpi_equal_icase(p - a, g->literal, g->literal_len))
+			return p - a;
+	}
+	return NULL;
+}
+
+struct ybp_grep* ybp_get_grep(const char* literal, const char* regex, bool icase)
+{
+	struct ybp_grep* g;
+	size_t i;
+	int err;
+	if (literal == NULL && regex == NULL)
+		return NULL;
+	if ((g = malloc(sizeof(struct ybp_grep))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	memset(g, 0, sizeof(struct ybp_grep));
+	g->icase = icase;
+	if (literal != NULL && *literal != '\0') {
+		if ((g->literal = strdup(literal)) == NULL) {
+			perror("strdup");
+			free(g);
+			return NULL;
+		}
+		g->literal_len = strlen(literal);
+		/* Punctuation and digits are rarer in SQL than letters or spaces,
+		 * and don't need looking for in two cases */
+		for (i = 0; i < g->literal_len; ++i) {
+			if (!isalpha((unsigned char)literal[i]) && !isspace((unsigned char)literal[i])) {
+				g->anchor = i;
+				break;
+			}
+		}
+	}
+	if (regex != NULL) {
+		if ((err = regcomp(&g->regex, regex, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0))) != 0) {
+			char message[256];
+			regerror(err, &g->regex, message, sizeof(message));
+			fprintf(stderr, "Bad regex %s: %s\n", regex, message);
+			free(g->literal);
+			free(g);
+			return NULL;
+		}
+		g->has_regex = true;
+	}
+	return g;
+}
+
+bool ybp_grep_statement(const struct ybp_grep* restrict g, const char* restrict statement, size_t len)
+{
+	if (g->literal_len > 0) {
+		if (g->icase) {
+			if (ybpi_memcasemem(g, statement, len) == NULL)
+				return false;
+		}
+		else if (memmem(statement, len, g->literal, g->literal_len) == NULL) {
+			return false;
+		}
+	}
+	if (g->has_regex) {
+		regmatch_t bounds;
+		bounds.rm_so = 0;
+		bounds.rm_eo = len;
+		return regexec(&g->regex, statement, 1, &bounds, REG_STARTEND) == 0;
+	}
+	return true;
+}
+
+bool ybp_grep_event(struct ybp_binlog_parser* restrict p, const struct ybp_grep* restrict g, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	if (e->type_code != QUERY_EVENT || ybp_decode_event(p, e, &d) < 0)
+		return false;
+	return ybp_grep_statement(g, d.u.query.statement, d.u.query.statement_len);
+}
+
+void ybp_dispose_grep(struct ybp_grep* g)
+{
+	if (g == NULL)
+		return;
+	if (g->has_regex)
+		regfree(&g->regex);
+	free(g->literal);
+	free(g);
+}
+
+/******** statement fingerprints ********/
+
+#define FINGERPRINT_MAX_DEPTH 32
+
+static uint64_t ybpi_fnv1a(const char* s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/**
+ * Write a ? for a literal at out[o]. Inside parentheses, fold it into a
+ * list if one comes just before: "(?, ?" becomes "(?+"
+ **/
+static size_t ybpi_placeholder(char* out, size_t o, bool in_group)
+{
+	size_t j = o;
+	if (!in_group) {
+		out[o] = '?';
+		return o + 1;
+	}
+	if (j > 0 && out[j-1] == ' ')
+		--j;
+	if (j > 0 && out[j-1] == ',') {
+		--j;
+		if (j > 0 && out[j-1] == ' ')
+			--j;
+		if (j > 1 && out[j-1] == '+' && out[j-2] == '?')
+			return j;
+		if (j > 0 && out[j-1] == '?') {
+			out[j] = '+';
+			return j + 1;
+		}
+	}
+	out[o] = '?';
+	return o + 1;
+}
+
+/**
+ * out[start, o) is a group just closed. If it holds nothing but
+ * placeholders and repeats the group before it, as VALUES rows do, drop it.
+ **/
+static size_t ybpi_collapse_group(char* out, size_t o, size_t start)
+{
+	size_t len = o - start;
+	size_t j;
+	for (j = start + 1; j + 1 < o; ++j) {
+		if (out[j] != '?' && out[j] != '+' && out[j] != ',' && out[j] != ' ')
+			return o;
+	}
+	j = start;
+	if (j > 0 && out[j-1] == ' ')
+		--j;
+	if (j == 0 || out[j-1] != ',')
+		return o;
+	--j;
+	if (j >= len && memcmp(out + j - len, out + start, len) == 0)
+		return j;
+	return o;
+}
+
+size_t ybp_fingerprint(const char* statement, size_t len, char* out, uint64_t* hash)
+{
+	size_t groups[FINGERPRINT_MAX_DEPTH];
+	size_t depth = 0;
+	size_t i = 0, o = 0;
+	bool space = false;
+	/* o never passes i, which is what makes normalizing in place safe */
+	while (i < len) {
+		unsigned char c = statement[i];
+		if (isspace(c)) {
+			space = true;
+			++i;
+			continue;
+		}
+		if (c == '/' && i + 1 < len && statement[i+1] == '*') {
+			for (i += 2; i + 1 < len && !(statement[i] == '*' && statement[i+1] == '/'); ++i)
+				;
+			i += 2;
+			space = true;
+			continue;
+		}
+		if (c == '#' || (c == '-' && i + 1 < len && statement[i+1] == '-' &&
+					(i + 2 == len || isspace((unsigned char)statement[i+2])))) {
+			while (i < len && statement[i] != '\n')
+				++i;
+			space = true;
+			continue;
+		}
+		if (space && o > 0)
+			out[o++] = ' ';
+		space = false;
+		if (c == '\'' || c == '"') {
+			for (++i; i < len; ++i) {
+				if (statement[i] == '\\')
+					++i;
+				else if (statement[i] == c) {
+					/* '' inside a string is a quote, not its end */
+					if (i + 1 < len && statement[i+1] == c)
+						++i;
+					else
+						break;
+				}
+			}
+			++i;
+			o = ybpi_placeholder(out, o, depth > 0);
+		}
+		else if (c == '`') {
+			out[o++] = statement[i++];
+			while (i < len && statement[i] != '`')
+				out[o++] = statement[i++];
+			if (i < len)
+				out[o++] = statement[i++];
+		}
+		else if ((isdigit(c) || (c == '.' && i + 1 < len && isdigit((unsigned char)statement[i+1]))) &&
+				(o == 0 || !ybpi_is_ident_char(out[o-1]))) {
+			if (c == '0' && i + 1 < len && (statement[i+1] == 'x' || statement[i+1] == 'X')) {
+				for (i += 2; i < len && isxdigit((unsigned char)statement[i]); ++i)
+					;
+			}
+			else {
+				while (i < len && (isdigit((unsigned char)statement[i]) || statement[i] == '.'))
+					++i;
+				if (i < len && (statement[i] == 'e' || statement[i] == 'E')) {
+					++i;
+					if (i < len && (statement[i] == '+' || statement[i] == '-'))
+						++i;
+					while (i < len && isdigit((unsigned char)statement[i]))
+						++i;
+				}
+			}
+			o = ybpi_placeholder(out, o, depth > 0);
+		}
+		else if (ybpi_is_ident_char(c)) {
+			while (i < len && ybpi_is_ident_char(statement[i]))
+				out[o++] = tolower((unsigned char)statement[i++]);
+		}
+		else if (c == '(') {
+			if (depth < FINGERPRINT_MAX_DEPTH)
+				groups[depth] = o;
+			++depth;
+			out[o++] = '(';
+			++i;
+		}
+		else if (c == ')') {
+			out[o++] = ')';
+			++i;
+			if (depth > 0 && --depth < FINGERPRINT_MAX_DEPTH)
+				o = ybpi_collapse_group(out, o, groups[depth]);
+		}
+		else {
+			out[o++] = c;
+			++i;
+		}
+	}
+	*hash = ybpi_fnv1a(out, o);
+	return o;
+}
+
+struct ybp_fingerprints* ybp_get_fingerprints(size_t capacity, enum ybp_fingerprint_measure measure)
+{
+	struct ybp_fingerprints* f;
+	if (capacity == 0)
+		return NULL;
+	if ((f = malloc(sizeof(struct ybp_fingerprints))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	memset(f, 0, sizeof(struct ybp_fingerprints));
+	f->measure = measure;
+	f->capacity = capacity;
+	for (f->num_slots = 16; f->num_slots < 2 * capacity; f->num_slots *= 2)
+		;
+	f->entries = malloc(capacity * sizeof(struct ybp_fingerprint_entry));
+	f->heap = malloc(capacity * sizeof(size_t));
+	f->slots = calloc(f->num_slots, sizeof(size_t));
+	if (f->entries == NULL || f->heap == NULL || f->slots == NULL) {
+		perror("malloc");
+		ybp_dispose_fingerprints(f);
+		return NULL;
+	}
+	return f;
+}
+
+void ybp_dispose_fingerprints(struct ybp_fingerprints* f)
+{
+	if (f == NULL)
+		return;
+	free(f->entries);
+	free(f->heap);
+	free(f->slots);
+	free(f->scratch);
+	free(f);
+}
+
+static size_t ybpi_fingerprint_slot(struct ybp_fingerprints* f, uint64_t hash)
+{
+	size_t mask = f->num_slots - 1;
+	size_t slot = hash & mask;
+	while (f->slots[slot] != 0 && f->entries[f->slots[slot] - 1].hash != hash)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/**
+ * Empty a slot, shifting back the entries that probed past it so lookups
+ * still find them
+ **/
+static void ybpi_fingerprint_unslot(struct ybp_fingerprints* f, size_t slot)
+{
+	size_t mask = f->num_slots - 1;
+	size_t next = slot;
+	for (;;) {
+		size_t home;
+		f->slots[slot] = 0;
+		for (;;) {
+			next = (next + 1) & mask;
+			if (f->slots[next] == 0)
+				return;
+			home = f->entries[f->slots[next] - 1].hash & mask;
+			/* Can it move back to slot without passing its home? */
+			if ((slot <= next) ? (home <= slot || home > next) : (home <= slot && home > next))
+				break;
+		}
+		f->slots[slot] = f->slots[next];
+		slot = next;
+	}
+}
+
+static void ybpi_fingerprint_sift_down(struct ybp_fingerprints* f, size_t pos)
+{
+	size_t n = f->num_entries;
+	for (;;) {
+		size_t smallest = pos;
+		size_t left = 2 * pos + 1, right = left + 1;
+		size_t tmp;
+		if (left < n && f->entries[f->heap[left]].weight < f->entries[f->heap[smallest]].weight)
+			smallest = left;
+		if (right < n && f->entries[f->heap[right]].weight < f->entries[f->heap[smallest]].weight)
+			smallest = right;
+		if (smallest == pos)
+			return;
+		tmp = f->heap[pos];
+		f->heap[pos] = f->heap[smallest];
+		f->heap[smallest] = tmp;
+		f->entries[f->heap[pos]].heap_pos = pos;
+		f->entries[f->heap[smallest]].heap_pos = smallest;
+		pos = smallest;
+	}
+}
+
+static void ybpi_fingerprint_sift_up(struct ybp_fingerprints* f, size_t pos)
+{
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+		size_t tmp;
+		if (f->entries[f->heap[parent]].weight <= f->entries[f->heap[pos]].weight)
+			return;
+		tmp = f->heap[pos];
+		f->heap[pos] = f->heap[parent];
+		f->heap[parent] = tmp;
+		f->entries[f->heap[pos]].heap_pos = pos;
+		f->entries[f->heap[parent]].heap_pos = parent;
+		pos = parent;
+	}
+}
+
+static void ybpi_fingerprint_copy_text(char* dest, size_t dest_size, const char* src, size_t len)
+{
+	if (len >= dest_size)
+		len = dest_size - 1;
+	memcpy(dest, src, len);
+	dest[len] = '\0';
+}
+
+int ybp_fingerprints_add(struct ybp_fingerprints* restrict f, const char* restrict statement, size_t len, uint64_t bytes, uint32_t query_time)
+{
+	struct ybp_fingerprint_entry* e;
+	uint64_t hash;
+	uint64_t weight = (f->measure == YBP_FINGERPRINT_BY_BYTES) ? bytes : 1;
+	size_t shape_len, slot;
+	if (len > f->scratch_size) {
+		char* scratch;
+		if ((scratch = realloc(f->scratch, len)) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		f->scratch = scratch;
+		f->scratch_size = len;
+	}
+	shape_len = ybp_fingerprint(statement, len, f->scratch, &hash);
+	f->total_count++;
+	f->total_bytes += bytes;
+	slot = ybpi_fingerprint_slot(f, hash);
+	if (f->slots[slot] != 0) {
+		e = &f->entries[f->slots[slot] - 1];
+	}
+	else {
+		if (f->num_entries < f->capacity) {
+			e = &f->entries[f->num_entries];
+			e->heap_pos = f->num_entries;
+			f->heap[f->num_entries] = f->num_entries;
+			f->num_entries++;
+			e->weight = 0;
+			e->weight_error = 0;
+		}
+		else {
+			/* Space-saving: the newcomer inherits the lightest slot's weight */
+			e = &f->entries[f->heap[0]];
+			ybpi_fingerprint_unslot(f, ybpi_fingerprint_slot(f, e->hash));
+			slot = ybpi_fingerprint_slot(f, hash);
+			e->weight_error = e->weight;
+		}
+		e->hash = hash;
+		e->count = 0;
+		e->bytes = 0;
+		e->query_time = 0;
+		ybpi_fingerprint_copy_text(e->shape, sizeof(e->shape), f->scratch, shape_len);
+		ybpi_fingerprint_copy_text(e->sample, sizeof(e->sample), statement, len);
+		f->slots[slot] = (e - f->entries) + 1;
+		ybpi_fingerprint_sift_up(f, e->heap_pos);
+	}
+	e->weight += weight;
+	e->count++;
+	e->bytes += bytes;
+	e->query_time += query_time;
+	ybpi_fingerprint_sift_down(f, e->heap_pos);
+	return 0;
+}
+
+int ybp_fingerprints_observe(struct ybp_fingerprints* restrict f, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	if (e->type_code != QUERY_EVENT || ybp_decode_event(p, e, &d) < 0)
+		return 0;
+	if (ybp_fingerprints_add(f, d.u.query.statement, d.u.query.statement_len, e->length, d.u.query.query_time) < 0)
+		return -1;
+	return 1;
+}
+
+static int ybpi_compare_fingerprint_weight(const void* a, const void* b, void* arg)
+{
+	const struct ybp_fingerprint_entry* entries = arg;
+	uint64_t wa = entries[*(const size_t*)a].weight;
+	uint64_t wb = entries[*(const size_t*)b].weight;
+	return (wa < wb) - (wa > wb);
+}
+
+size_t ybp_fingerprints_top(struct ybp_fingerprints* restrict f, struct ybp_fingerprint_entry* restrict out, size_t n)
+{
+	size_t* order;
+	size_t i;
+	if ((order = malloc(f->num_entries * sizeof(size_t) + 1)) == NULL) {
+		perror("malloc");
+		return 0;
+	}
+	for (i = 0; i < f->num_entries; ++i)
+		order[i] = i;
+	qsort_r(order, f->num_entries, sizeof(size_t), ybpi_compare_fingerprint_weight, f->entries);
+	if (n > f->num_entries)
+		n = f->num_entries;
+	for (i = 0; i < n; ++i)
+		out[i] = f->entries[order[i]];
+	free(order);
+	return n;
+}
+
+/******** merging ********/
+
+static bool ybpi_merge_before(struct ybp_merge* m, size_t a, size_t b)
+{
+	struct ybp_event* x = m->sources[a].head;
+	struct ybp_event* y = m->sources[b].head;
+	if (x->timestamp != y->timestamp)
+		return x->timestamp < y->timestamp;
+	if (x->server_id != y->server_id)
+		return x->server_id < y->server_id;
+	if (x->offset != y->offset)
+		return x->offset < y->offset;
+	return a < b;
+}
+
+static void ybpi_merge_sift_up(struct ybp_merge* m, size_t pos)
+{
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+		size_t tmp;
+		if (!ybpi_merge_before(m, m->heap[pos], m->heap[parent]))
+			break;
+		tmp = m->heap[pos];
+		m->heap[pos] = m->heap[parent];
+		m->heap[parent] = tmp;
+		pos = parent;
+	}
+}
+
+static void ybpi_merge_sift_down(struct ybp_merge* m, size_t pos)
+{
+	for (;;) {
+		size_t smallest = pos, left = 2 * pos + 1, right = 2 * pos + 2, tmp;
+		if (left < m->heap_len && ybpi_merge_before(m, m->heap[left], m->heap[smallest]))
+			smallest = left;
+		if (right < m->heap_len && ybpi_merge_before(m, m->heap[right], m->heap[smallest]))
+			smallest = right;
+		if (smallest == pos)
+			break;
+		tmp = m->heap[pos];
+		m->heap[pos] = m->heap[smallest];
+		m->heap[smallest] = tmp;
+		pos = smallest;
+	}
+}
+
+/**
+ * Read the next event of source i into its head, moving on to the next
+ * parser of its chain if need be. Returns 1 if there was one, 0 if the
+ * source has run out, and -1 if its binlog couldn't be read (an event
+ * cut short before the end of the file counts).
+ **/
+static int ybpi_merge_advance(struct ybp_merge* m, size_t i)
+{
+	struct ybp_merge_source* src = &m->sources[i];
+	while (src->parser != NULL) {
+		int ret = -1;
+		if (!src->last) {
+			ybp_reset_event(src->head);
+			ret = ybp_next_event(src->parser, src->head);
+			if (ret < 0 && src->parser->offset < src->parser->file_size) {
+				Dprintf("error reading merge source %zd at %zd\n", i, src->parser->offset);
+				return -1;
+			}
+		}
+		if (ret >= 0) {
+			src->last = (ret == 0);
+			return 1;
+		}
+		src->parser = (m->refill != NULL) ? m->refill(i, m->refill_arg) : NULL;
+		src->last = false;
+	}
+	return 0;
+}
+
+struct ybp_merge* ybp_get_merge(struct ybp_binlog_parser** parsers, size_t num_parsers, ybp_merge_refill_fn refill, void* refill_arg)
+{
+	struct ybp_merge* m;
+	size_t i;
+	if ((m = calloc(1, sizeof(struct ybp_merge))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	m->num_sources = num_parsers;
+	m->refill = refill;
+	m->refill_arg = refill_arg;
+	if ((m->sources = calloc(num_parsers, sizeof(struct ybp_merge_source))) == NULL ||
+			(m->heap = calloc(num_parsers, sizeof(size_t))) == NULL) {
+		perror("calloc");
+		ybp_dispose_merge(m);
+		return NULL;
+	}
+	for (i = 0; i < num_parsers; ++i) {
+		m->sources[i].parser = parsers[i];
+		if ((m->sources[i].head = ybp_get_event()) == NULL) {
+			ybp_dispose_merge(m);
+			return NULL;
+		}
+		switch (ybpi_merge_advance(m, i)) {
+		case 1:
+			m->heap[m->heap_len] = i;
+			ybpi_merge_sift_up(m, m->heap_len++);
+			break;
+		case -1:
+			if (!m->failed) {
+				m->failed = true;
+				m->failed_source = i;
+			}
+			break;
+		}
+	}
+	return m;
+}
+
+int ybp_merge_next(struct ybp_merge* restrict m, struct ybp_event* restrict evbuf, size_t* source)
+{
+	size_t i;
+	struct ybp_event* head;
+	int ret;
+	/* The last event's source is only moved on now, so that its parser
+	 * lived as long as the caller needed it */
+	if (m->handed_out) {
+		m->handed_out = false;
+		i = m->heap[0];
+		if ((ret = ybpi_merge_advance(m, i)) <= 0) {
+			m->heap[0] = m->heap[--m->heap_len];
+			if (ret < 0 && !m->failed) {
+				m->failed = true;
+				m->failed_source = i;
+			}
+		}
+		ybpi_merge_sift_down(m, 0);
+	}
+	if (m->failed) {
+		*source = m->failed_source;
+		return -1;
+	}
+	if (m->heap_len == 0)
+		return 0;
+	i = m->heap[0];
+	head = m->sources[i].head;
+	/* Hand over the head's data rather than copying it */
+	memcpy(evbuf, head, sizeof(struct ybp_event));
+	head->data = NULL;
+	*source = i;
+	m->handed_out = true;
+	return 1;
+}
+
+void ybp_dispose_merge(struct ybp_merge* m)
+{
+	size_t i;
+	if (m == NULL)
+		return;
+	if (m->sources != NULL) {
+		for (i = 0; i < m->num_sources; ++i) {
+			if (m->sources[i].head != NULL)
+				ybp_dispose_event(m->sources[i].head);
+		}
+	}
+	free(m->sources);
+	free(m->heap);
+	free(m);
+}
+
+/******** shared-memory event ring ********/
+
+#define RING_ALIGN(x) (((x) + 7) & ~((size_t)7))
+#define RING_WRAP_MARKER 0xFFFFFFFFu
+
+static size_t ybpi_ring_map_len(uint64_t capacity)
+{
+	return sizeof(struct ybp_ring_header) + capacity;
+}
+
+struct ybp_ring* ybp_ring_create(const char* shm_name, size_t capacity)
+{
+	struct ybp_ring* r;
+	uint64_t cap = 4096;
+	int fd;
+	while (cap < capacity)
+		cap <<= 1;
+	if ((r = malloc(sizeof(struct ybp_ring))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	strncpy(r->shm_name, shm_name, YBP_RING_SHM_NAME_LEN - 1);
+	r->shm_name[YBP_RING_SHM_NAME_LEN - 1] = '\0';
+	r->map_len = ybpi_ring_map_len(cap);
+	if ((fd = shm_open(r->shm_name, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) {
+		perror("shm_open");
+		free(r);
+		return NULL;
+	}
+	if (ftruncate(fd, r->map_len) < 0) {
+		perror("ftruncate");
+		close(fd);
+		shm_unlink(r->shm_name);
+		free(r);
+		return NULL;
+	}
+	r->hdr = mmap(NULL, r->map_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->hdr == MAP_FAILED) {
+		perror("mmap");
+		shm_unlink(r->shm_name);
+		free(r);
+		return NULL;
+	}
+	memset(r->hdr, 0, sizeof(struct ybp_ring_header));
+	r->hdr->capacity = cap;
+	r->hdr->version = YBP_RING_VERSION;
+	r->data = (char*)r->hdr + sizeof(struct ybp_ring_header);
+	__atomic_store_n(&r->hdr->magic, YBP_RING_MAGIC, __ATOMIC_RELEASE);
+	return r;
+}
+
+void ybp_ring_dispose(struct ybp_ring* r)
+{
+	if (r == NULL)
+		return;
+	munmap(r->hdr, r->map_len);
+	shm_unlink(r->shm_name);
+	free(r);
+}
+
+void ybp_ring_set_file(struct ybp_ring* r, uint32_t file_seq, const char* file_name)
+{
+	strncpy(r->hdr->file_name, file_name, sizeof(r->hdr->file_name) - 1);
+	__atomic_store_n(&r->hdr->file_seq, file_seq, __ATOMIC_RELEASE);
+}
+
+int ybp_ring_add_consumer(struct ybp_ring* r, uint32_t pid, uint32_t flags)
+{
+	int i;
+	for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+		struct ybp_ring_consumer* c = &r->hdr->consumers[i];
+		if (c->in_use)
+			continue;
+		c->pid = pid;
+		c->evicted = 0;
+		if (flags & YBP_RING_FROM_OLDEST)
+			c->read_pos = r->hdr->tail_pos;
+		else
+			c->read_pos = r->hdr->write_pos;
+		__atomic_store_n(&c->in_use, 1, __ATOMIC_RELEASE);
+		return i;
+	}
+	return -1;
+}
+
+void ybp_ring_remove_consumer(struct ybp_ring* r, int slot)
+{
+	if (slot < 0 || slot >= YBP_RING_MAX_CONSUMERS)
+		return;
+	__atomic_store_n(&r->hdr->consumers[slot].in_use, 0, __ATOMIC_RELEASE);
+}
+
+void ybp_ring_evict_consumer(struct ybp_ring* r, int slot)
+{
+	if (slot < 0 || slot >= YBP_RING_MAX_CONSUMERS)
+		return;
+	__atomic_store_n(&r->hdr->consumers[slot].evicted, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t ybp_ring_lag(struct ybp_ring_header* hdr, int slot)
+{
+	uint64_t w = __atomic_load_n(&hdr->write_pos, __ATOMIC_ACQUIRE);
+	uint64_t rp = __atomic_load_n(&hdr->consumers[slot].read_pos, __ATOMIC_ACQUIRE);
+	return w - rp;
+}
+
+int ybp_ring_slowest(struct ybp_ring* r)
+{
+	int i, slowest = -1;
+	uint64_t max_lag = 0;
+	for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+		struct ybp_ring_consumer* c = &r->hdr->consumers[i];
+		if (!c->in_use || c->evicted)
+			continue;
+		if (slowest < 0 || ybp_ring_lag(r->hdr, i) > max_lag) {
+			slowest = i;
+			max_lag = ybp_ring_lag(r->hdr, i);
+		}
+	}
+	return slowest;
+}
+
+/**
+ * Would writing total bytes at the write position overrun a consumer?
+ **/
+static bool ybpi_ring_has_room(struct ybp_ring* r, uint64_t total)
+{
+	int i;
+	for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+		struct ybp_ring_consumer* c = &r->hdr->consumers[i];
+		if (!__atomic_load_n(&c->in_use, __ATOMIC_ACQUIRE) || c->evicted)
+			continue;
+		if (r->hdr->write_pos + total - __atomic_load_n(&c->read_pos, __ATOMIC_ACQUIRE) > r->hdr->capacity)
+			return false;
+	}
+	return true;
+}
+
+int ybp_ring_publish(struct ybp_ring* restrict r, struct ybp_event* restrict e, uint32_t file_seq)
+{
+	struct ybp_ring_header* hdr = r->hdr;
+	uint64_t mask = hdr->capacity - 1;
+	uint64_t pos = hdr->write_pos & mask;
+	uint32_t payload_len = (e->data == NULL) ? 0 : e->data_len;
+	uint8_t rec_flags = 0;
+	size_t need, pad = 0;
+	struct ybp_ring_record* rec;
+
+	if (e->data != NULL && e->data_len < e->length - EVENT_HEADER_SIZE)
+		rec_flags |= YBP_RING_TRUNCATED;
+
+	/* Never let a single event take more than a quarter of the ring */
+	if (sizeof(struct ybp_ring_record) + payload_len > hdr->capacity / 4) {
+		payload_len = hdr->capacity / 4 - sizeof(struct ybp_ring_record);
+		rec_flags |= YBP_RING_TRUNCATED;
+	}
+	need = RING_ALIGN(sizeof(struct ybp_ring_record) + payload_len);
+	if (pos + need > hdr->capacity)
+		pad = hdr->capacity - pos;
+	if (!ybpi_ring_has_room(r, pad + need))
+		return 0;
+
+	/* Retire whatever we are about to overwrite */
+	while (hdr->tail_pos + hdr->capacity < hdr->write_pos + pad + need) {
+		struct ybp_ring_record* old = (struct ybp_ring_record*)(r->data + (hdr->tail_pos & mask));
+		hdr->tail_pos += old->record_len;
+	}
+
+	if (pad > 0) {
+		rec = (struct ybp_ring_record*)(r->data + pos);
+		rec->record_len = pad;
+		rec->payload_len = RING_WRAP_MARKER;
+		pos = 0;
+	}
+	rec = (struct ybp_ring_record*)(r->data + pos);
+	rec->record_len = need;
+	rec->payload_len = payload_len;
+	rec->offset = e->offset;
+	rec->file_seq = file_seq;
+	rec->timestamp = e->timestamp;
+	rec->server_id = e->server_id;
+	rec->length = e->length;
+	rec->next_position = e->next_position;
+	rec->flags = e->flags;
+	rec->type_code = e->type_code;
+	rec->rec_flags = rec_flags;
+	if (payload_len > 0)
+		memcpy((char*)rec + sizeof(struct ybp_ring_record), e->data, payload_len);
+	hdr->events_published++;
+	__atomic_store_n(&hdr->write_pos, hdr->write_pos + pad + need, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * Move all len bytes of a handshake message over the socket, however many
+ * calls it takes. Returns 0, or -1 on an error or the other end going away.
+ **/
+static int ybpi_ring_transfer(int sock, void* buf, size_t len, bool sending)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t amt = sending ? write(sock, (char*)buf + done, len - done) : read(sock, (char*)buf + done, len - done);
+		if (amt < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(sending ? "write hello" : "read welcome");
+			return -1;
+		} else if (amt == 0) {
+			fprintf(stderr, "ybinlogpd hung up during the handshake\n");
+			return -1;
+		}
+		done += amt;
+	}
+	return 0;
+}
+
+struct ybp_ring_client* ybp_ring_connect(const char* socket_path, uint32_t flags)
+{
+	struct ybp_ring_client* c;
+	struct sockaddr_un addr;
+	struct ybp_ring_hello hello;
+	struct ybp_ring_welcome welcome;
+	int shm_fd;
+
+	if ((c = malloc(sizeof(struct ybp_ring_client))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if ((c->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		free(c);
+		return NULL;
+	}
+	if (connect(c->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		goto fail;
+	}
+	hello.magic = YBP_RING_MAGIC;
+	hello.version = YBP_RING_VERSION;
+	hello.flags = flags;
+	hello.pid = getpid();
+	if (ybpi_ring_transfer(c->sock, &hello, sizeof(hello), true) < 0 ||
+			ybpi_ring_transfer(c->sock, &welcome, sizeof(welcome), false) < 0)
+		goto fail;
+	if (welcome.magic != YBP_RING_MAGIC || welcome.slot < 0) {
+		fprintf(stderr, "ybinlogpd refused us (slot %d)\n", welcome.slot);
+		goto fail;
+	}
+	welcome.shm_name[YBP_RING_SHM_NAME_LEN - 1] = '\0';
+	c->slot = welcome.slot;
+	c->map_len = ybpi_ring_map_len(welcome.capacity);
+	if ((shm_fd = shm_open(welcome.shm_name, O_RDWR, 0)) < 0) {
+		perror("shm_open");
+		goto fail;
+	}
+	c->hdr = mmap(NULL, c->map_len, PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (c->hdr == MAP_FAILED) {
+		perror("mmap");
+		goto fail;
+	}
+	c->data = (char*)c->hdr + sizeof(struct ybp_ring_header);
+	return c;
+fail:
+	close(c->sock);
+	free(c);
+	return NULL;
+}
+
+int ybp_ring_next(struct ybp_ring_client* restrict c, struct ybp_event* restrict evbuf, uint32_t* file_seq)
+{
+	struct ybp_ring_consumer* me = &c->hdr->consumers[c->slot];
+	uint64_t mask = c->hdr->capacity - 1;
+	uint64_t rp = me->read_pos;
+	struct ybp_ring_record* rec;
+
+	if (__atomic_load_n(&me->evicted, __ATOMIC_ACQUIRE))
+		return -1;
+	if (rp == __atomic_load_n(&c->hdr->write_pos, __ATOMIC_ACQUIRE))
+		return 0;
+	rec = (struct ybp_ring_record*)(c->data + (rp & mask));
+	if (rec->payload_len == RING_WRAP_MARKER) {
+		rp += rec->record_len;
+		rec = (struct ybp_ring_record*)(c->data + (rp & mask));
+	}
+	evbuf->timestamp = rec->timestamp;
+	evbuf->type_code = rec->type_code;
+	evbuf->server_id = rec->server_id;
+	evbuf->length = rec->length;
+	evbuf->next_position = rec->next_position;
+	evbuf->flags = rec->flags;
+	evbuf->offset = rec->offset;
+	evbuf->data = NULL;
+	if (file_seq != NULL)
+		*file_seq = rec->file_seq;
+	/* Truncated payloads are dropped rather than handed out short, since
+	 * every accessor trusts e->length */
+	if (rec->payload_len > 0 && !(rec->rec_flags & YBP_RING_TRUNCATED)) {
+		if ((evbuf->data = malloc(rec->payload_len)) == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		memcpy(evbuf->data, (char*)rec + sizeof(struct ybp_ring_record), rec->payload_len);
+		evbuf->data_len = rec->payload_len;
+	}
+	/* The producer stops respecting our position once we're evicted, so
+	 * what we just copied may have been overwritten underneath us */
+	if (__atomic_load_n(&me->evicted, __ATOMIC_ACQUIRE)) {
+		ybp_reset_event(evbuf);
+		return -1;
+	}
+	rp += rec->record_len;
+	__atomic_store_n(&me->read_pos, rp, __ATOMIC_RELEASE);
+	return 1;
+}
+
+uint64_t ybp_ring_client_lag(struct ybp_ring_client* c)
+{
+	return ybp_ring_lag(c->hdr, c->slot);
+}
+
+void ybp_ring_disconnect(struct ybp_ring_client* c)
+{
+	if (c == NULL)
+		return;
+	munmap(c->hdr, c->map_len);
+	close(c->sock);
+	free(c);
+}
+
+/******** durable consumer checkpoints ********/
+
+#define CHECKPOINT_HEADER "ybinlogp-checkpoint 1\n"
+
+static long ybpi_ms_since(struct timespec* then)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+struct ybp_checkpoint* ybp_get_checkpoint(const char* path, unsigned int flush_every, unsigned int flush_interval_ms)
+{
+	struct ybp_checkpoint* cp;
+	if ((cp = malloc(sizeof(struct ybp_checkpoint))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	memset(cp, 0, sizeof(struct ybp_checkpoint));
+	if ((cp->path = strdup(path)) == NULL) {
+		perror("strdup");
+		free(cp);
+		return NULL;
+	}
+	if ((cp->tmp_path = malloc(strlen(path) + 5)) == NULL) {
+		perror("malloc");
+		free(cp->path);
+		free(cp);
+		return NULL;
+	}
+	sprintf(cp->tmp_path, "%s.tmp", path);
+	cp->flush_every = flush_every;
+	cp->flush_interval_ms = flush_interval_ms;
+	clock_gettime(CLOCK_MONOTONIC, &cp->last_flush);
+	return cp;
+}
+
+/**
+ * Work out whether query event e is a BEGIN or a COMMIT (or ROLLBACK),
+ * decoding it through p's FDE. If it can't be decoded, it's neither.
+ **/
+static void ybpi_classify_statement(struct ybp_binlog_parser* p, struct ybp_event* e, bool* begin, bool* commit)
+{
+	struct ybp_decoded_event d;
+	const char* statement;
+	size_t len;
+	*begin = *commit = false;
+	if (ybp_decode_event(p, e, &d) < 0)
+		return;
+	statement = d.u.query.statement;
+	len = d.u.query.statement_len;
+	*begin = (len == 5 && strncasecmp(statement, "BEGIN", 5) == 0);
+	*commit = ((len == 6 && strncasecmp(statement, "COMMIT", 6) == 0) ||
+			(len == 8 && strncasecmp(statement, "ROLLBACK", 8) == 0));
+}
+
+#define MARIADB_FL_STANDALONE 1
+
+/**
+ * Follow the transaction state through e. Returns true if the position just
+ * after e is between transactions, i.e. a safe place to start or stop.
+ * Events that only mean something along with what follows them (GTIDs,
+ * INTVAR, table maps...) never end a transaction.
+ **/
+static bool ybpi_transaction_step(struct ybp_binlog_parser* p, struct ybp_event* e, bool* in_transaction)
+{
+	switch (e->type_code) {
+		case XID_EVENT:
+			*in_transaction = false;
+			return true;
+		case QUERY_EVENT:
+			{
+			bool begin = false, commit = false;
+			if (e->data != NULL)
+				ybpi_classify_statement(p, e, &begin, &commit);
+			if (begin) {
+				*in_transaction = true;
+				return false;
+			}
+			if (commit)
+				*in_transaction = false;
+			return !*in_transaction;
+			}
+		case MARIADB_GTID_EVENT:
+			/* MariaDB writes no BEGIN; its GTID event opens the transaction */
+			if (e->data != NULL && e->length >= EVENT_HEADER_SIZE + sizeof(struct ybp_mariadb_gtid_event))
+				*in_transaction = !(((struct ybp_mariadb_gtid_event*)e->data)->flags2 & MARIADB_FL_STANDALONE);
+			return false;
+		case GTID_LOG_EVENT:
+		case ANONYMOUS_GTID_LOG_EVENT:
+		case INTVAR_EVENT:
+		case RAND_EVENT:
+		case USER_VAR_EVENT:
+		case TABLE_MAP_EVENT:
+		case ROWS_QUERY_LOG_EVENT:
+		case ANNOTATE_ROWS_EVENT:
+		case BEGIN_LOAD_QUERY_EVENT:
+		case APPEND_BLOCK_EVENT:
+			return false;
+		default:
+			return !*in_transaction;
+	}
+}
+
+int ybp_checkpoint_observe(struct ybp_checkpoint* restrict cp, struct ybp_binlog_parser* restrict p, const char* restrict file_name, struct ybp_event* restrict e)
+{
+	bool boundary = false;
+	switch (e->type_code) {
+		case ROTATE_EVENT:
+			{
+			struct ybp_decoded_event d;
+			const char* slash = strrchr(file_name, '/');
+			int dir_len = (slash == NULL) ? 0 : (slash - file_name + 1);
+			/* Decoded, so that a checksum isn't taken for part of the name */
+			if (ybp_decode_event(p, e, &d) < 0 || d.truncated)
+				break;
+			snprintf(cp->file_name, sizeof(cp->file_name), "%.*s%.*s", dir_len, file_name,
+					(int)d.u.rotate.file_name_len, d.u.rotate.file_name);
+			cp->offset = d.u.rotate.next_position;
+			cp->in_transaction = false;
+			cp->dirty = true;
+			/* Always make rotations durable, the old file may go away */
+			return (ybp_checkpoint_flush(cp) < 0) ? -1 : 1;
+			}
+		default:
+			boundary = ybpi_transaction_step(p, e, &cp->in_transaction);
+			break;
+	}
+	if (!boundary)
+		return 0;
+	if (file_name != cp->file_name)
+		strncpy(cp->file_name, file_name, sizeof(cp->file_name) - 1);
+	cp->offset = e->offset + e->length;
+	cp->dirty = true;
+	cp->pending++;
+	if ((cp->flush_every > 0 && cp->pending >= cp->flush_every) ||
+			(cp->flush_interval_ms > 0 && ybpi_ms_since(&cp->last_flush) >= cp->flush_interval_ms)) {
+		return (ybp_checkpoint_flush(cp) < 0) ? -1 : 1;
+	}
+	return 0;
+}
+
+int ybp_checkpoint_flush(struct ybp_checkpoint* cp)
+{
+	FILE* f;
+	int dir_fd;
+	char* dir;
+	char* slash;
+	if (!cp->dirty)
+		return 0;
+	if ((f = fopen(cp->tmp_path, "w")) == NULL) {
+		perror("Error opening checkpoint");
+		return -1;
+	}
+	fprintf(f, CHECKPOINT_HEADER "%s\n%lld\n", cp->file_name, (long long)cp->offset);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		perror("Error writing checkpoint");
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	if (rename(cp->tmp_path, cp->path) < 0) {
+		perror("Error renaming checkpoint");
+		return -1;
+	}
+	/* The rename itself isn't durable until the directory is synced */
+	if ((dir = strdup(cp->path)) == NULL) {
+		perror("strdup");
+		return -1;
+	}
+	if ((slash = strrchr(dir, '/')) != NULL)
+		*(slash + 1) = '\0';
+	else
+		strcpy(dir, ".");
+	if ((dir_fd = open(dir, O_RDONLY)) >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	free(dir);
+	cp->dirty = false;
+	cp->pending = 0;
+	cp->flushes++;
+	clock_gettime(CLOCK_MONOTONIC, &cp->last_flush);
+	return 0;
+}
+
+void ybp_dispose_checkpoint(struct ybp_checkpoint* cp)
+{
+	if (cp == NULL)
+		return;
+	ybp_checkpoint_flush(cp);
+	free(cp->path);
+	free(cp->tmp_path);
+	free(cp);
+}
+
+int ybp_load_checkpoint(const char* restrict path, char* restrict file_name, size_t file_name_len, off64_t* offset)
+{
+	FILE* f;
+	char header[64];
+	long long off;
+	size_t len;
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	if (fgets(header, sizeof(header), f) == NULL ||
+			strcmp(header, CHECKPOINT_HEADER) != 0 ||
+			fgets(file_name, file_name_len, f) == NULL ||
+			fscanf(f, "%lld", &off) != 1) {
+		fclose(f);
+		return -2;
+	}
+	fclose(f);
+	len = strlen(file_name);
+	if (len == 0 || file_name[len - 1] != '\n')
+		return -2;
+	file_name[len - 1] = '\0';
+	*offset = off;
+	return 0;
+}
+
+
+/******** slicing ********/
+
+#define CRC32_POLY 0xedb88320
+#define LOG_EVENT_BINLOG_IN_USE_F 0x1
+#define SLICE_CLASSIFY_MAX 4096	/* a query longer than this isn't BEGIN or COMMIT */
+#define SLICE_COPY_CHUNK 1048576
+
+static const char ybpi_binlog_magic[4] = {'\xfe', 'b', 'i', 'n'};
+
+/**
+ * The CRC32 register after feeding it buf, without the usual pre- and
+ * post-inversion
+ **/
+static uint32_t ybpi_crc32_raw(uint32_t crc, const unsigned char* buf, size_t len)
+{
+	size_t i;
+	int k;
+	for (i = 0; i < len; ++i) {
+		crc ^= buf[i];
+		for (k = 0; k < 8; ++k)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+	}
+	return crc;
+}
+
+static uint32_t ybpi_crc32(const void* buf, size_t len)
+{
+	return ybpi_crc32_raw(0xffffffff, buf, len) ^ 0xffffffff;
+}
+
+/**
+ * a * b modulo the CRC32 polynomial, in its bit-reflected form
+ **/
+static uint32_t ybpi_crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31, product = 0;
+	while (m != 0) {
+		if (a & m)
+			product ^= b;
+		b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+		m >>= 1;
+	}
+	return product;
+}
+
+/**
+ * CRC32 is linear, so if len bytes of an event change, its new checksum is
+ * the old one xor the CRC of the difference pushed through the bytes_after
+ * bytes that follow it; that's O(log n) instead of re-reading the event.
+ **/
+static uint32_t ybpi_crc32_patch(uint32_t crc, const unsigned char* old_bytes, const unsigned char* new_bytes, size_t len, off64_t bytes_after)
+{
+	uint32_t delta = 0, shift = (uint32_t)1 << 23;	/* x^8 */
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		unsigned char diff = old_bytes[i] ^ new_bytes[i];
+		delta = ybpi_crc32_raw(delta, &diff, 1);
+	}
+	while (bytes_after > 0) {
+		if (bytes_after & 1)
+			delta = ybpi_crc32_multmodp(shift, delta);
+		shift = ybpi_crc32_multmodp(shift, shift);
+		bytes_after >>= 1;
+	}
+	return crc ^ delta;
+}
+
+static size_t ybpi_checksum_len(const struct ybp_binlog_parser* p)
+{
+	return (p->checksum_alg == YBP_CHECKSUM_CRC32) ? YBP_CHECKSUM_LEN : 0;
+}
+
+static bool ybpi_is_gtid(struct ybp_event* e)
+{
+	return (e->type_code == GTID_LOG_EVENT || e->type_code == ANONYMOUS_GTID_LOG_EVENT ||
+			e->type_code == MARIADB_GTID_EVENT);
+}
+
+/**
+ * Read an event at offset, but only bother with the body if the
+ * transaction tracking will look at it
+ **/
+static int ybpi_read_for_slice(struct ybp_binlog_parser* restrict p, off64_t offset, struct ybp_event* restrict evbuf)
+{
+	if (pread(p->fd, evbuf, EVENT_HEADER_SIZE, offset) != EVENT_HEADER_SIZE)
+		return -2;
+	evbuf->offset = offset;
+	evbuf->data = NULL;
+	if (!ybpi_check_event(evbuf, p) || offset + evbuf->length > p->file_size)
+		return -2;
+	if ((evbuf->type_code == QUERY_EVENT && evbuf->length <= SLICE_CLASSIFY_MAX) ||
+			evbuf->type_code == MARIADB_GTID_EVENT)
+		return ybpi_read_event(p, offset, evbuf);
+	return 0;
+}
+
+/**
+ * Widen start back to the beginning of the transaction it's in. Walking
+ * backwards we can't tell a standalone statement from one inside a
+ * transaction, so stop at the first thing that unambiguously starts one
+ * (a GTID, or a BEGIN not preceded by one) or ends one (XID, COMMIT).
+ **/
+static off64_t ybpi_transaction_start(struct ybp_binlog_parser* restrict p, off64_t start)
+{
+	struct ybp_event* evbuf;
+	bool at_begin = false;
+	bool had_boundaries = (p->boundaries != NULL);
+	int ret;
+	if ((evbuf = ybp_get_event()) == NULL)
+		return -1;
+	if (ybpi_read_event(p, start, evbuf) < 0) {
+		ybp_dispose_event(evbuf);
+		return -1;
+	}
+	if (ybpi_is_gtid(evbuf)) {
+		ybp_dispose_event(evbuf);
+		return start;
+	}
+	if (evbuf->type_code == QUERY_EVENT && evbuf->data != NULL) {
+		bool commit;
+		ybpi_classify_statement(p, evbuf, &at_begin, &commit);
+	}
+	ybp_rewind_bp(p, start);
+	for (;;) {
+		bool begin = false, commit = false;
+		ybp_reset_event(evbuf);
+		if ((ret = ybp_prev_event(p, evbuf)) == -2)
+			break;
+		if (ret == -1) {
+			start = -1;
+			break;
+		}
+		if (ybpi_is_gtid(evbuf)) {
+			start = evbuf->offset;
+			break;
+		}
+		if (evbuf->type_code == QUERY_EVENT && evbuf->data != NULL)
+			ybpi_classify_statement(p, evbuf, &begin, &commit);
+		if (at_begin || commit || evbuf->type_code == XID_EVENT)
+			break;
+		start = evbuf->offset;
+		at_begin = begin;
+		if (ret == 0)
+			break;
+	}
+	ybp_dispose_event(evbuf);
+	/* The walk back was a one-off; don't keep what it found around */
+	if (!had_boundaries) {
+		free(p->boundaries);
+		p->boundaries = NULL;
+		p->num_boundaries = 0;
+		p->boundaries_size = 0;
+	}
+	return start;
+}
+
+/**
+ * Copy len bytes from in_fd at in_off to out_fd at out_off, in the kernel
+ * if at all possible
+ **/
+static int ybpi_copy_range(int in_fd, off64_t in_off, int out_fd, off64_t out_off, off64_t len)
+{
+	char* buf;
+	while (len > 0) {
+		ssize_t copied = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+		if (copied > 0) {
+			len -= copied;
+			continue;
+		}
+		if (copied == 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP))
+			break;
+		/* Older kernel, or across filesystems */
+		if (lseek(out_fd, out_off, SEEK_SET) < 0)
+			break;
+		while (len > 0 && (copied = sendfile(out_fd, in_fd, &in_off, len)) > 0) {
+			len -= copied;
+			out_off += copied;
+		}
+		break;
+	}
+	if (len == 0)
+		return 0;
+	/* ...or failing all that, the old-fashioned way */
+	if ((buf = malloc(SLICE_COPY_CHUNK)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	while (len > 0) {
+		ssize_t amt = pread(in_fd, buf, (len < SLICE_COPY_CHUNK) ? len : SLICE_COPY_CHUNK, in_off);
+		if (amt <= 0 || pwrite(out_fd, buf, amt, out_off) != amt) {
+			perror("Error copying slice");
+			free(buf);
+			return -1;
+		}
+		len -= amt;
+		in_off += amt;
+		out_off += amt;
+	}
+	free(buf);
+	return 0;
+}
+
+/**
+ * Build an event from scratch at out_offset, checksumming it if the binlog
+ * it's going into is checksummed. Returns its length.
+ **/
+static size_t ybpi_make_event(struct ybp_binlog_parser* restrict p, unsigned char* restrict buf, uint8_t type_code, uint32_t timestamp, off64_t out_offset, const void* payload, size_t payload_len)
+{
+	struct ybp_event* header = (struct ybp_event*)buf;
+	size_t length = EVENT_HEADER_SIZE + payload_len;
+	if (p->checksum_alg == YBP_CHECKSUM_CRC32)
+		length += YBP_CHECKSUM_LEN;
+	header->timestamp = timestamp;
+	header->type_code = type_code;
+	header->server_id = p->slave_server_id;
+	header->length = length;
+	header->next_position = out_offset + length;
+	header->flags = 0;
+	memcpy(buf + EVENT_HEADER_SIZE, payload, payload_len);
+	if (p->checksum_alg == YBP_CHECKSUM_CRC32) {
+		uint32_t crc = ybpi_crc32(buf, length - YBP_CHECKSUM_LEN);
+		memcpy(buf + length - YBP_CHECKSUM_LEN, &crc, YBP_CHECKSUM_LEN);
+	}
+	return length;
+}
+
+/**
+ * A copy of p's FDE to start another binlog with, no longer marked as
+ * being written to. Returns NULL on error.
+ **/
+static unsigned char* ybpi_copy_fde(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict evbuf, size_t* len)
+{
+	unsigned char* fde;
+	ybp_reset_event(evbuf);
+	if (ybpi_read_event(p, 4, evbuf) < 0 || evbuf->data == NULL)
+		return NULL;
+	*len = evbuf->length;
+	if ((fde = malloc(*len)) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	memcpy(fde, evbuf, EVENT_HEADER_SIZE);
+	memcpy(fde + EVENT_HEADER_SIZE, evbuf->data, *len - EVENT_HEADER_SIZE);
+	((struct ybp_event*)fde)->flags &= ~LOG_EVENT_BINLOG_IN_USE_F;
+	if (p->checksum_alg == YBP_CHECKSUM_CRC32) {
+		uint32_t crc = ybpi_crc32(fde, *len - YBP_CHECKSUM_LEN);
+		memcpy(fde + *len - YBP_CHECKSUM_LEN, &crc, YBP_CHECKSUM_LEN);
+	}
+	return fde;
+}
+
+off64_t ybp_transaction_start(struct ybp_binlog_parser* restrict p, off64_t offset)
+{
+	off64_t saved_offset = p->offset;
+	bool esi = p->enforce_server_id;
+	p->enforce_server_id = false;
+	offset = ybpi_transaction_start(p, offset);
+	p->enforce_server_id = esi;
+	p->offset = saved_offset;
+	return offset;
+}
+
+off64_t ybp_slice(struct ybp_binlog_parser* restrict p, off64_t start, off64_t end, int out_fd, const char* next_file)
+{
+	struct ybp_event* evbuf;
+	unsigned char* fde = NULL;
+	unsigned char* map = NULL;
+	unsigned char trailer[EVENT_HEADER_SIZE + sizeof(uint64_t) + FILENAME_MAX + YBP_CHECKSUM_LEN];
+	unsigned char payload[sizeof(uint64_t) + FILENAME_MAX];
+	size_t fde_len, payload_len = 0, trailer_len, map_len = 0;
+	off64_t offset, slice_end, body_start, num_events = 0, events_since_boundary = 0;
+	uint32_t last_timestamp = 0;
+	bool in_transaction = false;
+	bool esi = p->enforce_server_id;
+	off64_t saved_offset = p->offset;
+	off64_t ret = -1;
+
+	if (!p->has_read_fde)
+		ybpi_read_fde(p);
+	if (start < p->first_event_offset)
+		start = p->first_event_offset;
+	if ((start = ybp_nearest_offset(p, start)) < 0)
+		return start;
+	if (end > p->file_size)
+		end = p->file_size;
+	if ((evbuf = ybp_get_event()) == NULL)
+		return -1;
+
+	/* Don't skip events from other servers, that would break the chain */
+	p->enforce_server_id = false;
+	if ((start = ybpi_transaction_start(p, start)) < 0)
+		goto out;
+
+	/* Walk forward to the first transaction boundary at or after end */
+	slice_end = start;
+	offset = start;
+	while (offset + EVENT_HEADER_SIZE <= p->file_size) {
+		bool boundary;
+		ybp_reset_event(evbuf);
+		if (ybpi_read_for_slice(p, offset, evbuf) < 0)
+			break;
+		/* We write our own, and the next file's FDE mustn't come along */
+		if (evbuf->type_code == ROTATE_EVENT || evbuf->type_code == STOP_EVENT ||
+				evbuf->type_code == FORMAT_DESCRIPTION_EVENT)
+			break;
+		boundary = ybpi_transaction_step(p, evbuf, &in_transaction);
+		offset += evbuf->length;
+		events_since_boundary++;
+		if (boundary) {
+			slice_end = offset;
+			num_events += events_since_boundary;
+			events_since_boundary = 0;
+			last_timestamp = evbuf->timestamp;
+			if (offset >= end)
+				break;
+		}
+	}
+	if (num_events == 0) {
+		ret = -2;
+		goto out;
+	}
+	Dprintf("slicing [%lld, %lld), %lld events\n", (long long)start, (long long)slice_end, (long long)num_events);
+
+	/* Magic and FDE */
+	if ((fde = ybpi_copy_fde(p, evbuf, &fde_len)) == NULL)
+		goto out;
+	if (pwrite(out_fd, ybpi_binlog_magic, sizeof(ybpi_binlog_magic), 0) != sizeof(ybpi_binlog_magic) ||
+			pwrite(out_fd, fde, fde_len, 4) != (ssize_t)fde_len) {
+		perror("Error writing slice");
+		goto out;
+	}
+
+	/* The bodies */
+	body_start = 4 + fde_len;
+	if (ybpi_copy_range(p->fd, start, out_fd, body_start, slice_end - start) < 0)
+		goto out;
+
+	/* Fix up the headers in place */
+	map_len = body_start + (slice_end - start);
+	if ((map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0)) == MAP_FAILED) {
+		map = NULL;
+		perror("Error mapping slice");
+		goto out;
+	}
+	for (offset = body_start; offset < (off64_t)map_len; ) {
+		struct ybp_event* header = (struct ybp_event*)(map + offset);
+		uint32_t length = header->length;
+		uint32_t old_position = header->next_position;
+		uint32_t new_position = offset + length;
+		if (p->checksum_alg == YBP_CHECKSUM_CRC32) {
+			uint32_t crc;
+			memcpy(&crc, map + offset + length - YBP_CHECKSUM_LEN, YBP_CHECKSUM_LEN);
+			crc = ybpi_crc32_patch(crc, (unsigned char*)&old_position, (unsigned char*)&new_position,
+					sizeof(uint32_t), length - YBP_CHECKSUM_LEN - offsetof(struct ybp_event, flags));
+			memcpy(map + offset + length - YBP_CHECKSUM_LEN, &crc, YBP_CHECKSUM_LEN);
+		}
+		header->next_position = new_position;
+		offset += length;
+	}
+
+	/* And sign off */
+	if (next_file != NULL) {
+		uint64_t position = 4;
+		size_t name_len = strlen(next_file);
+		if (name_len > FILENAME_MAX)
+			name_len = FILENAME_MAX;
+		memcpy(payload, &position, sizeof(position));
+		memcpy(payload + sizeof(position), next_file, name_len);
+		payload_len = sizeof(position) + name_len;
+	}
+	trailer_len = ybpi_make_event(p, trailer, (next_file != NULL) ? ROTATE_EVENT : STOP_EVENT,
+			last_timestamp, map_len, payload, payload_len);
+	if (pwrite(out_fd, trailer, trailer_len, map_len) != (ssize_t)trailer_len ||
+			ftruncate(out_fd, map_len + trailer_len) < 0) {
+		perror("Error writing slice");
+		goto out;
+	}
+	ret = num_events;
+
+out:
+	p->enforce_server_id = esi;
+	p->offset = saved_offset;
+	if (map != NULL)
+		munmap(map, map_len);
+	free(fde);
+	ybp_dispose_event(evbuf);
+	return ret;
+}
+
+/******** GTIDs ********/
+
+#define MARIADB_FL_GROUP_COMMIT_ID 2
+#define GTID_SCAN_CHUNK (1024 * 1024)
+
+int ybp_event_to_gtid(struct ybp_event* restrict e, struct ybp_gtid* restrict gtid)
+{
+	size_t data_len = e->length - EVENT_HEADER_SIZE;
+	if (e->data == NULL)
+		return -1;
+	memset(gtid, 0, sizeof(struct ybp_gtid));
+	if (e->type_code == GTID_LOG_EVENT || e->type_code == ANONYMOUS_GTID_LOG_EVENT) {
+		struct ybp_gtid_log_event* g = (struct ybp_gtid_log_event*)e->data;
+		if (data_len < sizeof(struct ybp_gtid_log_event))
+			return -1;
+		gtid->flavor = YBP_GTID_MYSQL;
+		memcpy(gtid->sid, g->sid, sizeof(gtid->sid));
+		gtid->gno = g->gno;
+		gtid->server_id = e->server_id;
+		/* 5.7 logical clock: type byte, then two 8-byte counters */
+		if (data_len >= sizeof(struct ybp_gtid_log_event) + 17) {
+			char* clock = e->data + sizeof(struct ybp_gtid_log_event) + 1;
+			memcpy(&gtid->last_committed, clock, 8);
+			memcpy(&gtid->sequence_number, clock + 8, 8);
+		}
+		return 0;
+	}
+	else if (e->type_code == MARIADB_GTID_EVENT) {
+		struct ybp_mariadb_gtid_event* g = (struct ybp_mariadb_gtid_event*)e->data;
+		if (data_len < sizeof(struct ybp_mariadb_gtid_event))
+			return -1;
+		gtid->flavor = YBP_GTID_MARIADB;
+		gtid->gno = g->seq_no;
+		gtid->domain_id = g->domain_id;
+		gtid->server_id = e->server_id;
+		return 0;
+	}
+	return -1;
+}
+
+static int ybpi_hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int ybp_parse_gtid(const char* restrict str, struct ybp_gtid* restrict gtid)
+{
+	const char* colon = strchr(str, ':');
+	memset(gtid, 0, sizeof(struct ybp_gtid));
+	if (colon != NULL) {
+		const char* c;
+		int nibbles = 0;
+		char* end;
+		gtid->flavor = YBP_GTID_MYSQL;
+		for (c = str; c < colon; ++c) {
+			int v;
+			if (*c == '-')
+				continue;
+			if ((v = ybpi_hex_value(*c)) < 0 || nibbles >= 32)
+				return -1;
+			gtid->sid[nibbles / 2] |= (nibbles % 2) ? v : (v << 4);
+			nibbles++;
+		}
+		gtid->gno = strtoull(colon + 1, &end, 10);
+		if (nibbles != 32 || *end != '\0' || end == colon + 1)
+			return -1;
+		return 0;
+	}
+	else {
+		unsigned int domain_id, server_id;
+		unsigned long long seq_no;
+		int consumed = 0;
+		if (sscanf(str, "%u-%u-%llu%n", &domain_id, &server_id, &seq_no, &consumed) != 3 || str[consumed] != '\0')
+			return -1;
+		gtid->flavor = YBP_GTID_MARIADB;
+		gtid->domain_id = domain_id;
+		gtid->server_id = server_id;
+		gtid->gno = seq_no;
+		return 0;
+	}
+}
+
+void ybp_format_gtid(const struct ybp_gtid* restrict gtid, char* restrict out)
+{
+	if (gtid->flavor == YBP_GTID_MARIADB) {
+		snprintf(out, YBP_GTID_STR_LEN, "%u-%u-%llu", gtid->domain_id, gtid->server_id, (unsigned long long)gtid->gno);
+	}
+	else {
+		int i;
+		char* o = out;
+		for (i = 0; i < 16; ++i) {
+			if (i == 4 || i == 6 || i == 8 || i == 10)
+				*(o++) = '-';
+			o += sprintf(o, "%02x", gtid->sid[i]);
+		}
+		snprintf(o, YBP_GTID_STR_LEN - (o - out), ":%llu", (unsigned long long)gtid->gno);
+	}
+}
+
+bool ybp_gtid_set_contains(struct ybp_event* restrict e, const struct ybp_gtid* restrict gtid)
+{
+	char* p = e->data;
+	char* end = e->data + e->length - EVENT_HEADER_SIZE;
+	if (e->data == NULL)
+		return false;
+	if (e->type_code == PREVIOUS_GTIDS_LOG_EVENT && gtid->flavor == YBP_GTID_MYSQL) {
+		uint64_t n_sids, n_intervals, i, j;
+		if (p + 8 > end)
+			return false;
+		memcpy(&n_sids, p, 8);
+		p += 8;
+		for (i = 0; i < n_sids; ++i) {
+			bool same_sid;
+			if (p + 24 > end)
+				return false;
+			same_sid = (memcmp(p, gtid->sid, 16) == 0);
+			memcpy(&n_intervals, p + 16, 8);
+			p += 24;
+			if (p + n_intervals * 16 > end)
+				return false;
+			for (j = 0; same_sid && j < n_intervals; ++j) {
+				uint64_t start, stop;
+				memcpy(&start, p + j * 16, 8);
+				memcpy(&stop, p + j * 16 + 8, 8);
+				/* intervals are [start, stop) */
+				if (gtid->gno >= start && gtid->gno < stop)
+					return true;
+			}
+			p += n_intervals * 16;
+		}
+	}
+	else if (e->type_code == MARIADB_GTID_LIST_EVENT && gtid->flavor == YBP_GTID_MARIADB) {
+		uint32_t count, i;
+		if (p + 4 > end)
+			return false;
+		memcpy(&count, p, 4);
+		count &= 0x0fffffff;	/* top bits are flags */
+		p += 4;
+		/* The list holds the last GTID logged in each domain */
+		for (i = 0; i < count && p + 16 <= end; ++i, p += 16) {
+			uint32_t domain_id;
+			uint64_t seq_no;
+			memcpy(&domain_id, p, 4);
+			memcpy(&seq_no, p + 8, 8);
+			if (domain_id == gtid->domain_id && gtid->gno <= seq_no)
+				return true;
+		}
+	}
+	return false;
+}
+
+int ybp_gtid_before_file(struct ybp_binlog_parser* restrict p, const struct ybp_gtid* restrict gtid)
+{
+	struct ybp_event* evbuf;
+	int ret;
+	if (p->gtid_set_offset == 0)
+		return -1;
+	if ((evbuf = ybp_get_event()) == NULL)
+		return -1;
+	if (ybpi_read_event(p, p->gtid_set_offset, evbuf) < 0 || evbuf->data == NULL) {
+		ybp_dispose_event(evbuf);
+		return -1;
+	}
+	ret = ybp_gtid_set_contains(evbuf, gtid) ? 1 : 0;
+	ybp_dispose_event(evbuf);
+	return ret;
+}
+
+static bool ybpi_gtid_same_source(const struct ybp_gtid_source* s, const struct ybp_gtid* gtid)
+{
+	if (s->flavor != gtid->flavor)
+		return false;
+	if (gtid->flavor == YBP_GTID_MARIADB)
+		return s->domain_id == gtid->domain_id && s->server_id == gtid->server_id;
+	return memcmp(s->sid, gtid->sid, 16) == 0;
+}
+
+static bool ybpi_gtid_equal(const struct ybp_gtid* a, const struct ybp_gtid* b)
+{
+	if (a->flavor != b->flavor || a->gno != b->gno)
+		return false;
+	if (a->flavor == YBP_GTID_MARIADB)
+		return a->domain_id == b->domain_id && a->server_id == b->server_id;
+	return memcmp(a->sid, b->sid, 16) == 0;
+}
+
+static struct ybp_gtid_source* ybpi_gtid_find_source(struct ybp_gtid_index* idx, const struct ybp_gtid* gtid, bool create)
+{
+	size_t i;
+	struct ybp_gtid_source* s;
+	for (i = 0; i < idx->num_sources; ++i) {
+		if (ybpi_gtid_same_source(&idx->sources[i], gtid))
+			return &idx->sources[i];
+	}
+	if (!create)
+		return NULL;
+	if ((s = realloc(idx->sources, (idx->num_sources + 1) * sizeof(struct ybp_gtid_source))) == NULL) {
+		perror("realloc");
+		return NULL;
+	}
+	idx->sources = s;
+	s = &idx->sources[idx->num_sources++];
+	memset(s, 0, sizeof(struct ybp_gtid_source));
+	s->flavor = gtid->flavor;
+	memcpy(s->sid, gtid->sid, 16);
+	s->domain_id = gtid->domain_id;
+	s->server_id = gtid->server_id;
+	s->sorted = true;
+	return s;
+}
+
+/**
+ * Feed an event to the index. Only events that continue the indexed
+ * prefix count, so the index never has holes.
+ **/
+static void ybpi_gtid_index_observe(struct ybp_gtid_index* restrict idx, struct ybp_event* restrict e)
+{
+	struct ybp_gtid gtid;
+	struct ybp_gtid_source* s;
+	if (e->offset != idx->scanned_to)
+		return;
+	idx->scanned_to = ybpi_next_after(e);
+	if (ybp_event_to_gtid(e, &gtid) < 0 || e->type_code == ANONYMOUS_GTID_LOG_EVENT)
+		return;
+	if ((s = ybpi_gtid_find_source(idx, &gtid, true)) == NULL)
+		return;
+	if (s->count == s->capacity) {
+		size_t new_capacity = s->capacity ? s->capacity * 2 : 1024;
+		struct ybp_gtid_entry* entries = realloc(s->entries, new_capacity * sizeof(struct ybp_gtid_entry));
+		if (entries == NULL) {
+			perror("realloc");
+			return;
+		}
+		s->entries = entries;
+		s->capacity = new_capacity;
+	}
+	if (s->count > 0 && s->entries[s->count - 1].gno > gtid.gno)
+		s->sorted = false;
+	s->entries[s->count].gno = gtid.gno;
+	s->entries[s->count].offset = e->offset;
+	s->count++;
+}
+
+static void ybpi_dispose_gtid_index(struct ybp_gtid_index* idx)
+{
+	size_t i;
+	if (idx == NULL)
+		return;
+	for (i = 0; i < idx->num_sources; ++i)
+		free(idx->sources[i].entries);
+	free(idx->sources);
+	free(idx);
+}
+
+int ybp_enable_gtid_index(struct ybp_binlog_parser* p)
+{
+	if (p->gtid_index != NULL)
+		return 0;
+	if (!p->has_read_fde && ybpi_read_fde(p) < 0)
+		return -1;
+	if ((p->gtid_index = malloc(sizeof(struct ybp_gtid_index))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(p->gtid_index, 0, sizeof(struct ybp_gtid_index));
+	p->gtid_index->scanned_to = p->first_event_offset;
+	return 0;
+}
+
+static int ybpi_compare_gtid_entries(const void* a, const void* b)
+{
+	uint64_t ga = ((const struct ybp_gtid_entry*)a)->gno;
+	uint64_t gb = ((const struct ybp_gtid_entry*)b)->gno;
+	return (ga > gb) - (ga < gb);
+}
+
+static off64_t ybpi_gtid_lookup(struct ybp_gtid_index* idx, const struct ybp_gtid* gtid)
+{
+	struct ybp_gtid_source* s = ybpi_gtid_find_source(idx, gtid, false);
+	struct ybp_gtid_entry key;
+	struct ybp_gtid_entry* found;
+	if (s == NULL || s->count == 0)
+		return -2;
+	/* Cheap check for the common "just appended it" case */
+	if (s->entries[s->count - 1].gno == gtid->gno)
+		return s->entries[s->count - 1].offset;
+	if (!s->sorted) {
+		qsort(s->entries, s->count, sizeof(struct ybp_gtid_entry), ybpi_compare_gtid_entries);
+		s->sorted = true;
+	}
+	key.gno = gtid->gno;
+	found = bsearch(&key, s->entries, s->count, sizeof(struct ybp_gtid_entry), ybpi_compare_gtid_entries);
+	return (found == NULL) ? -2 : (off64_t)found->offset;
+}
+
+off64_t ybp_find_gtid(struct ybp_binlog_parser* restrict p, const struct ybp_gtid* restrict gtid)
+{
+	struct ybp_gtid_index* idx;
+	unsigned char* buf;
+	struct ybp_gtid seen;
+	off64_t found;
+	if (ybp_enable_gtid_index(p) < 0)
+		return -1;
+	idx = p->gtid_index;
+	if ((found = ybpi_gtid_lookup(idx, gtid)) != -2)
+		return found;
+	if ((buf = malloc(GTID_SCAN_CHUNK)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	/* Only GTID events need their bodies, so walk the headers in big reads */
+	while (found == -2 && idx->scanned_to + EVENT_HEADER_SIZE <= p->file_size) {
+		off64_t base = idx->scanned_to;
+		ssize_t amt_read = pread(p->fd, buf, GTID_SCAN_CHUNK, base);
+		size_t pos = 0;
+		if (amt_read < 0) {
+			perror("Error reading events");
+			found = -1;
+			break;
+		}
+		if (amt_read < EVENT_HEADER_SIZE)
+			break;
+		while (found == -2 && pos + EVENT_HEADER_SIZE <= (size_t)amt_read) {
+			struct ybp_event header;
+			memcpy(&header, buf + pos, EVENT_HEADER_SIZE);
+			header.offset = base + pos;
+			header.data = NULL;
+			if (header.length < MIN_EVENT_LENGTH || header.offset + header.length > p->file_size)
+				goto out;
+			if (ybpi_is_gtid(&header)) {
+				/* Read it again from the top of the next chunk */
+				if (pos + header.length > (size_t)amt_read)
+					break;
+				header.data = (char*)buf + pos + EVENT_HEADER_SIZE;
+				header.data_len = header.length - EVENT_HEADER_SIZE;
+				ybpi_gtid_index_observe(idx, &header);
+				if (ybp_event_to_gtid(&header, &seen) == 0 && ybpi_gtid_equal(&seen, gtid))
+					found = header.offset;
+			} else {
+				idx->scanned_to = ybpi_next_after(&header);
+			}
+			pos += header.length;
+		}
+	}
+out:
+	free(buf);
+	return found;
+}
+
+/******** Bloom-filter sidecars ********/
+
+#define BLOOM_MAGIC "ybinlogp-bloom 1\n"
+#define BLOOM_NAME_MAX 64
+
+/* What a Bloom key names; the kind is hashed along with it */
+#define BLOOM_KEY_DB			'd'
+#define BLOOM_KEY_TABLE			't'	/* db.table */
+#define BLOOM_KEY_BARE_TABLE	'T'	/* table, whatever the db */
+#define BLOOM_KEY_THREAD		'i'
+
+typedef void (*ybpi_key_fn)(char kind, const char* key, size_t len, void* arg);
+
+/**
+ * FNV-1a over the kind and the lowercased key; the two halves make the
+ * double hash that picks the filter bits
+ **/
+static uint64_t ybpi_bloom_hash(char kind, const char* key, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	h = (h ^ (unsigned char)kind) * 0x100000001b3ULL;
+	for (i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)tolower((unsigned char)key[i])) * 0x100000001b3ULL;
+	return h;
+}
+
+static void ybpi_bloom_set(uint8_t* filter, uint32_t filter_bytes, uint64_t h)
+{
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	uint32_t bits = filter_bytes * 8;
+	int i;
+	for (i = 0; i < YBP_BLOOM_HASHES; ++i) {
+		uint32_t bit = (h1 + i * h2) % bits;
+		filter[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+static bool ybpi_bloom_test(const uint8_t* filter, uint32_t filter_bytes, uint64_t h)
+{
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	uint32_t bits = filter_bytes * 8;
+	int i;
+	for (i = 0; i < YBP_BLOOM_HASHES; ++i) {
+		uint32_t bit = (h1 + i * h2) % bits;
+		if (!(filter[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+	return true;
+}
+
+static bool ybpi_is_ident_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '$' || (c & 0x80);
+}
+
+/**
+ * Read a possibly backquoted identifier at s[*i], leaving *i after it.
+ * Returns its length (0 if there isn't one) and where it starts in *name.
+ **/
+static size_t ybpi_read_ident(const char* s, size_t len, size_t* i, const char** name)
+{
+	size_t start, end;
+	if (*i < len && s[*i] == '`') {
+		start = ++*i;
+		while (*i < len && s[*i] != '`')
+			++*i;
+		end = *i;
+		if (*i < len)
+			++*i;
+		*name = s + start;
+		return end - start;
+	}
+	start = *i;
+	while (*i < len && ybpi_is_ident_char(s[*i]))
+		++*i;
+	*name = s + start;
+	return *i - start;
+}
+
+static void ybpi_skip_space(const char* s, size_t len, size_t* i)
+{
+	while (*i < len && isspace((unsigned char)s[*i]))
+		++*i;
+}
+
+static bool ybpi_word_is(const char* word, size_t len, const char* const* words)
+{
+	for (; *words != NULL; ++words) {
+		if (strlen(*words) == len && strncasecmp(word, *words, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void ybpi_emit_table(const char* db, size_t db_len, const char* table, size_t table_len, ybpi_key_fn fn, void* arg)
+{
+	char key[2 * BLOOM_NAME_MAX + 2];
+	if (table_len == 0 || table_len > BLOOM_NAME_MAX || db_len > BLOOM_NAME_MAX)
+		return;
+	fn(BLOOM_KEY_BARE_TABLE, table, table_len, arg);
+	memcpy(key, db, db_len);
+	key[db_len] = '.';
+	memcpy(key + db_len + 1, table, table_len);
+	fn(BLOOM_KEY_TABLE, key, db_len + 1 + table_len, arg);
+	if (db_len > 0)
+		fn(BLOOM_KEY_DB, db, db_len, arg);
+}
+
+/**
+ * Find the tables a statement names: whatever follows the keywords that
+ * introduce table names, skipping string literals. This over-reports
+ * (FROM in a subquery on a function, say), which a Bloom filter doesn't
+ * mind.
+ **/
+static void ybpi_statement_tables(const char* s, size_t len, const char* db, size_t db_len, ybpi_key_fn fn, void* arg)
+{
+	static const char* const introducers[] = {"INTO", "UPDATE", "FROM", "JOIN", "TABLE", "TRUNCATE", "TO", NULL};
+	static const char* const modifiers[] = {"LOW_PRIORITY", "DELAYED", "HIGH_PRIORITY", "IGNORE", "QUICK",
+		"TABLE", "TEMPORARY", "IF", "NOT", "EXISTS", "ONLY", NULL};
+	size_t i = 0;
+	while (i < len) {
+		char c = s[i];
+		if (c == '\'' || c == '"') {
+			for (++i; i < len && s[i] != c; ++i) {
+				if (s[i] == '\\')
+					++i;
+			}
+			++i;
+		}
+		else if (c == '`') {
+			const char* name;
+			ybpi_read_ident(s, len, &i, &name);
+		}
+		else if (ybpi_is_ident_char(c)) {
+			const char* word;
+			size_t word_len = ybpi_read_ident(s, len, &i, &word);
+			if (!ybpi_word_is(word, word_len, introducers))
+				continue;
+			for (;;) {
+				const char *first, *second;
+				size_t first_len, second_len = 0, mark;
+				ybpi_skip_space(s, len, &i);
+				mark = i;
+				first_len = ybpi_read_ident(s, len, &i, &first);
+				if (first_len > 0 && s[mark] != '`' && ybpi_word_is(first, first_len, modifiers))
+					continue;
+				if (first_len == 0)
+					break;
+				if (i < len && s[i] == '.') {
+					++i;
+					second_len = ybpi_read_ident(s, len, &i, &second);
+				}
+				if (second_len > 0)
+					ybpi_emit_table(first, first_len, second, second_len, fn, arg);
+				else
+					ybpi_emit_table(db, db_len, first, first_len, fn, arg);
+				ybpi_skip_space(s, len, &i);
+				if (i >= len || s[i] != ',')
+					break;
+				++i;
+			}
+		}
+		else {
+			++i;
+		}
+	}
+}
+
+/**
+ * Everything an event can be found by
+ **/
+static void ybpi_event_keys(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, ybpi_key_fn fn, void* arg)
+{
+	struct ybp_decoded_event dec;
+	if (e->type_code != QUERY_EVENT && e->type_code != TABLE_MAP_EVENT)
+		return;
+	if (ybp_decode_event(p, e, &dec) < 0)
+		return;
+	if (e->type_code == QUERY_EVENT) {
+		const struct ybp_query_view* q = &dec.u.query;
+		char thread[16];
+		snprintf(thread, sizeof(thread), "%u", q->thread_id);
+		fn(BLOOM_KEY_THREAD, thread, strlen(thread), arg);
+		if (q->db_name_len > 0)
+			fn(BLOOM_KEY_DB, q->db_name, q->db_name_len, arg);
+		ybpi_statement_tables(q->statement, q->statement_len, q->db_name, q->db_name_len, fn, arg);
+	}
+	else {
+		/* table id and flags in the post-header, then length-prefixed,
+		 * NUL-ended names */
+		const unsigned char* d = (const unsigned char*)dec.body;
+		size_t len = dec.body_len;
+		size_t db_len, table_len;
+		if (len < 1)
+			return;
+		db_len = d[0];
+		if (3 + db_len > len)
+			return;
+		table_len = d[2 + db_len];
+		if (3 + db_len + table_len > len)
+			return;
+		ybpi_emit_table((const char*)d + 1, db_len, (const char*)d + 3 + db_len, table_len, fn, arg);
+	}
+}
+
+struct ybpi_bloom_adder {
+	uint8_t*	filter;
+	uint32_t	filter_bytes;
+};
+
+static void ybpi_bloom_add_key(char kind, const char* key, size_t len, void* arg)
+{
+	struct ybpi_bloom_adder* a = arg;
+	ybpi_bloom_set(a->filter, a->filter_bytes, ybpi_bloom_hash(kind, key, len));
+}
+
+/**
+ * Feed an event to the index. As with the GTID index, only events that
+ * continue the indexed prefix count.
+ **/
+static void ybpi_bloom_index_observe(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_bloom_index* idx = p->bloom_index;
+	struct ybpi_bloom_adder adder;
+	size_t block;
+	if (e->offset != idx->scanned_to)
+		return;
+	block = e->offset / idx->block_size;
+	if (block >= idx->blocks_size) {
+		size_t size = idx->blocks_size ? idx->blocks_size * 2 : 64;
+		uint8_t* filters;
+		while (size <= block)
+			size *= 2;
+		if ((filters = realloc(idx->filters, size * idx->filter_bytes)) == NULL) {
+			perror("realloc");
+			return;
+		}
+		memset(filters + idx->blocks_size * idx->filter_bytes, 0, (size - idx->blocks_size) * idx->filter_bytes);
+		idx->filters = filters;
+		idx->blocks_size = size;
+	}
+	if (block >= idx->num_blocks)
+		idx->num_blocks = block + 1;
+	idx->scanned_to = ybpi_next_after(e);
+	adder.filter = idx->filters + block * idx->filter_bytes;
+	adder.filter_bytes = idx->filter_bytes;
+	ybpi_event_keys(p, e, ybpi_bloom_add_key, &adder);
+}
+
+static void ybpi_dispose_bloom_index(struct ybp_bloom_index* idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->filters);
+	free(idx);
+}
+
+static uint32_t ybpi_fde_timestamp(struct ybp_binlog_parser* p)
+{
+	uint32_t timestamp = 0;
+	if (pread(p->fd, &timestamp, sizeof(timestamp), 4) != sizeof(timestamp))
+		return 0;
+	return timestamp;
+}
+
+int ybp_enable_bloom_index(struct ybp_binlog_parser* p, uint32_t block_size, uint32_t filter_bytes)
+{
+	if (p->bloom_index != NULL)
+		return 0;
+	if (!p->has_read_fde && ybpi_read_fde(p) < 0)
+		return -1;
+	if ((p->bloom_index = malloc(sizeof(struct ybp_bloom_index))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(p->bloom_index, 0, sizeof(struct ybp_bloom_index));
+	p->bloom_index->block_size = block_size ? block_size : YBP_BLOOM_BLOCK_SIZE;
+	p->bloom_index->filter_bytes = filter_bytes ? filter_bytes : YBP_BLOOM_FILTER_BYTES;
+	p->bloom_index->fde_timestamp = ybpi_fde_timestamp(p);
+	p->bloom_index->scanned_to = p->first_event_offset;
+	return 0;
+}
+
+int ybp_extend_bloom_index(struct ybp_binlog_parser* p)
+{
+	struct ybp_bloom_index* idx;
+	struct ybp_event* evbuf;
+	bool esi = p->enforce_server_id;
+	int ret = 0;
+	if (ybp_enable_bloom_index(p, 0, 0) < 0)
+		return -1;
+	idx = p->bloom_index;
+	if ((evbuf = ybp_get_event()) == NULL)
+		return -1;
+	posix_fadvise(p->fd, idx->scanned_to, 0, POSIX_FADV_SEQUENTIAL);
+	p->enforce_server_id = false;
+	while (idx->scanned_to + EVENT_HEADER_SIZE <= p->file_size) {
+		off64_t before = idx->scanned_to;
+		ybp_reset_event(evbuf);
+		if (ybpi_read_event(p, idx->scanned_to, evbuf) < 0 || evbuf->length < MIN_EVENT_LENGTH) {
+			ret = -1;
+			break;
+		}
+		ybpi_bloom_index_observe(p, evbuf);
+		if (idx->scanned_to == before) {
+			ret = -1;
+			break;
+		}
+	}
+	p->enforce_server_id = esi;
+	ybp_dispose_event(evbuf);
+	return ret;
+}
+
+int ybp_save_bloom_index(struct ybp_binlog_parser* restrict p, const char* restrict path)
+{
+	struct ybp_bloom_index* idx = p->bloom_index;
+	char* tmp_path;
+	FILE* f;
+	int ret = 0;
+	if (idx == NULL)
+		return -1;
+	if ((tmp_path = malloc(strlen(path) + 5)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+	if ((f = fopen(tmp_path, "w")) == NULL) {
+		perror("Error opening Bloom index");
+		free(tmp_path);
+		return -1;
+	}
+	fprintf(f, BLOOM_MAGIC "%u %u %u %zu %lld\n", idx->block_size, idx->filter_bytes, idx->fde_timestamp,
+			idx->num_blocks, (long long)idx->scanned_to);
+	if (fwrite(idx->filters, idx->filter_bytes, idx->num_blocks, f) != idx->num_blocks ||
+			fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		perror("Error writing Bloom index");
+		ret = -1;
+	}
+	fclose(f);
+	if (ret == 0 && rename(tmp_path, path) < 0) {
+		perror("Error renaming Bloom index");
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(tmp_path);
+	free(tmp_path);
+	return ret;
+}
+
+int ybp_load_bloom_index(struct ybp_binlog_parser* restrict p, const char* restrict path)
+{
+	struct ybp_bloom_index* idx;
+	char header[64];
+	unsigned int block_size, filter_bytes, fde_timestamp;
+	size_t num_blocks;
+	long long scanned_to;
+	FILE* f;
+	if ((f = fopen(path, "r")) == NULL)
+		return (errno == ENOENT) ? -2 : -1;
+	if (fgets(header, sizeof(header), f) == NULL || strcmp(header, BLOOM_MAGIC) != 0 ||
+			fscanf(f, "%u %u %u %zu %lld", &block_size, &filter_bytes, &fde_timestamp, &num_blocks, &scanned_to) != 5 ||
+			fgetc(f) != '\n' || block_size == 0 || filter_bytes == 0 ||
+			fde_timestamp != ybpi_fde_timestamp(p) || scanned_to > p->file_size ||
+			num_blocks > (size_t)(scanned_to / block_size) + 1) {
+		fclose(f);
+		return -2;
+	}
+	if ((idx = malloc(sizeof(struct ybp_bloom_index))) == NULL ||
+			(idx->filters = malloc(num_blocks ? num_blocks * filter_bytes : 1)) == NULL) {
+		perror("malloc");
+		free(idx);
+		fclose(f);
+		return -1;
+	}
+	if (fread(idx->filters, filter_bytes, num_blocks, f) != num_blocks) {
+		ybpi_dispose_bloom_index(idx);
+		fclose(f);
+		return -2;
+	}
+	fclose(f);
+	idx->block_size = block_size;
+	idx->filter_bytes = filter_bytes;
+	idx->fde_timestamp = fde_timestamp;
+	idx->num_blocks = num_blocks;
+	idx->blocks_size = num_blocks;
+	idx->scanned_to = scanned_to;
+	ybpi_dispose_bloom_index(p->bloom_index);
+	p->bloom_index = idx;
+	return 0;
+}
+
+bool ybp_bloom_block_may_match(const struct ybp_bloom_index* restrict idx, size_t block, const struct ybp_bloom_query* restrict q)
+{
+	const uint8_t* filter;
+	char thread[24];
+	if ((off64_t)(block + 1) * idx->block_size > idx->scanned_to)
+		return true;
+	/* Indexed, but no event starts there */
+	if (block >= idx->num_blocks)
+		return false;
+	filter = idx->filters + block * idx->filter_bytes;
+	if (q->db != NULL && !ybpi_bloom_test(filter, idx->filter_bytes, ybpi_bloom_hash(BLOOM_KEY_DB, q->db, strlen(q->db))))
+		return false;
+	if (q->table != NULL) {
+		char kind = (strchr(q->table, '.') != NULL) ? BLOOM_KEY_TABLE : BLOOM_KEY_BARE_TABLE;
+		if (!ybpi_bloom_test(filter, idx->filter_bytes, ybpi_bloom_hash(kind, q->table, strlen(q->table))))
+			return false;
+	}
+	if (q->thread_id >= 0) {
+		snprintf(thread, sizeof(thread), "%lld", (long long)q->thread_id);
+		if (!ybpi_bloom_test(filter, idx->filter_bytes, ybpi_bloom_hash(BLOOM_KEY_THREAD, thread, strlen(thread))))
+			return false;
+	}
+	return true;
+}
+
+struct ybpi_bloom_matcher {
+	const struct ybp_bloom_query*	q;
+	char		thread[24];
+	bool		db, table, thread_id;
+};
+
+static bool ybpi_key_equal(const char* key, size_t len, const char* want)
+{
+	return (want != NULL && strlen(want) == len && strncasecmp(key, want, len) == 0);
+}
+
+static void ybpi_bloom_match_key(char kind, const char* key, size_t len, void* arg)
+{
+	struct ybpi_bloom_matcher* m = arg;
+	switch (kind) {
+		case BLOOM_KEY_DB:
+			m->db |= ybpi_key_equal(key, len, m->q->db);
+			break;
+		case BLOOM_KEY_TABLE:
+		case BLOOM_KEY_BARE_TABLE:
+			if (m->q->table != NULL && (strchr(m->q->table, '.') != NULL) == (kind == BLOOM_KEY_TABLE))
+				m->table |= ybpi_key_equal(key, len, m->q->table);
+			break;
+		case BLOOM_KEY_THREAD:
+			m->thread_id |= ybpi_key_equal(key, len, m->thread);
+			break;
+	}
+}
+
+bool ybp_bloom_event_matches(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, const struct ybp_bloom_query* restrict q)
+{
+	struct ybpi_bloom_matcher m;
+	memset(&m, 0, sizeof(m));
+	m.q = q;
+	snprintf(m.thread, sizeof(m.thread), "%lld", (long long)q->thread_id);
+	ybpi_event_keys(p, e, ybpi_bloom_match_key, &m);
+	return ((q->db == NULL || m.db) && (q->table == NULL || m.table) && (q->thread_id < 0 || m.thread_id));
+}
+
+/******** event index ********/
+
+#define EVENT_INDEX_MAGIC "ybinlogp-events 1\n"
+#define EVENT_INDEX_CHUNK (1024 * 1024)
+
+static int ybpi_event_index_append(struct ybp_event_index* idx, off64_t offset, uint32_t timestamp, uint8_t type_code)
+{
+	if (idx->count == idx->capacity) {
+		size_t capacity = idx->capacity ? idx->capacity * 2 : 4096;
+		uint64_t* offsets;
+		uint32_t* timestamps;
+		uint8_t* type_codes;
+		if ((offsets = realloc(idx->offsets, capacity * sizeof(uint64_t))) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		idx->offsets = offsets;
+		if ((timestamps = realloc(idx->timestamps, capacity * sizeof(uint32_t))) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		idx->timestamps = timestamps;
+		if ((type_codes = realloc(idx->type_codes, capacity)) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		idx->type_codes = type_codes;
+		idx->capacity = capacity;
+	}
+	idx->offsets[idx->count] = offset;
+	idx->timestamps[idx->count] = timestamp;
+	idx->type_codes[idx->count] = type_code;
+	idx->count++;
+	return 0;
+}
+
+/**
+ * Feed an event to the index; only events that continue the indexed
+ * prefix count
+ **/
+static void ybpi_event_index_observe(struct ybp_event_index* restrict idx, struct ybp_event* restrict e)
+{
+	if (e->offset != idx->scanned_to)
+		return;
+	if (ybpi_event_index_append(idx, e->offset, e->timestamp, e->type_code) == 0)
+		idx->scanned_to = ybpi_next_after(e);
+}
+
+static void ybpi_dispose_event_index(struct ybp_event_index* idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->offsets);
+	free(idx->timestamps);
+	free(idx->type_codes);
+	free(idx);
+}
+
+int ybp_enable_event_index(struct ybp_binlog_parser* p)
+{
+	if (p->event_index != NULL)
+		return 0;
+	if (!p->has_read_fde && ybpi_read_fde(p) < 0)
+		return -1;
+	if ((p->event_index = malloc(sizeof(struct ybp_event_index))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(p->event_index, 0, sizeof(struct ybp_event_index));
+	p->event_index->scanned_to = p->first_event_offset;
+	p->event_index->fde_timestamp = ybpi_fde_timestamp(p);
+	return 0;
+}
+
+/**
+ * Only the headers are wanted, so walk them through big reads instead of
+ * reading events one at a time
+ **/
+int ybp_extend_event_index(struct ybp_binlog_parser* p, size_t n)
+{
+	struct ybp_event_index* idx;
+	unsigned char* buf;
+	int ret = 0;
+	if (ybp_enable_event_index(p) < 0)
+		return -1;
+	idx = p->event_index;
+	if (idx->count > n)
+		return 0;
+	if ((buf = malloc(EVENT_INDEX_CHUNK)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	while (idx->count <= n && idx->scanned_to + EVENT_HEADER_SIZE <= p->file_size) {
+		off64_t base = idx->scanned_to;
+		ssize_t amt_read = pread(p->fd, buf, EVENT_INDEX_CHUNK, base);
+		size_t pos = 0;
+		if (amt_read < 0) {
+			perror("Error reading event headers");
+			ret = -1;
+			break;
+		}
+		if (amt_read < EVENT_HEADER_SIZE)
+			break;
+		while (pos + EVENT_HEADER_SIZE <= (size_t)amt_read && idx->count <= n) {
+			struct ybp_event header;
+			memcpy(&header, buf + pos, EVENT_HEADER_SIZE);
+			if (header.length < MIN_EVENT_LENGTH) {
+				fprintf(stderr, "Bad event length %u at %lld\n", header.length, (long long)(base + pos));
+				ret = -1;
+				goto out;
+			}
+			/* The last event may still be on its way in */
+			if (base + pos + header.length > (size_t)p->file_size)
+				goto out;
+			if (ybpi_event_index_append(idx, base + pos, header.timestamp, header.type_code) < 0) {
+				ret = -1;
+				goto out;
+			}
+			pos += header.length;
+			idx->scanned_to = base + pos;
+		}
+	}
+out:
+	free(buf);
+	return ret;
+}
+
+int ybp_save_event_index(struct ybp_binlog_parser* restrict p, const char* restrict path)
+{
+	struct ybp_event_index* idx = p->event_index;
+	char* tmp_path;
+	FILE* f;
+	int ret = 0;
+	if (idx == NULL)
+		return -1;
+	if ((tmp_path = malloc(strlen(path) + 5)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+	if ((f = fopen(tmp_path, "w")) == NULL) {
+		perror("Error opening event index");
+		free(tmp_path);
+		return -1;
+	}
+	fprintf(f, EVENT_INDEX_MAGIC "%u %zu %lld\n", idx->fde_timestamp, idx->count, (long long)idx->scanned_to);
+	if (fwrite(idx->offsets, sizeof(uint64_t), idx->count, f) != idx->count ||
+			fwrite(idx->timestamps, sizeof(uint32_t), idx->count, f) != idx->count ||
+			fwrite(idx->type_codes, 1, idx->count, f) != idx->count ||
+			fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		perror("Error writing event index");
+		ret = -1;
+	}
+	fclose(f);
+	if (ret == 0 && rename(tmp_path, path) < 0) {
+		perror("Error renaming event index");
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(tmp_path);
+	free(tmp_path);
+	return ret;
+}
+
+int ybp_load_event_index(struct ybp_binlog_parser* restrict p, const char* restrict path)
+{
+	struct ybp_event_index* idx;
+	char header[64];
+	unsigned int fde_timestamp;
+	size_t count;
+	long long scanned_to;
+	FILE* f;
+	if ((f = fopen(path, "r")) == NULL)
+		return (errno == ENOENT) ? -2 : -1;
+	if (fgets(header, sizeof(header), f) == NULL || strcmp(header, EVENT_INDEX_MAGIC) != 0 ||
+			fscanf(f, "%u %zu %lld", &fde_timestamp, &count, &scanned_to) != 3 || fgetc(f) != '\n' ||
+			fde_timestamp != ybpi_fde_timestamp(p) || scanned_to > p->file_size ||
+			count > (size_t)scanned_to / MIN_EVENT_LENGTH) {
+		fclose(f);
+		return -2;
+	}
+	if ((idx = malloc(sizeof(struct ybp_event_index))) == NULL) {
+		perror("malloc");
+		fclose(f);
+		return -1;
+	}
+	memset(idx, 0, sizeof(struct ybp_event_index));
+	idx->offsets = malloc((count + 1) * sizeof(uint64_t));
+	idx->timestamps = malloc((count + 1) * sizeof(uint32_t));
+	idx->type_codes = malloc(count + 1);
+	if (idx->offsets == NULL || idx->timestamps == NULL || idx->type_codes == NULL) {
+		perror("malloc");
+		ybpi_dispose_event_index(idx);
+		fclose(f);
+		return -1;
+	}
+	if (fread(idx->offsets, sizeof(uint64_t), count, f) != count ||
+			fread(idx->timestamps, sizeof(uint32_t), count, f) != count ||
+			fread(idx->type_codes, 1, count, f) != count) {
+		ybpi_dispose_event_index(idx);
+		fclose(f);
+		return -2;
+	}
+	fclose(f);
+	idx->count = count;
+	idx->capacity = count + 1;
+	idx->scanned_to = scanned_to;
+	idx->fde_timestamp = fde_timestamp;
+	ybpi_dispose_event_index(p->event_index);
+	p->event_index = idx;
+	return 0;
+}
+
+off64_t ybp_seek_event_n(struct ybp_binlog_parser* p, size_t n)
+{
+	if (ybp_extend_event_index(p, n) < 0)
+		return -1;
+	if (n >= p->event_index->count)
+		return -2;
+	p->offset = p->event_index->offsets[n];
+	return p->offset;
+}
+
+ssize_t ybp_event_n_at_offset(struct ybp_binlog_parser* p, off64_t offset)
+{
+	struct ybp_event_index* idx;
+	size_t lo = 0, hi;
+	if (ybp_extend_event_index(p, SIZE_MAX) < 0)
+		return -1;
+	idx = p->event_index;
+	hi = idx->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if ((off64_t)idx->offsets[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < idx->count) ? (ssize_t)lo : -2;
+}
+
+ssize_t ybp_event_n_at_time(struct ybp_binlog_parser* p, size_t from, time_t t)
+{
+	struct ybp_event_index* idx;
+	size_t i;
+	if (ybp_extend_event_index(p, SIZE_MAX) < 0)
+		return -1;
+	idx = p->event_index;
+	for (i = from; i < idx->count; ++i) {
+		if (idx->timestamps[i] >= t)
+			return i;
+	}
+	return -2;
+}
+
+ssize_t ybp_count_events(struct ybp_binlog_parser* p, size_t first, size_t last, int type_code)
+{
+	struct ybp_event_index* idx;
+	size_t i;
+	ssize_t count = 0;
+	if (ybp_extend_event_index(p, (last == SIZE_MAX) ? SIZE_MAX : last - 1) < 0)
+		return -1;
+	idx = p->event_index;
+	if (last > idx->count)
+		last = idx->count;
+	if (first >= last)
+		return 0;
+	if (type_code < 0)
+		return last - first;
+	for (i = first; i < last; ++i)
+		count += (idx->type_codes[i] == type_code);
+	return count;
+}
+
+/******** divergence ********/
+
+#define DIVERGE_TIME_SLACK 5		/* seconds either side of a transaction to look for it */
+#define DIVERGE_WINDOW 65536		/* transactions to try at most per lookup by time */
+#define DIVERGE_STREAM_BYTES 1048576	/* stop bisecting and just compare below this */
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t ybpi_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t ybpi_hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH_PRIME2;
+	return ybpi_rotl64(acc, 31) * HASH_PRIME1;
+}
+
+static inline uint64_t ybpi_hash_merge(uint64_t acc, uint64_t lane)
+{
+	acc ^= ybpi_hash_round(0, lane);
+	return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+static inline uint64_t ybpi_load64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * XXH64: four independent lanes of 8 bytes each, so it runs at about
+ * memory speed. Chain calls through seed to hash several pieces.
+ **/
+static uint64_t ybpi_hash64(const void* data, size_t len, uint64_t seed)
+{
+	const uint8_t* p = data;
+	const uint8_t* end = p + len;
+	uint64_t h;
+	if (len >= 32) {
+		const uint8_t* limit = end - 32;
+		uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2, v2 = seed + HASH_PRIME2;
+		uint64_t v3 = seed, v4 = seed - HASH_PRIME1;
+		do {
+			v1 = ybpi_hash_round(v1, ybpi_load64(p));
+			v2 = ybpi_hash_round(v2, ybpi_load64(p + 8));
+			v3 = ybpi_hash_round(v3, ybpi_load64(p + 16));
+			v4 = ybpi_hash_round(v4, ybpi_load64(p + 24));
+			p += 32;
+		} while (p <= limit);
+		h = ybpi_rotl64(v1, 1) + ybpi_rotl64(v2, 7) + ybpi_rotl64(v3, 12) + ybpi_rotl64(v4, 18);
+		h = ybpi_hash_merge(h, v1);
+		h = ybpi_hash_merge(h, v2);
+		h = ybpi_hash_merge(h, v3);
+		h = ybpi_hash_merge(h, v4);
+	} else {
+		h = seed + HASH_PRIME5;
+	}
+	h += len;
+	for (; p + 8 <= end; p += 8)
+		h = ybpi_rotl64(h ^ ybpi_hash_round(0, ybpi_load64(p)), 27) * HASH_PRIME1 + HASH_PRIME4;
+	if (p + 4 <= end) {
+		uint32_t k;
+		memcpy(&k, p, sizeof(k));
+		h = ybpi_rotl64(h ^ (k * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+		h = ybpi_rotl64(h ^ (*p * HASH_PRIME5), 11) * HASH_PRIME1;
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * Events that say something about the binlog rather than a transaction
+ **/
+static bool ybpi_txn_ignored(struct ybp_event* e)
+{
+	switch (e->type_code) {
+		case FORMAT_DESCRIPTION_EVENT:
+		case ROTATE_EVENT:
+		case STOP_EVENT:
+		case PREVIOUS_GTIDS_LOG_EVENT:
+		case HEARTBEAT_LOG_EVENT:
+		case IGNORABLE_LOG_EVENT:
+		case ROWS_QUERY_LOG_EVENT:
+		case ANNOTATE_ROWS_EVENT:
+		case BINLOG_CHECKPOINT_EVENT:
+		case MARIADB_GTID_LIST_EVENT:
+		case START_ENCRYPTION_EVENT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Fold what e changes into h. Post-headers are skipped: what's in them
+ * (thread ids, execution times, table ids, file ids) is local to the
+ * server. The original statements logged alongside row events are left
+ * out too, since servers can differ on whether they log them.
+ **/
+static uint64_t ybpi_txn_hash_event(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, uint64_t h)
+{
+	struct ybp_decoded_event d;
+	uint8_t type_code = e->type_code;
+	h = ybpi_hash64(&type_code, 1, h);
+	if (ybp_decode_event(p, e, &d) < 0)
+		return ybpi_hash64(&e->length, sizeof(e->length), h);
+	switch (e->type_code) {
+		case QUERY_EVENT:
+			h = ybpi_hash64(d.u.query.db_name, d.u.query.db_name_len, h);
+			return ybpi_hash64(d.u.query.statement, d.u.query.statement_len, h);
+		case XID_EVENT:
+			return h;
+		default:
+			return ybpi_hash64(d.body, d.body_len, h);
+	}
+}
+
+int ybp_next_transaction(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict evbuf, struct ybp_txn_digest* restrict t)
+{
+	bool in_transaction = false;
+	memset(t, 0, sizeof(struct ybp_txn_digest));
+	for (;;) {
+		int ret;
+		if (p->offset + EVENT_HEADER_SIZE > p->file_size)
+			break;
+		ybp_reset_event(evbuf);
+		if ((ret = ybp_next_event(p, evbuf)) == -2) {
+			ybp_rewind_bp(p, p->file_size);
+			break;
+		}
+		if (ret < 0)
+			return -1;
+		if (ybpi_txn_ignored(evbuf))
+			continue;
+		if (t->num_events++ == 0) {
+			t->offset = evbuf->offset;
+			t->timestamp = evbuf->timestamp;
+		}
+		t->end = ybpi_next_after(evbuf);
+		if (ybpi_is_gtid(evbuf))
+			t->has_gtid = (ybp_event_to_gtid(evbuf, &t->gtid) == 0);
+		else
+			t->hash = ybpi_txn_hash_event(p, evbuf, t->hash);
+		if (ybpi_transaction_step(p, evbuf, &in_transaction)) {
+			t->complete = true;
+			return 1;
+		}
+	}
+	return (t->num_events > 0) ? 1 : 0;
+}
+
+/**
+ * A chain of binlogs read as one, transaction by transaction. Positions
+ * in it are counted as if the binlogs were laid end to end.
+ **/
+struct ybpi_chain {
+	struct ybp_binlog_parser**	parsers;
+	size_t		num_parsers;
+	off64_t*	bases;			/* where each binlog starts */
+	off64_t		total;
+	size_t		file;			/* the binlog being read */
+	struct ybp_event*	evbuf;
+};
+
+static int ybpi_init_chain(struct ybpi_chain* restrict c, struct ybp_binlog_parser** parsers, size_t num_parsers)
+{
+	size_t i;
+	memset(c, 0, sizeof(struct ybpi_chain));
+	c->parsers = parsers;
+	c->num_parsers = num_parsers;
+	if ((c->bases = malloc((num_parsers + 1) * sizeof(off64_t))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	if ((c->evbuf = ybp_get_event()) == NULL)
+		return -1;
+	for (i = 0; i < num_parsers; ++i) {
+		c->bases[i] = c->total;
+		c->total += parsers[i]->file_size;
+	}
+	c->bases[num_parsers] = c->total;
+	return 0;
+}
+
+static void ybpi_dispose_chain(struct ybpi_chain* c)
+{
+	free(c->bases);
+	if (c->evbuf != NULL)
+		ybp_dispose_event(c->evbuf);
+}
+
+static void ybpi_chain_seek(struct ybpi_chain* c, size_t file, off64_t offset)
+{
+	c->file = file;
+	if (file < c->num_parsers)
+		ybp_rewind_bp(c->parsers[file], offset);
+}
+
+static int ybpi_chain_next(struct ybpi_chain* restrict c, struct ybp_txn_digest* restrict t)
+{
+	while (c->file < c->num_parsers) {
+		int ret = ybp_next_transaction(c->parsers[c->file], c->evbuf, t);
+		if (ret != 0) {
+			t->file = c->file;
+			return ret;
+		}
+		if (++c->file < c->num_parsers)
+			ybp_rewind_bp(c->parsers[c->file], c->parsers[c->file]->first_event_offset);
+	}
+	return 0;
+}
+
+static off64_t ybpi_chain_position(const struct ybpi_chain* c, size_t file, off64_t offset)
+{
+	return c->bases[file] + offset;
+}
+
+/**
+ * Read the transaction that position pos falls in (or, failing that, the
+ * next one) into t. Returns 1 if there was one, 0 if not, -1 on error.
+ **/
+static int ybpi_chain_transaction_at(struct ybpi_chain* restrict c, off64_t pos, struct ybp_txn_digest* restrict t)
+{
+	size_t file = 0;
+	off64_t offset;
+	while (file + 1 < c->num_parsers && c->bases[file + 1] <= pos)
+		++file;
+	offset = pos - c->bases[file];
+	if (offset < c->parsers[file]->first_event_offset)
+		offset = c->parsers[file]->first_event_offset;
+	if ((offset = ybp_nearest_offset(c->parsers[file], offset)) == -1)
+		return -1;
+	if (offset == -2) {
+		ybpi_chain_seek(c, file + 1, (file + 1 < c->num_parsers) ? c->parsers[file + 1]->first_event_offset : 0);
+	} else {
+		if ((offset = ybpi_transaction_start(c->parsers[file], offset)) < 0)
+			return -1;
+		ybpi_chain_seek(c, file, offset);
+	}
+	return ybpi_chain_next(c, t);
+}
+
+static bool ybpi_gtid_is_mysql_anonymous(const struct ybp_gtid* gtid)
+{
+	static const uint8_t zero[16];
+	return gtid->flavor == YBP_GTID_MYSQL && memcmp(gtid->sid, zero, sizeof(zero)) == 0;
+}
+
+/**
+ * Look for the transaction at its GTID, newest binlog first, letting the
+ * GTID sets at their heads rule binlogs out. Returns 1 if it's there with
+ * the same contents, 0 if not, -1 on error.
+ **/
+static int ybpi_locate_by_gtid(struct ybpi_chain* restrict c, const struct ybp_txn_digest* restrict t, struct ybp_txn_digest* restrict found)
+{
+	size_t i;
+	for (i = c->num_parsers; i-- > 0;) {
+		int before = ybp_gtid_before_file(c->parsers[i], &t->gtid);
+		off64_t offset;
+		int ret;
+		if (before != 1) {
+			if ((offset = ybp_find_gtid(c->parsers[i], &t->gtid)) == -1)
+				return -1;
+			if (offset >= 0) {
+				ybpi_chain_seek(c, i, offset);
+				if ((ret = ybpi_chain_next(c, found)) <= 0)
+					return ret;
+				return found->hash == t->hash;
+			}
+		}
+		if (before == 0)
+			break;
+	}
+	return 0;
+}
+
+/**
+ * Without a GTID, all there is to go on is the timestamp: try everything
+ * stamped within DIVERGE_TIME_SLACK seconds of it
+ **/
+static int ybpi_locate_by_time(struct ybpi_chain* restrict c, const struct ybp_txn_digest* restrict t, struct ybp_txn_digest* restrict found)
+{
+	time_t from = (t->timestamp > DIVERGE_TIME_SLACK) ? t->timestamp - DIVERGE_TIME_SLACK : 0;
+	size_t i;
+	off64_t offset;
+	int n, ret;
+	/* The last binlog that starts early enough; FDEs aren't always stamped */
+	for (i = c->num_parsers - 1; i > 0; --i) {
+		ybpi_chain_seek(c, i, c->parsers[i]->first_event_offset);
+		if ((ret = ybpi_chain_next(c, found)) < 0)
+			return -1;
+		if (ret == 1 && found->file == i && found->timestamp <= from)
+			break;
+	}
+	if ((offset = ybp_nearest_time(c->parsers[i], from)) == -1)
+		return -1;
+	if (offset == -2) {
+		ybpi_chain_seek(c, i + 1, (i + 1 < c->num_parsers) ? c->parsers[i + 1]->first_event_offset : 0);
+	} else {
+		if ((offset = ybpi_transaction_start(c->parsers[i], offset)) < 0)
+			return -1;
+		ybpi_chain_seek(c, i, offset);
+	}
+	for (n = 0; n < DIVERGE_WINDOW; ++n) {
+		if ((ret = ybpi_chain_next(c, found)) <= 0)
+			return ret;
+		if (found->hash == t->hash)
+			return 1;
+		if (found->timestamp > t->timestamp + DIVERGE_TIME_SLACK)
+			break;
+	}
+	return 0;
+}
+
+static int ybpi_locate_transaction(struct ybpi_chain* restrict c, const struct ybp_txn_digest* restrict t, struct ybp_txn_digest* restrict found)
+{
+	if (c->num_parsers == 0)
+		return 0;
+	if (t->has_gtid && !ybpi_gtid_is_mysql_anonymous(&t->gtid))
+		return ybpi_locate_by_gtid(c, t, found);
+	return ybpi_locate_by_time(c, t, found);
+}
+
+struct ybpi_tail {
+	struct ybp_txn_digest*	txns;
+	size_t	count;
+	size_t	size;
+};
+
+/**
+ * Read the rest of the chain into tail, starting with first (which has
+ * just been read)
+ **/
+static int ybpi_read_tail(struct ybpi_chain* restrict c, const struct ybp_txn_digest* restrict first, struct ybpi_tail* restrict tail)
+{
+	struct ybp_txn_digest t = *first;
+	int ret = 1;
+	while (ret > 0) {
+		if (tail->count == tail->size) {
+			size_t size = (tail->size == 0) ? 1024 : tail->size * 2;
+			struct ybp_txn_digest* txns = realloc(tail->txns, size * sizeof(struct ybp_txn_digest));
+			if (txns == NULL) {
+				perror("realloc");
+				return -1;
+			}
+			tail->txns = txns;
+			tail->size = size;
+		}
+		tail->txns[tail->count++] = t;
+		ret = ybpi_chain_next(c, &t);
+	}
+	return ret;
+}
+
+struct ybpi_tail_key {
+	uint64_t	hash;
+	size_t		index;
+};
+
+static int ybpi_compare_tail_keys(const void* a, const void* b)
+{
+	const struct ybpi_tail_key* x = a;
+	const struct ybpi_tail_key* y = b;
+	if (x->hash != y->hash)
+		return (x->hash < y->hash) ? -1 : 1;
+	return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+static struct ybpi_tail_key* ybpi_tail_keys(const struct ybpi_tail* tail)
+{
+	struct ybpi_tail_key* keys;
+	size_t i;
+	if ((keys = malloc((tail->count + 1) * sizeof(struct ybpi_tail_key))) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	for (i = 0; i < tail->count; ++i) {
+		keys[i].hash = tail->txns[i].hash;
+		keys[i].index = i;
+	}
+	qsort(keys, tail->count, sizeof(struct ybpi_tail_key), ybpi_compare_tail_keys);
+	return keys;
+}
+
+/**
+ * Pair off transactions the two tails have in common (as a multiset, so
+ * a statement run twice on one side and once on the other leaves one
+ * over) and report the rest
+ **/
+static int ybpi_compare_tails(struct ybpi_tail* tails, struct ybp_divergence* restrict out, ybp_divergence_fn extra, void* arg)
+{
+	struct ybpi_tail_key* keys[2] = {NULL, NULL};
+	bool* paired[2] = {NULL, NULL};
+	size_t i = 0, j = 0;
+	int side, ret = -1;
+	for (side = 0; side < 2; ++side) {
+		if ((keys[side] = ybpi_tail_keys(&tails[side])) == NULL)
+			goto done;
+		if ((paired[side] = calloc(tails[side].count + 1, sizeof(bool))) == NULL) {
+			perror("calloc");
+			goto done;
+		}
+	}
+	while (i < tails[0].count && j < tails[1].count) {
+		if (keys[0][i].hash < keys[1][j].hash) {
+			++i;
+		} else if (keys[0][i].hash > keys[1][j].hash) {
+			++j;
+		} else {
+			paired[0][keys[0][i++].index] = true;
+			paired[1][keys[1][j++].index] = true;
+			out->num_shared_after++;
+		}
+	}
+	for (side = 0; side < 2; ++side) {
+		for (i = 0; i < tails[side].count; ++i) {
+			if (paired[side][i])
+				continue;
+			out->num_extra[side]++;
+			if (extra != NULL)
+				extra(side, &tails[side].txns[i], arg);
+		}
+	}
+	ret = 0;
+done:
+	for (side = 0; side < 2; ++side) {
+		free(keys[side]);
+		free(paired[side]);
+	}
+	return ret;
+}
+
+/**
+ * Find where the shared history starts: at the head of b if a has it,
+ * else at the head of a if b has it. Returns 1 with lo set if there is
+ * any, 0 if not, -1 on error.
+ **/
+static int ybpi_anchor(struct ybpi_chain* c, struct ybp_txn_digest* lo, struct ybp_divergence* out)
+{
+	int side, ret;
+	for (side = 1; side >= 0; --side) {
+		struct ybp_txn_digest head;
+		ybpi_chain_seek(&c[side], 0, (c[side].num_parsers > 0) ? c[side].parsers[0]->first_event_offset : 0);
+		if ((ret = ybpi_chain_next(&c[side], &head)) <= 0)
+			return ret;
+		out->probes++;
+		if ((ret = ybpi_locate_transaction(&c[!side], &head, &lo[!side])) != 0) {
+			lo[side] = head;
+			return ret;
+		}
+	}
+	return 0;
+}
+
+int ybp_find_divergence(struct ybp_binlog_parser** a, size_t num_a, struct ybp_binlog_parser** b, size_t num_b,
+		struct ybp_divergence* out, ybp_divergence_fn extra, void* arg)
+{
+	struct ybpi_chain c[2];
+	struct ybpi_tail tails[2];
+	struct ybp_txn_digest lo[2], next[2];
+	int got[2] = {0, 0};
+	int side, ret = -1;
+	memset(out, 0, sizeof(struct ybp_divergence));
+	memset(c, 0, sizeof(c));
+	memset(tails, 0, sizeof(tails));
+	if (ybpi_init_chain(&c[0], a, num_a) < 0 || ybpi_init_chain(&c[1], b, num_b) < 0)
+		goto done;
+	if ((ret = ybpi_anchor(c, lo, out)) < 0)
+		goto done;
+	out->overlap = (ret == 1);
+	if (out->overlap) {
+		off64_t hi = c[0].total;
+		struct ybp_txn_digest probe, match;
+		/* Bisect a, keeping lo on a transaction both sides have */
+		while (hi - ybpi_chain_position(&c[0], lo[0].file, lo[0].end) > DIVERGE_STREAM_BYTES) {
+			off64_t lo_end = ybpi_chain_position(&c[0], lo[0].file, lo[0].end);
+			off64_t mid = lo_end + (hi - lo_end) / 2, pos;
+			if ((ret = ybpi_chain_transaction_at(&c[0], mid, &probe)) < 0)
+				goto done;
+			if (ret == 0) {
+				hi = mid;
+				continue;
+			}
+			pos = ybpi_chain_position(&c[0], probe.file, probe.offset);
+			if (pos < lo_end)
+				break;
+			if (pos >= hi) {
+				hi = mid;
+				continue;
+			}
+			out->probes++;
+			if ((ret = ybpi_locate_transaction(&c[1], &probe, &match)) < 0)
+				goto done;
+			if (ret == 1) {
+				lo[0] = probe;
+				lo[1] = match;
+			} else {
+				hi = pos;
+			}
+		}
+		/* Then walk both from there to the first difference */
+		for (side = 0; side < 2; ++side)
+			ybpi_chain_seek(&c[side], lo[side].file, lo[side].end);
+		for (;;) {
+			for (side = 0; side < 2; ++side) {
+				if ((got[side] = ybpi_chain_next(&c[side], &next[side])) < 0)
+					goto done;
+			}
+			if (got[0] == 0 || got[1] == 0 || next[0].hash != next[1].hash)
+				break;
+			out->num_compared++;
+			lo[0] = next[0];
+			lo[1] = next[1];
+		}
+		out->last_common[0] = lo[0];
+		out->last_common[1] = lo[1];
+	} else {
+		for (side = 0; side < 2; ++side) {
+			ybpi_chain_seek(&c[side], 0, (c[side].num_parsers > 0) ? c[side].parsers[0]->first_event_offset : 0);
+			if ((got[side] = ybpi_chain_next(&c[side], &next[side])) < 0)
+				goto done;
+		}
+	}
+	for (side = 0; side < 2; ++side) {
+		out->has_first[side] = (got[side] == 1);
+		if (!out->has_first[side])
+			continue;
+		out->first[side] = next[side];
+		if (ybpi_read_tail(&c[side], &next[side], &tails[side]) < 0)
+			goto done;
+	}
+	ret = ybpi_compare_tails(tails, out, extra, arg);
+done:
+	for (side = 0; side < 2; ++side) {
+		ybpi_dispose_chain(&c[side]);
+		free(tails[side].txns);
+	}
+	return ret;
+}
+
+/******** row compaction ********/
+
+#define COMPACT_MIN_SLOTS 1024
+#define COMPACT_EVENT_BYTES 65536	/* rows per event written, give or take one */
+#define COMPACT_TXN_EVENTS 64		/* row events per transaction written */
+#define ROWS_POST_HEADER_LEN 8		/* table id and flags */
+
+static inline bool ybpi_bit(const unsigned char* bits, size_t i)
+{
+	return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+static uint64_t ybpi_le(const unsigned char* q, size_t len)
+{
+	uint64_t v = 0;
+	memcpy(&v, q, len);
+	return v;
+}
+
+static uint64_t ybpi_be(const unsigned char* q, size_t len)
+{
+	uint64_t v = 0;
+	size_t i;
+	for (i = 0; i < len; ++i)
+		v = (v << 8) | q[i];
+	return v;
+}
+
+/**
+ * A length-encoded integer, as row events and table maps are full of.
+ * Returns where it ends, or NULL if it runs past end.
+ **/
+static const unsigned char* ybpi_packed_int(const unsigned char* q, const unsigned char* end, uint64_t* v)
+{
+	size_t len;
+	if (q >= end)
+		return NULL;
+	if (*q < 251) {
+		*v = *q;
+		return q + 1;
+	}
+	switch (*q) {
+		case 252: len = 2; break;
+		case 253: len = 3; break;
+		case 254: len = 8; break;
+		default: return NULL;
+	}
+	if (end - q - 1 < (ptrdiff_t)len)
+		return NULL;
+	*v = ybpi_le(q + 1, len);
+	return q + 1 + len;
+}
+
+static size_t ybpi_put_packed_int(unsigned char* out, uint64_t v)
+{
+	if (v < 251) {
+		out[0] = v;
+		return 1;
+	}
+	if (v < 65536) {
+		out[0] = 252;
+		memcpy(out + 1, &v, 2);
+		return 3;
+	}
+	if (v < 16777216) {
+		out[0] = 253;
+		memcpy(out + 1, &v, 3);
+		return 4;
+	}
+	out[0] = 254;
+	memcpy(out + 1, &v, 8);
+	return 9;
+}
+
+static size_t ybpi_decimal_size(unsigned int precision, unsigned int scale)
+{
+	static const int dig2bytes[10] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+	unsigned int intg = precision - scale;
+	if (scale > precision)
+		return 0;
+	return intg / 9 * 4 + dig2bytes[intg % 9] + scale / 9 * 4 + dig2bytes[scale % 9];
+}
+
+/**
+ * Read a column's table map metadata. Most of it is little-endian, but
+ * a few types have two separate bytes that are easiest to take as
+ * big-endian. Returns where it ends, or NULL if it runs past end.
+ **/
+static const unsigned char* ybpi_column_meta(uint8_t type, const unsigned char* q, const unsigned char* end, uint16_t* meta)
+{
+	size_t len = 0;
+	bool big_endian = false;
+	switch (type) {
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+		case MYSQL_TYPE_TINY_BLOB:
+		case MYSQL_TYPE_MEDIUM_BLOB:
+		case MYSQL_TYPE_LONG_BLOB:
+		case MYSQL_TYPE_BLOB:
+		case MYSQL_TYPE_GEOMETRY:
+		case MYSQL_TYPE_JSON:
+		case MYSQL_TYPE_TIMESTAMP2:
+		case MYSQL_TYPE_DATETIME2:
+		case MYSQL_TYPE_TIME2:
+			len = 1;
+			break;
+		case MYSQL_TYPE_VARCHAR:
+		case MYSQL_TYPE_VAR_STRING:
+		case MYSQL_TYPE_BIT:
+			len = 2;
+			break;
+		case MYSQL_TYPE_NEWDECIMAL:
+		case MYSQL_TYPE_STRING:
+		case MYSQL_TYPE_ENUM:
+		case MYSQL_TYPE_SET:
+			len = 2;
+			big_endian = true;
+			break;
+		default:
+			break;
+	}
+	if (end - q < (ptrdiff_t)len)
+		return NULL;
+	*meta = big_endian ? ybpi_be(q, len) : ybpi_le(q, len);
+	return q + len;
+}
+
+/**
+ * How many bytes of length come before a value of this column, or 0 if
+ * its size is fixed
+ **/
+static size_t ybpi_length_prefix(uint8_t type, uint16_t meta)
+{
+	switch (type) {
+		case MYSQL_TYPE_VARCHAR:
+		case MYSQL_TYPE_VAR_STRING:
+			return (meta < 256) ? 1 : 2;
+		case MYSQL_TYPE_STRING: {
+			/* CHARs over 255 bytes hide the top bits of their length in the type */
+			uint8_t real_type = meta >> 8;
+			size_t max_len = meta & 0xff;
+			if (real_type == MYSQL_TYPE_ENUM || real_type == MYSQL_TYPE_SET)
+				return 0;
+			if ((real_type & 0x30) != 0x30)
+				max_len |= (size_t)((real_type & 0x30) ^ 0x30) << 4;
+			return (max_len < 256) ? 1 : 2;
+		}
+		case MYSQL_TYPE_TINY_BLOB:
+		case MYSQL_TYPE_MEDIUM_BLOB:
+		case MYSQL_TYPE_LONG_BLOB:
+		case MYSQL_TYPE_BLOB:
+		case MYSQL_TYPE_GEOMETRY:
+		case MYSQL_TYPE_JSON:
+			return meta;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * How long a non-NULL value of a column is in a row image, or -1 if it
+ * runs past avail or is of a type whose size we don't know
+ **/
+static ssize_t ybpi_value_len(uint8_t type, uint16_t meta, const unsigned char* q, size_t avail)
+{
+	size_t len, prefix = ybpi_length_prefix(type, meta);
+	if (prefix > 0) {
+		if (prefix > 4 || prefix > avail)
+			return -1;
+		len = prefix + ybpi_le(q, prefix);
+		return (len <= avail) ? (ssize_t)len : -1;
+	}
+	switch (type) {
+		case MYSQL_TYPE_NULL:
+			len = 0;
+			break;
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_YEAR:
+			len = 1;
+			break;
+		case MYSQL_TYPE_SHORT:
+			len = 2;
+			break;
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_DATE:
+		case MYSQL_TYPE_NEWDATE:
+		case MYSQL_TYPE_TIME:
+			len = 3;
+			break;
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_TIMESTAMP:
+			len = 4;
+			break;
+		case MYSQL_TYPE_LONGLONG:
+		case MYSQL_TYPE_DOUBLE:
+		case MYSQL_TYPE_DATETIME:
+			len = 8;
+			break;
+		case MYSQL_TYPE_TIMESTAMP2:
+			len = 4 + (meta + 1) / 2;
+			break;
+		case MYSQL_TYPE_DATETIME2:
+			len = 5 + (meta + 1) / 2;
+			break;
+		case MYSQL_TYPE_TIME2:
+			len = 3 + (meta + 1) / 2;
+			break;
+		case MYSQL_TYPE_NEWDECIMAL:
+			if ((len = ybpi_decimal_size(meta >> 8, meta & 0xff)) == 0)
+				return -1;
+			break;
+		case MYSQL_TYPE_BIT:
+			len = (meta >> 8) + ((meta & 0xff) ? 1 : 0);
+			break;
+		case MYSQL_TYPE_ENUM:
+		case MYSQL_TYPE_SET:
+		case MYSQL_TYPE_STRING:
+			len = meta & 0xff;
+			break;
+		default:
+			return -1;
+	}
+	return (len <= avail) ? (ssize_t)len : -1;
+}
+
+static bool ybpi_is_numeric_type(uint8_t type)
+{
+	switch (type) {
+		case MYSQL_TYPE_DECIMAL:
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_LONGLONG:
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+		case MYSQL_TYPE_NEWDECIMAL:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * One bit per numeric column, highest first
+ **/
+static void ybpi_table_signedness(struct ybp_table_version* restrict t, const unsigned char* restrict v, size_t len)
+{
+	size_t i, k = 0;
+	for (i = 0; i < t->num_columns; ++i) {
+		if (!ybpi_is_numeric_type(t->types[i]))
+			continue;
+		if (k / 8 < len && (v[k / 8] & (0x80 >> (k % 8))))
+			t->flags[i] |= YBP_COLUMN_UNSIGNED;
+		k++;
+	}
+}
+
+static int ybpi_table_names(struct ybp_table_version* restrict t, const unsigned char* restrict v, size_t len)
+{
+	const unsigned char* end = v + len;
+	size_t i;
+	if ((t->names = calloc(t->num_columns, sizeof(char*))) == NULL ||
+			(t->name_lens = calloc(t->num_columns, sizeof(size_t))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < t->num_columns; ++i) {
+		uint64_t name_len;
+		if ((v = ybpi_packed_int(v, end, &name_len)) == NULL || name_len > (uint64_t)(end - v)) {
+			free(t->names);
+			free(t->name_lens);
+			t->names = NULL;
+			t->name_lens = NULL;
+			break;
+		}
+		t->names[i] = (const char*)v;
+		t->name_lens[i] = name_len;
+		v += name_len;
+	}
+	return 0;
+}
+
+/**
+ * Column indexes (each with a prefix length, which we don't need, if
+ * with_prefix). Returns whether there were any.
+ **/
+static bool ybpi_table_key(struct ybp_table_version* restrict t, const unsigned char* restrict v, size_t len, bool with_prefix)
+{
+	const unsigned char* end = v + len;
+	uint64_t column, prefix;
+	bool any = false;
+	while ((v = ybpi_packed_int(v, end, &column)) != NULL) {
+		if (with_prefix && (v = ybpi_packed_int(v, end, &prefix)) == NULL)
+			break;
+		if (column < t->num_columns) {
+			t->flags[column] |= YBP_COLUMN_KEY;
+			any = true;
+		}
+	}
+	return any;
+}
+
+/**
+ * Fill in t from the TABLE_MAP event copied into t->map. Returns 0, -2 if
+ * it doesn't parse, or -1 on error.
+ **/
+static int ybpi_parse_table_map(struct ybp_table_version* t)
+{
+	const unsigned char* q = t->map + t->post_header_len;
+	const unsigned char* end = t->map + t->map_len;
+	const unsigned char* meta_end;
+	uint64_t num_columns, meta_len;
+	bool has_key = false;
+	size_t i;
+	if (q >= end || (size_t)(end - q) < 2u + q[0])
+		return -2;
+	t->db_name = (const char*)q + 1;
+	t->db_name_len = q[0];
+	q += 2 + q[0];
+	if (q >= end || (size_t)(end - q) < 2u + q[0])
+		return -2;
+	t->table_name = (const char*)q + 1;
+	t->table_name_len = q[0];
+	q += 2 + q[0];
+	if ((q = ybpi_packed_int(q, end, &num_columns)) == NULL || num_columns == 0 || num_columns > (uint64_t)(end - q))
+		return -2;
+	t->num_columns = num_columns;
+	t->types = q;
+	q += num_columns;
+	if ((q = ybpi_packed_int(q, end, &meta_len)) == NULL || meta_len > (uint64_t)(end - q))
+		return -2;
+	meta_end = q + meta_len;
+	if ((t->meta = calloc(num_columns, sizeof(uint16_t))) == NULL ||
+			(t->flags = calloc(num_columns, sizeof(uint8_t))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < num_columns; ++i)
+		if ((q = ybpi_column_meta(t->types[i], q, meta_end, &t->meta[i])) == NULL)
+			return -2;
+	/* The NULL bitmap, then MySQL 8's optional metadata: type, length, value */
+	q = meta_end + (num_columns + 7) / 8;
+	while (q < end) {
+		uint8_t field = *q;
+		uint64_t len;
+		const unsigned char* v;
+		if ((v = ybpi_packed_int(q + 1, end, &len)) == NULL || len > (uint64_t)(end - v))
+			break;
+		q = v + len;
+		switch (field) {
+			case TM_SIGNEDNESS:
+				ybpi_table_signedness(t, v, len);
+				break;
+			case TM_COLUMN_NAME:
+				if (ybpi_table_names(t, v, len) < 0)
+					return -1;
+				break;
+			case TM_SIMPLE_PRIMARY_KEY:
+			case TM_PRIMARY_KEY_WITH_PREFIX:
+				has_key |= ybpi_table_key(t, v, len, field == TM_PRIMARY_KEY_WITH_PREFIX);
+				break;
+		}
+	}
+	if (!has_key)
+		t->flags[0] |= YBP_COLUMN_KEY;
+	return 0;
+}
+
+static void ybpi_dispose_table_version(struct ybp_table_version* t)
+{
+	free(t->map);
+	free(t->meta);
+	free(t->flags);
+	free(t->names);
+	free(t->name_lens);
+}
+
+static int ybpi_add_table_version(struct ybp_compactor* restrict c, const struct ybp_decoded_event* restrict d, uint64_t map_hash)
+{
+	struct ybp_table_version* t;
+	int ret;
+	if (c->num_tables == c->tables_size) {
+		size_t size = (c->tables_size == 0) ? 64 : c->tables_size * 2;
+		struct ybp_table_version* tables = realloc(c->tables, size * sizeof(struct ybp_table_version));
+		if (tables == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		c->tables = tables;
+		c->tables_size = size;
+	}
+	t = &c->tables[c->num_tables];
+	memset(t, 0, sizeof(*t));
+	t->map_len = d->post_header_len + d->body_len;
+	if ((t->map = malloc(t->map_len)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memcpy(t->map, d->post_header, d->post_header_len);
+	memcpy(t->map + d->post_header_len, d->body, d->body_len);
+	t->post_header_len = d->post_header_len;
+	t->map_hash = map_hash;
+	if ((ret = ybpi_parse_table_map(t)) < 0) {
+		ybpi_dispose_table_version(t);
+		return ret;
+	}
+	t->name_hash = ybpi_hash64(t->table_name, t->table_name_len, ybpi_hash64(t->db_name, t->db_name_len, 0));
+	c->num_tables++;
+	return 0;
+}
+
+static size_t ybpi_table_id_slot(const struct ybp_compactor* c, uint64_t id)
+{
+	size_t mask = c->ids_size - 1;
+	size_t i = (size_t)((id * HASH_PRIME1) >> 32) & mask;
+	while (c->ids[i].table != 0 && c->ids[i].id != id)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static int ybpi_set_table_id(struct ybp_compactor* c, uint64_t id, size_t table)
+{
+	size_t i;
+	if ((c->num_ids + 1) * 2 > c->ids_size) {
+		struct ybp_table_id* old = c->ids;
+		size_t old_size = c->ids_size;
+		if ((c->ids = calloc(old_size * 2, sizeof(struct ybp_table_id))) == NULL) {
+			perror("calloc");
+			c->ids = old;
+			return -1;
+		}
+		c->ids_size = old_size * 2;
+		for (i = 0; i < old_size; ++i)
+			if (old[i].table != 0)
+				c->ids[ybpi_table_id_slot(c, old[i].id)] = old[i];
+		free(old);
+	}
+	i = ybpi_table_id_slot(c, id);
+	if (c->ids[i].table == 0)
+		c->num_ids++;
+	c->ids[i].id = id;
+	c->ids[i].table = table + 1;
+	return 0;
+}
+
+/**
+ * Servers hand out a new table id whenever a table is opened afresh, so
+ * the same layout keeps coming back under new ids; keep one copy of each
+ * layout and point the ids at it
+ **/
+static int ybpi_compactor_table_map(struct ybp_compactor* restrict c, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	uint64_t id = 0, map_hash;
+	size_t i, slot;
+	int ret;
+	if (ybp_decode_event(p, e, &d) < 0 || d.truncated || d.post_header_len < 6)
+		return 0;
+	memcpy(&id, d.post_header, (d.post_header_len >= 8) ? 6 : 4);
+	map_hash = ybpi_hash64(d.body, d.body_len, 0);
+	slot = ybpi_table_id_slot(c, id);
+	if (c->ids[slot].table != 0 && c->tables[c->ids[slot].table - 1].map_hash == map_hash)
+		return 0;
+	for (i = 0; i < c->num_tables; ++i)
+		if (c->tables[i].map_hash == map_hash)
+			break;
+	if (i == c->num_tables && (ret = ybpi_add_table_version(c, &d, map_hash)) < 0)
+		return (ret == -2) ? 0 : -1;
+	return ybpi_set_table_id(c, id, i);
+}
+
+static int ybpi_compare_row_refs(const void* a, const void* b, void* arg)
+{
+	const struct ybp_table_version* tables = arg;
+	const struct ybp_row_ref* x = a;
+	const struct ybp_row_ref* y = b;
+	uint64_t hx = tables[x->table].name_hash, hy = tables[y->table].name_hash;
+	if (hx != hy)
+		return (hx < hy) ? -1 : 1;
+	if (x->key[0] != y->key[0])
+		return (x->key[0] < y->key[0]) ? -1 : 1;
+	if (x->key[1] != y->key[1])
+		return (x->key[1] < y->key[1]) ? -1 : 1;
+	return 0;
+}
+
+static inline bool ybpi_row_slot_free(const struct ybp_row_ref* r)
+{
+	return r->key[0] == 0 && r->key[1] == 0;
+}
+
+/**
+ * Pack the rows in the hash table down to the front, sorted by table and
+ * key, and return how many there are. It's no longer a hash table after.
+ **/
+static size_t ybpi_compactor_sort(struct ybp_compactor* c)
+{
+	size_t i, n = 0;
+	for (i = 0; i < c->num_slots; ++i)
+		if (!ybpi_row_slot_free(&c->slots[i]))
+			c->slots[n++] = c->slots[i];
+	qsort_r(c->slots, n, sizeof(struct ybp_row_ref), ybpi_compare_row_refs, c->tables);
+	return n;
+}
+
+static int ybpi_compactor_spill(struct ybp_compactor* c)
+{
+	char path[FILENAME_MAX];
+	FILE** runs;
+	FILE* run;
+	size_t n;
+	int fd;
+	if ((runs = realloc(c->runs, (c->num_runs + 1) * sizeof(FILE*))) == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	c->runs = runs;
+	snprintf(path, sizeof(path), "%s/ybinlogp-compact.XXXXXX", c->spill_dir);
+	if ((fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	if ((run = fdopen(fd, "w+")) == NULL) {
+		perror("fdopen");
+		close(fd);
+		return -1;
+	}
+	n = ybpi_compactor_sort(c);
+	Dprintf("compactor: spilling %zd rows\n", n);
+	if (fwrite(c->slots, sizeof(struct ybp_row_ref), n, run) != n || fflush(run) != 0) {
+		perror("Error spilling rows");
+		fclose(run);
+		return -1;
+	}
+	c->runs[c->num_runs++] = run;
+	memset(c->slots, 0, c->num_slots * sizeof(struct ybp_row_ref));
+	c->num_rows = 0;
+	return 0;
+}
+
+/**
+ * Double the hash table, or spill it if it's as big as it's allowed to get
+ * (or as big as it can get)
+ **/
+static int ybpi_compactor_make_room(struct ybp_compactor* c)
+{
+	struct ybp_row_ref* slots;
+	size_t i, j, mask;
+	if (c->num_slots * 2 > c->max_slots ||
+			(slots = calloc(c->num_slots * 2, sizeof(struct ybp_row_ref))) == NULL)
+		return ybpi_compactor_spill(c);
+	mask = c->num_slots * 2 - 1;
+	for (i = 0; i < c->num_slots; ++i) {
+		if (ybpi_row_slot_free(&c->slots[i]))
+			continue;
+		for (j = c->slots[i].key[0] & mask; !ybpi_row_slot_free(&slots[j]); j = (j + 1) & mask)
+			;
+		slots[j] = c->slots[i];
+	}
+	free(c->slots);
+	c->slots = slots;
+	c->num_slots *= 2;
+	return 0;
+}
+
+static int ybpi_compactor_put(struct ybp_compactor* restrict c, struct ybp_row_ref* restrict ref)
+{
+	size_t i, mask;
+	if ((c->num_rows + 1) * 4 > c->num_slots * 3 && ybpi_compactor_make_room(c) < 0)
+		return -1;
+	mask = c->num_slots - 1;
+	for (i = ref->key[0] & mask; !ybpi_row_slot_free(&c->slots[i]); i = (i + 1) & mask)
+		if (c->slots[i].key[0] == ref->key[0] && c->slots[i].key[1] == ref->key[1])
+			break;
+	if (ybpi_row_slot_free(&c->slots[i]))
+		c->num_rows++;
+	c->slots[i] = *ref;
+	return 0;
+}
+
+/**
+ * Walk one row image, whose columns are the ones set in the columns
+ * bitmap. Returns its length, -2 if it doesn't parse or -1 on error. If
+ * every key column is in it, *has_key is set and their values are
+ * gathered into c->key, *key_len bytes of them.
+ **/
+static ssize_t ybpi_row_image(struct ybp_compactor* restrict c, const struct ybp_table_version* restrict t, const unsigned char* restrict columns,
+		const unsigned char* restrict q, size_t avail, size_t* key_len, bool* has_key)
+{
+	size_t i, k = 0, num_present = 0, pos;
+	*key_len = 0;
+	*has_key = true;
+	for (i = 0; i < t->num_columns; ++i)
+		num_present += ybpi_bit(columns, i);
+	if ((pos = (num_present + 7) / 8) > avail)
+		return -2;
+	for (i = 0; i < t->num_columns; ++i) {
+		bool is_key = t->flags[i] & YBP_COLUMN_KEY;
+		bool is_null;
+		ssize_t len = 0;
+		if (!ybpi_bit(columns, i)) {
+			*has_key &= !is_key;
+			continue;
+		}
+		is_null = ybpi_bit(q, k++);
+		if (!is_null && (len = ybpi_value_len(t->types[i], t->meta[i], q + pos, avail - pos)) < 0)
+			return -2;
+		if (is_key) {
+			if (*key_len + 1 + len > c->key_size) {
+				size_t size = (*key_len + 1 + len) * 2;
+				unsigned char* key = realloc(c->key, size);
+				if (key == NULL) {
+					perror("realloc");
+					return -1;
+				}
+				c->key = key;
+				c->key_size = size;
+			}
+			c->key[(*key_len)++] = is_null;
+			memcpy(c->key + *key_len, q + pos, len);
+			*key_len += len;
+		}
+		pos += len;
+	}
+	return pos;
+}
+
+static void ybpi_row_key(const struct ybp_compactor* restrict c, const struct ybp_table_version* restrict t, size_t key_len, uint64_t* restrict key)
+{
+	key[0] = ybpi_hash64(c->key, key_len, t->name_hash);
+	key[1] = ybpi_hash64(c->key, key_len, t->name_hash ^ HASH_PRIME5);
+	if (key[0] == 0 && key[1] == 0)
+		key[1] = 1;
+}
+
+static int ybpi_compactor_rows(struct ybp_compactor* restrict c, struct ybp_binlog_parser* restrict p, size_t file, struct ybp_event* restrict e, enum ybp_row_op op)
+{
+	struct ybp_decoded_event d;
+	const struct ybp_table_version* t;
+	const unsigned char *q, *end, *before, *after = NULL;
+	const unsigned char* data = (const unsigned char*)e->data;
+	struct ybp_row_ref ref;
+	uint64_t id = 0, num_columns;
+	size_t slot, bitmap_len;
+	ssize_t len = 0, after_len = 0;
+	if (ybp_decode_event(p, e, &d) < 0 || d.truncated || d.post_header_len < 6)
+		goto skip;
+	memcpy(&id, d.post_header, (d.post_header_len >= 8) ? 6 : 4);
+	slot = ybpi_table_id_slot(c, id);
+	if (c->ids[slot].table == 0)
+		goto skip;
+	t = &c->tables[c->ids[slot].table - 1];
+	q = (const unsigned char*)d.body;
+	end = q + d.body_len;
+	if (d.post_header_len >= 10) {
+		/* v2 row events have extra data, whose length counts itself */
+		uint16_t extra_len;
+		memcpy(&extra_len, d.post_header + 8, sizeof(extra_len));
+		if (extra_len < 2 || extra_len - 2 > end - q)
+			goto skip;
+		q += extra_len - 2;
+	}
+	if ((q = ybpi_packed_int(q, end, &num_columns)) == NULL || num_columns != t->num_columns)
+		goto skip;
+	bitmap_len = (num_columns + 7) / 8;
+	before = q;
+	q += bitmap_len;
+	if (op == YBP_ROW_UPDATE) {
+		after = q;
+		q += bitmap_len;
+	}
+	if (q > end)
+		goto skip;
+	memset(&ref, 0, sizeof(ref));
+	ref.offset = e->offset;
+	ref.file = file;
+	ref.table = t - c->tables;
+	while (q < end) {
+		uint64_t key[2];
+		size_t key_len;
+		bool has_key;
+		after_len = 0;
+		if ((len = ybpi_row_image(c, t, before, q, end - q, &key_len, &has_key)) < 0)
+			goto bad;
+		if (has_key)
+			ybpi_row_key(c, t, key_len, key);
+		ref.row = EVENT_HEADER_SIZE + (q - data);
+		ref.row_len = len;
+		ref.columns = EVENT_HEADER_SIZE + (before - data);
+		if (op == YBP_ROW_UPDATE) {
+			uint64_t after_key[2];
+			bool after_has_key;
+			if ((after_len = ybpi_row_image(c, t, after, q + len, end - q - len, &key_len, &after_has_key)) < 0)
+				goto bad;
+			if (after_has_key) {
+				ybpi_row_key(c, t, key_len, after_key);
+				/* The key changed: the old row is gone */
+				if (has_key && (key[0] != after_key[0] || key[1] != after_key[1])) {
+					ref.op = YBP_ROW_DELETE;
+					memcpy(ref.key, key, sizeof(ref.key));
+					if (ybpi_compactor_put(c, &ref) < 0)
+						return -1;
+				}
+				memcpy(key, after_key, sizeof(key));
+				has_key = true;
+			}
+			ref.row += len;
+			ref.row_len = after_len;
+			ref.columns = EVENT_HEADER_SIZE + (after - data);
+		}
+		q += len + after_len;
+		c->rows_seen++;
+		if (!has_key) {
+			c->rows_skipped++;
+			continue;
+		}
+		ref.op = op;
+		memcpy(ref.key, key, sizeof(ref.key));
+		if (ybpi_compactor_put(c, &ref) < 0)
+			return -1;
+	}
+	return 0;
+bad:
+	if (len == -1 || after_len == -1)
+		return -1;
+skip:
+	c->events_skipped++;
+	return 0;
+}
+
+struct ybp_compactor* ybp_get_compactor(size_t max_memory, const char* spill_dir)
+{
+	struct ybp_compactor* c;
+	if ((c = calloc(1, sizeof(struct ybp_compactor))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	if (spill_dir == NULL && (spill_dir = getenv("TMPDIR")) == NULL)
+		spill_dir = "/tmp";
+	c->max_slots = COMPACT_MIN_SLOTS;
+	while (c->max_slots * 2 * sizeof(struct ybp_row_ref) <= max_memory)
+		c->max_slots *= 2;
+	c->num_slots = COMPACT_MIN_SLOTS;
+	c->ids_size = 256;
+	if ((c->spill_dir = strdup(spill_dir)) == NULL ||
+			(c->slots = calloc(c->num_slots, sizeof(struct ybp_row_ref))) == NULL ||
+			(c->ids = calloc(c->ids_size, sizeof(struct ybp_table_id))) == NULL) {
+		perror("calloc");
+		ybp_dispose_compactor(c);
+		return NULL;
+	}
+	return c;
+}
+
+void ybp_dispose_compactor(struct ybp_compactor* c)
+{
+	size_t i;
+	if (c == NULL)
+		return;
+	for (i = 0; i < c->num_tables; ++i)
+		ybpi_dispose_table_version(&c->tables[i]);
+	for (i = 0; i < c->num_runs; ++i)
+		fclose(c->runs[i]);
+	free(c->slots);
+	free(c->tables);
+	free(c->ids);
+	free(c->key);
+	free(c->spill_dir);
+	free(c->runs);
+	free(c);
+}
+
+int ybp_compactor_observe(struct ybp_compactor* restrict c, struct ybp_binlog_parser* restrict p, size_t file, struct ybp_event* restrict e)
+{
+	if (c->sorted)
+		return -1;
+	switch (e->type_code) {
+		case TABLE_MAP_EVENT:
+			return ybpi_compactor_table_map(c, p, e);
+		case WRITE_ROWS_EVENT:
+		case WRITE_ROWS_EVENT_V2:
+			return ybpi_compactor_rows(c, p, file, e, YBP_ROW_INSERT);
+		case UPDATE_ROWS_EVENT:
+		case UPDATE_ROWS_EVENT_V2:
+			return ybpi_compactor_rows(c, p, file, e, YBP_ROW_UPDATE);
+		case DELETE_ROWS_EVENT:
+		case DELETE_ROWS_EVENT_V2:
+			return ybpi_compactor_rows(c, p, file, e, YBP_ROW_DELETE);
+		case PARTIAL_UPDATE_ROWS_EVENT:
+		case WRITE_ROWS_COMPRESSED_EVENT_V1:
+		case UPDATE_ROWS_COMPRESSED_EVENT_V1:
+		case DELETE_ROWS_COMPRESSED_EVENT_V1:
+		case WRITE_ROWS_COMPRESSED_EVENT:
+		case UPDATE_ROWS_COMPRESSED_EVENT:
+		case DELETE_ROWS_COMPRESSED_EVENT:
+			c->events_skipped++;
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+typedef int (*ybpi_row_fn)(struct ybp_compactor* restrict, const struct ybp_row_ref* restrict, void*);
+
+static bool ybpi_compactor_advance(struct ybp_compactor* restrict c, size_t source, size_t* restrict in_memory, struct ybp_row_ref* restrict head)
+{
+	if (source < c->num_runs)
+		return fread(head, sizeof(struct ybp_row_ref), 1, c->runs[source]) == 1;
+	if (*in_memory == c->num_rows)
+		return false;
+	*head = c->slots[(*in_memory)++];
+	return true;
+}
+
+/**
+ * Call fn on the latest image of every row, in order: a k-way merge of
+ * the spills and what's left in memory, with later ones winning ties
+ **/
+static int ybpi_compactor_each(struct ybp_compactor* restrict c, ybpi_row_fn fn, void* arg)
+{
+	struct ybp_row_ref* heads;
+	bool* live;
+	size_t i, in_memory = 0, num_sources = c->num_runs + 1;
+	int ret = -1;
+	if (!c->sorted) {
+		c->num_rows = ybpi_compactor_sort(c);
+		c->sorted = true;
+	}
+	if ((heads = malloc(num_sources * sizeof(struct ybp_row_ref))) == NULL ||
+			(live = malloc(num_sources * sizeof(bool))) == NULL) {
+		perror("malloc");
+		free(heads);
+		return -1;
+	}
+	for (i = 0; i < num_sources; ++i) {
+		if (i < c->num_runs)
+			rewind(c->runs[i]);
+		live[i] = ybpi_compactor_advance(c, i, &in_memory, &heads[i]);
+	}
+	for (;;) {
+		struct ybp_row_ref winner;
+		size_t best = num_sources;
+		for (i = 0; i < num_sources; ++i)
+			if (live[i] && (best == num_sources || ybpi_compare_row_refs(&heads[i], &heads[best], c->tables) <= 0))
+				best = i;
+		if (best == num_sources)
+			break;
+		winner = heads[best];
+		for (i = 0; i < num_sources; ++i)
+			while (live[i] && ybpi_compare_row_refs(&heads[i], &winner, c->tables) == 0)
+				live[i] = ybpi_compactor_advance(c, i, &in_memory, &heads[i]);
+		if (fn(c, &winner, arg) < 0)
+			goto done;
+	}
+	ret = 0;
+	for (i = 0; i < c->num_runs; ++i) {
+		if (ferror(c->runs[i])) {
+			perror("Error reading spilled rows");
+			ret = -1;
+		}
+	}
+done:
+	free(heads);
+	free(live);
+	return ret;
+}
+
+/**
+ * Reads row images back from the binlogs they're in
+ **/
+struct ybpi_row_reader {
+	struct ybp_binlog_parser**	parsers;
+	size_t		num_parsers;
+	unsigned char*	buf;
+	size_t		size;
+	uint32_t	timestamp;		/* of the event the row is in */
+	const unsigned char*	columns;	/* these point into buf */
+	const unsigned char*	row;
+};
+
+static int ybpi_read_row(struct ybpi_row_reader* restrict r, const struct ybp_table_version* restrict t, const struct ybp_row_ref* restrict ref)
+{
+	size_t head_len = ref->columns + (t->num_columns + 7) / 8;
+	int fd;
+	if (ref->file >= r->num_parsers)
+		return -2;
+	if (head_len + ref->row_len > r->size) {
+		size_t size = (head_len + ref->row_len) * 2;
+		unsigned char* buf = realloc(r->buf, size);
+		if (buf == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		r->buf = buf;
+		r->size = size;
+	}
+	fd = r->parsers[ref->file]->fd;
+	if (pread(fd, r->buf, head_len, ref->offset) != (ssize_t)head_len ||
+			pread(fd, r->buf + head_len, ref->row_len, ref->offset + ref->row) != (ssize_t)ref->row_len) {
+		fprintf(stderr, "Error reading row image at %llu: %s\n", (unsigned long long)ref->offset, strerror(errno));
+		return -1;
+	}
+	memcpy(&r->timestamp, r->buf, sizeof(uint32_t));
+	r->columns = r->buf + ref->columns;
+	r->row = r->buf + head_len;
+	return 0;
+}
+
+/**
+ * The length of the UTF-8 sequence at s, or 1 if there isn't a valid one
+ **/
+static size_t ybpi_utf8_len(const unsigned char* s, size_t avail)
+{
+	size_t i, len;
+	uint32_t cp;
+	if (s[0] < 0xc2 || s[0] > 0xf4)
+		return 1;
+	len = (s[0] < 0xe0) ? 2 : (s[0] < 0xf0) ? 3 : 4;
+	if (len > avail)
+		return 1;
+	cp = s[0] & (0x7f >> len);
+	for (i = 1; i < len; ++i) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 1;
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+	if ((len == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) ||
+			(len == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+		return 1;
+	return len;
+}
+
+/**
+ * Write bytes as a JSON string. Nothing says what charset column data is
+ * in, so whatever isn't valid UTF-8 goes out a byte at a time as \u00XX.
+ **/
+static void ybpi_json_string(FILE* out, const char* s, size_t len)
+{
+	const unsigned char* u = (const unsigned char*)s;
+	size_t i = 0;
+	fputc('"', out);
+	while (i < len) {
+		size_t n = ybpi_utf8_len(u + i, len - i);
+		if (n > 1)
+			fwrite(u + i, 1, n, out);
+		else if (u[i] == '"' || u[i] == '\\')
+			fprintf(out, "\\%c", u[i]);
+		else if (u[i] < 0x20 || u[i] >= 0x7f)
+			fprintf(out, "\\u%04x", u[i]);
+		else
+			fputc(u[i], out);
+		i += n;
+	}
+	fputc('"', out);
+}
+
+/**
+ * The fractional seconds of a TIMESTAMP2, DATETIME2 or TIME2: (fsp + 1) / 2
+ * big-endian bytes, in units of two digits
+ **/
+static void ybpi_json_fraction(FILE* out, const unsigned char* v, uint16_t fsp)
+{
+	size_t len = (fsp + 1) / 2;
+	uint64_t usec;
+	int i;
+	if (fsp == 0 || fsp > 6)
+		return;
+	usec = ybpi_be(v, len) * ((len == 1) ? 10000 : (len == 2) ? 100 : 1);
+	for (i = fsp; i < 6; ++i)
+		usec /= 10;
+	fprintf(out, ".%0*u", (int)fsp, (unsigned int)usec);
+}
+
+static void ybpi_json_value(FILE* out, uint8_t type, uint16_t meta, bool is_unsigned, const unsigned char* v, size_t len)
+{
+	size_t prefix = ybpi_length_prefix(type, meta);
+	uint64_t u;
+	int64_t s;
+	if (prefix > 0) {
+		if (type == MYSQL_TYPE_JSON || type == MYSQL_TYPE_GEOMETRY) {
+			/* Binary formats of MySQL's own */
+			fputc('"', out);
+			ybpi_sql_base64(out, v + prefix, len - prefix);
+			fputc('"', out);
+		} else
+			ybpi_json_string(out, (const char*)v + prefix, len - prefix);
+		return;
+	}
+	switch (type) {
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_LONGLONG:
+			u = ybpi_le(v, len);
+			if (is_unsigned) {
+				fprintf(out, "%llu", (unsigned long long)u);
+				break;
+			}
+			if (len < 8 && ((u >> (len * 8 - 1)) & 1))
+				u |= ~0ULL << (len * 8);
+			fprintf(out, "%lld", (long long)u);
+			break;
+		case MYSQL_TYPE_FLOAT: {
+			float f;
+			memcpy(&f, v, sizeof(f));
+			if (isfinite(f))
+				fprintf(out, "%.9g", f);
+			else
+				fputs("null", out);
+			break;
+		}
+		case MYSQL_TYPE_DOUBLE: {
+			double f;
+			memcpy(&f, v, sizeof(f));
+			if (isfinite(f))
+				fprintf(out, "%.17g", f);
+			else
+				fputs("null", out);
+			break;
+		}
+		case MYSQL_TYPE_NEWDECIMAL: {
+			/* As a string, so nothing rounds it on the way in */
+			unsigned char buf[2 + 64];
+			if (len > sizeof(buf) - 2) {
+				fputs("null", out);
+				break;
+			}
+			buf[0] = meta >> 8;
+			buf[1] = meta & 0xff;
+			memcpy(buf + 2, v, len);
+			fputc('"', out);
+			ybpi_sql_decimal(out, buf, len + 2);
+			fputc('"', out);
+			break;
+		}
+		case MYSQL_TYPE_YEAR:
+			fprintf(out, "%u", v[0] ? 1900u + v[0] : 0u);
+			break;
+		case MYSQL_TYPE_DATE:
+		case MYSQL_TYPE_NEWDATE:
+			u = ybpi_le(v, 3);
+			fprintf(out, "\"%04u-%02u-%02u\"", (unsigned int)(u >> 9), (unsigned int)(u >> 5) & 15, (unsigned int)u & 31);
+			break;
+		case MYSQL_TYPE_TIME:
+			/* HHMMSS as a number */
+			s = ybpi_le(v, 3);
+			if (s & 0x800000)
+				s -= 0x1000000;
+			u = (s < 0) ? -s : s;
+			fprintf(out, "\"%s%02u:%02u:%02u\"", (s < 0) ? "-" : "", (unsigned int)(u / 10000), (unsigned int)(u / 100 % 100), (unsigned int)(u % 100));
+			break;
+		case MYSQL_TYPE_DATETIME:
+			/* YYYYMMDDHHMMSS as a number */
+			u = ybpi_le(v, 8);
+			fprintf(out, "\"%04u-%02u-%02u %02u:%02u:%02u\"", (unsigned int)(u / 10000000000ULL), (unsigned int)(u / 100000000 % 100),
+					(unsigned int)(u / 1000000 % 100), (unsigned int)(u / 10000 % 100), (unsigned int)(u / 100 % 100), (unsigned int)(u % 100));
+			break;
+		case MYSQL_TYPE_TIMESTAMP:
+			fprintf(out, "%u", (unsigned int)ybpi_le(v, 4));
+			break;
+		case MYSQL_TYPE_TIMESTAMP2:
+			fprintf(out, "%u", (unsigned int)ybpi_be(v, 4));
+			ybpi_json_fraction(out, v + 4, meta);
+			break;
+		case MYSQL_TYPE_DATETIME2: {
+			/* Sign bit, 17 bits of year * 13 + month, 5 of day, then 5, 6 and 6 of time */
+			uint64_t ymd, ym;
+			u = ybpi_be(v, 5) - 0x8000000000ULL;
+			ymd = u >> 17;
+			ym = ymd >> 5;
+			fprintf(out, "\"%04u-%02u-%02u %02u:%02u:%02u", (unsigned int)(ym / 13), (unsigned int)(ym % 13), (unsigned int)(ymd & 31),
+					(unsigned int)(u >> 12) & 31, (unsigned int)(u >> 6) & 63, (unsigned int)u & 63);
+			ybpi_json_fraction(out, v + 5, meta);
+			fputc('"', out);
+			break;
+		}
+		case MYSQL_TYPE_TIME2:
+			/* Sign bit, then 10 bits of hours, 6 of minutes and 6 of seconds */
+			s = (int64_t)ybpi_be(v, 3) - 0x800000;
+			u = (s < 0) ? -s : s;
+			fprintf(out, "\"%s%02u:%02u:%02u", (s < 0) ? "-" : "", (unsigned int)(u >> 12) & 1023, (unsigned int)(u >> 6) & 63, (unsigned int)u & 63);
+			ybpi_json_fraction(out, v + 3, meta);
+			fputc('"', out);
+			break;
+		case MYSQL_TYPE_BIT:
+			fprintf(out, "%llu", (unsigned long long)ybpi_be(v, len));
+			break;
+		case MYSQL_TYPE_ENUM:
+		case MYSQL_TYPE_SET:
+		case MYSQL_TYPE_STRING:
+			/* The index of the value, or a bitmap of them */
+			fprintf(out, "%llu", (unsigned long long)ybpi_le(v, len));
+			break;
+		default:
+			fputs("null", out);
+			break;
+	}
+}
+
+static void ybpi_json_row(FILE* out, const struct ybp_table_version* restrict t, const unsigned char* restrict columns, const unsigned char* restrict row, size_t len)
+{
+	size_t i, k = 0, num_present = 0, pos;
+	bool first = true;
+	for (i = 0; i < t->num_columns; ++i)
+		num_present += ybpi_bit(columns, i);
+	pos = (num_present + 7) / 8;
+	for (i = 0; i < t->num_columns && pos <= len; ++i) {
+		ssize_t value_len;
+		bool is_null;
+		if (!ybpi_bit(columns, i))
+			continue;
+		is_null = ybpi_bit(row, k++);
+		if (!first)
+			fputc(',', out);
+		first = false;
+		if (t->names != NULL)
+			ybpi_json_string(out, t->names[i], t->name_lens[i]);
+		else
+			fprintf(out, "\"@%zu\"", i + 1);
+		fputc(':', out);
+		if (is_null)
+			fputs("null", out);
+		else if ((value_len = ybpi_value_len(t->types[i], t->meta[i], row + pos, len - pos)) >= 0) {
+			ybpi_json_value(out, t->types[i], t->meta[i], t->flags[i] & YBP_COLUMN_UNSIGNED, row + pos, value_len);
+			pos += value_len;
+		} else {
+			fputs("null", out);
+			break;
+		}
+	}
+}
+
+struct ybpi_json_rows {
+	struct ybpi_row_reader	reader;
+	FILE*		out;
+	off64_t		num_rows;
+};
+
+static int ybpi_compactor_json_row(struct ybp_compactor* restrict c, const struct ybp_row_ref* restrict ref, void* arg)
+{
+	static const char* const ops[] = {"?", "insert", "update", "delete"};
+	struct ybpi_json_rows* j = arg;
+	const struct ybp_table_version* t = &c->tables[ref->table];
+	if (ybpi_read_row(&j->reader, t, ref) < 0)
+		return -1;
+	fputs("{\"db\":", j->out);
+	ybpi_json_string(j->out, t->db_name, t->db_name_len);
+	fputs(",\"table\":", j->out);
+	ybpi_json_string(j->out, t->table_name, t->table_name_len);
+	fprintf(j->out, ",\"op\":\"%s\",\"file\":%u,\"offset\":%llu,\"timestamp\":%u,\"row\":{",
+			ops[(ref->op <= YBP_ROW_DELETE) ? ref->op : 0], ref->file, (unsigned long long)ref->offset, j->reader.timestamp);
+	ybpi_json_row(j->out, t, j->reader.columns, j->reader.row, ref->row_len);
+	fputs("}}\n", j->out);
+	j->num_rows++;
+	return ferror(j->out) ? -1 : 0;
+}
+
+off64_t ybp_compactor_write_json(struct ybp_compactor* restrict c, struct ybp_binlog_parser** parsers, size_t num_parsers, FILE* restrict out)
+{
+	struct ybpi_json_rows j;
+	int ret;
+	memset(&j, 0, sizeof(j));
+	j.reader.parsers = parsers;
+	j.reader.num_parsers = num_parsers;
+	j.out = out;
+	ret = ybpi_compactor_each(c, ybpi_compactor_json_row, &j);
+	free(j.reader.buf);
+	return (ret < 0) ? -1 : j.num_rows;
+}
+
+/**
+ * Puts the compacted binlog together. Each table's rows go in batches of
+ * row events after a BEGIN and its TABLE_MAP (renumbered, so that table
+ * ids the server reused can't collide), and an XID ends each batch.
+ **/
+struct ybpi_binlog_rows {
+	struct ybpi_row_reader	reader;
+	struct ybp_binlog_parser*	p;	/* whose FDE and checksums we go by */
+	int			fd;
+	off64_t		offset;
+	off64_t		num_events;
+	unsigned char*	event;		/* scratch for whole events */
+	size_t		event_size;
+	unsigned char*	payload;	/* ...and for table maps */
+	size_t		payload_size;
+	unsigned char*	rows;		/* the row event being put together, less its header */
+	size_t		rows_len;
+	size_t		rows_size;
+	size_t		columns;	/* where its column bitmap is in rows */
+	size_t		table;
+	uint8_t		type_code;
+	uint32_t	timestamp;
+	size_t		events_in_txn;
+	bool		in_txn;
+	uint64_t	xid;
+};
+
+static int ybpi_grow_buffer(unsigned char** buf, size_t* size, size_t need)
+{
+	unsigned char* grown;
+	if (need <= *size)
+		return 0;
+	if ((grown = realloc(*buf, need * 2)) == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	*buf = grown;
+	*size = need * 2;
+	return 0;
+}
+
+static int ybpi_write_compacted_event(struct ybpi_binlog_rows* restrict w, uint8_t type_code, const void* payload, size_t payload_len)
+{
+	size_t length;
+	if (ybpi_grow_buffer(&w->event, &w->event_size, EVENT_HEADER_SIZE + payload_len + YBP_CHECKSUM_LEN) < 0)
+		return -1;
+	length = ybpi_make_event(w->p, w->event, type_code, w->timestamp, w->offset, payload, payload_len);
+	if (pwrite(w->fd, w->event, length, w->offset) != (ssize_t)length) {
+		perror("Error writing compacted binlog");
+		return -1;
+	}
+	w->offset += length;
+	w->num_events++;
+	return 0;
+}
+
+/**
+ * Write out the row event being put together, starting a transaction for
+ * it if there isn't one, and ending the transaction after it if that's
+ * the end of the table or the transaction is big enough
+ **/
+static int ybpi_flush_rows(struct ybp_compactor* restrict c, struct ybpi_binlog_rows* restrict w, bool end_of_table)
+{
+	uint16_t flags = 0;
+	if (w->rows_len == 0)
+		return 0;
+	if (!w->in_txn) {
+		const struct ybp_table_version* t = &c->tables[w->table];
+		unsigned char query[UINT8_MAX + 1 + sizeof("BEGIN")];
+		size_t post_header_len = w->p->post_header_len[QUERY_EVENT];
+		memset(query, 0, post_header_len + 1);
+		memcpy(query + post_header_len + 1, "BEGIN", 5);
+		if (ybpi_write_compacted_event(w, QUERY_EVENT, query, post_header_len + 1 + 5) < 0 ||
+				ybpi_grow_buffer(&w->payload, &w->payload_size, t->map_len) < 0)
+			return -1;
+		memcpy(w->payload, w->rows, 6);
+		memcpy(w->payload + 6, t->map + 6, t->map_len - 6);
+		if (ybpi_write_compacted_event(w, TABLE_MAP_EVENT, w->payload, t->map_len) < 0)
+			return -1;
+		w->in_txn = true;
+	}
+	if (++w->events_in_txn == COMPACT_TXN_EVENTS)
+		end_of_table = true;
+	if (end_of_table)
+		flags |= ROWS_STMT_END_F;
+	memcpy(w->rows + 6, &flags, sizeof(flags));
+	if (ybpi_write_compacted_event(w, w->type_code, w->rows, w->rows_len) < 0)
+		return -1;
+	w->rows_len = 0;
+	if (end_of_table) {
+		w->xid++;
+		if (ybpi_write_compacted_event(w, XID_EVENT, &w->xid, sizeof(w->xid)) < 0)
+			return -1;
+		w->in_txn = false;
+		w->events_in_txn = 0;
+	}
+	return 0;
+}
+
+static int ybpi_compactor_binlog_row(struct ybp_compactor* restrict c, const struct ybp_row_ref* restrict ref, void* arg)
+{
+	struct ybpi_binlog_rows* w = arg;
+	const struct ybp_table_version* t = &c->tables[ref->table];
+	size_t bitmap_len = (t->num_columns + 7) / 8;
+	uint8_t type_code = (ref->op == YBP_ROW_DELETE) ? DELETE_ROWS_EVENT : WRITE_ROWS_EVENT;
+	if (ybpi_read_row(&w->reader, t, ref) < 0)
+		return -1;
+	if (w->rows_len > 0 && (w->table != ref->table || w->type_code != type_code ||
+				memcmp(w->rows + w->columns, w->reader.columns, bitmap_len) != 0 ||
+				w->rows_len + ref->row_len > COMPACT_EVENT_BYTES)) {
+		if (ybpi_flush_rows(c, w, w->table != ref->table) < 0)
+			return -1;
+	}
+	if (w->rows_len == 0) {
+		uint64_t table_id = ref->table + 1;
+		if (ybpi_grow_buffer(&w->rows, &w->rows_size, ROWS_POST_HEADER_LEN + 9 + bitmap_len) < 0)
+			return -1;
+		memcpy(w->rows, &table_id, 6);
+		memset(w->rows + 6, 0, 2);
+		w->columns = ROWS_POST_HEADER_LEN + ybpi_put_packed_int(w->rows + ROWS_POST_HEADER_LEN, t->num_columns);
+		memcpy(w->rows + w->columns, w->reader.columns, bitmap_len);
+		w->rows_len = w->columns + bitmap_len;
+		w->table = ref->table;
+		w->type_code = type_code;
+		w->timestamp = w->reader.timestamp;
+	}
+	if (ybpi_grow_buffer(&w->rows, &w->rows_size, w->rows_len + ref->row_len) < 0)
+		return -1;
+	memcpy(w->rows + w->rows_len, w->reader.row, ref->row_len);
+	w->rows_len += ref->row_len;
+	return 0;
+}
+
+off64_t ybp_compactor_write_binlog(struct ybp_compactor* restrict c, struct ybp_binlog_parser** parsers, size_t num_parsers, int out_fd)
+{
+	struct ybpi_binlog_rows w;
+	struct ybp_event* evbuf;
+	unsigned char* fde = NULL;
+	size_t i, fde_len;
+	off64_t ret = -1;
+	if (num_parsers == 0)
+		return -2;
+	memset(&w, 0, sizeof(w));
+	w.p = parsers[0];
+	if (!w.p->has_read_fde && ybpi_read_fde(w.p) < 0)
+		return -1;
+	/* We write events with plain headers and the usual post-headers */
+	if (w.p->common_header_len != EVENT_HEADER_SIZE || w.p->post_header_len[QUERY_EVENT] < sizeof(struct ybp_query_event) ||
+			w.p->post_header_len[TABLE_MAP_EVENT] != ROWS_POST_HEADER_LEN ||
+			w.p->post_header_len[WRITE_ROWS_EVENT] != ROWS_POST_HEADER_LEN ||
+			w.p->post_header_len[DELETE_ROWS_EVENT] != ROWS_POST_HEADER_LEN)
+		return -2;
+	for (i = 0; i < c->num_tables; ++i)
+		if (c->tables[i].post_header_len != ROWS_POST_HEADER_LEN)
+			return -2;
+	if ((evbuf = ybp_get_event()) == NULL)
+		return -1;
+	if ((fde = ybpi_copy_fde(w.p, evbuf, &fde_len)) == NULL)
+		goto out;
+	if (pwrite(out_fd, ybpi_binlog_magic, sizeof(ybpi_binlog_magic), 0) != sizeof(ybpi_binlog_magic) ||
+			pwrite(out_fd, fde, fde_len, 4) != (ssize_t)fde_len) {
+		perror("Error writing compacted binlog");
+		goto out;
+	}
+	w.reader.parsers = parsers;
+	w.reader.num_parsers = num_parsers;
+	w.fd = out_fd;
+	w.offset = 4 + fde_len;
+	w.num_events = 1;
+	if (ybpi_compactor_each(c, ybpi_compactor_binlog_row, &w) < 0 ||
+			ybpi_flush_rows(c, &w, true) < 0 ||
+			ybpi_write_compacted_event(&w, STOP_EVENT, "", 0) < 0)
+		goto out;
+	if (ftruncate(out_fd, w.offset) < 0) {
+		perror("Error writing compacted binlog");
+		goto out;
+	}
+	ret = w.num_events;
+out:
+	free(fde);
+	free(w.reader.buf);
+	free(w.event);
+	free(w.payload);
+	free(w.rows);
+	ybp_dispose_event(evbuf);
+	return ret;
+}
+
+/******** sessions ********/
+
+#define SESSION_NONE SIZE_MAX
+
+static size_t ybpi_session_home(const struct ybp_sessions* s, uint32_t thread_id)
+{
+	return (size_t)(((uint64_t)thread_id * HASH_PRIME1) >> 32) & (s->num_slots - 1);
+}
+
+static size_t ybpi_session_slot(const struct ybp_sessions* s, uint32_t thread_id)
+{
+	size_t mask = s->num_slots - 1;
+	size_t i = ybpi_session_home(s, thread_id);
+	while (s->slots[i] != 0 && s->sessions[s->slots[i] - 1].thread_id != thread_id)
+		i = (i + 1) & mask;
+	return i;
+}
+
+/**
+ * Empty a slot, moving later entries back so none of them ends up on the
+ * wrong side of a gap from its home
+ **/
+static void ybpi_session_unslot(struct ybp_sessions* s, size_t slot)
+{
+	size_t mask = s->num_slots - 1;
+	size_t next = slot;
+	for (;;) {
+		size_t home;
+		s->slots[slot] = 0;
+		for (;;) {
+			next = (next + 1) & mask;
+			if (s->slots[next] == 0)
+				return;
+			home = ybpi_session_home(s, s->sessions[s->slots[next] - 1].thread_id);
+			if ((slot <= next) ? (home <= slot || home > next) : (home <= slot && home > next))
+				break;
+		}
+		s->slots[slot] = s->slots[next];
+		slot = next;
+	}
+}
+
+static void ybpi_session_unlink(struct ybp_sessions* s, size_t i)
+{
+	struct ybp_session* x = &s->sessions[i];
+	if (x->lru_prev != SESSION_NONE)
+		s->sessions[x->lru_prev].lru_next = x->lru_next;
+	else
+		s->lru_head = x->lru_next;
+	if (x->lru_next != SESSION_NONE)
+		s->sessions[x->lru_next].lru_prev = x->lru_prev;
+	else
+		s->lru_tail = x->lru_prev;
+}
+
+static void ybpi_session_push(struct ybp_sessions* s, size_t i)
+{
+	struct ybp_session* x = &s->sessions[i];
+	x->lru_prev = SESSION_NONE;
+	x->lru_next = s->lru_head;
+	if (s->lru_head != SESSION_NONE)
+		s->sessions[s->lru_head].lru_prev = i;
+	else
+		s->lru_tail = i;
+	s->lru_head = i;
+}
+
+/**
+ * Find thread_id's session and move it to the front, starting one (in
+ * place of the least recently used, if there's no room) if need be
+ **/
+static size_t ybpi_session_get(struct ybp_sessions* s, uint32_t thread_id)
+{
+	size_t slot = ybpi_session_slot(s, thread_id);
+	size_t i;
+	if (s->slots[slot] != 0) {
+		i = s->slots[slot] - 1;
+		if (s->lru_head != i) {
+			ybpi_session_unlink(s, i);
+			ybpi_session_push(s, i);
+		}
+		return i;
+	}
+	if (s->num_sessions < s->max_sessions)
+		i = s->num_sessions++;
+	else {
+		i = s->lru_tail;
+		if (s->evict != NULL)
+			s->evict(&s->sessions[i], s->evict_arg);
+		ybpi_session_unslot(s, ybpi_session_slot(s, s->sessions[i].thread_id));
+		ybpi_session_unlink(s, i);
+		slot = ybpi_session_slot(s, thread_id);
+		s->num_evicted++;
+	}
+	memset(&s->sessions[i], 0, sizeof(struct ybp_session));
+	s->sessions[i].thread_id = thread_id;
+	s->slots[slot] = i + 1;
+	ybpi_session_push(s, i);
+	s->num_created++;
+	return i;
+}
+
+struct ybp_sessions* ybp_get_sessions(size_t max_sessions, ybp_session_evict_fn evict, void* arg)
+{
+	struct ybp_sessions* s;
+	if ((s = calloc(1, sizeof(struct ybp_sessions))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	s->max_sessions = (max_sessions < 1) ? 1 : max_sessions;
+	for (s->num_slots = 16; s->num_slots < s->max_sessions * 2; s->num_slots *= 2)
+		;
+	s->lru_head = s->lru_tail = s->current = SESSION_NONE;
+	s->evict = evict;
+	s->evict_arg = arg;
+	if ((s->sessions = calloc(s->max_sessions, sizeof(struct ybp_session))) == NULL ||
+			(s->slots = calloc(s->num_slots, sizeof(size_t))) == NULL) {
+		perror("calloc");
+		ybp_dispose_sessions(s);
+		return NULL;
+	}
+	return s;
+}
+
+static int ybpi_compare_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+int ybp_sessions_filter(struct ybp_sessions* restrict s, const uint32_t* restrict thread_ids, size_t n)
+{
+	uint32_t* filter = NULL;
+	if (n > 0) {
+		if ((filter = malloc(n * sizeof(uint32_t))) == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		memcpy(filter, thread_ids, n * sizeof(uint32_t));
+		qsort(filter, n, sizeof(uint32_t), ybpi_compare_u32);
+	}
+	free(s->filter);
+	s->filter = filter;
+	s->filter_len = n;
+	return 0;
+}
+
+static void ybpi_drop_context(struct ybp_sessions* s)
+{
+	size_t i;
+	for (i = 0; i < s->num_context; ++i)
+		ybp_reset_event(&s->context[i]);
+	s->num_context = 0;
+	s->context_delivered = false;
+}
+
+/**
+ * Read whatever of e's body a short read left out, up to p's read limit
+ **/
+static int ybpi_read_event_rest(struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	size_t want = e->length - EVENT_HEADER_SIZE;
+	char* data;
+	if (p->read_limit > 0 && want > p->read_limit)
+		want = p->read_limit;
+	if (e->data == NULL || e->data_len >= want)
+		return 0;
+	if ((data = realloc(e->data, want)) == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	e->data = data;
+	if (pread(p->fd, data + e->data_len, want - e->data_len, e->offset + EVENT_HEADER_SIZE + e->data_len) != (ssize_t)(want - e->data_len)) {
+		fprintf(stderr, "Error reading event at %lld: %s\n", (long long)e->offset, strerror(errno));
+		return -1;
+	}
+	e->data_len = want;
+	return 0;
+}
+
+/**
+ * Hold on to e (taking its body) until the statement it goes with
+ **/
+static int ybpi_hold_context(struct ybp_sessions* restrict s, struct ybp_event* restrict e)
+{
+	if (s->num_context == s->context_size) {
+		size_t size = (s->context_size == 0) ? 8 : s->context_size * 2;
+		struct ybp_event* context = realloc(s->context, size * sizeof(struct ybp_event));
+		if (context == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		s->context = context;
+		s->context_size = size;
+	}
+	s->context[s->num_context++] = *e;
+	e->data = NULL;
+	return 0;
+}
+
+static bool ybpi_is_context_event(uint8_t type_code)
+{
+	switch (type_code) {
+		case INTVAR_EVENT:
+		case RAND_EVENT:
+		case USER_VAR_EVENT:
+		case GTID_LOG_EVENT:
+		case ANONYMOUS_GTID_LOG_EVENT:
+		case MARIADB_GTID_EVENT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool ybpi_is_sessionless_event(uint8_t type_code)
+{
+	switch (type_code) {
+		case START_EVENT_V3:
+		case FORMAT_DESCRIPTION_EVENT:
+		case ROTATE_EVENT:
+		case STOP_EVENT:
+		case INCIDENT_EVENT:
+		case HEARTBEAT_LOG_EVENT:
+		case HEARTBEAT_LOG_EVENT_V2:
+		case PREVIOUS_GTIDS_LOG_EVENT:
+		case BINLOG_CHECKPOINT_EVENT:
+		case MARIADB_GTID_LIST_EVENT:
+		case START_ENCRYPTION_EVENT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+int ybp_sessions_next(struct ybp_sessions* restrict s, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict evbuf, struct ybp_session** session)
+{
+	size_t read_limit = p->read_limit;
+	struct ybp_session* x;
+	bool was_in_transaction;
+	size_t i;
+	int ret;
+	*session = NULL;
+	if (s->context_delivered)
+		ybpi_drop_context(s);
+	if (!p->has_read_fde)
+		ybpi_read_fde(p);
+	for (;;) {
+		size_t extra = p->common_header_len - EVENT_HEADER_SIZE;
+		uint32_t thread_id;
+		ybp_reset_event(evbuf);
+		/* Only far enough to see whose a statement is, if that matters */
+		if (s->filter != NULL)
+			p->read_limit = extra + p->post_header_len[QUERY_EVENT];
+		ret = ybp_next_event(p, evbuf);
+		p->read_limit = read_limit;
+		if (ret < 0)
+			return ret;
+		if ((evbuf->type_code == QUERY_EVENT || evbuf->type_code == QUERY_COMPRESSED_EVENT) &&
+				evbuf->data != NULL && evbuf->data_len >= extra + sizeof(uint32_t)) {
+			memcpy(&thread_id, evbuf->data + extra, sizeof(uint32_t));
+			if (s->filter != NULL && bsearch(&thread_id, s->filter, s->filter_len, sizeof(uint32_t), ybpi_compare_u32) == NULL) {
+				s->current = SESSION_NONE;
+				s->current_filtered = true;
+				s->events_skipped += s->num_context;
+				ybpi_drop_context(s);
+			} else {
+				s->current = ybpi_session_get(s, thread_id);
+				s->current_filtered = false;
+				x = &s->sessions[s->current];
+				/* What went before it may have opened a transaction (MariaDB's GTIDs do) */
+				for (i = 0; i < s->num_context; ++i)
+					ybpi_transaction_step(p, &s->context[i], &x->in_transaction);
+				s->context_delivered = true;
+				x->num_statements++;
+				break;
+			}
+		}
+		else if (ybpi_is_context_event(evbuf->type_code) && ret > 0) {
+			if (ybpi_read_event_rest(p, evbuf) < 0 || ybpi_hold_context(s, evbuf) < 0)
+				return -1;
+			continue;
+		}
+		else if (ybpi_is_sessionless_event(evbuf->type_code) || (s->current == SESSION_NONE && !s->current_filtered))
+			return (ybpi_read_event_rest(p, evbuf) < 0) ? -1 : ret;
+		else if (!s->current_filtered)
+			break;
+		s->events_skipped++;
+		if (ret == 0)
+			return 0;
+	}
+	if (ybpi_read_event_rest(p, evbuf) < 0)
+		return -1;
+	x = &s->sessions[s->current];
+	was_in_transaction = x->in_transaction;
+	ybpi_transaction_step(p, evbuf, &x->in_transaction);
+	if (was_in_transaction && !x->in_transaction)
+		x->num_transactions++;
+	if (x->first_timestamp == 0)
+		x->first_timestamp = evbuf->timestamp;
+	x->last_timestamp = evbuf->timestamp;
+	x->last_offset = evbuf->offset;
+	*session = x;
+	return ret;
+}
+
+void ybp_dispose_sessions(struct ybp_sessions* s)
+{
+	size_t i;
+	if (s == NULL)
+		return;
+	if (s->evict != NULL && s->sessions != NULL)
+		for (i = 0; i < s->num_sessions; ++i)
+			s->evict(&s->sessions[i], s->evict_arg);
+	ybpi_drop_context(s);
+	free(s->context);
+	free(s->sessions);
+	free(s->slots);
+	free(s->filter);
+	free(s);
+}
+
+/******** filter expressions ********/
+
+enum ybpi_filter_token_kinds {
+	FILTER_END,
+	FILTER_WORD,
+	FILTER_NUMBER,
+	FILTER_STRING,
+	FILTER_PUNCT,
+	FILTER_BAD,
+};
+
+struct ybpi_filter_token {
+	int			kind;
+	const char*	start;
+	size_t		len;
+};
+
+struct ybpi_filter_parser {
+	const char*	pos;
+	struct ybp_filter*	f;
+	const char*	error;
+	const char*	error_at;
+};
+
+static const char* ybpi_filter_fields[] = {
+	[YBP_FILTER_TYPE] = "type",
+	[YBP_FILTER_SERVER_ID] = "server_id",
+	[YBP_FILTER_TIME] = "time",
+	[YBP_FILTER_OFFSET] = "offset",
+	[YBP_FILTER_LENGTH] = "length",
+	[YBP_FILTER_THREAD] = "thread",
+	[YBP_FILTER_ERROR] = "error",
+	[YBP_FILTER_DB] = "db",
+	[YBP_FILTER_STMT] = "stmt",
+};
+
+static bool ybpi_filter_fail(struct ybpi_filter_parser* fp, const char* error, const char* at)
+{
+	if (fp->error == NULL) {
+		fp->error = error;
+		fp->error_at = at;
+	}
+	return false;
+}
+
+static struct ybpi_filter_token ybpi_filter_peek(const struct ybpi_filter_parser* fp)
+{
+	static const char* pairs[] = { "!=", "<>", "<=", ">=", "~*", "=~" };
+	struct ybpi_filter_token t;
+	const char* s = fp->pos;
+	size_t i;
+	while (isspace((unsigned char)*s))
+		s++;
+	t.start = s;
+	t.len = 1;
+	if (*s == '\0') {
+		t.kind = FILTER_END;
+		t.len = 0;
+	}
+	else if (isalpha((unsigned char)*s) || *s == '_') {
+		t.kind = FILTER_WORD;
+		while (isalnum((unsigned char)s[t.len]) || s[t.len] == '_')
+			t.len++;
+	}
+	else if (isdigit((unsigned char)*s) || (*s == '-' && isdigit((unsigned char)s[1]))) {
+		t.kind = FILTER_NUMBER;
+		while (isdigit((unsigned char)s[t.len]))
+			t.len++;
+	}
+	else if (*s == '\'' || *s == '"') {
+		/* The quote doubled or backslashed stands for itself; other
+		 * backslashes are left for regexes */
+		t.kind = FILTER_BAD;
+		while (s[t.len] != '\0') {
+			if ((s[t.len] == '\\' || s[t.len] == *s) && s[t.len + 1] == *s)
+				t.len += 2;
+			else if (s[t.len++] == *s) {
+				t.kind = FILTER_STRING;
+				break;
+			}
+		}
+	}
+	else {
+		t.kind = strchr("()=<>~,", *s) ? FILTER_PUNCT : FILTER_BAD;
+		for (i = 0; i < sizeof(pairs) / sizeof(pairs[0]); ++i) {
+			if (strncmp(s, pairs[i], 2) == 0) {
+				t.kind = FILTER_PUNCT;
+				t.len = 2;
+			}
+		}
+	}
+	return t;
+}
+
+static struct ybpi_filter_token ybpi_filter_next(struct ybpi_filter_parser* fp)
+{
+	struct ybpi_filter_token t = ybpi_filter_peek(fp);
+	fp->pos = t.start + t.len;
+	return t;
+}
+
+static bool ybpi_filter_is(struct ybpi_filter_token t, const char* word)
+{
+	return t.kind != FILTER_STRING && t.len == strlen(word) && strncasecmp(t.start, word, t.len) == 0;
+}
+
+/**
+ * Take the next token if it's word
+ **/
+static bool ybpi_filter_accept(struct ybpi_filter_parser* fp, const char* word)
+{
+	struct ybpi_filter_token t = ybpi_filter_peek(fp);
+	if (!ybpi_filter_is(t, word))
+		return false;
+	fp->pos = t.start + t.len;
+	return true;
+}
+
+/**
+ * The text of a string token, unquoted, in a new NUL-terminated buffer
+ **/
+static char* ybpi_filter_string(struct ybpi_filter_token t, size_t* len)
+{
+	char* out;
+	size_t i, n = 0;
+	if ((out = malloc(t.len)) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	for (i = 1; i + 1 < t.len; ++i) {
+		if ((t.start[i] == '\\' || t.start[i] == t.start[0]) && t.start[i + 1] == t.start[0])
+			i++;
+		out[n++] = t.start[i];
+	}
+	out[n] = '\0';
+	*len = n;
+	return out;
+}
+
+static int ybpi_filter_add(struct ybpi_filter_parser* fp, size_t at, uint8_t op, uint8_t field)
+{
+	struct ybp_filter* f = fp->f;
+	if (f->num_nodes == f->nodes_size) {
+		size_t size = (f->nodes_size == 0) ? 16 : f->nodes_size * 2;
+		struct ybp_filter_node* nodes = realloc(f->nodes, size * sizeof(struct ybp_filter_node));
+		if (nodes == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		f->nodes = nodes;
+		f->nodes_size = size;
+	}
+	memmove(f->nodes + at + 1, f->nodes + at, (f->num_nodes - at) * sizeof(struct ybp_filter_node));
+	f->num_nodes++;
+	memset(&f->nodes[at], 0, sizeof(struct ybp_filter_node));
+	f->nodes[at].op = op;
+	f->nodes[at].field = field;
+	f->nodes[at].size = 1;
+	return 0;
+}
+
+/**
+ * Put an AND, OR or NOT over the nodes from start on
+ **/
+static bool ybpi_filter_wrap(struct ybpi_filter_parser* fp, size_t start, uint8_t op)
+{
+	if (ybpi_filter_add(fp, start, op, 0) < 0)
+		return ybpi_filter_fail(fp, "out of memory", fp->pos);
+	fp->f->nodes[start].size = fp->f->num_nodes - start;
+	return true;
+}
+
+static bool ybpi_filter_number(struct ybpi_filter_parser* fp, int field, int64_t* value)
+{
+	struct ybpi_filter_token t = ybpi_filter_next(fp);
+	if (t.kind == FILTER_NUMBER) {
+		*value = strtoll(t.start, NULL, 10);
+		return true;
+	}
+	/* Times may also be given as local times */
+	if (t.kind == FILTER_STRING && field == YBP_FILTER_TIME) {
+		char buf[64];
+		const char* end;
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		snprintf(buf, sizeof(buf), "%.*s", (int)(t.len - 2), t.start + 1);
+		if ((end = strptime(buf, "%Y-%m-%d", &tm)) != NULL && *end != '\0')
+			end = strptime(end, " %H:%M:%S", &tm);
+		if (end != NULL && *end == '\0') {
+			tm.tm_isdst = -1;
+			*value = mktime(&tm);
+			return true;
+		}
+		return ybpi_filter_fail(fp, "expected YYYY-MM-DD[ HH:MM:SS]", t.start);
+	}
+	return ybpi_filter_fail(fp, "expected a number", t.start);
+}
+
+static bool ybpi_filter_type(struct ybpi_filter_parser* fp, struct ybp_filter_node* n)
+{
+	struct ybpi_filter_token t = ybpi_filter_next(fp);
+	bool found = false;
+	int i;
+	if (t.kind == FILTER_NUMBER) {
+		long code = strtol(t.start, NULL, 10);
+		if (code < 0 || code > 255)
+			return ybpi_filter_fail(fp, "no such event type", t.start);
+		n->types[code >> 3] |= 1 << (code & 7);
+		return true;
+	}
+	if (t.kind != FILTER_WORD)
+		return ybpi_filter_fail(fp, "expected an event type", t.start);
+	/* QUERY will do for QUERY_EVENT */
+	for (i = 0; i < 256; ++i) {
+		const char* name = ybpi_event_types[i];
+		if (name != NULL && strncasecmp(name, t.start, t.len) == 0 &&
+				(name[t.len] == '\0' || strcmp(name + t.len, "_EVENT") == 0)) {
+			n->types[i >> 3] |= 1 << (i & 7);
+			found = true;
+		}
+	}
+	return found ? true : ybpi_filter_fail(fp, "no such event type", t.start);
+}
+
+/**
+ * Parse the value after field op and add the test
+ **/
+static bool ybpi_filter_compare(struct ybpi_filter_parser* fp, int field, struct ybpi_filter_token op)
+{
+	size_t start = fp->f->num_nodes;
+	struct ybp_filter_node* n;
+	bool negate = ybpi_filter_is(op, "!=") || ybpi_filter_is(op, "<>");
+	if (field == YBP_FILTER_TYPE) {
+		if (!ybpi_filter_is(op, "=") && !negate)
+			return ybpi_filter_fail(fp, "types can only be compared with =, != or in", op.start);
+		if (ybpi_filter_add(fp, start, YBP_FILTER_TYPE_IN, field) < 0)
+			return ybpi_filter_fail(fp, "out of memory", op.start);
+		if (!ybpi_filter_type(fp, &fp->f->nodes[start]))
+			return false;
+	}
+	else if (field < YBP_FILTER_DB) {
+		int64_t v;
+		if (ybpi_filter_add(fp, start, YBP_FILTER_RANGE, field) < 0)
+			return ybpi_filter_fail(fp, "out of memory", op.start);
+		if (!ybpi_filter_number(fp, field, &v))
+			return false;
+		n = &fp->f->nodes[start];
+		n->cost = (field >= YBP_FILTER_THREAD) ? 1 : 0;
+		n->lo = INT64_MIN;
+		n->hi = INT64_MAX;
+		if (ybpi_filter_is(op, "=") || negate)
+			n->lo = n->hi = v;
+		else if (ybpi_filter_is(op, "<"))
+			n->hi = v - 1;
+		else if (ybpi_filter_is(op, "<="))
+			n->hi = v;
+		else if (ybpi_filter_is(op, ">"))
+			n->lo = v + 1;
+		else if (ybpi_filter_is(op, ">="))
+			n->lo = v;
+		else
+			return ybpi_filter_fail(fp, "numbers can't be searched", op.start);
+	}
+	else {
+		struct ybpi_filter_token t = ybpi_filter_next(fp);
+		bool search = ybpi_filter_is(op, "~") || ybpi_filter_is(op, "~*") || ybpi_filter_is(op, "=~");
+		if (t.kind != FILTER_STRING)
+			return ybpi_filter_fail(fp, "expected a quoted string", t.start);
+		if (!search && !ybpi_filter_is(op, "=") && !negate)
+			return ybpi_filter_fail(fp, "text can only be compared with =, !=, ~, ~* or =~", op.start);
+		if (ybpi_filter_add(fp, start, search ? YBP_FILTER_SEARCH : YBP_FILTER_EQUAL, field) < 0)
+			return ybpi_filter_fail(fp, "out of memory", op.start);
+		n = &fp->f->nodes[start];
+		if ((n->text = ybpi_filter_string(t, &n->text_len)) == NULL)
+			return ybpi_filter_fail(fp, "out of memory", t.start);
+		n->cost = 2;
+		if (search) {
+			bool regex = ybpi_filter_is(op, "=~");
+			if ((n->grep = ybp_get_grep(regex ? NULL : n->text, regex ? n->text : NULL, ybpi_filter_is(op, "~*"))) == NULL)
+				return ybpi_filter_fail(fp, "bad regex", t.start);
+			n->cost = regex ? 4 : 3;
+		}
+	}
+	return negate ? ybpi_filter_wrap(fp, start, YBP_FILTER_NOT) : true;
+}
+
+static bool ybpi_filter_or(struct ybpi_filter_parser* fp);
+
+/**
+ * A single test: field op value, field [not] in (...), or field between
+ * a and b
+ **/
+static bool ybpi_filter_test(struct ybpi_filter_parser* fp)
+{
+	struct ybpi_filter_token t = ybpi_filter_next(fp);
+	struct ybpi_filter_token op;
+	size_t start = fp->f->num_nodes;
+	int field;
+	bool negate;
+	if (t.kind != FILTER_WORD)
+		return ybpi_filter_fail(fp, "expected a field", t.start);
+	for (field = 0; field <= YBP_FILTER_STMT; ++field) {
+		if (ybpi_filter_is(t, ybpi_filter_fields[field]))
+			break;
+	}
+	if (field > YBP_FILTER_STMT)
+		return ybpi_filter_fail(fp, "no such field", t.start);
+	negate = ybpi_filter_accept(fp, "not");
+	op = ybpi_filter_next(fp);
+	if (ybpi_filter_is(op, "between")) {
+		int64_t lo, hi;
+		if (field >= YBP_FILTER_DB || field == YBP_FILTER_TYPE)
+			return ybpi_filter_fail(fp, "only numbers can be between", op.start);
+		if (ybpi_filter_add(fp, start, YBP_FILTER_RANGE, field) < 0)
+			return ybpi_filter_fail(fp, "out of memory", op.start);
+		if (!ybpi_filter_number(fp, field, &lo))
+			return false;
+		if (!ybpi_filter_accept(fp, "and"))
+			return ybpi_filter_fail(fp, "expected and", fp->pos);
+		if (!ybpi_filter_number(fp, field, &hi))
+			return false;
+		fp->f->nodes[start].lo = lo;
+		fp->f->nodes[start].hi = hi;
+		fp->f->nodes[start].cost = (field >= YBP_FILTER_THREAD) ? 1 : 0;
+	}
+	else if (ybpi_filter_is(op, "in")) {
+		struct ybpi_filter_token eq = { FILTER_PUNCT, "=", 1 };
+		size_t n = 0;
+		if (!ybpi_filter_accept(fp, "("))
+			return ybpi_filter_fail(fp, "expected (", fp->pos);
+		/* One bitmap takes all the types; anything else is an OR of = */
+		if (field == YBP_FILTER_TYPE && ybpi_filter_add(fp, start, YBP_FILTER_TYPE_IN, field) < 0)
+			return ybpi_filter_fail(fp, "out of memory", op.start);
+		do {
+			if (field == YBP_FILTER_TYPE) {
+				if (!ybpi_filter_type(fp, &fp->f->nodes[start]))
+					return false;
+			}
+			else if (!ybpi_filter_compare(fp, field, eq))
+				return false;
+			n++;
+		} while (ybpi_filter_accept(fp, ","));
+		if (!ybpi_filter_accept(fp, ")"))
+			return ybpi_filter_fail(fp, "expected , or )", fp->pos);
+		if (field != YBP_FILTER_TYPE && n > 1 && !ybpi_filter_wrap(fp, start, YBP_FILTER_OR))
+			return false;
+	}
+	else if (negate)
+		return ybpi_filter_fail(fp, "expected in or between", op.start);
+	else if (op.kind == FILTER_PUNCT && !ybpi_filter_is(op, ",") && !ybpi_filter_is(op, "(") && !ybpi_filter_is(op, ")"))
+		return ybpi_filter_compare(fp, field, op);
+	else
+		return ybpi_filter_fail(fp, "expected a comparison", op.start);
+	return negate ? ybpi_filter_wrap(fp, start, YBP_FILTER_NOT) : true;
+}
+
+static bool ybpi_filter_not(struct ybpi_filter_parser* fp)
+{
+	size_t start = fp->f->num_nodes;
+	if (ybpi_filter_accept(fp, "not"))
+		return ybpi_filter_not(fp) && ybpi_filter_wrap(fp, start, YBP_FILTER_NOT);
+	if (ybpi_filter_accept(fp, "(")) {
+		if (!ybpi_filter_or(fp))
+			return false;
+		return ybpi_filter_accept(fp, ")") ? true : ybpi_filter_fail(fp, "expected )", fp->pos);
+	}
+	return ybpi_filter_test(fp);
+}
+
+static bool ybpi_filter_and(struct ybpi_filter_parser* fp)
+{
+	size_t start = fp->f->num_nodes;
+	bool chain = false;
+	if (!ybpi_filter_not(fp))
+		return false;
+	while (ybpi_filter_accept(fp, "and")) {
+		chain = true;
+		if (!ybpi_filter_not(fp))
+			return false;
+	}
+	return chain ? ybpi_filter_wrap(fp, start, YBP_FILTER_AND) : true;
+}
+
+static bool ybpi_filter_or(struct ybpi_filter_parser* fp)
+{
+	size_t start = fp->f->num_nodes;
+	bool chain = false;
+	if (!ybpi_filter_and(fp))
+		return false;
+	while (ybpi_filter_accept(fp, "or")) {
+		chain = true;
+		if (!ybpi_filter_and(fp))
+			return false;
+	}
+	return chain ? ybpi_filter_wrap(fp, start, YBP_FILTER_OR) : true;
+}
+
+struct ybpi_filter_child {
+	size_t		start;
+	uint32_t	size;
+	uint8_t		cost;
+};
+
+/**
+ * Work out the cost of the subtree at i, and put the cheap children of
+ * each AND and OR in it first (stably, so ties keep the order written)
+ **/
+static int ybpi_filter_arrange(struct ybp_filter* restrict f, size_t i, struct ybp_filter_node* restrict scratch)
+{
+	struct ybp_filter_node* n = &f->nodes[i];
+	struct ybpi_filter_child* children;
+	size_t j, k, o, num_children = 0, end = i + n->size;
+	int cost;
+	if (n->op > YBP_FILTER_NOT)
+		return n->cost;
+	for (j = i + 1; j < end; j += f->nodes[j].size)
+		num_children++;
+	if ((children = malloc(num_children * sizeof(struct ybpi_filter_child))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	n->cost = 0;
+	num_children = 0;
+	for (j = i + 1; j < end; j += f->nodes[j].size) {
+		if ((cost = ybpi_filter_arrange(f, j, scratch)) < 0) {
+			free(children);
+			return -1;
+		}
+		if (cost > n->cost)
+			n->cost = cost;
+		/* Insertion sort: there are rarely more than a handful */
+		for (k = num_children++; k > 0 && children[k - 1].cost > cost; --k)
+			children[k] = children[k - 1];
+		children[k].start = j;
+		children[k].size = f->nodes[j].size;
+		children[k].cost = cost;
+	}
+	for (k = 0, o = 0; k < num_children; o += children[k].size, ++k)
+		memcpy(scratch + o, f->nodes + children[k].start, children[k].size * sizeof(struct ybp_filter_node));
+	memcpy(f->nodes + i + 1, scratch, o * sizeof(struct ybp_filter_node));
+	free(children);
+	return n->cost;
+}
+
+void ybp_dispose_filter(struct ybp_filter* f)
+{
+	size_t i;
+	if (f == NULL)
+		return;
+	for (i = 0; i < f->num_nodes; ++i) {
+		free(f->nodes[i].text);
+		ybp_dispose_grep(f->nodes[i].grep);
+	}
+	free(f->nodes);
+	free(f);
+}
+
+struct ybp_filter* ybp_get_filter(const char* expr)
+{
+	struct ybpi_filter_parser fp;
+	struct ybp_filter_node* scratch;
+	struct ybp_filter* f;
+	if ((f = calloc(1, sizeof(struct ybp_filter))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	fp.pos = expr;
+	fp.f = f;
+	fp.error = NULL;
+	fp.error_at = NULL;
+	if (!ybpi_filter_or(&fp) || ybpi_filter_peek(&fp).kind != FILTER_END) {
+		ybpi_filter_fail(&fp, "expected and, or or the end", fp.pos);
+		fprintf(stderr, "Bad filter: %s at character %d of\n\t%s\n", fp.error, (int)(fp.error_at - expr) + 1, expr);
+		ybp_dispose_filter(f);
+		return NULL;
+	}
+	if ((scratch = malloc(f->num_nodes * sizeof(struct ybp_filter_node))) == NULL) {
+		perror("malloc");
+		ybp_dispose_filter(f);
+		return NULL;
+	}
+	if (ybpi_filter_arrange(f, 0, scratch) < 0) {
+		free(scratch);
+		ybp_dispose_filter(f);
+		return NULL;
+	}
+	free(scratch);
+	return f;
+}
+
+/**
+ * The event being filtered, and its query fields once a test needs them
+ **/
+struct ybpi_filter_view {
+	struct ybp_binlog_parser*	p;
+	struct ybp_event*	e;
+	int			decoded;	/* 0 if not yet tried, 1 if a query, -1 if not */
+	struct ybp_decoded_event	d;
+};
+
+static bool ybpi_filter_query(struct ybpi_filter_view* v)
+{
+	if (v->decoded == 0)
+		v->decoded = (v->e->type_code == QUERY_EVENT && ybp_decode_event(v->p, v->e, &v->d) == 0) ? 1 : -1;
+	return v->decoded > 0;
+}
+
+static bool ybpi_filter_eval(const struct ybp_filter_node* restrict nodes, size_t i, struct ybpi_filter_view* restrict v)
+{
+	const struct ybp_filter_node* n = &nodes[i];
+	size_t j, end = i + n->size;
+	const char* text;
+	size_t len;
+	int64_t x;
+	switch (n->op) {
+		case YBP_FILTER_AND:
+			for (j = i + 1; j < end; j += nodes[j].size)
+				if (!ybpi_filter_eval(nodes, j, v))
+					return false;
+			return true;
+		case YBP_FILTER_OR:
+			for (j = i + 1; j < end; j += nodes[j].size)
+				if (ybpi_filter_eval(nodes, j, v))
+					return true;
+			return false;
+		case YBP_FILTER_NOT:
+			return !ybpi_filter_eval(nodes, i + 1, v);
+		case YBP_FILTER_TYPE_IN:
+			return (n->types[v->e->type_code >> 3] >> (v->e->type_code & 7)) & 1;
+		case YBP_FILTER_RANGE:
+			switch (n->field) {
+				case YBP_FILTER_SERVER_ID:
+					x = v->e->server_id;
+					break;
+				case YBP_FILTER_TIME:
+					x = v->e->timestamp;
+					break;
+				case YBP_FILTER_OFFSET:
+					x = v->e->offset;
+					break;
+				case YBP_FILTER_LENGTH:
+					x = v->e->length;
+					break;
+				case YBP_FILTER_THREAD:
+					if (!ybpi_filter_query(v))
+						return false;
+					x = v->d.u.query.thread_id;
+					break;
+				case YBP_FILTER_ERROR:
+					if (!ybpi_filter_query(v))
+						return false;
+					x = v->d.u.query.error_code;
+					break;
+				default:
+					return false;
+			}
+			return x >= n->lo && x <= n->hi;
+		case YBP_FILTER_EQUAL:
+		case YBP_FILTER_SEARCH:
+			if (!ybpi_filter_query(v))
+				return false;
+			if (n->field == YBP_FILTER_DB) {
+				text = v->d.u.query.db_name;
+				len = v->d.u.query.db_name_len;
+			} else {
+				text = v->d.u.query.statement;
+				len = v->d.u.query.statement_len;
+			}
+			if (n->op == YBP_FILTER_SEARCH)
+				return ybp_grep_statement(n->grep, text, len);
+			return len == n->text_len && memcmp(text, n->text, len) == 0;
+	}
+	return false;
+}
+
+bool ybp_filter_event(struct ybp_binlog_parser* restrict p, const struct ybp_filter* restrict f, struct ybp_event* restrict e)
+{
+	struct ybpi_filter_view v;
+	v.p = p;
+	v.e = e;
+	v.decoded = 0;
+	return ybpi_filter_eval(f->nodes, 0, &v);
+}
+
+/******** pipelined decoding ********/
+
+#define PIPELINE_QUEUE_DEPTH 4		/* batches in flight per worker */
+#define PIPELINE_SPINS 64			/* yields before waits start sleeping */
+#define PIPELINE_SLEEP_NS 100000	/* between looks at an empty or full queue */
+#define PIPELINE_POLL_NS 1000000	/* between looks for more of a followed binlog */
+#define PIPELINE_MAX_RETRIES 5000	/* polls of an unreadable event in a binlog that's stopped growing */
+
+static bool ybpi_queue_push(struct ybp_pipeline_queue* q, struct ybp_pipeline_batch* b)
+{
+	uint64_t head = q->head;
+	if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) > q->mask)
+		return false;
+	q->slots[head & q->mask] = b;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static struct ybp_pipeline_batch* ybpi_queue_pop(struct ybp_pipeline_queue* q)
+{
+	uint64_t tail = q->tail;
+	struct ybp_pipeline_batch* b;
+	if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	b = q->slots[tail & q->mask];
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return b;
+}
+
+static int ybpi_queue_init(struct ybp_pipeline_queue* q, size_t capacity)
+{
+	size_t size;
+	for (size = 2; size < capacity; size *= 2)
+		;
+	memset(q, 0, sizeof(struct ybp_pipeline_queue));
+	if ((q->slots = calloc(size, sizeof(struct ybp_pipeline_batch*))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	q->mask = size - 1;
+	return 0;
+}
+
+static void ybpi_nap(long ns)
+{
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = ns;
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * Back off a little more each time round a wait
+ **/
+static void ybpi_pipeline_backoff(unsigned int* spins)
+{
+	if ((*spins)++ < PIPELINE_SPINS)
+		sched_yield();
+	else
+		ybpi_nap(PIPELINE_SLEEP_NS);
+}
+
+static bool ybpi_pipeline_stopping(struct ybp_pipeline* pl)
+{
+	return __atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Copy what decoding needs out of the reader's parser, so workers never
+ * look at it while the reader moves it along
+ **/
+static void ybpi_copy_decode_state(struct ybp_binlog_parser* restrict to, const struct ybp_binlog_parser* restrict from)
+{
+	to->fd = -1;
+	to->has_read_fde = from->has_read_fde;
+	to->checksum_alg = from->checksum_alg;
+	to->common_header_len = from->common_header_len;
+	memcpy(to->post_header_len, from->post_header_len, sizeof(to->post_header_len));
+	memcpy(to->decoders, from->decoders, sizeof(to->decoders));
+}
+
+/**
+ * Whether the event at offset has been unreadable for long enough, in a
+ * binlog that's stopped growing, to give up waiting for the rest of it
+ **/
+static bool ybpi_pipeline_stuck(struct ybp_pipeline* restrict pl, off64_t offset)
+{
+	struct ybp_binlog_parser* p = pl->parser;
+	ybp_update_bp(p);
+	if (offset != pl->retry_offset || p->file_size != pl->retry_size) {
+		pl->retry_offset = offset;
+		pl->retry_size = p->file_size;
+		pl->num_retries = 0;
+		return false;
+	}
+	return ++pl->num_retries >= PIPELINE_MAX_RETRIES;
+}
+
+/**
+ * Fill b with what's there to read. Returns false (leaving the parser
+ * where it was) if there's nothing yet.
+ **/
+static bool ybpi_pipeline_fill(struct ybp_pipeline* restrict pl, struct ybp_pipeline_batch* restrict b)
+{
+	struct ybp_binlog_parser* p = pl->parser;
+	b->num_events = 0;
+	b->status = 1;
+	ybpi_copy_decode_state(b->parser, p);
+	while (b->num_events < pl->batch_size) {
+		struct ybp_event* e = &b->events[b->num_events];
+		off64_t offset = ybp_tell_bp(p);
+		int ret;
+		if (offset + EVENT_HEADER_SIZE > p->file_size && pl->follow)
+			ybp_update_bp(p);
+		if (offset + EVENT_HEADER_SIZE > p->file_size) {
+			if (!pl->follow)
+				b->status = 0;
+			break;
+		}
+		ret = ybp_next_event(p, e);
+		if (ret < 0) {
+			ybp_reset_event(e);
+			/* Probably a half-written event; try again when it's done */
+			if (pl->follow) {
+				ybp_rewind_bp(p, offset);
+				if (!ybpi_pipeline_stuck(pl, offset))
+					break;
+				fprintf(stderr, "Event at %lld is still unreadable and the binlog has stopped growing; giving up\n",
+						(long long)offset);
+			}
+			b->status = ret;
+			break;
+		}
+		b->num_events++;
+		if (e->type_code == ROTATE_EVENT || e->type_code == STOP_EVENT || (ret == 0 && !pl->follow)) {
+			b->status = 0;
+			break;
+		}
+	}
+	b->end_offset = ybp_tell_bp(p);
+	return b->num_events > 0 || b->status != 1;
+}
+
+static void* ybpi_pipeline_reader(void* arg)
+{
+	struct ybp_pipeline* pl = arg;
+	struct ybp_pipeline_batch* b = NULL;
+	uint64_t seq = 0;
+	unsigned int spins = 0;
+	while (!ybpi_pipeline_stopping(pl)) {
+		struct ybp_pipeline_queue* q;
+		if (b == NULL && (b = ybpi_queue_pop(&pl->free)) == NULL) {
+			ybpi_pipeline_backoff(&spins);
+			continue;
+		}
+		if (!ybpi_pipeline_fill(pl, b)) {
+			ybpi_nap(PIPELINE_POLL_NS);
+			continue;
+		}
+		b->seq = seq;
+		q = &pl->to_workers[seq % pl->num_workers];
+		spins = 0;
+		while (!ybpi_queue_push(q, b)) {
+			if (ybpi_pipeline_stopping(pl))
+				return NULL;
+			ybpi_pipeline_backoff(&spins);
+		}
+		seq++;
+		spins = 0;
+		if (b->status != 1)
+			break;
+		b = NULL;
+	}
+	return NULL;
+}
+
+struct ybpi_pipeline_worker {
+	struct ybp_pipeline*	pl;
+	unsigned int	index;
+};
+
+static void* ybpi_pipeline_worker(void* arg)
+{
+	struct ybp_pipeline* pl = ((struct ybpi_pipeline_worker*)arg)->pl;
+	unsigned int index = ((struct ybpi_pipeline_worker*)arg)->index;
+	struct ybp_pipeline_queue* in = &pl->to_workers[index];
+	struct ybp_pipeline_queue* out = &pl->from_workers[index];
+	unsigned int spins = 0;
+	free(arg);
+	while (!ybpi_pipeline_stopping(pl)) {
+		struct ybp_pipeline_batch* b;
+		size_t i, kept = 0;
+		if ((b = ybpi_queue_pop(in)) == NULL) {
+			ybpi_pipeline_backoff(&spins);
+			continue;
+		}
+		for (i = 0; i < b->num_events; ++i) {
+			struct ybp_event* e = &b->events[i];
+			if (pl->filter != NULL && !ybp_filter_event(b->parser, pl->filter, e)) {
+				ybp_reset_event(e);
+				continue;
+			}
+			if (kept != i) {
+				b->events[kept] = *e;
+				ybp_init_event(e);
+			}
+			b->has_decoded[kept] = (ybp_decode_event(b->parser, &b->events[kept], &b->decoded[kept]) == 0);
+			kept++;
+		}
+		b->num_events = kept;
+		spins = 0;
+		while (!ybpi_queue_push(out, b)) {
+			if (ybpi_pipeline_stopping(pl))
+				return NULL;
+			ybpi_pipeline_backoff(&spins);
+		}
+		spins = 0;
+	}
+	return NULL;
+}
+
+struct ybp_pipeline* ybp_get_pipeline(struct ybp_binlog_parser* restrict p, unsigned int num_workers, size_t batch_size,
+		const struct ybp_filter* restrict filter, bool follow)
+{
+	struct ybp_pipeline* pl;
+	unsigned int i;
+	size_t j;
+	int err;
+	if ((pl = calloc(1, sizeof(struct ybp_pipeline))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	if (!p->has_read_fde)
+		ybpi_read_fde(p);
+	pl->parser = p;
+	pl->filter = filter;
+	pl->follow = follow;
+	pl->num_workers = (num_workers < 1) ? 1 : num_workers;
+	pl->batch_size = (batch_size < 1) ? 1 : batch_size;
+	pl->num_batches = pl->num_workers * PIPELINE_QUEUE_DEPTH;
+	if ((pl->batches = calloc(pl->num_batches, sizeof(struct ybp_pipeline_batch))) == NULL ||
+			(pl->to_workers = calloc(pl->num_workers, sizeof(struct ybp_pipeline_queue))) == NULL ||
+			(pl->from_workers = calloc(pl->num_workers, sizeof(struct ybp_pipeline_queue))) == NULL ||
+			(pl->workers = calloc(pl->num_workers, sizeof(pthread_t))) == NULL ||
+			ybpi_queue_init(&pl->free, pl->num_batches) < 0) {
+		perror("calloc");
+		ybp_dispose_pipeline(pl);
+		return NULL;
+	}
+	for (i = 0; i < pl->num_workers; ++i) {
+		if (ybpi_queue_init(&pl->to_workers[i], PIPELINE_QUEUE_DEPTH) < 0 ||
+				ybpi_queue_init(&pl->from_workers[i], PIPELINE_QUEUE_DEPTH) < 0) {
+			ybp_dispose_pipeline(pl);
+			return NULL;
+		}
+	}
+	for (j = 0; j < pl->num_batches; ++j) {
+		struct ybp_pipeline_batch* b = &pl->batches[j];
+		if ((b->events = calloc(pl->batch_size, sizeof(struct ybp_event))) == NULL ||
+				(b->decoded = calloc(pl->batch_size, sizeof(struct ybp_decoded_event))) == NULL ||
+				(b->has_decoded = calloc(pl->batch_size, sizeof(bool))) == NULL ||
+				(b->parser = calloc(1, sizeof(struct ybp_binlog_parser))) == NULL) {
+			perror("calloc");
+			ybp_dispose_pipeline(pl);
+			return NULL;
+		}
+		ybpi_queue_push(&pl->free, b);
+	}
+	for (i = 0; i < pl->num_workers; ++i) {
+		struct ybpi_pipeline_worker* w;
+		if ((w = malloc(sizeof(struct ybpi_pipeline_worker))) == NULL) {
+			perror("malloc");
+			ybp_dispose_pipeline(pl);
+			return NULL;
+		}
+		w->pl = pl;
+		w->index = i;
+		if ((err = pthread_create(&pl->workers[i], NULL, ybpi_pipeline_worker, w)) != 0) {
+			fprintf(stderr, "Error starting a decoder: %s\n", strerror(err));
+			free(w);
+			ybp_dispose_pipeline(pl);
+			return NULL;
+		}
+		pl->num_started++;
+	}
+	if ((err = pthread_create(&pl->reader, NULL, ybpi_pipeline_reader, pl)) != 0) {
+		fprintf(stderr, "Error starting the reader: %s\n", strerror(err));
+		ybp_dispose_pipeline(pl);
+		return NULL;
+	}
+	pl->num_started++;
+	return pl;
+}
+
+int ybp_pipeline_next_batch(struct ybp_pipeline* restrict pl, struct ybp_pipeline_batch** restrict batch, int timeout_ms)
+{
+	struct timespec start, now;
+	unsigned int spins = 0;
+	*batch = NULL;
+	if (timeout_ms >= 0)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!pl->ended) {
+		struct ybp_pipeline_batch* b = ybpi_queue_pop(&pl->from_workers[pl->next_seq % pl->num_workers]);
+		if (b == NULL) {
+			if (timeout_ms >= 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= timeout_ms)
+					return 1;
+			}
+			ybpi_pipeline_backoff(&spins);
+			continue;
+		}
+		pl->next_seq++;
+		if (b->status != 1) {
+			pl->ended = true;
+			pl->end_status = b->status;
+		}
+		if (b->num_events > 0) {
+			*batch = b;
+			return 1;
+		}
+		ybp_pipeline_release_batch(pl, b);
+	}
+	return pl->end_status;
+}
+
+void ybp_pipeline_release_batch(struct ybp_pipeline* restrict pl, struct ybp_pipeline_batch* restrict batch)
+{
+	size_t i;
+	for (i = 0; i < batch->num_events; ++i)
+		ybp_reset_event(&batch->events[i]);
+	batch->num_events = 0;
+	/* There's room for every batch */
+	ybpi_queue_push(&pl->free, batch);
+}
+
+void ybp_dispose_pipeline(struct ybp_pipeline* pl)
+{
+	unsigned int i;
+	size_t j;
+	if (pl == NULL)
+		return;
+	__atomic_store_n(&pl->stop, 1, __ATOMIC_RELEASE);
+	/* The reader is started last, once every worker is */
+	if (pl->num_started > pl->num_workers)
+		pthread_join(pl->reader, NULL);
+	for (i = 0; i < pl->num_started && i < pl->num_workers; ++i)
+		pthread_join(pl->workers[i], NULL);
+	for (j = 0; pl->batches != NULL && j < pl->num_batches; ++j) {
+		struct ybp_pipeline_batch* b = &pl->batches[j];
+		size_t k;
+		for (k = 0; b->events != NULL && k < pl->batch_size; ++k)
+			ybp_reset_event(&b->events[k]);
+		free(b->events);
+		free(b->decoded);
+		free(b->has_decoded);
+		free(b->parser);
+	}
+	for (i = 0; pl->to_workers != NULL && i < pl->num_workers; ++i)
+		free(pl->to_workers[i].slots);
+	for (i = 0; pl->from_workers != NULL && i < pl->num_workers; ++i)
+		free(pl->from_workers[i].slots);
+	free(pl->free.slots);
+	free(pl->to_workers);
+	free(pl->from_workers);
+	free(pl->workers);
+	free(pl->batches);
+	free(pl);
+}
+
+/******** bulk export ********/
+
+#define EXPORT_PEEK_LEN 512		/* of each event read first: enough for most queries' databases */
+
+struct ybp_export* ybp_get_export(int flags)
+{
+	struct ybp_export* x;
+	if ((x = calloc(1, sizeof(struct ybp_export))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	x->flags = flags;
+	ybp_init_event(&x->evbuf);
+	return x;
+}
+
+/**
+ * The number of the database called name, numbering it if it's new
+ **/
+static uint16_t ybpi_export_db(struct ybp_export* restrict x, const char* restrict name, size_t len)
+{
+	size_t mask, i;
+	if (x->num_dbs * 2 >= x->num_db_slots) {
+		size_t size = (x->num_db_slots == 0) ? 64 : x->num_db_slots * 2;
+		uint32_t* slots;
+		char** names;
+		if (x->num_dbs >= YBP_EXPORT_NO_DB)
+			goto lookup;
+		if ((slots = calloc(size, sizeof(uint32_t))) == NULL ||
+				(names = realloc(x->db_names, (size / 2) * sizeof(char*))) == NULL) {
+			perror("realloc");
+			free(slots);
+			return YBP_EXPORT_NO_DB;
+		}
+		for (i = 0; i < x->num_dbs; ++i) {
+			size_t j = ybpi_hash64(names[i], strlen(names[i]), 0) & (size - 1);
+			while (slots[j] != 0)
+				j = (j + 1) & (size - 1);
+			slots[j] = i + 1;
+		}
+		free(x->db_slots);
+		x->db_slots = slots;
+		x->db_names = names;
+		x->num_db_slots = size;
+	}
+lookup:
+	mask = x->num_db_slots - 1;
+	for (i = ybpi_hash64(name, len, 0) & mask; x->db_slots[i] != 0; i = (i + 1) & mask) {
+		const char* known = x->db_names[x->db_slots[i] - 1];
+		if (strncmp(known, name, len) == 0 && known[len] == '\0')
+			return x->db_slots[i] - 1;
+	}
+	if (x->num_dbs >= YBP_EXPORT_NO_DB)
+		return YBP_EXPORT_NO_DB;
+	if ((x->db_names[x->num_dbs] = strndup(name, len)) == NULL) {
+		perror("strndup");
+		return YBP_EXPORT_NO_DB;
+	}
+	x->db_slots[i] = ++x->num_dbs;
+	return x->num_dbs - 1;
+}
+
+static int ybpi_export_payload(struct ybp_export* restrict x, struct ybp_event_record* restrict r, const char* restrict payload, size_t len)
+{
+	if (x->payload_len + len > x->payload_size) {
+		size_t size = (x->payload_size == 0) ? 1 << 20 : x->payload_size;
+		char* grown;
+		while (size < x->payload_len + len)
+			size *= 2;
+		if ((grown = realloc(x->payload, size)) == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		x->payload = grown;
+		x->payload_size = size;
+	}
+	memcpy(x->payload + x->payload_len, payload, len);
+	r->payload_offset = x->payload_len;
+	r->payload_len = len;
+	x->payload_len += len;
+	return 0;
+}
+
+/**
+ * Fill in r from the event in x->evbuf, reading more of it if need be
+ **/
+static int ybpi_export_event(struct ybp_export* restrict x, struct ybp_binlog_parser* restrict p, struct ybp_event_record* restrict r)
+{
+	struct ybp_event* e = &x->evbuf;
+	struct ybp_decoded_event d;
+	memset(r, 0, sizeof(struct ybp_event_record));
+	r->offset = e->offset;
+	r->timestamp = e->timestamp;
+	r->server_id = e->server_id;
+	r->length = e->length;
+	r->type_code = e->type_code;
+	r->db_id = YBP_EXPORT_NO_DB;
+	if (e->type_code == QUERY_EVENT) {
+		int ret = ybp_decode_event(p, e, &d);
+		/* The database didn't fit in what we peeked at, or we want it all */
+		if (ret == -2 || (x->flags & YBP_EXPORT_STATEMENTS)) {
+			if (ybpi_read_event_rest(p, e) < 0)
+				return -1;
+			ret = ybp_decode_event(p, e, &d);
+		}
+		if (ret < 0)
+			return 0;
+		r->thread_id = d.u.query.thread_id;
+		if (d.u.query.db_name_len > 0)
+			r->db_id = ybpi_export_db(x, d.u.query.db_name, d.u.query.db_name_len);
+		if (x->flags & YBP_EXPORT_STATEMENTS) {
+			r->truncated = d.truncated;
+			return ybpi_export_payload(x, r, d.u.query.statement, d.u.query.statement_len);
+		}
+		return 0;
+	}
+	if (e->type_code == TABLE_MAP_EVENT && ybp_decode_event(p, e, &d) == 0 &&
+			d.body_len >= 1 && (size_t)d.body[0] + 1 <= d.body_len)
+		r->db_id = ybpi_export_db(x, d.body + 1, (unsigned char)d.body[0]);
+	if (x->flags & YBP_EXPORT_BODIES) {
+		r->truncated = (e->data_len < e->length - EVENT_HEADER_SIZE);
+		return ybpi_export_payload(x, r, e->data, e->data_len);
+	}
+	return 0;
+}
+
+ssize_t ybp_export_events(struct ybp_export* restrict x, struct ybp_binlog_parser* restrict p, size_t max_events)
+{
+	size_t read_limit = p->read_limit;
+	size_t peek = read_limit;
+	ssize_t added = 0;
+	if (!(x->flags & YBP_EXPORT_BODIES) && (peek == 0 || peek > EXPORT_PEEK_LEN))
+		peek = EXPORT_PEEK_LEN;
+	while (max_events == 0 || (size_t)added < max_events) {
+		int ret;
+		if (x->num_records == x->records_size) {
+			size_t size = (x->records_size == 0) ? 4096 : x->records_size * 2;
+			struct ybp_event_record* records = realloc(x->records, size * sizeof(struct ybp_event_record));
+			if (records == NULL) {
+				perror("realloc");
+				return -1;
+			}
+			x->records = records;
+			x->records_size = size;
+		}
+		ybp_reset_event(&x->evbuf);
+		p->read_limit = peek;
+		ret = ybp_next_event(p, &x->evbuf);
+		p->read_limit = read_limit;
+		if (ret < 0)
+			break;
+		if (ybpi_export_event(x, p, &x->records[x->num_records]) < 0)
+			return -1;
+		x->num_records++;
+		added++;
+		if (ret == 0)
+			break;
+	}
+	ybp_reset_event(&x->evbuf);
+	return added;
+}
+
+void ybp_dispose_export(struct ybp_export* x)
+{
+	size_t i;
+	if (x == NULL)
+		return;
+	for (i = 0; i < x->num_dbs; ++i)
+		free(x->db_names[i]);
+	free(x->db_names);
+	free(x->db_slots);
+	free(x->records);
+	free(x->payload);
+	ybp_reset_event(&x->evbuf);
+	free(x);
+}
+
+/******** scanning many binlogs ********/
+
+#define SCAN_PROGRESS_BYTES (1 << 20)	/* how often a task owns up to its progress */
+#define SCAN_FAILED 0x80000000u			/* in ranges_left: we've complained about the file */
+
+struct ybpi_scan_worker {
+	struct ybp_scan*	s;
+	unsigned int	index;
+	pthread_t	thread;
+	size_t		file;		/* the binlog p is open on, or SIZE_MAX */
+	int			fd;
+	off64_t		first_offset;	/* where p started */
+	struct ybp_binlog_parser*	p;
+	struct ybp_event	evbuf;
+};
+
+static int ybpi_compare_scan_tasks(const void* a, const void* b)
+{
+	const struct ybp_scan_task* x = a;
+	const struct ybp_scan_task* y = b;
+	off64_t dx = x->end - x->start, dy = y->end - y->start;
+	/* Biggest first, then in file order */
+	if (dx != dy)
+		return (dx < dy) ? 1 : -1;
+	if (x->file != y->file)
+		return (x->file < y->file) ? -1 : 1;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+struct ybp_scan* ybp_get_scan(const char* const* paths, size_t num_paths, unsigned int num_threads, off64_t split_size)
+{
+	struct ybp_scan* s;
+	size_t i;
+	if ((s = calloc(1, sizeof(struct ybp_scan))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	s->num_threads = (num_threads < 1) ? 1 : num_threads;
+	s->split_size = (split_size < YBP_MIN_READ_LIMIT) ? YBP_MIN_READ_LIMIT : split_size;
+	s->enforce_server_id = true;
+	if ((s->paths = calloc(num_paths, sizeof(char*))) == NULL ||
+			(s->sizes = calloc(num_paths, sizeof(off64_t))) == NULL ||
+			(s->ranges_left = calloc(num_paths, sizeof(uint32_t))) == NULL ||
+			(s->deques = calloc(s->num_threads, sizeof(struct ybp_scan_deque))) == NULL) {
+		perror("calloc");
+		ybp_dispose_scan(s);
+		return NULL;
+	}
+	for (i = 0; i < s->num_threads; ++i)
+		pthread_mutex_init(&s->deques[i].lock, NULL);
+	for (i = 0; i < num_paths; ++i) {
+		struct stat st;
+		if ((s->paths[i] = strdup(paths[i])) == NULL) {
+			perror("strdup");
+			ybp_dispose_scan(s);
+			return NULL;
+		}
+		s->num_files++;
+		/* Unreadable ones are complained about when they come up */
+		s->sizes[i] = (stat(paths[i], &st) == 0) ? st.st_size : 0;
+		s->bytes_total += s->sizes[i];
+	}
+	return s;
+}
+
+int ybp_scan_add_reducer(struct ybp_scan* restrict s, const struct ybp_scan_reducer* restrict r)
+{
+	struct ybp_scan_reducer* reducers = realloc(s->reducers, (s->num_reducers + 1) * sizeof(struct ybp_scan_reducer));
+	if (reducers == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	s->reducers = reducers;
+	s->reducers[s->num_reducers] = *r;
+	return s->num_reducers++;
+}
+
+/**
+ * Cut the binlogs up and deal the pieces out, biggest first, so each
+ * thread starts with a fair share
+ **/
+static int ybpi_scan_deal(struct ybp_scan* s)
+{
+	struct ybp_scan_task* tasks;
+	size_t num_tasks = 0, i, t;
+	/* Nothing to deal; every thread finds its deque empty */
+	if (s->num_files == 0)
+		return 0;
+	for (i = 0; i < s->num_files; ++i)
+		num_tasks += (s->sizes[i] <= s->split_size) ? 1 : (s->sizes[i] + s->split_size - 1) / s->split_size;
+	if ((tasks = malloc(num_tasks * sizeof(struct ybp_scan_task))) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (i = 0, t = 0; i < s->num_files; ++i) {
+		off64_t n = (s->sizes[i] <= s->split_size) ? 1 : (s->sizes[i] + s->split_size - 1) / s->split_size;
+		off64_t k;
+		for (k = 0; k < n; ++k, ++t) {
+			tasks[t].file = i;
+			tasks[t].start = s->sizes[i] * k / n;
+			tasks[t].end = s->sizes[i] * (k + 1) / n;
+		}
+		s->ranges_left[i] = n;
+	}
+	qsort(tasks, num_tasks, sizeof(struct ybp_scan_task), ybpi_compare_scan_tasks);
+	for (i = 0; i < s->num_threads; ++i) {
+		struct ybp_scan_deque* d = &s->deques[i];
+		if ((d->tasks = malloc((num_tasks / s->num_threads + 1) * sizeof(struct ybp_scan_task))) == NULL) {
+			perror("malloc");
+			free(tasks);
+			return -1;
+		}
+		d->head = d->tail = 0;
+	}
+	for (t = 0; t < num_tasks; ++t) {
+		struct ybp_scan_deque* d = &s->deques[t % s->num_threads];
+		d->tasks[d->tail++] = tasks[t];
+	}
+	free(tasks);
+	return 0;
+}
+
+/**
+ * The next task for thread index: from the front of its own deque, or
+ * else from the back of someone else's
+ **/
+static bool ybpi_scan_take(struct ybp_scan* restrict s, unsigned int index, struct ybp_scan_task* restrict task)
+{
+	unsigned int i;
+	for (i = 0; i < s->num_threads; ++i) {
+		struct ybp_scan_deque* d = &s->deques[(index + i) % s->num_threads];
+		bool found = false;
+		pthread_mutex_lock(&d->lock);
+		if (d->head < d->tail) {
+			*task = (i == 0) ? d->tasks[d->head++] : d->tasks[--d->tail];
+			found = true;
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (found)
+			return true;
+	}
+	return false;
+}
+
+static void ybpi_scan_close(struct ybpi_scan_worker* w)
+{
+	if (w->p != NULL) {
+		ybp_dispose_binlog_parser(w->p);
+		close(w->fd);
+		w->p = NULL;
+	}
+	w->file = SIZE_MAX;
+}
+
+/**
+ * Get w's parser onto the task's binlog, keeping it if it's already there
+ **/
+static int ybpi_scan_open(struct ybpi_scan_worker* restrict w, size_t file)
+{
+	struct ybp_scan* s = w->s;
+	if (w->file == file)
+		return 0;
+	ybpi_scan_close(w);
+	if ((w->fd = open(s->paths[file], O_RDONLY)) < 0)
+		return -1;
+	if ((w->p = ybp_get_binlog_parser(w->fd)) == NULL) {
+		close(w->fd);
+		return -1;
+	}
+	w->p->enforce_server_id = s->enforce_server_id;
+	if (s->read_limit > 0)
+		ybp_set_read_limit(w->p, s->read_limit);
+	posix_fadvise(w->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	w->first_offset = ybp_tell_bp(w->p);
+	w->file = file;
+	return 0;
+}
+
+static void ybpi_scan_task(struct ybpi_scan_worker* restrict w, const struct ybp_scan_task* restrict t)
+{
+	struct ybp_scan* s = w->s;
+	struct ybp_binlog_parser* p;
+	struct ybp_event* e = &w->evbuf;
+	off64_t start, stop = INT64_MAX;
+	uint64_t credited = 0, events = 0;
+	uint32_t left;
+	size_t r;
+	int ret;
+	bool failed = false;
+	if (ybpi_scan_open(w, t->file) < 0) {
+		failed = true;
+		goto done;
+	}
+	p = w->p;
+	start = (t->start == 0) ? w->first_offset : ybp_nearest_offset(p, t->start);
+	/* The next piece starts at the same place */
+	if (t->end < s->sizes[t->file] && start >= 0 && (stop = ybp_nearest_offset(p, t->end)) == -2)
+		stop = INT64_MAX;
+	if (start == -1 || stop == -1) {
+		failed = true;
+		goto done;
+	}
+	if (start < 0 || start >= stop)
+		goto done;
+	ybp_rewind_bp(p, start);
+	while ((ret = ybp_next_event(p, e)) >= 0) {
+		void** states = s->states + w->index * s->num_reducers;
+		if (e->offset >= stop)
+			break;
+		for (r = 0; r < s->num_reducers; ++r) {
+			if (s->reducers[r].observe(states[r], p, e, t->file, s->reducers[r].arg) < 0)
+				failed = true;
+		}
+		events++;
+		if ((uint64_t)(e->offset - t->start) > credited + SCAN_PROGRESS_BYTES && e->offset > t->start) {
+			__atomic_add_fetch(&s->bytes_done, e->offset - t->start - credited, __ATOMIC_RELAXED);
+			credited = e->offset - t->start;
+		}
+		ybp_reset_event(e);
+		if (ret == 0 || failed)
+			break;
+	}
+	ybp_reset_event(e);
+done:
+	__atomic_add_fetch(&s->events, events, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->bytes_done, (t->end - t->start) - credited, __ATOMIC_RELAXED);
+	if (failed) {
+		if (!(__atomic_fetch_or(&s->ranges_left[t->file], SCAN_FAILED, __ATOMIC_ACQ_REL) & SCAN_FAILED)) {
+			fprintf(stderr, "Error scanning %s: %s\n", s->paths[t->file], strerror(errno));
+			__atomic_add_fetch(&s->files_failed, 1, __ATOMIC_RELAXED);
+		}
+		ybpi_scan_close(w);
+	}
+	left = __atomic_sub_fetch(&s->ranges_left[t->file], 1, __ATOMIC_ACQ_REL);
+	if ((left & ~SCAN_FAILED) == 0)
+		__atomic_add_fetch(&s->files_done, 1, __ATOMIC_RELAXED);
+}
+
+static void* ybpi_scan_worker(void* arg)
+{
+	struct ybpi_scan_worker* w = arg;
+	struct ybp_scan_task task;
+	while (ybpi_scan_take(w->s, w->index, &task))
+		ybpi_scan_task(w, &task);
+	ybpi_scan_close(w);
+	return NULL;
+}
+
+static double ybpi_seconds_since(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void ybpi_scan_report(struct ybp_scan* restrict s, const struct timespec* restrict start, ybp_scan_progress_fn progress, void* arg)
+{
+	struct ybp_scan_progress pr;
+	pr.bytes_done = __atomic_load_n(&s->bytes_done, __ATOMIC_RELAXED);
+	pr.bytes_total = s->bytes_total;
+	pr.files_done = __atomic_load_n(&s->files_done, __ATOMIC_RELAXED);
+	pr.num_files = s->num_files;
+	pr.events = __atomic_load_n(&s->events, __ATOMIC_RELAXED);
+	pr.elapsed = ybpi_seconds_since(start);
+	progress(&pr, arg);
+}
+
+int ybp_scan_run(struct ybp_scan* restrict s, ybp_scan_progress_fn progress, void* arg, unsigned int interval_ms)
+{
+	struct ybpi_scan_worker* workers;
+	struct timespec start;
+	unsigned int i, num_started = 0;
+	size_t r;
+	int ret = -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ybpi_scan_deal(s) < 0)
+		return -1;
+	if ((workers = calloc(s->num_threads, sizeof(struct ybpi_scan_worker))) == NULL ||
+			(s->states = calloc(s->num_threads * s->num_reducers + 1, sizeof(void*))) == NULL) {
+		perror("calloc");
+		free(workers);
+		return -1;
+	}
+	for (i = 0; i < s->num_threads * s->num_reducers; ++i) {
+		const struct ybp_scan_reducer* red = &s->reducers[i % s->num_reducers];
+		if ((s->states[i] = calloc(1, red->state_size)) == NULL) {
+			perror("calloc");
+			goto out;
+		}
+		if (red->init != NULL)
+			red->init(s->states[i], red->arg);
+	}
+	for (i = 0; i < s->num_threads; ++i) {
+		int err;
+		workers[i].s = s;
+		workers[i].index = i;
+		workers[i].file = SIZE_MAX;
+		ybp_init_event(&workers[i].evbuf);
+		/* The rest steal whatever a thread that didn't start was dealt */
+		if ((err = pthread_create(&workers[i].thread, NULL, ybpi_scan_worker, &workers[i])) != 0) {
+			fprintf(stderr, "Error starting a scanner: %s\n", strerror(err));
+			break;
+		}
+		num_started++;
+	}
+	if (num_started == 0)
+		goto out;
+	while (__atomic_load_n(&s->files_done, __ATOMIC_RELAXED) < s->num_files) {
+		struct timespec wait;
+		unsigned int ms = (interval_ms > 0 && interval_ms < 100) ? interval_ms : 100;
+		wait.tv_sec = 0;
+		wait.tv_nsec = ms * 1000000L;
+		nanosleep(&wait, NULL);
+		if (progress != NULL && interval_ms > 0 &&
+				ybpi_seconds_since(&start) * 1000 >= (double)interval_ms * (s->num_reported + 1)) {
+			s->num_reported++;
+			ybpi_scan_report(s, &start, progress, arg);
+		}
+	}
+	ret = 0;
+out:
+	for (i = 0; i < num_started; ++i)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+	if (ret == 0) {
+		for (i = 1; i < s->num_threads; ++i) {
+			for (r = 0; r < s->num_reducers; ++r) {
+				if (s->reducers[r].merge != NULL)
+					s->reducers[r].merge(s->states[r], s->states[i * s->num_reducers + r], s->reducers[r].arg);
+			}
+		}
+		if (progress != NULL)
+			ybpi_scan_report(s, &start, progress, arg);
+	}
+	return ret;
+}
+
+void* ybp_scan_result(struct ybp_scan* s, int r)
+{
+	if (s->states == NULL || r < 0 || (size_t)r >= s->num_reducers)
+		return NULL;
+	return s->states[r];
+}
+
+void ybp_dispose_scan(struct ybp_scan* s)
+{
+	size_t i;
+	if (s == NULL)
+		return;
+	for (i = 0; s->states != NULL && i < s->num_threads * s->num_reducers; ++i) {
+		const struct ybp_scan_reducer* r = &s->reducers[i % s->num_reducers];
+		if (s->states[i] != NULL && r->dispose != NULL)
+			r->dispose(s->states[i], r->arg);
+		free(s->states[i]);
+	}
+	for (i = 0; s->deques != NULL && i < s->num_threads; ++i) {
+		pthread_mutex_destroy(&s->deques[i].lock);
+		free(s->deques[i].tasks);
+	}
+	for (i = 0; i < s->num_files; ++i)
+		free(s->paths[i]);
+	free(s->deques);
+	free(s->states);
+	free(s->reducers);
+	free(s->ranges_left);
+	free(s->sizes);
+	free(s->paths);
+	free(s);
+}
+
+/******** arrival timeline ********/
+
+static unsigned int ybpi_histogram_bucket(uint64_t value)
+{
+	unsigned int e, b;
+	if (value < 4)
+		return value;
+	e = 63 - __builtin_clzll(value);
+	b = 4 * (e - 1) + ((value >> (e - 2)) & 3);
+	return (b < YBP_HISTOGRAM_BUCKETS) ? b : YBP_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t ybp_histogram_bucket_floor(unsigned int b)
+{
+	if (b < 4)
+		return b;
+	return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+void ybp_histogram_add(struct ybp_histogram* h, uint64_t value)
+{
+	h->counts[ybpi_histogram_bucket(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+uint64_t ybp_histogram_quantile(const struct ybp_histogram* h, double q)
+{
+	uint64_t rank, seen = 0;
+	unsigned int b;
+	if (h->count == 0)
+		return 0;
+	rank = (q <= 0) ? 1 : (q >= 1) ? h->count : (uint64_t)(q * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (b = 0; b < YBP_HISTOGRAM_BUCKETS; ++b) {
+		seen += h->counts[b];
+		if (seen >= rank)
+			return ybp_histogram_bucket_floor(b);
+	}
+	return h->max;
+}
+
+int64_t ybp_timeline_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ybp_init_timeline(struct ybp_timeline* t)
+{
+	memset(t, 0, sizeof(struct ybp_timeline));
+}
+
+void ybp_timeline_observe(struct ybp_timeline* restrict t, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, int64_t arrival)
+{
+	struct ybp_timeline_second* s = &t->seconds[(arrival / 1000000) % YBP_TIMELINE_SECONDS];
+	int64_t written = (int64_t)e->timestamp * 1000000;
+	bool commit = false;
+	if (e->type_code == QUERY_EVENT) {
+		struct ybp_decoded_event d;
+		if (ybp_decode_event(p, e, &d) >= 0)
+			written += (int64_t)d.u.query.query_time * 1000000;
+	}
+	/* Only a boundary after a COMMIT or a standalone statement is a commit */
+	if (ybpi_transaction_step(p, e, &t->in_transaction))
+		commit = (e->type_code == XID_EVENT || e->type_code == QUERY_EVENT);
+	t->last_delay = arrival - written;
+	/* The binlog's clock is a second coarse, and may not agree with ours */
+	ybp_histogram_add(&t->delay, (t->last_delay > 0) ? t->last_delay : 0);
+	if (s->second != arrival / 1000000) {
+		memset(s, 0, sizeof(struct ybp_timeline_second));
+		s->second = arrival / 1000000;
+	}
+	s->events++;
+	s->bytes += e->length;
+	t->events++;
+	t->bytes += e->length;
+	if (commit) {
+		if (t->last_commit != 0)
+			ybp_histogram_add(&t->commit_gap, (arrival > t->last_commit) ? arrival - t->last_commit : 0);
+		t->last_commit = arrival;
+		t->commits++;
+		s->commits++;
+	}
+	if (t->first_arrival == 0)
+		t->first_arrival = arrival;
+	t->last_arrival = arrival;
+	t->last_timestamp = e->timestamp;
+}
+
+void ybp_timeline_stats(const struct ybp_timeline* restrict t, int64_t now, struct ybp_timeline_stats* restrict out)
+{
+	int64_t now_second = now / 1000000;
+	int64_t span = YBP_TIMELINE_SECONDS - 1;
+	unsigned int i;
+	memset(out, 0, sizeof(struct ybp_timeline_stats));
+	out->events = t->events;
+	out->bytes = t->bytes;
+	out->commits = t->commits;
+	out->last_delay = t->last_delay;
+	out->delay_p50 = ybp_histogram_quantile(&t->delay, 0.5);
+	out->delay_p99 = ybp_histogram_quantile(&t->delay, 0.99);
+	out->delay_max = t->delay.max;
+	out->commit_gap_p50 = ybp_histogram_quantile(&t->commit_gap, 0.5);
+	out->commit_gap_p99 = ybp_histogram_quantile(&t->commit_gap, 0.99);
+	out->commit_gap_max = t->commit_gap.max;
+	if (t->first_arrival == 0)
+		return;
+	/* Don't spread the first few seconds' events over a whole window */
+	if (now_second - t->first_arrival / 1000000 < span)
+		span = now_second - t->first_arrival / 1000000;
+	for (i = 0; i < YBP_TIMELINE_SECONDS; ++i) {
+		const struct ybp_timeline_second* s = &t->seconds[i];
+		if (s->second >= now_second || s->second < now_second - span)
+			continue;
+		out->events_per_second += s->events;
+		out->bytes_per_second += s->bytes;
+		out->commits_per_second += s->commits;
+		if (s->commits > out->peak_commits_per_second)
+			out->peak_commits_per_second = s->commits;
+	}
+	if (span > 0) {
+		out->events_per_second /= span;
+		out->bytes_per_second /= span;
+		out->commits_per_second /= span;
+	}
+}
+
+static void ybpi_write_histogram(FILE* f, const char* name, const struct ybp_histogram* h)
+{
+	uint64_t seen = 0;
+	unsigned int b;
+	fprintf(f, "# TYPE %s histogram\n", name);
+	for (b = 0; b + 1 < YBP_HISTOGRAM_BUCKETS && seen < h->count; ++b) {
+		/* Buckets nothing fell in add nothing to the cumulative counts */
+		if (h->counts[b] == 0)
+			continue;
+		seen += h->counts[b];
+		fprintf(f, "%s_bucket{le=\"%.6f\"} %llu\n", name, (ybp_histogram_bucket_floor(b + 1) - 1) / 1e6,
+				(unsigned long long)seen);
+	}
+	fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+	fprintf(f, "%s_sum %.6f\n", name, h->sum / 1e6);
+	fprintf(f, "%s_count %llu\n", name, (unsigned long long)h->count);
+}
+
+int ybp_timeline_write(const struct ybp_timeline* restrict t, const char* restrict path)
+{
+	struct ybp_timeline_stats st;
+	char* tmp_path;
+	FILE* f;
+	int ret = 0;
+	ybp_timeline_stats(t, ybp_timeline_now(), &st);
+	if ((tmp_path = malloc(strlen(path) + 5)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+	if ((f = fopen(tmp_path, "w")) == NULL) {
+		perror("Error opening metrics file");
+		free(tmp_path);
+		return -1;
+	}
+	fprintf(f, "# TYPE ybinlogp_events_total counter\nybinlogp_events_total %llu\n", (unsigned long long)st.events);
+	fprintf(f, "# TYPE ybinlogp_bytes_total counter\nybinlogp_bytes_total %llu\n", (unsigned long long)st.bytes);
+	fprintf(f, "# TYPE ybinlogp_commits_total counter\nybinlogp_commits_total %llu\n", (unsigned long long)st.commits);
+	fprintf(f, "# TYPE ybinlogp_last_arrival_seconds gauge\nybinlogp_last_arrival_seconds %.6f\n", t->last_arrival / 1e6);
+	fprintf(f, "# TYPE ybinlogp_last_event_timestamp_seconds gauge\nybinlogp_last_event_timestamp_seconds %u\n", t->last_timestamp);
+	fprintf(f, "# TYPE ybinlogp_arrival_delay_last_seconds gauge\nybinlogp_arrival_delay_last_seconds %.6f\n", st.last_delay / 1e6);
+	fprintf(f, "# TYPE ybinlogp_events_per_second gauge\nybinlogp_events_per_second %.3f\n", st.events_per_second);
+	fprintf(f, "# TYPE ybinlogp_bytes_per_second gauge\nybinlogp_bytes_per_second %.3f\n", st.bytes_per_second);
+	fprintf(f, "# TYPE ybinlogp_commits_per_second gauge\nybinlogp_commits_per_second %.3f\n", st.commits_per_second);
+	fprintf(f, "# TYPE ybinlogp_commits_per_second_peak gauge\nybinlogp_commits_per_second_peak %llu\n",
+			(unsigned long long)st.peak_commits_per_second);
+	ybpi_write_histogram(f, "ybinlogp_arrival_delay_seconds", &t->delay);
+	ybpi_write_histogram(f, "ybinlogp_commit_gap_seconds", &t->commit_gap);
+	/* Losing one to a crash is harmless, so no fsync */
+	if (fclose(f) != 0) {
+		perror("Error writing metrics file");
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmp_path, path) < 0) {
+		perror("Error renaming metrics file");
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(tmp_path);
+	free(tmp_path);
+	return ret;
+}
+
+/******** change-data-capture sink ********/
+
+#define CDC_MANIFEST_HEADER "ybinlogp-cdc 1\n"
+#define CDC_NAME_MAX 512
+
+static char* ybpi_cdc_path(const struct ybp_cdc_sink* restrict s, const char* restrict name, const char* restrict suffix)
+{
+	char* path;
+	if ((path = malloc(strlen(s->dir) + strlen(name) + strlen(suffix) + 2)) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	sprintf(path, "%s/%s%s", s->dir, name, suffix);
+	return path;
+}
+
+/**
+ * A partition's name as it can go in a file name and the manifest
+ **/
+static size_t ybpi_cdc_clean_name(char* restrict out, const char* restrict name, size_t len)
+{
+	size_t i;
+	if (len == 0)
+		len = 1, name = "_";
+	if (len >= CDC_NAME_MAX)
+		len = CDC_NAME_MAX - 1;
+	for (i = 0; i < len; ++i)
+		out[i] = (name[i] == '/' || name[i] == '\n' || name[i] == '\0' || (i == 0 && name[i] == '.')) ? '_' : name[i];
+	out[len] = '\0';
+	return len;
+}
+
+static ssize_t ybpi_cdc_find(const struct ybp_cdc_sink* restrict s, const char* restrict name, size_t len, uint64_t hash)
+{
+	size_t slot;
+	if (s->num_slots == 0)
+		return -1;
+	for (slot = hash & (s->num_slots - 1); s->slots[slot] != 0; slot = (slot + 1) & (s->num_slots - 1)) {
+		const struct ybp_cdc_partition* part = &s->partitions[s->slots[slot] - 1];
+		if (part->hash == hash && strlen(part->name) == len && memcmp(part->name, name, len) == 0)
+			return s->slots[slot] - 1;
+	}
+	return -1;
+}
+
+/**
+ * Add a partition for the file open on fd, of size bytes
+ **/
+static ssize_t ybpi_cdc_add(struct ybp_cdc_sink* restrict s, const char* restrict name, size_t len, uint64_t hash, int fd, off64_t size)
+{
+	struct ybp_cdc_partition* part;
+	size_t slot, i;
+	if (s->num_partitions == s->partitions_size) {
+		size_t new_size = s->partitions_size ? s->partitions_size * 2 : 16;
+		struct ybp_cdc_partition* grown = realloc(s->partitions, new_size * sizeof(struct ybp_cdc_partition));
+		if (grown == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		s->partitions = grown;
+		s->partitions_size = new_size;
+	}
+	if (2 * (s->num_partitions + 1) > s->num_slots) {
+		size_t num_slots = s->num_slots ? s->num_slots * 2 : 64;
+		size_t* slots = calloc(num_slots, sizeof(size_t));
+		if (slots == NULL) {
+			perror("calloc");
+			return -1;
+		}
+		for (i = 0; i < s->num_partitions; ++i) {
+			for (slot = s->partitions[i].hash & (num_slots - 1); slots[slot] != 0; slot = (slot + 1) & (num_slots - 1))
+				;
+			slots[slot] = i + 1;
+		}
+		free(s->slots);
+		s->slots = slots;
+		s->num_slots = num_slots;
+	}
+	part = &s->partitions[s->num_partitions];
+	memset(part, 0, sizeof(struct ybp_cdc_partition));
+	if ((part->name = strndup(name, len)) == NULL || (part->buf = malloc(YBP_CDC_BUFFER_SIZE)) == NULL) {
+		perror("malloc");
+		free(part->name);
+		return -1;
+	}
+	part->hash = hash;
+	part->fd = fd;
+	part->size = part->committed_size = size;
+	for (slot = hash & (s->num_slots - 1); s->slots[slot] != 0; slot = (slot + 1) & (s->num_slots - 1))
+		;
+	s->slots[slot] = s->num_partitions + 1;
+	return s->num_partitions++;
+}
+
+/**
+ * Write all of buf at offset at, however many pwrites it takes
+ **/
+static int ybpi_cdc_pwrite(int fd, const void* buf, size_t len, off64_t at)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t amt = pwrite(fd, (const unsigned char*)buf + done, len - done, at + done);
+		if (amt < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error writing partition");
+			return -1;
+		}
+		done += amt;
+	}
+	return 0;
+}
+
+static int ybpi_cdc_flush_partition(struct ybp_cdc_partition* part)
+{
+	if (ybpi_cdc_pwrite(part->fd, part->buf, part->buf_len, part->size - part->buf_len) < 0)
+		return -1;
+	part->buf_len = 0;
+	part->dirty = true;
+	return 0;
+}
+
+static int ybpi_cdc_write(struct ybp_cdc_partition* restrict part, const void* restrict buf, size_t len)
+{
+	if (part->buf_len + len > YBP_CDC_BUFFER_SIZE && ybpi_cdc_flush_partition(part) < 0)
+		return -1;
+	if (len > YBP_CDC_BUFFER_SIZE) {
+		/* Too big to be worth buffering */
+		if (ybpi_cdc_pwrite(part->fd, buf, len, part->size) < 0)
+			return -1;
+		part->dirty = true;
+	}
+	else {
+		memcpy(part->buf + part->buf_len, buf, len);
+		part->buf_len += len;
+	}
+	part->size += len;
+	return 0;
+}
+
+/**
+ * Append an event, given as its header and body, to part, moving its
+ * next_position (and checksum) to where it lands
+ **/
+static int ybpi_cdc_append(struct ybp_cdc_sink* restrict s, struct ybp_cdc_partition* restrict part,
+		const unsigned char* restrict header, const unsigned char* restrict body)
+{
+	struct ybp_event e;
+	uint32_t old_position, new_position;
+	size_t body_len;
+	memcpy(&e, header, EVENT_HEADER_SIZE);
+	body_len = e.length - EVENT_HEADER_SIZE;
+	old_position = e.next_position;
+	new_position = part->size + e.length;
+	e.next_position = new_position;
+	if (s->checksum_alg == YBP_CHECKSUM_CRC32) {
+		uint32_t crc;
+		memcpy(&crc, body + body_len - YBP_CHECKSUM_LEN, YBP_CHECKSUM_LEN);
+		crc = ybpi_crc32_patch(crc, (unsigned char*)&old_position, (unsigned char*)&new_position,
+				sizeof(uint32_t), e.length - YBP_CHECKSUM_LEN - offsetof(struct ybp_event, flags));
+		return (ybpi_cdc_write(part, &e, EVENT_HEADER_SIZE) < 0 ||
+				ybpi_cdc_write(part, body, body_len - YBP_CHECKSUM_LEN) < 0 ||
+				ybpi_cdc_write(part, &crc, YBP_CHECKSUM_LEN) < 0) ? -1 : 0;
+	}
+	return (ybpi_cdc_write(part, &e, EVENT_HEADER_SIZE) < 0 || ybpi_cdc_write(part, body, body_len) < 0) ? -1 : 0;
+}
+
+/**
+ * Keep a copy of a whole event to write out later
+ **/
+static int ybpi_cdc_hold(unsigned char** buf, size_t* len, size_t* size, const struct ybp_event* e)
+{
+	if (ybpi_grow_buffer(buf, size, *len + e->length) < 0)
+		return -1;
+	memcpy(*buf + *len, e, EVENT_HEADER_SIZE);
+	memcpy(*buf + *len + EVENT_HEADER_SIZE, e->data, e->length - EVENT_HEADER_SIZE);
+	*len += e->length;
+	return 0;
+}
+
+static int ybpi_cdc_append_held(struct ybp_cdc_sink* restrict s, struct ybp_cdc_partition* restrict part,
+		const unsigned char* buf, size_t len)
+{
+	size_t at = 0;
+	while (at < len) {
+		const struct ybp_event* e = (const struct ybp_event*)(buf + at);
+		if (ybpi_cdc_append(s, part, buf + at, buf + at + EVENT_HEADER_SIZE) < 0)
+			return -1;
+		at += e->length;
+	}
+	return 0;
+}
+
+/**
+ * The partition called name, creating it (with p's FDE) if need be
+ **/
+static ssize_t ybpi_cdc_partition(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, const char* restrict name, size_t len)
+{
+	char clean[CDC_NAME_MAX];
+	unsigned char* fde;
+	size_t fde_len;
+	char* path;
+	uint64_t hash;
+	ssize_t i;
+	int fd;
+	len = ybpi_cdc_clean_name(clean, name, len);
+	hash = ybpi_hash64(clean, len, 0);
+	if ((i = ybpi_cdc_find(s, clean, len, hash)) >= 0)
+		return i;
+	if ((path = ybpi_cdc_path(s, clean, YBP_CDC_SUFFIX)) == NULL)
+		return -1;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	free(path);
+	if ((i = ybpi_cdc_add(s, clean, len, hash, fd, 0)) < 0) {
+		close(fd);
+		return -1;
+	}
+	/* A partition starts out as an empty binlog, which its consumer can
+	 * open before anything is committed to it */
+	if ((fde = ybpi_copy_fde(p, &s->evbuf, &fde_len)) == NULL) {
+		ybp_reset_event(&s->evbuf);
+		return -1;
+	}
+	ybp_reset_event(&s->evbuf);
+	if (ybpi_cdc_write(&s->partitions[i], ybpi_binlog_magic, sizeof(ybpi_binlog_magic)) < 0 ||
+			ybpi_cdc_write(&s->partitions[i], fde, fde_len) < 0) {
+		free(fde);
+		return -1;
+	}
+	free(fde);
+	s->partitions[i].committed_size = s->partitions[i].size;
+	return i;
+}
+
+/**
+ * Start partition i on the current transaction if it isn't already:
+ * write its GTID event, if it had one, and its BEGIN (a made-up one if
+ * there was none and a MySQL GTID or nothing began it)
+ **/
+static int ybpi_cdc_touch(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, size_t i, uint32_t timestamp)
+{
+	struct ybp_cdc_partition* part = &s->partitions[i];
+	if (part->txn == s->txn && s->num_touched > 0)
+		return 0;
+	part->txn = s->txn;
+	if (ybpi_grow_buffer((unsigned char**)&s->touched, &s->touched_size, (s->num_touched + 1) * sizeof(size_t)) < 0)
+		return -1;
+	s->touched[s->num_touched++] = i;
+	if (s->gtid_len > 0 && ybpi_cdc_append_held(s, part, s->gtid, s->gtid_len) < 0)
+		return -1;
+	if (!s->in_transaction)
+		return 0;
+	/* MariaDB's GTID event is the BEGIN */
+	if (s->begin_len == 0 && s->gtid_len > 0 && ((struct ybp_event*)s->gtid)->type_code == MARIADB_GTID_EVENT)
+		return 0;
+	if (s->begin_len == 0) {
+		unsigned char query[UINT8_MAX + 1 + sizeof("BEGIN")];
+		unsigned char event[EVENT_HEADER_SIZE + sizeof(query) + YBP_CHECKSUM_LEN];
+		size_t post_header_len = p->post_header_len[QUERY_EVENT];
+		size_t length;
+		memset(query, 0, post_header_len + 1);
+		memcpy(query + post_header_len + 1, "BEGIN", 5);
+		length = ybpi_make_event(p, event, QUERY_EVENT, timestamp, 0, query, post_header_len + 1 + 5);
+		return ybpi_cdc_append_held(s, part, event, length);
+	}
+	return ybpi_cdc_append_held(s, part, s->begin, s->begin_len);
+}
+
+/**
+ * Write e to the partition called name, after whatever came before it
+ **/
+static int ybpi_cdc_route(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e,
+		const char* restrict name, size_t len, ssize_t* partition)
+{
+	struct ybp_cdc_partition* part;
+	ssize_t i;
+	if ((i = ybpi_cdc_partition(s, p, name, len)) < 0 || ybpi_cdc_touch(s, p, i, e->timestamp) < 0)
+		return -1;
+	part = &s->partitions[i];
+	if (ybpi_cdc_append_held(s, part, s->context, s->context_len) < 0 ||
+			ybpi_cdc_append(s, part, (const unsigned char*)e, (const unsigned char*)e->data) < 0)
+		return -1;
+	s->context_len = 0;
+	s->events_routed++;
+	if (partition != NULL)
+		*partition = i;
+	return 0;
+}
+
+static void ybpi_cdc_first_table(char kind, const char* key, size_t len, void* arg)
+{
+	char* name = arg;
+	if (kind == BLOOM_KEY_TABLE && name[0] == '\0')
+		ybpi_cdc_clean_name(name, key, len);
+}
+
+static int ybpi_cdc_query(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	char name[CDC_NAME_MAX] = "";
+	if (ybp_decode_event(p, e, &d) < 0)
+		return -2;
+	ybpi_statement_tables(d.u.query.statement, d.u.query.statement_len, d.u.query.db_name, d.u.query.db_name_len,
+			ybpi_cdc_first_table, name);
+	if (name[0] != '\0')
+		return ybpi_cdc_route(s, p, e, name, strlen(name), NULL);
+	return ybpi_cdc_route(s, p, e, d.u.query.db_name, d.u.query.db_name_len, NULL);
+}
+
+static int ybpi_cdc_table_map(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	char name[CDC_NAME_MAX];
+	const unsigned char* b;
+	size_t db_len, table_len;
+	uint64_t id = 0;
+	ssize_t i;
+	if (ybp_decode_event(p, e, &d) < 0 || d.post_header_len < 6 || d.body_len < 1)
+		return -2;
+	b = (const unsigned char*)d.body;
+	db_len = b[0];
+	if (db_len + 3 > d.body_len || (table_len = b[db_len + 2]) + db_len + 3 > d.body_len ||
+			db_len + table_len + 2 > sizeof(name))
+		return -2;
+	memcpy(&id, d.post_header, (d.post_header_len >= 8) ? 6 : 4);
+	memcpy(name, b + 1, db_len);
+	name[db_len] = '.';
+	memcpy(name + db_len + 1, b + db_len + 3, table_len);
+	if (ybpi_cdc_route(s, p, e, name, db_len + 1 + table_len, &i) < 0)
+		return -1;
+	if (ybpi_grow_buffer((unsigned char**)&s->table_ids, &s->table_ids_size, (s->num_table_ids + 2) * sizeof(uint64_t)) < 0)
+		return -1;
+	s->table_ids[s->num_table_ids++] = id;
+	s->table_ids[s->num_table_ids++] = i;
+	return 0;
+}
+
+static int ybpi_cdc_rows(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e)
+{
+	struct ybp_decoded_event d;
+	uint64_t id = 0;
+	size_t i;
+	if (ybp_decode_event(p, e, &d) < 0 || d.post_header_len < 6)
+		return -2;
+	memcpy(&id, d.post_header, (d.post_header_len >= 8) ? 6 : 4);
+	/* The latest map of an id is the one that counts */
+	for (i = s->num_table_ids; i > 0; i -= 2) {
+		if (s->table_ids[i - 2] == id) {
+			struct ybp_cdc_partition* part = &s->partitions[s->table_ids[i - 1]];
+			s->events_routed++;
+			return ybpi_cdc_append(s, part, (const unsigned char*)e, (const unsigned char*)e->data);
+		}
+	}
+	fprintf(stderr, "Row event at %lld has no table map; skipping it\n", (long long)e->offset);
+	return 0;
+}
+
+/**
+ * Write the event ending the transaction to every partition it touched
+ **/
+static int ybpi_cdc_end(struct ybp_cdc_sink* restrict s, struct ybp_event* restrict e)
+{
+	size_t i;
+	for (i = 0; i < s->num_touched; ++i) {
+		if (ybpi_cdc_append(s, &s->partitions[s->touched[i]], (const unsigned char*)e, (const unsigned char*)e->data) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static bool ybpi_is_rows_event(uint8_t type_code)
+{
+	switch (type_code) {
+		case PRE_GA_WRITE_ROWS_EVENT:
+		case PRE_GA_UPDATE_ROWS_EVENT:
+		case PRE_GA_DELETE_ROWS_EVENT:
+		case WRITE_ROWS_EVENT:
+		case UPDATE_ROWS_EVENT:
+		case DELETE_ROWS_EVENT:
+		case WRITE_ROWS_EVENT_V2:
+		case UPDATE_ROWS_EVENT_V2:
+		case DELETE_ROWS_EVENT_V2:
+		case PARTIAL_UPDATE_ROWS_EVENT:
+		case WRITE_ROWS_COMPRESSED_EVENT_V1:
+		case UPDATE_ROWS_COMPRESSED_EVENT_V1:
+		case DELETE_ROWS_COMPRESSED_EVENT_V1:
+		case WRITE_ROWS_COMPRESSED_EVENT:
+		case UPDATE_ROWS_COMPRESSED_EVENT:
+		case DELETE_ROWS_COMPRESSED_EVENT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+int ybp_cdc_sink_observe(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, const char* restrict file_name, struct ybp_event* restrict e)
+{
+	bool was_in_transaction = s->in_transaction;
+	bool boundary;
+	size_t i;
+	int ret = 0;
+	if (e->data == NULL || e->data_len < e->length - EVENT_HEADER_SIZE) {
+		fprintf(stderr, "Event at %lld was cut short; the CDC sink needs whole events\n", (long long)e->offset);
+		return -2;
+	}
+	if (s->checksum_alg < 0)
+		s->checksum_alg = p->checksum_alg;
+	else if (p->checksum_alg != s->checksum_alg) {
+		fprintf(stderr, "%s is %schecksummed, unlike the binlogs before it\n", file_name,
+				(p->checksum_alg == YBP_CHECKSUM_CRC32) ? "" : "not ");
+		return -2;
+	}
+	if (e->type_code == ROTATE_EVENT) {
+		struct ybp_decoded_event d;
+		const char* slash = strrchr(file_name, '/');
+		int dir_len = (slash == NULL) ? 0 : (slash - file_name + 1);
+		if (ybp_decode_event(p, e, &d) < 0)
+			return -2;
+		snprintf(s->file_name, sizeof(s->file_name), "%.*s%.*s", dir_len, file_name,
+				(int)d.u.rotate.file_name_len, d.u.rotate.file_name);
+		s->offset = d.u.rotate.next_position;
+		/* The old binlog may go away */
+		return (ybp_cdc_sink_commit(s) < 0) ? -1 : 1;
+	}
+	boundary = ybpi_transaction_step(p, e, &s->in_transaction);
+	switch (e->type_code) {
+		case GTID_LOG_EVENT:
+		case ANONYMOUS_GTID_LOG_EVENT:
+		case MARIADB_GTID_EVENT:
+			/* Goes ahead of the transaction in every partition it touches */
+			s->gtid_len = 0;
+			if (ybpi_cdc_hold(&s->gtid, &s->gtid_len, &s->gtid_size, e) < 0)
+				return -1;
+			break;
+		default:
+			break;
+	}
+	if (!was_in_transaction && s->in_transaction) {
+		s->txn++;
+		s->begin_len = 0;
+		if (e->type_code == QUERY_EVENT)
+			return (ybpi_cdc_hold(&s->begin, &s->begin_len, &s->begin_size, e) < 0) ? -1 : 0;
+		return 0;
+	}
+	switch (e->type_code) {
+		case QUERY_EVENT:
+			if (was_in_transaction && !s->in_transaction)
+				ret = ybpi_cdc_end(s, e);
+			else
+				ret = ybpi_cdc_query(s, p, e);
+			break;
+		case XID_EVENT:
+			ret = ybpi_cdc_end(s, e);
+			break;
+		case TABLE_MAP_EVENT:
+			ret = ybpi_cdc_table_map(s, p, e);
+			break;
+		case INTVAR_EVENT:
+		case RAND_EVENT:
+		case USER_VAR_EVENT:
+		case ROWS_QUERY_LOG_EVENT:
+		case ANNOTATE_ROWS_EVENT:
+			ret = ybpi_cdc_hold(&s->context, &s->context_len, &s->context_size, e);
+			break;
+		default:
+			if (ybpi_is_rows_event(e->type_code))
+				ret = ybpi_cdc_rows(s, p, e);
+			break;
+	}
+	if (ret < 0)
+		return ret;
+	if (!boundary)
+		return 0;
+	if (s->num_touched > 0)
+		s->pending++;
+	for (i = 0; i < s->num_touched; ++i)
+		s->partitions[s->touched[i]].committed_size = s->partitions[s->touched[i]].size;
+	s->num_touched = 0;
+	s->num_table_ids = 0;
+	s->context_len = 0;
+	s->gtid_len = 0;
+	if (file_name != s->file_name)
+		snprintf(s->file_name, sizeof(s->file_name), "%s", file_name);
+	s->offset = e->offset + e->length;
+	if (s->pending > 0 && ((s->flush_every > 0 && s->pending >= s->flush_every) ||
+			(s->flush_interval_ms > 0 && ybpi_ms_since(&s->last_flush) >= s->flush_interval_ms)))
+		return (ybp_cdc_sink_commit(s) < 0) ? -1 : 1;
+	return 0;
+}
+
+int ybp_cdc_sink_commit(struct ybp_cdc_sink* s)
+{
+	char* path;
+	char* tmp_path;
+	FILE* f;
+	size_t i;
+	int dir_fd, ret = -1;
+	for (i = 0; i < s->num_partitions; ++i) {
+		struct ybp_cdc_partition* part = &s->partitions[i];
+		if (part->buf_len > 0 && ybpi_cdc_flush_partition(part) < 0)
+			return -1;
+		if (part->dirty && fsync(part->fd) < 0) {
+			perror("Error syncing partition");
+			return -1;
+		}
+		part->dirty = false;
+	}
+	if ((path = ybpi_cdc_path(s, YBP_CDC_MANIFEST, "")) == NULL)
+		return -1;
+	if ((tmp_path = ybpi_cdc_path(s, YBP_CDC_MANIFEST, ".tmp")) == NULL) {
+		free(path);
+		return -1;
+	}
+	if ((f = fopen(tmp_path, "w")) == NULL) {
+		perror("Error opening CDC manifest");
+		goto out;
+	}
+	fprintf(f, CDC_MANIFEST_HEADER "%s\n%lld\n%zu\n", s->file_name, (long long)s->offset, s->num_partitions);
+	for (i = 0; i < s->num_partitions; ++i)
+		fprintf(f, "%lld %s\n", (long long)s->partitions[i].committed_size, s->partitions[i].name);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		perror("Error writing CDC manifest");
+		fclose(f);
+		goto out;
+	}
+	fclose(f);
+	if (rename(tmp_path, path) < 0) {
+		perror("Error renaming CDC manifest");
+		goto out;
+	}
+	/* New partitions, and the rename, aren't durable until the directory is */
+	if ((dir_fd = open(s->dir, O_RDONLY)) >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	s->pending = 0;
+	s->group_commits++;
+	clock_gettime(CLOCK_MONOTONIC, &s->last_flush);
+	ret = 0;
+out:
+	free(path);
+	free(tmp_path);
+	return ret;
+}
+
+/**
+ * Cut the partitions back to what the manifest in s->dir says, and get
+ * rid of any it doesn't list. Returns 0, -1 if there's no manifest (errno
+ * is ENOENT) or on other system errors, and -2 if it's malformed.
+ **/
+static int ybpi_cdc_load(struct ybp_cdc_sink* s)
+{
+	char line[CDC_NAME_MAX + 32];
+	char* manifest;
+	FILE* f;
+	size_t num_partitions, i, len;
+	long long offset;
+	int ret = -2;
+	if ((manifest = ybpi_cdc_path(s, YBP_CDC_MANIFEST, "")) == NULL)
+		return -1;
+	f = fopen(manifest, "r");
+	free(manifest);
+	if (f == NULL)
+		return -1;
+	if (fgets(line, sizeof(line), f) == NULL || strcmp(line, CDC_MANIFEST_HEADER) != 0 ||
+			fgets(s->file_name, sizeof(s->file_name), f) == NULL ||
+			(len = strlen(s->file_name)) == 0 || s->file_name[len - 1] != '\n' ||
+			fscanf(f, "%lld\n%zu\n", &offset, &num_partitions) != 2)
+		goto out;
+	s->file_name[len - 1] = '\0';
+	s->offset = offset;
+	for (i = 0; i < num_partitions; ++i) {
+		long long size;
+		char* name;
+		char* path;
+		int fd;
+		if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "%lld ", &size) != 1 ||
+				(name = strchr(line, ' ')) == NULL || (len = strlen(++name)) < 2 || name[len - 1] != '\n')
+			goto out;
+		name[--len] = '\0';
+		if ((path = ybpi_cdc_path(s, name, YBP_CDC_SUFFIX)) == NULL) {
+			ret = -1;
+			goto out;
+		}
+		if ((fd = open(path, O_WRONLY)) < 0 || ftruncate(fd, size) < 0) {
+			fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			free(path);
+			ret = -1;
+			goto out;
+		}
+		free(path);
+		if (ybpi_cdc_add(s, name, len, ybpi_hash64(name, len, 0), fd, size) < 0) {
+			close(fd);
+			ret = -1;
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Find the partitions in s->dir that s doesn't have, removing them if
+ * told to: they were started after the last group commit
+ **/
+static int ybpi_cdc_sweep(struct ybp_cdc_sink* s, bool remove, bool* found)
+{
+	DIR* d;
+	struct dirent* de;
+	size_t suffix_len = strlen(YBP_CDC_SUFFIX);
+	*found = false;
+	if ((d = opendir(s->dir)) == NULL) {
+		fprintf(stderr, "Error opening %s: %s\n", s->dir, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+		char* path;
+		if (len <= suffix_len || strcmp(de->d_name + len - suffix_len, YBP_CDC_SUFFIX) != 0)
+			continue;
+		len -= suffix_len;
+		if (ybpi_cdc_find(s, de->d_name, len, ybpi_hash64(de->d_name, len, 0)) >= 0)
+			continue;
+		*found = true;
+		if (!remove)
+			continue;
+		if ((path = ybpi_cdc_path(s, de->d_name, "")) == NULL) {
+			closedir(d);
+			return -1;
+		}
+		unlink(path);
+		free(path);
+	}
+	closedir(d);
+	return 0;
+}
+
+static void ybpi_free_cdc_sink(struct ybp_cdc_sink* s)
+{
+	size_t i;
+	for (i = 0; i < s->num_partitions; ++i) {
+		close(s->partitions[i].fd);
+		free(s->partitions[i].name);
+		free(s->partitions[i].buf);
+	}
+	ybp_reset_event(&s->evbuf);
+	free(s->partitions);
+	free(s->slots);
+	free(s->touched);
+	free(s->table_ids);
+	free(s->context);
+	free(s->begin);
+	free(s->gtid);
+	free(s->dir);
+	free(s);
+}
+
+struct ybp_cdc_sink* ybp_get_cdc_sink(const char* dir, unsigned int flush_every, unsigned int flush_interval_ms)
+{
+	struct ybp_cdc_sink* s;
+	bool found;
+	int ret;
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+		return NULL;
+	}
+	if ((s = calloc(1, sizeof(struct ybp_cdc_sink))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	if ((s->dir = strdup(dir)) == NULL) {
+		perror("strdup");
+		free(s);
+		return NULL;
+	}
+	ybp_init_event(&s->evbuf);
+	s->checksum_alg = -1;
+	s->flush_every = flush_every;
+	s->flush_interval_ms = flush_interval_ms;
+	clock_gettime(CLOCK_MONOTONIC, &s->last_flush);
+	if ((ret = ybpi_cdc_load(s)) == 0) {
+		if (ybpi_cdc_sweep(s, true, &found) < 0)
+			goto fail;
+		return s;
+	}
+	if (ret == -2) {
+		fprintf(stderr, "%s/" YBP_CDC_MANIFEST " is malformed\n", dir);
+		goto fail;
+	}
+	if (errno != ENOENT) {
+		fprintf(stderr, "Error reading %s/" YBP_CDC_MANIFEST ": %s\n", dir, strerror(errno));
+		goto fail;
+	}
+	/* Without a manifest, there's no telling whose partitions these are */
+	if (ybpi_cdc_sweep(s, false, &found) < 0)
+		goto fail;
+	if (found) {
+		fprintf(stderr, "%s has partitions but no manifest\n", dir);
+		goto fail;
+	}
+	s->file_name[0] = '\0';
+	if (ybp_cdc_sink_commit(s) < 0)
+		goto fail;
+	return s;
+fail:
+	ybpi_free_cdc_sink(s);
+	return NULL;
+}
+
+void ybp_dispose_cdc_sink(struct ybp_cdc_sink* s)
+{
+	if (s == NULL)
+		return;
+	ybp_cdc_sink_commit(s);
+	ybpi_free_cdc_sink(s);
+}
+
+/******** LOAD DATA ********/
+
+#define LOAD_POST_HEADER_LEN 4	/* file id */
+#define EXECUTE_LOAD_POST_HEADER_LEN (QUERY_MIN_POST_HEADER_LEN + 2 + 13)
+#define LOAD_DUP_IGNORE 1
+#define LOAD_DUP_REPLACE 2
+#define LOAD_MAX_VERSIONS 1000
+
+static ssize_t ybpi_find_load(const struct ybp_loads* restrict l, uint32_t file_id, uint32_t server_id)
+{
+	size_t i;
+	for (i = 0; i < l->num_files; ++i) {
+		if (l->files[i].file_id == file_id && l->files[i].server_id == server_id)
+			return i;
+	}
+	return -1;
+}
+
+static void ybpi_drop_load(struct ybp_loads* restrict l, size_t i, bool remove)
+{
+	struct ybp_load_file* f = &l->files[i];
+	close(f->fd);
+	if (remove)
+		unlink(f->path);
+	free(f->path);
+	l->files[i] = l->files[--l->num_files];
+}
+
+/**
+ * Start a file, named the way mysqlbinlog names them
+ **/
+static int ybpi_begin_load(struct ybp_loads* restrict l, uint32_t file_id, uint32_t server_id)
+{
+	struct ybp_load_file* f;
+	ssize_t i;
+	int version;
+	if ((i = ybpi_find_load(l, file_id, server_id)) >= 0) {
+		/* Its EXECUTE_LOAD_QUERY never came */
+		fprintf(stderr, "Load of file %u never finished; leaving %s\n", file_id, l->files[i].path);
+		ybpi_drop_load(l, i, false);
+	}
+	if (l->num_files == l->files_size) {
+		size_t size = (l->files_size == 0) ? 4 : l->files_size * 2;
+		struct ybp_load_file* files = realloc(l->files, size * sizeof(struct ybp_load_file));
+		if (files == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		l->files = files;
+		l->files_size = size;
+	}
+	f = &l->files[l->num_files];
+	if ((f->path = malloc(strlen(l->dir) + 64)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (version = 0; version < LOAD_MAX_VERSIONS; ++version) {
+		sprintf(f->path, "%s/SQL_LOAD_MB-%x-%x-%x", l->dir, file_id, server_id, version);
+		if ((f->fd = open(f->path, O_WRONLY | O_CREAT | O_EXCL, 0644)) >= 0 || errno != EEXIST)
+			break;
+	}
+	if (f->fd < 0) {
+		fprintf(stderr, "Error creating %s: %s\n", f->path, strerror(errno));
+		free(f->path);
+		return -1;
+	}
+	f->file_id = file_id;
+	f->server_id = server_id;
+	f->size = 0;
+	l->num_files++;
+	return 0;
+}
+
+/**
+ * Copy the block an event carries to the end of its file, without it
+ * passing through memory
+ **/
+static int ybpi_append_load(struct ybp_loads* restrict l, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e,
+		const struct ybp_decoded_event* restrict d, struct ybp_load_file* restrict f)
+{
+	off64_t start = e->offset + EVENT_HEADER_SIZE + (d->body - e->data);
+	off64_t len = e->offset + e->length - ybpi_checksum_len(p) - start;
+	if (len <= 0)
+		return 0;
+	if (ybpi_copy_range(p->fd, start, f->fd, f->size, len) < 0)
+		return -1;
+	f->size += len;
+	l->bytes += len;
+	return 0;
+}
+
+/**
+ * The EXECUTE_LOAD_QUERY statement, reading from f instead: its INFILE
+ * clause (between the positions the event gives) is replaced with a LOCAL
+ * one, as mysqlbinlog does
+ **/
+static int ybpi_finish_load(struct ybp_loads* restrict l, const struct ybp_decoded_event* restrict d, struct ybp_load_file* restrict f)
+{
+	const struct ybp_query_view* q = &d->u.query;
+	static const char* const dup_handling[] = {"", " IGNORE", " REPLACE"};
+	uint32_t fn_start, fn_end;
+	uint8_t dup;
+	char* s;
+	const char* c;
+	memcpy(&fn_start, d->post_header + QUERY_MIN_POST_HEADER_LEN + 2 + 4, 4);
+	memcpy(&fn_end, d->post_header + QUERY_MIN_POST_HEADER_LEN + 2 + 8, 4);
+	dup = d->post_header[QUERY_MIN_POST_HEADER_LEN + 2 + 12];
+	if (fn_start > fn_end || fn_end > q->statement_len || dup > LOAD_DUP_REPLACE)
+		return -2;
+	free(l->last.statement);
+	free(l->last.path);
+	/* Every character of the path might need escaping */
+	if ((l->last.statement = malloc(q->statement_len + 2 * strlen(f->path) + 64)) == NULL) {
+		perror("malloc");
+		l->last.path = NULL;
+		return -1;
+	}
+	s = l->last.statement;
+	memcpy(s, q->statement, fn_start);
+	s += fn_start;
+	s += sprintf(s, " LOCAL INFILE '");
+	for (c = f->path; *c != '\0'; ++c) {
+		if (*c == '\'' || *c == '\\')
+			*s++ = '\\';
+		*s++ = *c;
+	}
+	s += sprintf(s, "'%s INTO", dup_handling[dup]);
+	memcpy(s, q->statement + fn_end, q->statement_len - fn_end);
+	s += q->statement_len - fn_end;
+	*s = '\0';
+	l->last.statement_len = s - l->last.statement;
+	memcpy(l->last.db_name, q->db_name, q->db_name_len);
+	l->last.db_name[q->db_name_len] = '\0';
+	l->last.thread_id = q->thread_id;
+	l->last.path = f->path;
+	l->last.file_id = f->file_id;
+	l->last.size = f->size;
+	f->path = NULL;
+	l->loads++;
+	return 0;
+}
+
+struct ybp_loads* ybp_get_loads(const char* dir)
+{
+	struct ybp_loads* l;
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+		return NULL;
+	}
+	if ((l = calloc(1, sizeof(struct ybp_loads))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	if ((l->dir = strdup(dir)) == NULL) {
+		perror("strdup");
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+int ybp_loads_observe(struct ybp_loads* restrict l, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, struct ybp_load_statement** out)
+{
+	struct ybp_decoded_event d;
+	uint32_t file_id;
+	ssize_t i;
+	int ret;
+	switch (e->type_code) {
+		case BEGIN_LOAD_QUERY_EVENT:
+		case APPEND_BLOCK_EVENT:
+		case DELETE_FILE_EVENT:
+			if (ybp_decode_event(p, e, &d) < 0 || d.post_header_len < LOAD_POST_HEADER_LEN)
+				return -2;
+			memcpy(&file_id, d.post_header, 4);
+			if (e->type_code == BEGIN_LOAD_QUERY_EVENT && ybpi_begin_load(l, file_id, e->server_id) < 0)
+				return -1;
+			if ((i = ybpi_find_load(l, file_id, e->server_id)) < 0) {
+				fprintf(stderr, "%s at %lld is for file %u, whose BEGIN_LOAD_QUERY we didn't see; skipping it\n",
+						ybp_event_type(e), (long long)e->offset, file_id);
+				return 0;
+			}
+			if (e->type_code == DELETE_FILE_EVENT) {
+				ybpi_drop_load(l, i, true);
+				return 0;
+			}
+			return ybpi_append_load(l, p, e, &d, &l->files[i]);
+		case EXECUTE_LOAD_QUERY_EVENT:
+			/* The statement we do need whole */
+			if (e->data_len < e->length - EVENT_HEADER_SIZE) {
+				size_t read_limit = p->read_limit;
+				p->read_limit = 0;
+				ret = ybpi_read_event_rest(p, e);
+				p->read_limit = read_limit;
+				if (ret < 0)
+					return -1;
+			}
+			if (ybp_decode_event(p, e, &d) < 0 || d.post_header_len < EXECUTE_LOAD_POST_HEADER_LEN)
+				return -2;
+			memcpy(&file_id, d.post_header + QUERY_MIN_POST_HEADER_LEN + 2, 4);
+			if ((i = ybpi_find_load(l, file_id, e->server_id)) < 0) {
+				fprintf(stderr, "EXECUTE_LOAD_QUERY_EVENT at %lld is for file %u, whose BEGIN_LOAD_QUERY we didn't see\n",
+						(long long)e->offset, file_id);
+				return 0;
+			}
+			if ((ret = ybpi_finish_load(l, &d, &l->files[i])) < 0)
+				return ret;
+			ybpi_drop_load(l, i, false);
+			*out = &l->last;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void ybp_dispose_loads(struct ybp_loads* l)
+{
+	if (l == NULL)
+		return;
+	while (l->num_files > 0)
+		ybpi_drop_load(l, l->num_files - 1, false);
+	free(l->files);
+	free(l->last.statement);
+	free(l->last.path);
+	free(l->dir);
+	free(l);
+}
+
 /* vim: set sts=0 sw=4 ts=4 noexpandtab: */
@@ -11,49 +11,97 @@
 #define _YBINLOGP_PRIVATE_H_
 
 /******* various mappings ********/
-static const char* ybpi_event_types[27] = {
-	"UNKNOWN_EVENT",            // 0
-	"START_EVENT_V3",           // 1
-	"QUERY_EVENT",              // 2
-	"STOP_EVENT",               // 3
-	"ROTATE_EVENT",             // 4
-	"INTVAR_EVENT",             // 5
-	"LOAD_EVENT",               // 6
-	"SLAVE_EVENT",              // 7
-	"CREATE_FILE_EVENT",        // 8
-	"APPEND_BLOCK_EVENT",       // 9
-	"EXEC_LOAD_EVENT",          // 10
-	"DELETE_FILE_EVENT",        // 11
-	"NEW_LOAD_EVENT",           // 12
-	"RAND_EVENT",               // 13
-	"USER_VAR_EVENT",           // 14
-	"FORMAT_DESCRIPTION_EVENT", // 15
-	"XID_EVENT",                // 16
-	"BEGIN_LOAD_QUERY_EVENT",   // 17
-	"EXECUTE_LOAD_QUERY_EVENT", // 18
-	"TABLE_MAP_EVENT",          // 19
-	"PRE_GA_WRITE_ROWS_EVENT",  // 20
-	"PRE_GA_DELETE_ROWS_EVENT", // 21
-	"WRITE_ROWS_EVENT",         // 22
-	"UPDATE_ROWS_EVENT",        // 23
-	"DELETE_ROWS_EVENT",        // 24
-	"INCIDENT_EVENT",           // 25
-	"HEARTBEAT_LOG_EVENT",      // 26
+/* Indexed by type code; gaps are codes no server we know of uses */
+static const char* ybpi_event_types[256] = {
+	[0] = "UNKNOWN_EVENT",
+	[1] = "START_EVENT_V3",
+	[2] = "QUERY_EVENT",
+	[3] = "STOP_EVENT",
+	[4] = "ROTATE_EVENT",
+	[5] = "INTVAR_EVENT",
+	[6] = "LOAD_EVENT",
+	[7] = "SLAVE_EVENT",
+	[8] = "CREATE_FILE_EVENT",
+	[9] = "APPEND_BLOCK_EVENT",
+	[10] = "EXEC_LOAD_EVENT",
+	[11] = "DELETE_FILE_EVENT",
+	[12] = "NEW_LOAD_EVENT",
+	[13] = "RAND_EVENT",
+	[14] = "USER_VAR_EVENT",
+	[15] = "FORMAT_DESCRIPTION_EVENT",
+	[16] = "XID_EVENT",
+	[17] = "BEGIN_LOAD_QUERY_EVENT",
+	[18] = "EXECUTE_LOAD_QUERY_EVENT",
+	[19] = "TABLE_MAP_EVENT",
+	[20] = "PRE_GA_WRITE_ROWS_EVENT",
+	[21] = "PRE_GA_UPDATE_ROWS_EVENT",
+	[22] = "PRE_GA_DELETE_ROWS_EVENT",
+	[23] = "WRITE_ROWS_EVENT",
+	[24] = "UPDATE_ROWS_EVENT",
+	[25] = "DELETE_ROWS_EVENT",
+	[26] = "INCIDENT_EVENT",
+	[27] = "HEARTBEAT_LOG_EVENT",
+	/* MySQL 5.6+ */
+	[28] = "IGNORABLE_LOG_EVENT",
+	[29] = "ROWS_QUERY_LOG_EVENT",
+	[30] = "WRITE_ROWS_EVENT_V2",
+	[31] = "UPDATE_ROWS_EVENT_V2",
+	[32] = "DELETE_ROWS_EVENT_V2",
+	[33] = "GTID_LOG_EVENT",
+	[34] = "ANONYMOUS_GTID_LOG_EVENT",
+	[35] = "PREVIOUS_GTIDS_LOG_EVENT",
+	[36] = "TRANSACTION_CONTEXT_EVENT",
+	[37] = "VIEW_CHANGE_EVENT",
+	[38] = "XA_PREPARE_LOG_EVENT",
+	[39] = "PARTIAL_UPDATE_ROWS_EVENT",
+	[40] = "TRANSACTION_PAYLOAD_EVENT",
+	[41] = "HEARTBEAT_LOG_EVENT_V2",
+	/* MariaDB 5.3+ */
+	[160] = "ANNOTATE_ROWS_EVENT",
+	[161] = "BINLOG_CHECKPOINT_EVENT",
+	[162] = "GTID_EVENT",
+	[163] = "GTID_LIST_EVENT",
+	[164] = "START_ENCRYPTION_EVENT",
+	[165] = "QUERY_COMPRESSED_EVENT",
+	[166] = "WRITE_ROWS_COMPRESSED_EVENT_V1",
+	[167] = "UPDATE_ROWS_COMPRESSED_EVENT_V1",
+	[168] = "DELETE_ROWS_COMPRESSED_EVENT_V1",
+	[169] = "WRITE_ROWS_COMPRESSED_EVENT",
+	[170] = "UPDATE_ROWS_COMPRESSED_EVENT",
+	[171] = "DELETE_ROWS_COMPRESSED_EVENT",
 };
 
-static const char* ybpi_variable_types[10] = {
-	"Q_FLAGS2_CODE",               // 0
-	"Q_SQL_MODE_CODE",             // 1
-	"Q_CATALOG_CODE",              // 2
-	"Q_AUTO_INCREMENT",            // 3
-	"Q_CHARSET_CODE",              // 4
-	"Q_TIME_ZONE_CODE",            // 5
-	"Q_CATALOG_NZ_CODE",           // 6
-	"Q_LC_TIME_NAMES_CODE",        // 7
-	"Q_CHARSET_DATABASE_CODE",     // 8
-	"Q_TABLE_MAP_FOR_UPDATE_CODE", // 9
+/* Post-header lengths by type code, as 5.7 writes them; used for the types
+ * a binlog's FDE doesn't list */
+static const uint8_t ybpi_default_post_header_len[256] = {
+	[START_EVENT_V3] = 56,
+	[QUERY_EVENT] = 13,
+	[ROTATE_EVENT] = 8,
+	[LOAD_EVENT] = 18,
+	[CREATE_FILE_EVENT] = 4,
+	[APPEND_BLOCK_EVENT] = 4,
+	[EXEC_LOAD_EVENT] = 4,
+	[DELETE_FILE_EVENT] = 4,
+	[NEW_LOAD_EVENT] = 18,
+	[FORMAT_DESCRIPTION_EVENT] = 84,
+	[BEGIN_LOAD_QUERY_EVENT] = 4,
+	[EXECUTE_LOAD_QUERY_EVENT] = 26,
+	[TABLE_MAP_EVENT] = 8,
+	[WRITE_ROWS_EVENT] = 8,
+	[UPDATE_ROWS_EVENT] = 8,
+	[DELETE_ROWS_EVENT] = 8,
+	[INCIDENT_EVENT] = 2,
+	[WRITE_ROWS_EVENT_V2] = 10,
+	[UPDATE_ROWS_EVENT_V2] = 10,
+	[DELETE_ROWS_EVENT_V2] = 10,
+	[GTID_LOG_EVENT] = 42,
+	[ANONYMOUS_GTID_LOG_EVENT] = 42,
+	[TRANSACTION_CONTEXT_EVENT] = 18,
+	[VIEW_CHANGE_EVENT] = 52,
 };
 
+#define QUERY_MIN_POST_HEADER_LEN 11	/* before 5.0 there was no status_var_len */
+
 static const char* ybpi_intvar_types[3] = {
 	"",
 	"LAST_INSERT_ID_EVENT",         // 1
@@ -118,8 +166,11 @@ static const char* ybpi_flags2[32] = {
  * -1 indicates variable (the first byte is a length byte)
  *  -2 indicates variable + 1 (the first byte is a length byte that is
  *  wrong)
+ *  -3 indicates two of -1 in a row
+ *  -4 indicates a count byte followed by that many NUL-terminated strings
  */
-static int ybpi_status_var_data_len_by_type[10] = {
+#define YBPI_NUM_STATUS_VARS 21
+static int ybpi_status_var_data_len_by_type[YBPI_NUM_STATUS_VARS] = {
 	4, // 0 = Q_FLAGS2_CODE
 	8, // 1 = Q_SQL_MODE_CODE
 	-2,// 2 = Q_CATALOG_CODE (length byte + string + NUL)
@@ -130,6 +181,41 @@ static int ybpi_status_var_data_len_by_type[10] = {
 	2, // 7 = Q_LC_TIME_NAMES_COE
 	2, // 8 = Q_CHARSET_DATABASE_CODE
 	8, // 9 = Q_TABLE_MAP_FOR_UPDATE_COE
+	4, // 10 = Q_MASTER_DATA_WRITTEN_CODE
+	-3,// 11 = Q_INVOKER (user, then host)
+	-4,// 12 = Q_UPDATED_DB_NAMES
+	3, // 13 = Q_MICROSECONDS
+	8, // 14 = Q_COMMIT_TS
+	8, // 15 = Q_COMMIT_TS2
+	1, // 16 = Q_EXPLICIT_DEFAULTS_FOR_TIMESTAMP
+	8, // 17 = Q_DDL_LOGGED_WITH_XID
+	2, // 18 = Q_DEFAULT_COLLATION_FOR_UTF8MB4
+	1, // 19 = Q_SQL_REQUIRE_PRIMARY_KEY
+	1, // 20 = Q_DEFAULT_TABLE_ENCRYPTION
+};
+
+static const char* ybpi_variable_types[YBPI_NUM_STATUS_VARS] = {
+	"Q_FLAGS2_CODE",                     // 0
+	"Q_SQL_MODE_CODE",                   // 1
+	"Q_CATALOG_CODE",                    // 2
+	"Q_AUTO_INCREMENT",                  // 3
+	"Q_CHARSET_CODE",                    // 4
+	"Q_TIME_ZONE_CODE",                  // 5
+	"Q_CATALOG_NZ_CODE",                 // 6
+	"Q_LC_TIME_NAMES_CODE",              // 7
+	"Q_CHARSET_DATABASE_CODE",           // 8
+	"Q_TABLE_MAP_FOR_UPDATE_CODE",       // 9
+	"Q_MASTER_DATA_WRITTEN_CODE",        // 10
+	"Q_INVOKER",                         // 11
+	"Q_UPDATED_DB_NAMES",                // 12
+	"Q_MICROSECONDS",                    // 13
+	"Q_COMMIT_TS",                       // 14
+	"Q_COMMIT_TS2",                      // 15
+	"Q_EXPLICIT_DEFAULTS_FOR_TIMESTAMP", // 16
+	"Q_DDL_LOGGED_WITH_XID",             // 17
+	"Q_DEFAULT_COLLATION_FOR_UTF8MB4",   // 18
+	"Q_SQL_REQUIRE_PRIMARY_KEY",         // 19
+	"Q_DEFAULT_TABLE_ENCRYPTION",        // 20
 };
 
 enum ybpi_e_status_var_types {
@@ -142,22 +228,66 @@ enum ybpi_e_status_var_types {
 	Q_CATALOG_NZ_CODE=6,
 	Q_LC_TIME_NAMES_CODE=7,
 	Q_CHARSET_DATABASE_CODE=8,
-	Q_TABLE_MAP_FOR_UPDATE_CODE=9
+	Q_TABLE_MAP_FOR_UPDATE_CODE=9,
+	Q_MASTER_DATA_WRITTEN_CODE=10,
+	Q_INVOKER=11,
+	Q_UPDATED_DB_NAMES=12,
+	Q_MICROSECONDS=13,
+	/* MariaDB */
+	Q_HRNOW=128,
+	Q_XID=129
+};
+
+#define OVER_MAX_DBS_IN_EVENT_MTS 254	/* Q_UPDATED_DB_NAMES count with no names */
+#define Q_HRNOW_LEN 3
+#define Q_XID_LEN 8
+
+
+/* Column types, as TABLE_MAP events give them */
+enum ybpi_column_types {
+	MYSQL_TYPE_DECIMAL=0,
+	MYSQL_TYPE_TINY=1,
+	MYSQL_TYPE_SHORT=2,
+	MYSQL_TYPE_LONG=3,
+	MYSQL_TYPE_FLOAT=4,
+	MYSQL_TYPE_DOUBLE=5,
+	MYSQL_TYPE_NULL=6,
+	MYSQL_TYPE_TIMESTAMP=7,
+	MYSQL_TYPE_LONGLONG=8,
+	MYSQL_TYPE_INT24=9,
+	MYSQL_TYPE_DATE=10,
+	MYSQL_TYPE_TIME=11,
+	MYSQL_TYPE_DATETIME=12,
+	MYSQL_TYPE_YEAR=13,
+	MYSQL_TYPE_NEWDATE=14,
+	MYSQL_TYPE_VARCHAR=15,
+	MYSQL_TYPE_BIT=16,
+	MYSQL_TYPE_TIMESTAMP2=17,
+	MYSQL_TYPE_DATETIME2=18,
+	MYSQL_TYPE_TIME2=19,
+	MYSQL_TYPE_JSON=245,
+	MYSQL_TYPE_NEWDECIMAL=246,
+	MYSQL_TYPE_ENUM=247,
+	MYSQL_TYPE_SET=248,
+	MYSQL_TYPE_TINY_BLOB=249,
+	MYSQL_TYPE_MEDIUM_BLOB=250,
+	MYSQL_TYPE_LONG_BLOB=251,
+	MYSQL_TYPE_BLOB=252,
+	MYSQL_TYPE_VAR_STRING=253,
+	MYSQL_TYPE_STRING=254,
+	MYSQL_TYPE_GEOMETRY=255
 };
 
-static const char* ybpi_status_var_types[10] = {
-	"Q_FLAGS2_CODE",
-	"Q_SQL_MODE_CODE",
-	"Q_CATALOG_CODE",
-	"Q_AUTO_INCREMENT",
-	"Q_CHARSET_CODE",
-	"Q_TIME_ZONE_CODE",
-	"Q_CATALOG_NZ_CODE",
-	"Q_LC_TIME_NAMES_CODE",
-	"Q_CHARSET_DATABASE_CODE",
-	"Q_TABLE_MAP_FOR_UPDATE_CODE"
+/* The optional metadata MySQL 8 appends to TABLE_MAP events */
+enum ybpi_table_map_metadata_types {
+	TM_SIGNEDNESS=1,
+	TM_COLUMN_NAME=4,
+	TM_SIMPLE_PRIMARY_KEY=8,
+	TM_PRIMARY_KEY_WITH_PREFIX=9
 };
 
+#define ROWS_STMT_END_F 0x0001	/* rows event flag: the statement's last */
+
 
 /** Macros to do things with event data 
  *
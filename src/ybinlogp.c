@@ -10,7 +10,9 @@
 #define _XOPEN_SOURCE 600
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,31 +31,1599 @@ void usage(void) {
 	fprintf(stderr, "\t-E           do not enforce server-id checking\n");
 	fprintf(stderr, "\t-o OFFSET    find the first event after the given offset\n");
 	fprintf(stderr, "\t-t TIME      find the first event after the given time\n");
+	fprintf(stderr, "\t-p PROBES    with -t, read PROBES places in the binlog at once per search\n");
+	fprintf(stderr, "\t\t\t\tstep; helps on cold or network storage, default 1\n");
+	fprintf(stderr, "\t-n N         find the Nth event (from 0; negative counts back from the end),\n");
+	fprintf(stderr, "\t\t\t\tusing binlog.ybpevents if -I has made one\n");
 	fprintf(stderr, "\t-a COUNT     When used with one of the above, print COUNT items after the first one, default 2\n");
 	fprintf(stderr, "\t\t\t\tAccepts either an integer or the text 'all'\n");
+	fprintf(stderr, "\t-B COUNT     also print the COUNT events before the one found; without\n");
+	fprintf(stderr, "\t\t\t\t-o, -t or -u, print the last COUNT events in the binlog\n");
+	fprintf(stderr, "\t-x FILE      write the events from -o/-t up to -O/-T to FILE as a standalone\n");
+	fprintf(stderr, "\t\t\t\tbinlog, widened to whole transactions\n");
+	fprintf(stderr, "\t-O OFFSET    with -x, stop at the given offset (default: end of file)\n");
+	fprintf(stderr, "\t-T TIME      with -x, -k or -K, stop at the given time\n");
+	fprintf(stderr, "\t-L BYTES     read only the first BYTES (at least 256) of each event, so\n");
+	fprintf(stderr, "\t\t\t\tbig ones are quick to step over; statements are cut short\n");
 	fprintf(stderr, "\t-D DBNAME    Filter query events that were not in DBNAME\n");
 	fprintf(stderr, "\t\t\t\tNote that this still shows transaction control events\n");
 	fprintf(stderr, "\t\t\t\tsince those do not have an associated database. Mea culpa.\n");
 	fprintf(stderr, "\t-q           Be quieter\n");
+	fprintf(stderr, "\t-w EXPR      only print the events EXPR holds for, e.g. \"type in (QUERY, XID)\n");
+	fprintf(stderr, "\t\t\t\tand db = 'foo' and time between 1375210957 and 1375214557\n");
+	fprintf(stderr, "\t\t\t\tand stmt ~ 'UPDATE users'\" (see ybp_get_filter in ybinlogp.h)\n");
+	fprintf(stderr, "\t-g TEXT      print the query events whose statements contain TEXT, in\n");
+	fprintf(stderr, "\t\t\t\tevery binlog given\n");
+	fprintf(stderr, "\t-e REGEX     like -g, but statements must match the extended regex REGEX\n");
+	fprintf(stderr, "\t\t\t\t(along with TEXT, if -g is also given; it is much quicker\n");
+	fprintf(stderr, "\t\t\t\tto rule statements out with)\n");
+	fprintf(stderr, "\t-i           make -g and -e ignore case\n");
+	fprintf(stderr, "\t-f N         print the N commonest statement shapes (literals replaced by ?)\n");
+	fprintf(stderr, "\t\t\t\tby count and by bytes, over every binlog given\n");
+	fprintf(stderr, "\t-S K[,BYTES[,SEED]] estimate what the binlog is made of (by event type,\n");
+	fprintf(stderr, "\t\t\t\tdatabase and table) from K random windows of BYTES bytes each\n");
+	fprintf(stderr, "\t\t\t\t(default 65536), with 95%% confidence intervals; the same SEED\n");
+	fprintf(stderr, "\t\t\t\tpicks the same windows (default: the time)\n");
+	fprintf(stderr, "\t-s           print the events as SQL that the mysql client can replay,\n");
+	fprintf(stderr, "\t\t\t\tlike mysqlbinlog does (-D and -q are ignored)\n");
+	fprintf(stderr, "\t-m           merge several servers' binlogs into one stream in timestamp\n");
+	fprintf(stderr, "\t\t\t\torder, each event tagged with its binlog. Give each server's\n");
+	fprintf(stderr, "\t\t\t\tbinlogs as one comma-separated argument, oldest first\n");
+	fprintf(stderr, "\t-I           build or update the sidecars of each binlog given: Bloom filters\n");
+	fprintf(stderr, "\t\t\t\tof the databases, tables and thread ids in every 16MB block\n");
+	fprintf(stderr, "\t\t\t\t(binlog.ybpbloom) and an index of event headers (binlog.ybpevents)\n");
+	fprintf(stderr, "\t-b SEARCH    print the events touching SEARCH (db=NAME, table=[DB.]NAME and/or\n");
+	fprintf(stderr, "\t\t\t\tthread=ID, comma-separated) in each binlog given, only\n");
+	fprintf(stderr, "\t\t\t\treading the blocks their sidecars don't rule out\n");
+	fprintf(stderr, "\t-c OTHER     find where the binlogs given (one server's, oldest first) and\n");
+	fprintf(stderr, "\t\t\t\tthe comma-separated binlogs OTHER (another's) part ways, by\n");
+	fprintf(stderr, "\t\t\t\ttransaction contents, and list the transactions after that\n");
+	fprintf(stderr, "\t\t\t\tonly the given ones (<) or OTHER (>) have\n");
+	fprintf(stderr, "\t-k FILE      write the last image of every row that the row events in the\n");
+	fprintf(stderr, "\t\t\t\tbinlogs given (oldest first) touch, from -t up to -T, to FILE\n");
+	fprintf(stderr, "\t\t\t\tas JSON lines ('-' for stdout)\n");
+	fprintf(stderr, "\t-K FILE      like -k, but write them to FILE as a binlog that replays them\n");
+	fprintf(stderr, "\t-z MB        with -k or -K, spill rows to $TMPDIR past MB megabytes (or\n");
+	fprintf(stderr, "\t\t\t\tkilobytes, as NK), default 256\n");
+	fprintf(stderr, "\t-r IDS       print the events of the client connections with the given\n");
+	fprintf(stderr, "\t\t\t\tthread ids (comma-separated, or 'all') in the binlogs given\n");
+	fprintf(stderr, "\t\t\t\t(oldest first), each tagged with its thread id\n");
+	fprintf(stderr, "\t-R DIR       like -r, but append each connection's events to\n");
+	fprintf(stderr, "\t\t\t\tDIR/thread-ID.log instead (-r defaults to 'all')\n");
+	fprintf(stderr, "\t-A           scan every binlog given, and every binlog (NAME.NNNNNN) under the\n");
+	fprintf(stderr, "\t\t\t\tdirectories given, and report the events and bytes by type,\n");
+	fprintf(stderr, "\t\t\t\ttimestamps and server ids, plus what -g/-e/-w match by binlog\n");
+	fprintf(stderr, "\t-j N         with -A, read on N threads, default one per CPU\n");
+	fprintf(stderr, "\t-P DIR       route the events of the binlogs given (oldest first) to a binlog\n");
+	fprintf(stderr, "\t\t\t\tper table in DIR, fsynced together at transaction boundaries;\n");
+	fprintf(stderr, "\t\t\t\trun again, it carries on from DIR/manifest exactly once\n");
+	fprintf(stderr, "\t-l DIR       rebuild the files of the LOAD DATA statements in the binlogs given\n");
+	fprintf(stderr, "\t\t\t\tin DIR, and print the statements to load them back from there;\n");
+	fprintf(stderr, "\t\t\t\twith -s, replay them as LOAD DATA LOCAL of those files\n");
+	fprintf(stderr, "\t-u GTID      find the transaction with the given GTID (uuid:number or\n");
+	fprintf(stderr, "\t\t\t\tdomain-server-sequence). Several binlogs may be given, in order;\n");
+	fprintf(stderr, "\t\t\t\tthe GTID sets at their heads are used to pick the right one\n");
 }
 
-int main(int argc, char** argv) {
-	int opt;
-	int fd;
+/**
+ * Open a binlog and get a parser for it. Returns NULL (having complained)
+ * on failure.
+ **/
+static struct ybp_binlog_parser* open_binlog(const char* path, bool esi, int* fd)
+{
 	struct ybp_binlog_parser* bp;
+	if ((*fd = open(path, O_RDONLY|O_LARGEFILE)) <= 0) {
+		perror("Error opening file");
+		return NULL;
+	}
+	if ((bp = ybp_get_binlog_parser(*fd)) == NULL) {
+		perror("init_binlog_parser");
+		close(*fd);
+		return NULL;
+	}
+	bp->enforce_server_id = esi;
+	return bp;
+}
+
+/**
+ * Find which of the binlogs in paths holds gtid, working backwards from the
+ * newest. On success, returns its parser (with *fd set) rewound to the
+ * transaction.
+ **/
+static struct ybp_binlog_parser* find_gtid(char** paths, int num_paths, const struct ybp_gtid* gtid, bool esi, int* fd)
+{
+	int i;
+	for (i = num_paths - 1; i >= 0; --i) {
+		struct ybp_binlog_parser* bp;
+		int before;
+		off64_t offset;
+		if ((bp = open_binlog(paths[i], esi, fd)) == NULL)
+			return NULL;
+		before = ybp_gtid_before_file(bp, gtid);
+		if (before != 1) {
+			if ((offset = ybp_find_gtid(bp, gtid)) >= 0) {
+				fprintf(stderr, "Found in %s at offset %lld\n", paths[i], (long long)offset);
+				ybp_rewind_bp(bp, offset);
+				return bp;
+			}
+		}
+		ybp_dispose_binlog_parser(bp);
+		close(*fd);
+		/* If this file's GTID set says it came after it, it isn't anywhere */
+		if (before == 0)
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * Print one event to out; tag, if given, says where it came from
+ **/
+static void show_event(struct ybp_binlog_parser* bp, struct ybp_event* evbuf, bool q_mode, char* database_limit, const char* tag, FILE* out)
+{
+	if (q_mode) {
+		if (evbuf->type_code == QUERY_EVENT) {
+			struct ybp_query_event_safe* s = ybp_decode_safe_qe(bp, evbuf);
+			if (s == NULL)
+				return;
+			if ((database_limit == NULL) || (strcmp(s->db_name, database_limit) == 0))  {
+				if (tag != NULL)
+					fprintf(out, "%s ", tag);
+				fprintf(out, "%d %s\n", evbuf->timestamp, s->statement);
+			}
+			ybp_dispose_safe_qe(s);
+		}
+		else if (evbuf->type_code == XID_EVENT) {
+			struct ybp_decoded_event d;
+			if (ybp_decode_event(bp, evbuf, &d) < 0)
+				return;
+			if (tag != NULL)
+				fprintf(out, "%s ", tag);
+			fprintf(out, "%d XID %llu\n", evbuf->timestamp, (long long unsigned)d.u.xid);
+		}
+	} else {
+		if (tag != NULL)
+			fprintf(out, "SOURCE %s\n", tag);
+		ybp_print_event(evbuf, bp, out, q_mode, false, database_limit);
+		fprintf(out, "\n");
+	}
+}
+
+/**
+ * One input to -m: a comma-separated chain of binlogs from one server
+ **/
+struct merge_chain {
+	char*	paths;		/* what's left of the chain */
+	char*	current;	/* the binlog we're reading */
+	int		fd;
+	bool	esi;
+	struct ybp_binlog_parser*	bp;
+};
+
+static struct ybp_binlog_parser* next_in_chain(size_t source, void* arg)
+{
+	struct merge_chain* chain = (struct merge_chain*)arg + source;
+	char* comma;
+	if (chain->bp != NULL) {
+		ybp_dispose_binlog_parser(chain->bp);
+		close(chain->fd);
+		chain->bp = NULL;
+	}
+	if (chain->paths == NULL || *chain->paths == '\0')
+		return NULL;
+	chain->current = chain->paths;
+	if ((comma = strchr(chain->paths, ',')) != NULL) {
+		*comma = '\0';
+		chain->paths = comma + 1;
+	} else {
+		chain->paths = NULL;
+	}
+	chain->bp = open_binlog(chain->current, chain->esi, &chain->fd);
+	return chain->bp;
+}
+
+/**
+ * Print the events of several servers' binlogs (chains) interleaved in
+ * timestamp order, each tagged with the binlog it came from
+ **/
+static int merge_binlogs(char** args, int num_args, bool esi, long starting_time, int num_to_show,
+		bool show_all, bool q_mode, char* database_limit, struct ybp_filter* filter)
+{
+	struct merge_chain* chains;
+	struct ybp_binlog_parser** parsers;
+	struct ybp_merge* merge;
+	struct ybp_event* evbuf;
+	size_t source;
+	int i, ret = 0;
+	if ((chains = calloc(num_args, sizeof(struct merge_chain))) == NULL ||
+			(parsers = calloc(num_args, sizeof(struct ybp_binlog_parser*))) == NULL ||
+			(evbuf = ybp_get_event()) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < num_args; ++i) {
+		chains[i].paths = args[i];
+		chains[i].esi = esi;
+		parsers[i] = next_in_chain(i, chains);
+		if (parsers[i] != NULL && starting_time >= 0) {
+			off64_t offset = ybp_nearest_time(parsers[i], starting_time);
+			/* Nothing that late in this file: let the chain move on */
+			ybp_rewind_bp(parsers[i], (offset >= 0) ? offset : parsers[i]->file_size);
+		}
+	}
+	if ((merge = ybp_get_merge(parsers, num_args, next_in_chain, chains)) == NULL)
+		return 1;
+	for (i = 0; show_all || i < num_to_show; ++i) {
+		const char* tag;
+		if ((ret = ybp_merge_next(merge, evbuf, &source)) < 0)
+			fprintf(stderr, "Error reading %s\n", chains[source].current);
+		if (ret <= 0)
+			break;
+		if (filter != NULL && !ybp_filter_event(merge->sources[source].parser, filter, evbuf)) {
+			ybp_reset_event(evbuf);
+			i--;
+			continue;
+		}
+		tag = strrchr(chains[source].current, '/');
+		tag = (tag == NULL) ? chains[source].current : tag + 1;
+		show_event(merge->sources[source].parser, evbuf, q_mode, database_limit, tag, stdout);
+		ybp_reset_event(evbuf);
+	}
+	ybp_dispose_merge(merge);
+	for (i = 0; i < num_args; ++i)
+		next_in_chain(i, chains);
+	ybp_dispose_event(evbuf);
+	free(parsers);
+	free(chains);
+	return (ret < 0) ? 1 : 0;
+}
+
+/**
+ * Write the events from bp's position up to ending_offset or ending_time
+ * (whichever is given) to path
+ **/
+static int write_slice(struct ybp_binlog_parser* bp, const char* path, long ending_offset, long ending_time)
+{
+	off64_t end = bp->file_size;
+	off64_t written;
+	int out_fd;
+	if (ending_offset >= 0)
+		end = ending_offset;
+	if (ending_time >= 0) {
+		off64_t offset = ybp_nearest_time(bp, ending_time);
+		if (offset == -1) {
+			perror("nearest_time");
+			return 1;
+		}
+		else if (offset >= 0) {
+			end = offset;
+		}
+	}
+	if ((out_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("Error opening slice");
+		return 1;
+	}
+	written = ybp_slice(bp, ybp_tell_bp(bp), end, out_fd, NULL);
+	if (written == -2)
+		fprintf(stderr, "No complete transactions in that range\n");
+	else if (written >= 0)
+		fprintf(stderr, "Wrote %lld events to %s\n", (long long)written, path);
+	if (fsync(out_fd) < 0 || close(out_fd) < 0) {
+		perror("Error writing slice");
+		return 1;
+	}
+	return (written >= 0) ? 0 : 1;
+}
+
+/**
+ * Print events from the current position as replayable SQL
+ **/
+static int write_sql(struct ybp_binlog_parser* bp, struct ybp_event* evbuf, int num_to_show, bool show_all, const char* load_dir)
+{
+	struct ybp_sql_writer writer;
+	static char outbuf[1 << 20];
+	int i = 0;
+	int ret = 0;
+	/* Replays are big; don't pay for a write() per line */
+	setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+	if (ybp_sql_begin(&writer, bp, stdout) < 0) {
+		fprintf(stderr, "Unable to write SQL header\n");
+		return 1;
+	}
+	if (load_dir != NULL && (writer.loads = ybp_get_loads(load_dir)) == NULL)
+		return 1;
+	while ((ybp_next_event(bp, evbuf) >= 0) && (show_all || i < num_to_show)) {
+		if (ybp_sql_event(&writer, evbuf) < 0) {
+			ret = 1;
+			break;
+		}
+		ybp_reset_event(evbuf);
+		i+=1;
+	}
+	if (ybp_sql_end(&writer) < 0)
+		ret = 1;
+	if (ret != 0)
+		perror("write");
+	ybp_dispose_loads(writer.loads);
+	return ret;
+}
+
+/**
+ * What the samples saw of one type, database or table
+ **/
+struct sample_key {
+	char*		name;
+	double*		events;	/* per sample */
+	double*		bytes;
+	struct ybp_estimate	event_estimate;
+	struct ybp_estimate	byte_estimate;
+};
+
+struct sample_stats {
+	struct ybp_binlog_parser*	bp;
+	unsigned int	num_samples;
+	double*		events;	/* everything each sample saw */
+	double*		bytes;
+	struct sample_key*	keys;
+	size_t		num_keys;
+	size_t		keys_size;
+	unsigned int	table_sample;	/* the sample table was seen in */
+	char		table[512];	/* the last TABLE_MAP's db.table */
+	size_t		table_db_len;
+};
+
+static struct sample_key* sample_key(struct sample_stats* s, const char* name)
+{
+	size_t i;
+	struct sample_key* k;
+	for (i = 0; i < s->num_keys; ++i) {
+		if (strcmp(s->keys[i].name, name) == 0)
+			return s->keys + i;
+	}
+	if (s->num_keys == s->keys_size) {
+		size_t size = s->keys_size ? 2 * s->keys_size : 64;
+		struct sample_key* keys;
+		if ((keys = realloc(s->keys, size * sizeof(struct sample_key))) == NULL)
+			return NULL;
+		s->keys = keys;
+		s->keys_size = size;
+	}
+	k = s->keys + s->num_keys;
+	k->name = strdup(name);
+	k->events = calloc(s->num_samples, sizeof(double));
+	k->bytes = calloc(s->num_samples, sizeof(double));
+	if (k->name == NULL || k->events == NULL || k->bytes == NULL) {
+		free(k->name);
+		free(k->events);
+		free(k->bytes);
+		return NULL;
+	}
+	s->num_keys++;
+	return k;
+}
+
+static int sample_count(struct sample_stats* s, const char* name, struct ybp_event* e, unsigned int sample)
+{
+	struct sample_key* k;
+	if ((k = sample_key(s, name)) == NULL) {
+		perror("sample_key");
+		return -1;
+	}
+	k->events[sample] += 1;
+	k->bytes[sample] += e->length;
+	return 0;
+}
+
+static bool is_rows_event(uint8_t type_code)
+{
+	return ((type_code >= WRITE_ROWS_EVENT && type_code <= DELETE_ROWS_EVENT) ||
+			(type_code >= WRITE_ROWS_EVENT_V2 && type_code <= DELETE_ROWS_EVENT_V2) ||
+			type_code == PARTIAL_UPDATE_ROWS_EVENT ||
+			(type_code >= WRITE_ROWS_COMPRESSED_EVENT_V1 && type_code <= DELETE_ROWS_COMPRESSED_EVENT));
+}
+
+/**
+ * Count an event under its type, and its database and table where it has
+ * them. Row events belong to the table map before them, if the same
+ * sample saw it.
+ **/
+static int sample_event(struct ybp_event* restrict e, unsigned int sample, void* arg)
+{
+	struct sample_stats* s = arg;
+	struct ybp_decoded_event d;
+	char key[600];
+	s->events[sample] += 1;
+	s->bytes[sample] += e->length;
+	snprintf(key, sizeof(key), "type %s", ybp_event_type(e));
+	if (sample_count(s, key, e, sample) < 0)
+		return -1;
+	snprintf(key, sizeof(key), "db   (none)");
+	if (e->type_code == QUERY_EVENT && ybp_decode_event(s->bp, e, &d) == 0) {
+		if (d.u.query.db_name_len > 0)
+			snprintf(key, sizeof(key), "db   %.*s", (int)d.u.query.db_name_len, d.u.query.db_name);
+	}
+	else if (e->type_code == TABLE_MAP_EVENT && ybp_decode_event(s->bp, e, &d) == 0) {
+		/* length-prefixed, NUL-ended names after the post-header */
+		const unsigned char* b = (const unsigned char*)d.body;
+		size_t db_len, table_len;
+		if (d.body_len >= 1 && 3 + (size_t)b[0] <= d.body_len) {
+			db_len = b[0];
+			table_len = b[2 + db_len];
+			if (3 + db_len + table_len <= d.body_len) {
+				snprintf(s->table, sizeof(s->table), "%.*s.%.*s", (int)db_len, b + 1,
+						(int)table_len, b + 3 + db_len);
+				s->table_db_len = db_len;
+				s->table_sample = sample + 1;
+			}
+		}
+	}
+	if ((e->type_code == TABLE_MAP_EVENT || is_rows_event(e->type_code)) && s->table_sample == sample + 1) {
+		snprintf(key, sizeof(key), "db   %.*s", (int)s->table_db_len, s->table);
+		if (sample_count(s, key, e, sample) < 0)
+			return -1;
+		snprintf(key, sizeof(key), "tbl  %s", s->table);
+	}
+	return sample_count(s, key, e, sample);
+}
+
+static int sample_key_cmp(const void* a, const void* b)
+{
+	const struct sample_key* x = a;
+	const struct sample_key* y = b;
+	int c = strncmp(x->name, y->name, 4);
+	if (c != 0)
+		return c;
+	return (x->byte_estimate.share < y->byte_estimate.share) - (x->byte_estimate.share > y->byte_estimate.share);
+}
+
+/**
+ * Estimate what the binlog is made of from num_samples windows of it
+ **/
+static int estimate_binlog(struct ybp_binlog_parser* bp, unsigned int num_samples, off64_t window, unsigned int seed)
+{
+	struct sample_stats s;
+	off64_t span = ybp_sample_span(bp);
+	double scale, seen = 0;
+	struct ybp_estimate total;
+	unsigned int i;
+	size_t k;
+	int ret;
+	if (span == 0) {
+		printf("No events after the FDE to sample\n");
+		return 0;
+	}
+	memset(&s, 0, sizeof(s));
+	s.bp = bp;
+	s.num_samples = num_samples;
+	s.events = calloc(num_samples, sizeof(double));
+	s.bytes = calloc(num_samples, sizeof(double));
+	if (s.events == NULL || s.bytes == NULL) {
+		perror("calloc");
+		free(s.events);
+		free(s.bytes);
+		return 1;
+	}
+	if (window > span)
+		window = span;
+	if ((ret = ybp_sample(bp, num_samples, window, seed, sample_event, &s)) != 0) {
+		fprintf(stderr, "Sampling failed\n");
+		for (k = 0; k < s.num_keys; ++k) {
+			free(s.keys[k].name);
+			free(s.keys[k].events);
+			free(s.keys[k].bytes);
+		}
+		free(s.keys);
+		free(s.events);
+		free(s.bytes);
+		return 1;
+	}
+	scale = (double)span / window;
+	for (i = 0; i < num_samples; ++i)
+		seen += s.events[i];
+	ybp_sample_estimate(s.events, s.events, num_samples, scale, &total);
+	printf("%.0f events in %u samples of %lld bytes (%.2f%% of the binlog)\n", seen, num_samples,
+			(long long)window, 100.0 * num_samples * window / span);
+	printf("estimated %.0f +/- %.0f events in the binlog; 95%% intervals below\n\n", total.total, total.total_ci);
+	printf("%-40s %22s %18s %18s\n", "", "events", "event share", "byte share");
+	for (k = 0; k < s.num_keys; ++k) {
+		ybp_sample_estimate(s.keys[k].events, s.events, num_samples, scale, &s.keys[k].event_estimate);
+		ybp_sample_estimate(s.keys[k].bytes, s.bytes, num_samples, scale, &s.keys[k].byte_estimate);
+	}
+	qsort(s.keys, s.num_keys, sizeof(struct sample_key), sample_key_cmp);
+	for (k = 0; k < s.num_keys; ++k) {
+		struct sample_key* key = s.keys + k;
+		printf("%-40s %11.0f +/- %-7.0f %7.2f%% +/- %5.2f%% %7.2f%% +/- %5.2f%%\n", key->name,
+				key->event_estimate.total, key->event_estimate.total_ci,
+				100 * key->event_estimate.share, 100 * key->event_estimate.share_ci,
+				100 * key->byte_estimate.share, 100 * key->byte_estimate.share_ci);
+		free(key->name);
+		free(key->events);
+		free(key->bytes);
+	}
+	free(s.keys);
+	free(s.events);
+	free(s.bytes);
+	return 0;
+}
+
+#define BLOOM_SUFFIX ".ybpbloom"
+#define EVENT_INDEX_SUFFIX ".ybpevents"
+
+static char* sidecar_path(const char* binlog, const char* suffix)
+{
+	char* path;
+	if ((path = malloc(strlen(binlog) + strlen(suffix) + 1)) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	sprintf(path, "%s%s", binlog, suffix);
+	return path;
+}
+
+/**
+ * Bring each binlog's sidecars (Bloom filters and event index) up to date,
+ * reading only what the existing ones don't cover
+ **/
+static int index_binlogs(char** paths, int num_paths, bool esi)
+{
+	int i, fd;
+	for (i = 0; i < num_paths; ++i) {
+		struct ybp_binlog_parser* bp;
+		char* bloom_sidecar;
+		char* events_sidecar;
+		int ret = 0;
+		if ((bp = open_binlog(paths[i], esi, &fd)) == NULL)
+			return 1;
+		if ((bloom_sidecar = sidecar_path(paths[i], BLOOM_SUFFIX)) == NULL ||
+				(events_sidecar = sidecar_path(paths[i], EVENT_INDEX_SUFFIX)) == NULL)
+			return 1;
+		if (ybp_load_bloom_index(bp, bloom_sidecar) == -1 ||
+				ybp_extend_bloom_index(bp) < 0 ||
+				ybp_save_bloom_index(bp, bloom_sidecar) < 0 ||
+				ybp_load_event_index(bp, events_sidecar) == -1 ||
+				ybp_extend_event_index(bp, SIZE_MAX) < 0 ||
+				ybp_save_event_index(bp, events_sidecar) < 0) {
+			fprintf(stderr, "Unable to index %s\n", paths[i]);
+			ret = 1;
+		}
+		else {
+			fprintf(stderr, "%s: %zu events, %zu blocks\n", paths[i], bp->event_index->count,
+					bp->bloom_index->num_blocks);
+		}
+		free(bloom_sidecar);
+		free(events_sidecar);
+		ybp_dispose_binlog_parser(bp);
+		close(fd);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int parse_bloom_query(char* spec, struct ybp_bloom_query* q)
+{
+	char* term;
+	char* saveptr;
+	q->db = NULL;
+	q->table = NULL;
+	q->thread_id = -1;
+	for (term = strtok_r(spec, ",", &saveptr); term != NULL; term = strtok_r(NULL, ",", &saveptr)) {
+		if (strncmp(term, "db=", 3) == 0)
+			q->db = term + 3;
+		else if (strncmp(term, "table=", 6) == 0)
+			q->table = term + 6;
+		else if (strncmp(term, "thread=", 7) == 0)
+			q->thread_id = atoll(term + 7);
+		else
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Print the events starting in [start, end) that match q, along with
+ * the row events of matching table maps (even past the end of the run)
+ **/
+static int search_run(struct ybp_binlog_parser* bp, struct ybp_event* evbuf, off64_t start, off64_t end,
+		const struct ybp_bloom_query* q, bool q_mode, const char* tag)
+{
+	bool rows_match = false;
+	bool after_table_map = false;
+	off64_t offset = ybp_nearest_offset(bp, start);
+	if (offset == -2)
+		return 0;
+	else if (offset < 0)
+		return -1;
+	ybp_rewind_bp(bp, offset);
+	while (ybp_tell_bp(bp) < end || (rows_match && after_table_map)) {
+		int ret = ybp_next_event(bp, evbuf);
+		if (ret < 0)
+			break;
+		if (evbuf->type_code == TABLE_MAP_EVENT) {
+			if (!after_table_map)
+				rows_match = false;
+			after_table_map = true;
+			rows_match |= ybp_bloom_event_matches(bp, evbuf, q);
+		}
+		else if (!is_rows_event(evbuf->type_code)) {
+			after_table_map = false;
+			rows_match = false;
+		}
+		if (ybp_bloom_event_matches(bp, evbuf, q) ||
+				(rows_match && is_rows_event(evbuf->type_code)))
+			show_event(bp, evbuf, q_mode, NULL, tag, stdout);
+		ybp_reset_event(evbuf);
+		if (ret == 0)
+			break;
+	}
+	return 0;
+}
+
+/**
+ * Find what q asks for across several binlogs, skipping the blocks their
+ * Bloom sidecars rule out. Binlogs without one are read in full.
+ **/
+static int search_binlogs(char** paths, int num_paths, bool esi, char* spec, bool q_mode)
+{
+	struct ybp_bloom_query q;
+	struct ybp_event* evbuf;
+	int i, fd;
+	if (parse_bloom_query(spec, &q) < 0) {
+		fprintf(stderr, "Invalid search %s; expected db=, table= and/or thread=\n", spec);
+		return 1;
+	}
+	if ((evbuf = ybp_get_event()) == NULL) {
+		perror("malloc event");
+		return 1;
+	}
+	for (i = 0; i < num_paths; ++i) {
+		struct ybp_binlog_parser* bp;
+		struct ybp_bloom_index* idx;
+		char* sidecar;
+		size_t block, num_blocks, runs_read = 0;
+		if ((bp = open_binlog(paths[i], esi, &fd)) == NULL)
+			return 1;
+		if ((sidecar = sidecar_path(paths[i], BLOOM_SUFFIX)) == NULL)
+			return 1;
+		if (ybp_load_bloom_index(bp, sidecar) != 0) {
+			fprintf(stderr, "%s: no usable %s, reading all of it\n", paths[i], sidecar);
+			search_run(bp, evbuf, bp->first_event_offset, bp->file_size, &q, q_mode, paths[i]);
+		}
+		else {
+			idx = bp->bloom_index;
+			num_blocks = (bp->file_size + idx->block_size - 1) / idx->block_size;
+			for (block = 0; block < num_blocks; ++block) {
+				size_t run_end = block;
+				if (!ybp_bloom_block_may_match(idx, block, &q))
+					continue;
+				while (run_end + 1 < num_blocks && ybp_bloom_block_may_match(idx, run_end + 1, &q))
+					++run_end;
+				search_run(bp, evbuf, (off64_t)block * idx->block_size, (off64_t)(run_end + 1) * idx->block_size,
+						&q, q_mode, paths[i]);
+				runs_read += run_end + 1 - block;
+				block = run_end;
+			}
+			fprintf(stderr, "%s: read %zu of %zu blocks\n", paths[i], runs_read, num_blocks);
+		}
+		free(sidecar);
+		ybp_dispose_binlog_parser(bp);
+		close(fd);
+	}
+	ybp_dispose_event(evbuf);
+	return 0;
+}
+
+/**
+ * Print the query events matching g (and filter, if given) in each binlog,
+ * tagged with the binlog's name if there's more than one
+ **/
+static int grep_binlogs(char** paths, int num_paths, bool esi, struct ybp_grep* g, bool q_mode, char* database_limit,
+		struct ybp_filter* filter)
+{
+	struct ybp_event* evbuf;
+	int i, fd;
+	if ((evbuf = ybp_get_event()) == NULL) {
+		perror("malloc event");
+		return 1;
+	}
+	for (i = 0; i < num_paths; ++i) {
+		struct ybp_binlog_parser* bp;
+		if ((bp = open_binlog(paths[i], esi, &fd)) == NULL)
+			return 1;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		while (ybp_next_event(bp, evbuf) >= 0) {
+			/* Only what matches is worth formatting */
+			if (ybp_grep_event(bp, g, evbuf) && (filter == NULL || ybp_filter_event(bp, filter, evbuf)))
+				show_event(bp, evbuf, q_mode, database_limit, (num_paths > 1) ? paths[i] : NULL, stdout);
+			ybp_reset_event(evbuf);
+		}
+		ybp_dispose_binlog_parser(bp);
+		close(fd);
+	}
+	ybp_dispose_event(evbuf);
+	ybp_dispose_grep(g);
+	return 0;
+}
+
+static void print_shapes(struct ybp_fingerprints* f, size_t n, const char* title)
+{
+	struct ybp_fingerprint_entry* top;
+	size_t i, num_top;
+	if ((top = malloc(n * sizeof(struct ybp_fingerprint_entry))) == NULL) {
+		perror("malloc");
+		return;
+	}
+	num_top = ybp_fingerprints_top(f, top, n);
+	printf("top %zu statement shapes by %s, of %llu statements in %llu bytes\n", num_top, title,
+			(unsigned long long)f->total_count, (unsigned long long)f->total_bytes);
+	printf("%4s %12s %12s %14s %10s  %s\n", "", "count", "(+/-)", "bytes", "query_time", "shape");
+	for (i = 0; i < num_top; ++i) {
+		printf("%4zu %12llu %12llu %14llu %10llu  %s\n", i + 1, (unsigned long long)top[i].count,
+				(unsigned long long)top[i].weight_error, (unsigned long long)top[i].bytes,
+				(unsigned long long)top[i].query_time, top[i].shape);
+		printf("%4s %12s %12s %14s %10s  e.g. %s\n", "", "", "", "", "", top[i].sample);
+	}
+	printf("\n");
+	free(top);
+}
+
+/**
+ * Print the n most common statement shapes in the given binlogs, by count
+ * and by bytes
+ **/
+static int fingerprint_binlogs(char** paths, int num_paths, bool esi, size_t n)
+{
+	struct ybp_fingerprints* by_count;
+	struct ybp_fingerprints* by_bytes;
+	struct ybp_event* evbuf;
+	/* Plenty of slack below the top n keeps their counts close */
+	size_t capacity = (n * 20 > 1000) ? n * 20 : 1000;
+	int i, fd;
+	if ((evbuf = ybp_get_event()) == NULL) {
+		perror("malloc event");
+		return 1;
+	}
+	by_count = ybp_get_fingerprints(capacity, YBP_FINGERPRINT_BY_COUNT);
+	by_bytes = ybp_get_fingerprints(capacity, YBP_FINGERPRINT_BY_BYTES);
+	if (by_count == NULL || by_bytes == NULL)
+		return 1;
+	for (i = 0; i < num_paths; ++i) {
+		struct ybp_binlog_parser* bp;
+		if ((bp = open_binlog(paths[i], esi, &fd)) == NULL)
+			return 1;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		while (ybp_next_event(bp, evbuf) >= 0) {
+			if (ybp_fingerprints_observe(by_count, bp, evbuf) < 0 ||
+					ybp_fingerprints_observe(by_bytes, bp, evbuf) < 0)
+				return 1;
+			ybp_reset_event(evbuf);
+		}
+		ybp_dispose_binlog_parser(bp);
+		close(fd);
+	}
+	print_shapes(by_count, n, "count");
+	print_shapes(by_bytes, n, "bytes");
+	ybp_dispose_fingerprints(by_count);
+	ybp_dispose_fingerprints(by_bytes);
+	ybp_dispose_event(evbuf);
+	return 0;
+}
+
+/**
+ * The binlogs of both sides of -c, for naming transactions
+ **/
+struct compare_sides {
+	char**	paths[2];
+	struct ybp_divergence*	d;
+	bool	printed_head;
+};
+
+static void print_transaction(const char* marker, char** paths, const struct ybp_txn_digest* t)
+{
+	printf("%s %s:%lld %u", marker, paths[t->file], (long long)t->offset, t->timestamp);
+	if (t->has_gtid) {
+		char gtid[YBP_GTID_STR_LEN];
+		ybp_format_gtid(&t->gtid, gtid);
+		printf(" %s", gtid);
+	}
+	printf("%s\n", t->complete ? "" : " (incomplete)");
+}
+
+/**
+ * Say where the common history ends (=) and where each side goes from
+ * there (!), once, before the transactions only one side has
+ **/
+static void print_divergence(struct compare_sides* sides)
+{
+	int side;
+	if (sides->printed_head)
+		return;
+	sides->printed_head = true;
+	if (!sides->d->overlap)
+		printf("no history in common\n");
+	for (side = 0; sides->d->overlap && side < 2; ++side)
+		print_transaction("=", sides->paths[side], &sides->d->last_common[side]);
+	for (side = 0; side < 2; ++side) {
+		if (sides->d->has_first[side])
+			print_transaction("!", sides->paths[side], &sides->d->first[side]);
+	}
+}
+
+static void show_extra(int side, const struct ybp_txn_digest* t, void* arg)
+{
+	struct compare_sides* sides = arg;
+	print_divergence(sides);
+	print_transaction((side == 0) ? "<" : ">", sides->paths[side], t);
+}
+
+static void close_chain(struct ybp_binlog_parser** parsers, int num_paths)
+{
+	int i;
+	for (i = 0; i < num_paths; ++i) {
+		close(parsers[i]->fd);
+		ybp_dispose_binlog_parser(parsers[i]);
+	}
+	free(parsers);
+}
+
+/**
+ * Open every binlog in paths. Returns the parsers, or NULL (having
+ * complained).
+ **/
+static struct ybp_binlog_parser** open_chain(char** paths, int num_paths, bool esi)
+{
+	struct ybp_binlog_parser** parsers;
+	int i, fd;
+	if ((parsers = calloc(num_paths + 1, sizeof(struct ybp_binlog_parser*))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	for (i = 0; i < num_paths; ++i) {
+		if ((parsers[i] = open_binlog(paths[i], esi, &fd)) == NULL) {
+			close_chain(parsers, i);
+			return NULL;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+	return parsers;
+}
+
+/**
+ * Find where the chain of binlogs in paths and the comma-separated chain
+ * other part ways, and list what each has that the other doesn't
+ **/
+static int compare_binlogs(char** paths, int num_paths, char* other, bool esi)
+{
+	struct compare_sides sides;
+	struct ybp_binlog_parser** parsers[2] = {NULL, NULL};
+	struct ybp_divergence d;
+	int num[2] = {num_paths, 0};
+	char* path;
+	int side, ret = 1;
+	if ((sides.paths[1] = calloc(strlen(other) / 2 + 2, sizeof(char*))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	sides.paths[0] = paths;
+	for (path = strtok(other, ","); path != NULL; path = strtok(NULL, ","))
+		sides.paths[1][num[1]++] = path;
+	for (side = 0; side < 2; ++side) {
+		if ((parsers[side] = open_chain(sides.paths[side], num[side], esi)) == NULL)
+			goto out;
+	}
+	sides.d = &d;
+	sides.printed_head = false;
+	if (ybp_find_divergence(parsers[0], num[0], parsers[1], num[1], &d, show_extra, &sides) < 0)
+		goto out;
+	print_divergence(&sides);
+	fprintf(stderr, "%zu transactions only in the binlogs given, %zu only in %s, %zu in both past that point "
+			"(%u lookups, %zu compared in turn)\n", d.num_extra[0], d.num_extra[1], sides.paths[1][0],
+			d.num_shared_after, d.probes, d.num_compared);
+	ret = 0;
+out:
+	for (side = 0; side < 2; ++side) {
+		if (parsers[side] != NULL)
+			close_chain(parsers[side], num[side]);
+	}
+	free(sides.paths[1]);
+	return ret;
+}
+
+/**
+ * Read the chain of binlogs in paths (oldest first) from the transaction
+ * around starting_time up to ending_time (or the end), keeping the last
+ * image of each row the row events in that window touch, and write the
+ * result to json_path (as JSON lines; "-" is stdout) and/or binlog_path
+ **/
+static int compact_binlogs(char** paths, int num_paths, bool esi, long starting_time, long ending_time,
+		const char* json_path, const char* binlog_path, long memory_kb)
+{
+	struct ybp_binlog_parser** parsers;
+	struct ybp_compactor* c;
+	struct ybp_event* evbuf;
+	bool started = (starting_time < 0);
+	bool done = false;
+	int i, ret = 1;
+	if ((parsers = open_chain(paths, num_paths, esi)) == NULL)
+		return 1;
+	if ((c = ybp_get_compactor((size_t)memory_kb << 10, NULL)) == NULL) {
+		close_chain(parsers, num_paths);
+		return 1;
+	}
+	if ((evbuf = ybp_get_event()) == NULL) {
+		perror("malloc event");
+		ybp_dispose_compactor(c);
+		close_chain(parsers, num_paths);
+		return 1;
+	}
+	for (i = 0; i < num_paths && !done; ++i) {
+		struct ybp_binlog_parser* bp = parsers[i];
+		if (!started) {
+			off64_t offset = ybp_nearest_time(bp, starting_time);
+			/* Nothing that late in this one */
+			if (offset == -2)
+				continue;
+			if (offset == -1 || (offset = ybp_transaction_start(bp, offset)) < 0) {
+				perror("nearest_time");
+				goto out;
+			}
+			ybp_rewind_bp(bp, offset);
+			started = true;
+		}
+		posix_fadvise(bp->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		while (ybp_next_event(bp, evbuf) >= 0) {
+			if (ending_time >= 0 && evbuf->timestamp >= ending_time) {
+				done = true;
+				break;
+			}
+			if (starting_time < 0 || evbuf->timestamp >= starting_time || !is_rows_event(evbuf->type_code)) {
+				if (ybp_compactor_observe(c, bp, i, evbuf) < 0)
+					goto out;
+			}
+			ybp_reset_event(evbuf);
+		}
+	}
+	if (json_path != NULL) {
+		FILE* out = (strcmp(json_path, "-") == 0) ? stdout : fopen(json_path, "w");
+		off64_t rows;
+		if (out == NULL) {
+			perror("Error opening JSON output");
+			goto out;
+		}
+		rows = ybp_compactor_write_json(c, parsers, num_paths, out);
+		if ((out != stdout && fclose(out) != 0) || rows < 0) {
+			perror("Error writing JSON");
+			goto out;
+		}
+		fprintf(stderr, "Wrote %lld rows to %s\n", (long long)rows, json_path);
+	}
+	if (binlog_path != NULL) {
+		off64_t written;
+		int out_fd;
+		if ((out_fd = open(binlog_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror("Error opening compacted binlog");
+			goto out;
+		}
+		written = ybp_compactor_write_binlog(c, parsers, num_paths, out_fd);
+		if (written == -2)
+			fprintf(stderr, "Can't write a binlog with this one's header layout\n");
+		else if (written >= 0)
+			fprintf(stderr, "Wrote %lld events to %s\n", (long long)written, binlog_path);
+		if (fsync(out_fd) < 0 || close(out_fd) < 0) {
+			perror("Error writing compacted binlog");
+			goto out;
+		}
+		if (written < 0)
+			goto out;
+	}
+	fprintf(stderr, "%llu row images read, %llu without their key columns, %llu row events skipped, "
+			"%zu spills\n", (unsigned long long)c->rows_seen, (unsigned long long)c->rows_skipped,
+			(unsigned long long)c->events_skipped, c->num_runs);
+	ret = 0;
+out:
+	ybp_dispose_compactor(c);
+	ybp_dispose_event(evbuf);
+	close_chain(parsers, num_paths);
+	return ret;
+}
+
+#define SESSION_FILES_OPEN 256
+#define SESSIONS_TRACKED 65536
+
+/**
+ * Where -r/-R send each session's events
+ **/
+struct session_output {
+	const char*	dir;		/* NULL to tag them on stdout instead */
+	bool		q_mode;
+	char*		database_limit;
+};
+
+static void close_session_file(struct ybp_session* session, void* arg)
+{
+	(void)arg;
+	if (session->user != NULL) {
+		fclose(session->user);
+		session->user = NULL;
+	}
+}
+
+/**
+ * Open (for appending, since an evicted session may come back) the file
+ * for session's events in o->dir
+ **/
+static FILE* session_file(struct session_output* o, struct ybp_session* session)
+{
+	if (session->user == NULL) {
+		char path[FILENAME_MAX];
+		snprintf(path, sizeof(path), "%s/thread-%u.log", o->dir, session->thread_id);
+		if ((session->user = fopen(path, "a")) == NULL)
+			fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+	}
+	return session->user;
+}
+
+/**
+ * Split the statements in the binlogs given (in order) up by the client
+ * connection that ran them, each with the INTVAR, RAND and USER_VAR events
+ * it depends on. thread_ids is "all" or a comma-separated list of the ones
+ * to follow.
+ **/
+static int session_binlogs(char** paths, int num_paths, bool esi, const char* thread_ids, struct session_output* o)
+{
+	struct ybp_sessions* s;
+	struct ybp_event* evbuf;
+	uint32_t* filter = NULL;
+	size_t filter_len = 0;
+	int i, fd, ret = 1;
+	if (strcmp(thread_ids, "all") != 0) {
+		const char* p = thread_ids;
+		if ((filter = malloc((strlen(thread_ids) / 2 + 1) * sizeof(uint32_t))) == NULL) {
+			perror("malloc");
+			return 1;
+		}
+		for (;;) {
+			char* end;
+			unsigned long id = strtoul(p, &end, 10);
+			if (end == p || (*end != ',' && *end != '\0')) {
+				fprintf(stderr, "Invalid thread ids %s\n", thread_ids);
+				free(filter);
+				return 1;
+			}
+			filter[filter_len++] = (uint32_t)id;
+			if (*end == '\0')
+				break;
+			p = end + 1;
+		}
+	}
+	if (o->dir != NULL && mkdir(o->dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating %s: %s\n", o->dir, strerror(errno));
+		free(filter);
+		return 1;
+	}
+	/* Every open file counts against the descriptor limit */
+	s = ybp_get_sessions((o->dir != NULL) ? SESSION_FILES_OPEN : SESSIONS_TRACKED,
+			(o->dir != NULL) ? close_session_file : NULL, NULL);
+	if (s == NULL || ybp_sessions_filter(s, filter, filter_len) < 0 ||
+			(evbuf = ybp_get_event()) == NULL) {
+		ybp_dispose_sessions(s);
+		free(filter);
+		return 1;
+	}
+	free(filter);
+	for (i = 0; i < num_paths; ++i) {
+		struct ybp_binlog_parser* bp;
+		struct ybp_session* session;
+		if ((bp = open_binlog(paths[i], esi, &fd)) == NULL)
+			goto out;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		while (ybp_sessions_next(s, bp, evbuf, &session) >= 0) {
+			char tag[32];
+			FILE* out = stdout;
+			size_t j;
+			if (session == NULL)
+				continue;
+			if (o->dir != NULL) {
+				if ((out = session_file(o, session)) == NULL) {
+					ybp_dispose_binlog_parser(bp);
+					close(fd);
+					goto out;
+				}
+				tag[0] = '\0';
+			}
+			else
+				snprintf(tag, sizeof(tag), "thread %u", session->thread_id);
+			for (j = 0; j < s->num_context; ++j)
+				show_event(bp, &s->context[j], o->q_mode, o->database_limit, (tag[0] != '\0') ? tag : NULL, out);
+			show_event(bp, evbuf, o->q_mode, o->database_limit, (tag[0] != '\0') ? tag : NULL, out);
+		}
+		ybp_dispose_binlog_parser(bp);
+		close(fd);
+	}
+	fprintf(stderr, "%llu sessions, %llu evicted, %llu events of other threads skipped\n",
+			(unsigned long long)s->num_created, (unsigned long long)s->num_evicted,
+			(unsigned long long)s->events_skipped);
+	ret = 0;
+out:
+	ybp_dispose_event(evbuf);
+	ybp_dispose_sessions(s);
+	return ret;
+}
+
+#define SCAN_SPLIT_SIZE (64LL << 20)
+#define SCAN_SERVER_IDS 64
+#define SCAN_INTERVAL_MS 1000
+
+/**
+ * What -A counts, over every event
+ **/
+struct scan_counts {
+	uint64_t	events[256];
+	uint64_t	bytes[256];
+	const char*	names[256];
+	uint32_t	first_time;
+	uint32_t	last_time;
+	uint32_t	server_ids[SCAN_SERVER_IDS];
+	size_t		num_server_ids;
+	bool		more_server_ids;
+};
+
+static void scan_counts_init(void* state, void* arg)
+{
+	struct scan_counts* c = state;
+	(void)arg;
+	c->first_time = UINT32_MAX;
+}
+
+static void scan_counts_server_id(struct scan_counts* c, uint32_t server_id)
+{
+	size_t i;
+	for (i = 0; i < c->num_server_ids; ++i) {
+		if (c->server_ids[i] == server_id)
+			return;
+	}
+	if (c->num_server_ids < SCAN_SERVER_IDS)
+		c->server_ids[c->num_server_ids++] = server_id;
+	else
+		c->more_server_ids = true;
+}
+
+static int scan_counts_observe(void* restrict state, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e,
+		size_t file, void* arg)
+{
+	struct scan_counts* c = state;
+	(void)p;
+	(void)file;
+	(void)arg;
+	if (c->events[e->type_code]++ == 0)
+		c->names[e->type_code] = ybp_event_type(e);
+	c->bytes[e->type_code] += e->length;
+	if (e->timestamp < c->first_time)
+		c->first_time = e->timestamp;
+	if (e->timestamp > c->last_time)
+		c->last_time = e->timestamp;
+	scan_counts_server_id(c, e->server_id);
+	return 0;
+}
+
+static void scan_counts_merge(void* restrict into, void* restrict from, void* arg)
+{
+	struct scan_counts* c = into;
+	struct scan_counts* f = from;
+	size_t i;
+	(void)arg;
+	for (i = 0; i < 256; ++i) {
+		if (f->events[i] > 0)
+			c->names[i] = f->names[i];
+		c->events[i] += f->events[i];
+		c->bytes[i] += f->bytes[i];
+	}
+	if (f->first_time < c->first_time)
+		c->first_time = f->first_time;
+	if (f->last_time > c->last_time)
+		c->last_time = f->last_time;
+	for (i = 0; i < f->num_server_ids; ++i)
+		scan_counts_server_id(c, f->server_ids[i]);
+	c->more_server_ids |= f->more_server_ids;
+}
+
+/**
+ * What -A counts, by binlog, of the events -g/-e/-w pick out
+ **/
+struct scan_matches {
+	uint64_t*	counts;
+	off64_t*	first;	/* offset of the first, or -1 */
+};
+
+struct scan_match_args {
+	struct ybp_grep*	grep;
+	struct ybp_filter*	filter;
+	size_t		num_files;
+};
+
+static void scan_matches_init(void* state, void* arg)
+{
+	struct scan_matches* m = state;
+	struct scan_match_args* a = arg;
+	size_t i;
+	/* An unallocated state just counts nothing */
+	if ((m->counts = calloc(a->num_files, sizeof(uint64_t))) == NULL ||
+			(m->first = malloc(a->num_files * sizeof(off64_t))) == NULL) {
+		perror("malloc");
+		free(m->counts);
+		m->counts = NULL;
+		return;
+	}
+	for (i = 0; i < a->num_files; ++i)
+		m->first[i] = -1;
+}
+
+static int scan_matches_observe(void* restrict state, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e,
+		size_t file, void* arg)
+{
+	struct scan_matches* m = state;
+	struct scan_match_args* a = arg;
+	if (m->counts == NULL)
+		return -1;
+	if (a->grep != NULL && !ybp_grep_event(p, a->grep, e))
+		return 0;
+	if (a->filter != NULL && !ybp_filter_event(p, a->filter, e))
+		return 0;
+	m->counts[file]++;
+	if (m->first[file] < 0 || e->offset < m->first[file])
+		m->first[file] = e->offset;
+	return 0;
+}
+
+static void scan_matches_merge(void* restrict into, void* restrict from, void* arg)
+{
+	struct scan_matches* m = into;
+	struct scan_matches* f = from;
+	struct scan_match_args* a = arg;
+	size_t i;
+	if (m->counts == NULL || f->counts == NULL)
+		return;
+	for (i = 0; i < a->num_files; ++i) {
+		m->counts[i] += f->counts[i];
+		if (f->first[i] >= 0 && (m->first[i] < 0 || f->first[i] < m->first[i]))
+			m->first[i] = f->first[i];
+	}
+}
+
+static void scan_matches_dispose(void* state, void* arg)
+{
+	struct scan_matches* m = state;
+	(void)arg;
+	free(m->counts);
+	free(m->first);
+}
+
+static void print_scan_progress(const struct ybp_scan_progress* pr, void* arg)
+{
+	bool tty = *(bool*)arg;
+	double done = (pr->bytes_total > 0) ? (double)pr->bytes_done / pr->bytes_total : 1;
+	fprintf(stderr, "%s%5.1f%% of %.1f MB, %llu/%llu binlogs, %llu events, %.0fs", tty ? "\r" : "",
+			done * 100, pr->bytes_total / 1048576.0, (unsigned long long)pr->files_done,
+			(unsigned long long)pr->num_files, (unsigned long long)pr->events, pr->elapsed);
+	if (done > 0 && pr->files_done < pr->num_files)
+		fprintf(stderr, ", about %.0fs to go  ", pr->elapsed * (1 - done) / done);
+	else
+		fprintf(stderr, "                    ");
+	if (!tty || pr->files_done == pr->num_files)
+		fprintf(stderr, "\n");
+}
+
+static char** scan_paths;
+static size_t num_scan_paths;
+static size_t scan_paths_size;
+
+static int add_scan_path(const char* path)
+{
+	if (num_scan_paths == scan_paths_size) {
+		size_t size = scan_paths_size ? scan_paths_size * 2 : 64;
+		char** paths = realloc(scan_paths, size * sizeof(char*));
+		if (paths == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		scan_paths = paths;
+		scan_paths_size = size;
+	}
+	if ((scan_paths[num_scan_paths] = strdup(path)) == NULL) {
+		perror("strdup");
+		return -1;
+	}
+	num_scan_paths++;
+	return 0;
+}
+
+/**
+ * Whether a file in a directory is named like a binlog: NAME.NNNNNN
+ **/
+static bool is_binlog_name(const char* name)
+{
+	const char* dot = strrchr(name, '.');
+	if (dot == NULL || dot == name || dot[1] == '\0')
+		return false;
+	for (dot++; *dot != '\0'; ++dot) {
+		if (*dot < '0' || *dot > '9')
+			return false;
+	}
+	return true;
+}
+
+static int walk_scan_path(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+	if (flag == FTW_F && S_ISREG(st->st_mode) && is_binlog_name(path + ftw->base))
+		return add_scan_path(path);
+	if (flag == FTW_DNR)
+		fprintf(stderr, "Unable to read directory %s\n", path);
+	return 0;
+}
+
+static int compare_scan_paths(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Read every binlog given, and every binlog under the directories given,
+ * on num_threads threads, and report what's in them, counting the events
+ * g and filter pick out (if either is given) by binlog
+ **/
+static int scan_binlogs(char** args, int num_args, bool esi, unsigned int num_threads, struct ybp_grep* g,
+		struct ybp_filter* filter)
+{
+	struct ybp_scan* s;
+	struct scan_match_args match_args = { g, filter, 0 };
+	struct ybp_scan_reducer counts = { sizeof(struct scan_counts), scan_counts_init, scan_counts_observe,
+			scan_counts_merge, NULL, NULL };
+	struct ybp_scan_reducer matches = { sizeof(struct scan_matches), scan_matches_init, scan_matches_observe,
+			scan_matches_merge, scan_matches_dispose, &match_args };
+	struct scan_counts* c;
+	struct scan_matches* m = NULL;
+	int counts_r, matches_r = -1, i;
+	bool tty = isatty(STDERR_FILENO);
+	uint64_t total_events = 0, total_bytes = 0;
+	size_t t;
+	for (i = 0; i < num_args; ++i) {
+		struct stat st;
+		if (stat(args[i], &st) < 0) {
+			fprintf(stderr, "Unable to stat %s: %s\n", args[i], strerror(errno));
+			return 1;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			if (nftw(args[i], walk_scan_path, 32, FTW_PHYS) != 0)
+				return 1;
+		}
+		else if (add_scan_path(args[i]) < 0) {
+			return 1;
+		}
+	}
+	if (num_scan_paths == 0) {
+		fprintf(stderr, "No binlogs found\n");
+		return 1;
+	}
+	qsort(scan_paths, num_scan_paths, sizeof(char*), compare_scan_paths);
+	if ((s = ybp_get_scan((const char* const*)scan_paths, num_scan_paths, num_threads, SCAN_SPLIT_SIZE)) == NULL)
+		return 1;
+	s->enforce_server_id = esi;
+	match_args.num_files = num_scan_paths;
+	if ((counts_r = ybp_scan_add_reducer(s, &counts)) < 0)
+		return 1;
+	if ((g != NULL || filter != NULL) && (matches_r = ybp_scan_add_reducer(s, &matches)) < 0)
+		return 1;
+	if (ybp_scan_run(s, print_scan_progress, &tty, tty ? SCAN_INTERVAL_MS : 10 * SCAN_INTERVAL_MS) < 0)
+		return 1;
+	c = ybp_scan_result(s, counts_r);
+	printf("%zu binlogs", s->num_files);
+	if (s->files_failed > 0)
+		printf(" (%llu unreadable)", (unsigned long long)s->files_failed);
+	printf(", %.1f MB\n", s->bytes_total / 1048576.0);
+	printf("%-28s %14s %16s\n", "type", "events", "bytes");
+	for (t = 0; t < 256; ++t) {
+		if (c->events[t] == 0)
+			continue;
+		printf("%-28s %14llu %16llu\n", c->names[t], (unsigned long long)c->events[t], (unsigned long long)c->bytes[t]);
+		total_events += c->events[t];
+		total_bytes += c->bytes[t];
+	}
+	printf("%-28s %14llu %16llu\n", "total", (unsigned long long)total_events, (unsigned long long)total_bytes);
+	if (total_events > 0) {
+		printf("timestamps: %u to %u\n", c->first_time, c->last_time);
+		printf("server ids:");
+		for (t = 0; t < c->num_server_ids; ++t)
+			printf(" %u", c->server_ids[t]);
+		printf("%s\n", c->more_server_ids ? " ..." : "");
+	}
+	if (matches_r >= 0 && (m = ybp_scan_result(s, matches_r))->counts != NULL) {
+		uint64_t total_matches = 0;
+		printf("\nmatching events by binlog\n");
+		for (t = 0; t < s->num_files; ++t) {
+			if (m->counts[t] == 0)
+				continue;
+			printf("%12llu  %s (first at %lld)\n", (unsigned long long)m->counts[t], s->paths[t],
+					(long long)m->first[t]);
+			total_matches += m->counts[t];
+		}
+		printf("%12llu  in all\n", (unsigned long long)total_matches);
+	}
+	i = (s->files_failed > 0) ? 1 : 0;
+	ybp_dispose_scan(s);
+	for (t = 0; t < num_scan_paths; ++t)
+		free(scan_paths[t]);
+	free(scan_paths);
+	ybp_dispose_grep(g);
+	return i;
+}
+
+#define CDC_FLUSH_EVERY 1000
+#define CDC_FLUSH_INTERVAL_MS 1000
+
+static const char* base_name(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+	return (slash == NULL) ? path : slash + 1;
+}
+
+/**
+ * Route the events of the binlogs given (oldest first) to a binlog per
+ * table in dir, carrying on from where dir's manifest left off
+ **/
+static int cdc_binlogs(char** paths, int num_paths, bool esi, const char* dir)
+{
+	struct ybp_cdc_sink* s;
+	struct ybp_event* evbuf;
+	off64_t offset = -1;
+	int first = 0, i, fd, ret = 1;
+	if ((s = ybp_get_cdc_sink(dir, CDC_FLUSH_EVERY, CDC_FLUSH_INTERVAL_MS)) == NULL)
+		return 1;
+	if ((evbuf = ybp_get_event()) == NULL) {
+		perror("malloc event");
+		ybp_dispose_cdc_sink(s);
+		return 1;
+	}
+	if (s->file_name[0] != '\0') {
+		while (first < num_paths && strcmp(base_name(paths[first]), base_name(s->file_name)) != 0)
+			first++;
+		if (first == num_paths) {
+			fprintf(stderr, "%s left off in %s, which isn't among the binlogs given\n", dir, s->file_name);
+			goto out;
+		}
+		offset = s->offset;
+	}
+	for (i = first; i < num_paths; ++i) {
+		struct ybp_binlog_parser* bp;
+		int r = 0;
+		if ((bp = open_binlog(paths[i], esi, &fd)) == NULL)
+			goto out;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (i == first && offset >= 0)
+			ybp_rewind_bp(bp, offset);
+		while (r >= 0 && ybp_next_event(bp, evbuf) >= 0) {
+			r = ybp_cdc_sink_observe(s, bp, paths[i], evbuf);
+			ybp_reset_event(evbuf);
+		}
+		ybp_dispose_binlog_parser(bp);
+		close(fd);
+		if (r < 0)
+			goto out;
+	}
+	ret = 0;
+	fprintf(stderr, "Routed %llu events to %zu partitions in %s\n", (unsigned long long)s->events_routed,
+			s->num_partitions, dir);
+out:
+	ybp_dispose_event(evbuf);
+	ybp_dispose_cdc_sink(s);
+	return ret;
+}
+
+/**
+ * Rebuild the LOAD DATA files of the binlogs given (oldest first) in dir,
+ * printing the statements that load them from there
+ **/
+static int load_binlogs(char** paths, int num_paths, bool esi, const char* dir)
+{
+	struct ybp_loads* l;
 	struct ybp_event* evbuf;
+	int i, fd, ret = 0;
+	if ((l = ybp_get_loads(dir)) == NULL)
+		return 1;
+	if ((evbuf = ybp_get_event()) == NULL) {
+		perror("malloc event");
+		ybp_dispose_loads(l);
+		return 1;
+	}
+	for (i = 0; i < num_paths && ret == 0; ++i) {
+		struct ybp_binlog_parser* bp;
+		struct ybp_load_statement* load;
+		int r;
+		if ((bp = open_binlog(paths[i], esi, &fd)) == NULL) {
+			ret = 1;
+			break;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		/* The blocks go from file to file; only their headers need reading */
+		ybp_set_read_limit(bp, YBP_MIN_READ_LIMIT);
+		while (ybp_next_event(bp, evbuf) >= 0) {
+			if ((r = ybp_loads_observe(l, bp, evbuf, &load)) == -1) {
+				ret = 1;
+				break;
+			}
+			else if (r == -2) {
+				fprintf(stderr, "Malformed %s at %lld in %s\n", ybp_event_type(evbuf), (long long)evbuf->offset, paths[i]);
+			}
+			else if (r == 1) {
+				printf("# %s at %lld: file %u, %lld bytes, thread %u\n", paths[i], (long long)evbuf->offset,
+						load->file_id, (long long)load->size, load->thread_id);
+				if (load->db_name[0] != '\0')
+					printf("use `%s`;\n", load->db_name);
+				fwrite(load->statement, 1, load->statement_len, stdout);
+				fputs(";\n", stdout);
+			}
+			ybp_reset_event(evbuf);
+		}
+		ybp_dispose_binlog_parser(bp);
+		close(fd);
+	}
+	if (ret == 0)
+		fprintf(stderr, "Rebuilt %llu files (%llu bytes) in %s\n", (unsigned long long)l->loads,
+				(unsigned long long)l->bytes, dir);
+	ybp_dispose_event(evbuf);
+	ybp_dispose_loads(l);
+	return ret;
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	int fd = -1;
+	struct ybp_binlog_parser* bp = NULL;
+	struct ybp_event* evbuf = NULL;
+	int ret = 1;
 	long starting_offset = -1;
 	long starting_time = -1;
+	int search_fanout = 1;
+	int context_before = 0;
+	char* slice_path = NULL;
+	long ending_offset = -1;
+	long ending_time = -1;
 	int num_to_show = 2;
 	int show_all = false;
 	bool q_mode = false;
 	bool esi = true;
 	char* database_limit = NULL;
-	while ((opt = getopt(argc, argv, "ho:t:a:D:qE")) != -1) {
+	char* gtid_str = NULL;
+	bool merge_mode = false;
+	bool sql_mode = false;
+	unsigned int num_samples = 0;
+	off64_t sample_window = 65536;
+	unsigned int sample_seed = (unsigned int)time(NULL);
+	bool index_mode = false;
+	long long event_n = 0;
+	bool seek_n = false;
+	char* grep_literal = NULL;
+	char* grep_regex = NULL;
+	bool grep_icase = false;
+	long num_shapes = 0;
+	long read_limit = 0;
+	char* bloom_search = NULL;
+	char* compare_with = NULL;
+	char* compact_json = NULL;
+	char* compact_binlog = NULL;
+	long compact_memory = 256 << 10;	/* KB */
+	char* session_ids = NULL;
+	struct ybp_filter* filter = NULL;
+	struct session_output session_out = { NULL, false, NULL };
+	bool scan_mode = false;
+	long scan_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	char* cdc_dir = NULL;
+	char* load_dir = NULL;
+	while ((opt = getopt(argc, argv, "ho:t:n:p:a:B:x:O:T:D:qsS:g:e:if:L:EmIb:u:c:k:K:z:r:R:w:Aj:P:l:")) != -1) {
 		switch (opt) {
 			case 'h':
 				usage();
-				return 0;
+				ret = 0;
+				goto out;
 			case 'o':      /* Offset mode */
 				starting_offset = atoll(optarg);
 				break;
@@ -63,6 +1633,13 @@ int main(int argc, char** argv) {
 			case 't':      /* Time mode */
 				starting_time = atoll(optarg);
 				break;
+			case 'n':
+				event_n = atoll(optarg);
+				seek_n = true;
+				break;
+			case 'p':
+				search_fanout = atoi(optarg);
+				break;
 			case 'a':
 				if (strncmp(optarg, "all", 3) == 0) {
 					num_to_show = 2;
@@ -73,89 +1650,316 @@ int main(int argc, char** argv) {
 				if (num_to_show < 1)
 					num_to_show = 1;
 				break;
+			case 'B':
+				context_before = atoi(optarg);
+				break;
+			case 'x':
+				slice_path = optarg;
+				break;
+			case 'O':
+				ending_offset = atoll(optarg);
+				break;
+			case 'T':
+				ending_time = atoll(optarg);
+				break;
 			case 'D':
+				free(database_limit);
 				database_limit = strdup(optarg);
 				break;
 			case 'q':
 				q_mode = true;
 				break;
+			case 's':
+				sql_mode = true;
+				break;
+			case 'S':
+				{
+				char* comma;
+				num_samples = atoi(optarg);
+				if ((comma = strchr(optarg, ',')) != NULL) {
+					sample_window = atoll(comma + 1);
+					if ((comma = strchr(comma + 1, ',')) != NULL)
+						sample_seed = strtoul(comma + 1, NULL, 10);
+				}
+				if (num_samples < 1 || sample_window < 1) {
+					fprintf(stderr, "Invalid sample spec %s\n", optarg);
+					goto out;
+				}
+				}
+				break;
+			case 'g':
+				grep_literal = optarg;
+				break;
+			case 'e':
+				grep_regex = optarg;
+				break;
+			case 'i':
+				grep_icase = true;
+				break;
+			case 'f':
+				if ((num_shapes = atol(optarg)) < 1) {
+					fprintf(stderr, "Invalid number of shapes %s\n", optarg);
+					goto out;
+				}
+				break;
+			case 'L':
+				read_limit = atol(optarg);
+				break;
+			case 'I':
+				index_mode = true;
+				break;
+			case 'b':
+				bloom_search = optarg;
+				break;
+			case 'u':
+				gtid_str = optarg;
+				break;
+			case 'm':
+				merge_mode = true;
+				break;
+			case 'c':
+				compare_with = optarg;
+				break;
+			case 'k':
+				compact_json = optarg;
+				break;
+			case 'K':
+				compact_binlog = optarg;
+				break;
+			case 'z':
+				{
+				char* unit;
+				compact_memory = strtol(optarg, &unit, 10);
+				if (strcmp(unit, "") == 0)
+					compact_memory <<= 10;
+				else if (strcmp(unit, "K") != 0)
+					compact_memory = 0;
+				if (compact_memory < 1) {
+					fprintf(stderr, "Invalid memory limit %s\n", optarg);
+					goto out;
+				}
+				break;
+				}
+			case 'r':
+				session_ids = optarg;
+				break;
+			case 'R':
+				session_out.dir = optarg;
+				break;
+			case 'A':
+				scan_mode = true;
+				break;
+			case 'j':
+				if ((scan_threads = atol(optarg)) < 1) {
+					fprintf(stderr, "Invalid number of threads %s\n", optarg);
+					goto out;
+				}
+				break;
+			case 'P':
+				cdc_dir = optarg;
+				break;
+			case 'l':
+				load_dir = optarg;
+				break;
+			case 'w':
+				ybp_dispose_filter(filter);
+				if ((filter = ybp_get_filter(optarg)) == NULL)
+					goto out;
+				break;
 			case '?':
 				fprintf(stderr, "Unknown argument %c\n", optopt);
 				usage();
-				return 1;
-				break;
+				goto out;
 		}
 	}
 	if (optind >= argc) {
 		usage();
-		return 2;
+		ret = 2;
+		goto out;
 	}
-	if ((fd = open(argv[optind], O_RDONLY|O_LARGEFILE)) <= 0) {
-		perror("Error opening file");
-		return 1;
+	if (scan_mode) {
+		struct ybp_grep* g = NULL;
+		if ((grep_literal != NULL || grep_regex != NULL) &&
+				(g = ybp_get_grep(grep_literal, grep_regex, grep_icase)) == NULL)
+			goto out;
+		ret = scan_binlogs(argv + optind, argc - optind, esi, (scan_threads < 1) ? 1 : scan_threads, g, filter);
+		goto out;
 	}
-	if ((bp = ybp_get_binlog_parser(fd)) == NULL) {
-		perror("init_binlog_parser");
-		return 1;
+	if (grep_literal != NULL || grep_regex != NULL) {
+		struct ybp_grep* g;
+		if ((g = ybp_get_grep(grep_literal, grep_regex, grep_icase)) == NULL)
+			goto out;
+		ret = grep_binlogs(argv + optind, argc - optind, esi, g, q_mode, database_limit, filter);
+		goto out;
+	}
+	if (cdc_dir != NULL) {
+		ret = cdc_binlogs(argv + optind, argc - optind, esi, cdc_dir);
+		goto out;
+	}
+	if (load_dir != NULL && !sql_mode) {
+		ret = load_binlogs(argv + optind, argc - optind, esi, load_dir);
+		goto out;
+	}
+	if (compare_with != NULL) {
+		ret = compare_binlogs(argv + optind, argc - optind, compare_with, esi);
+		goto out;
+	}
+	if (compact_json != NULL || compact_binlog != NULL) {
+		ret = compact_binlogs(argv + optind, argc - optind, esi, starting_time, ending_time,
+				compact_json, compact_binlog, compact_memory);
+		goto out;
+	}
+	if (session_ids != NULL || session_out.dir != NULL) {
+		session_out.q_mode = q_mode;
+		session_out.database_limit = database_limit;
+		ret = session_binlogs(argv + optind, argc - optind, esi,
+				(session_ids != NULL) ? session_ids : "all", &session_out);
+		goto out;
+	}
+	if (num_shapes > 0) {
+		ret = fingerprint_binlogs(argv + optind, argc - optind, esi, num_shapes);
+		goto out;
+	}
+	if (index_mode) {
+		ret = index_binlogs(argv + optind, argc - optind, esi);
+		goto out;
+	}
+	if (bloom_search != NULL) {
+		ret = search_binlogs(argv + optind, argc - optind, esi, bloom_search, q_mode);
+		goto out;
+	}
+	if (merge_mode) {
+		ret = merge_binlogs(argv + optind, argc - optind, esi, starting_time, num_to_show,
+				show_all, q_mode, database_limit, filter);
+		goto out;
+	}
+	if (gtid_str != NULL) {
+		struct ybp_gtid gtid;
+		if (ybp_parse_gtid(gtid_str, &gtid) < 0) {
+			fprintf(stderr, "Invalid GTID %s\n", gtid_str);
+			goto out;
+		}
+		if ((bp = find_gtid(argv + optind, argc - optind, &gtid, esi, &fd)) == NULL) {
+			fprintf(stderr, "Unable to find GTID %s\n", gtid_str);
+			goto out;
+		}
+	}
+	else if ((bp = open_binlog(argv[optind], esi, &fd)) == NULL) {
+		goto out;
+	}
+	if (read_limit > 0)
+		ybp_set_read_limit(bp, read_limit);
+	if (num_samples > 0) {
+		ret = estimate_binlog(bp, num_samples, sample_window, sample_seed);
+		goto out;
 	}
-	bp->enforce_server_id = esi;
 	if ((evbuf = malloc(sizeof(struct ybp_event))) == NULL) {
 		perror("malloc event");
-		return 1;
+		goto out;
 	}
 	ybp_init_event(evbuf);
 	if (starting_offset >= 0) {
 		off64_t offset = ybp_nearest_offset(bp, starting_offset);
 		if (offset == -2) {
 			fprintf(stderr, "Unable to find anything after offset %ld\n", starting_offset);
-			return 1;
+			goto out;
 		}
 		else if (offset == -1) {
 			perror("nearest_offset");
-			return 1;
+			goto out;
 		}
 		else {
 			ybp_rewind_bp(bp, offset);
 		}
 	}
 	if (starting_time >= 0) {
-		off64_t offset = ybp_nearest_time(bp, starting_time);
+		off64_t offset;
+		ybp_set_search_fanout(bp, search_fanout < 1 ? 1 : search_fanout);
+		offset = ybp_nearest_time(bp, starting_time);
 		if (offset == -2) {
 			fprintf(stderr, "Unable to find anything after time %ld\n", starting_time);
-			return 1;
+			goto out;
 		}
 		else if (offset == -1) {
 			perror("nearest_time");
-			return 1;
+			goto out;
 		}
 		else {
 			ybp_rewind_bp(bp, offset);
 		}
 	}
-	int i = 0;
-	while ((ybp_next_event(bp, evbuf) >= 0) && (show_all || i < num_to_show)) {
-		if (q_mode) {
-			if (evbuf->type_code == QUERY_EVENT) {
-				struct ybp_query_event_safe* s = ybp_event_to_safe_qe(evbuf);
-				if ((database_limit == NULL) || (strcmp(s->db_name, database_limit) == 0))  {
-					printf("%d %s\n", evbuf->timestamp, s->statement);
-				}
-				ybp_dispose_safe_qe(s);
+	if (seek_n) {
+		off64_t offset;
+		char* events_sidecar;
+		if ((events_sidecar = sidecar_path(argv[optind], EVENT_INDEX_SUFFIX)) == NULL)
+			goto out;
+		ret = ybp_load_event_index(bp, events_sidecar);
+		free(events_sidecar);
+		if (ret == -1) {
+			ret = 1;
+			goto out;
+		}
+		ret = 1;
+		if (event_n < 0) {
+			if (ybp_extend_event_index(bp, SIZE_MAX) < 0)
+				goto out;
+			event_n += bp->event_index->count;
+		}
+		if (event_n < 0 || (offset = ybp_seek_event_n(bp, event_n)) == -2) {
+			fprintf(stderr, "There is no event %lld\n", event_n);
+			goto out;
+		}
+		else if (offset == -1) {
+			perror("seek_event_n");
+			goto out;
+		}
+	}
+	if (slice_path != NULL) {
+		ret = write_slice(bp, slice_path, ending_offset, ending_time);
+		goto out;
+	}
+	if (context_before > 0) {
+		int found = 1;
+		/* With nothing to anchor on, show the tail of the binlog */
+		if (starting_offset < 0 && starting_time < 0 && gtid_str == NULL) {
+			ybp_rewind_bp(bp, bp->file_size);
+			show_all = true;
+		}
+		while (context_before > 0 && found > 0) {
+			found = ybp_prev_event(bp, evbuf);
+			ybp_reset_event(evbuf);
+			if (found == -1) {
+				perror("prev_event");
+				goto out;
 			}
-			else if (evbuf->type_code == XID_EVENT) {
-				struct ybp_xid_event* s = ybp_event_to_safe_xe(evbuf);
-				printf("%d XID %llu\n", evbuf->timestamp, (long long unsigned)s->id);
-				ybp_dispose_safe_xe(s);
+			else if (found >= 0) {
+				num_to_show++;
+				context_before--;
 			}
-		} else {
-			ybp_print_event(evbuf, bp, stdout, q_mode, false, database_limit);
-			fprintf(stdout, "\n");
+		}
+	}
+	if (sql_mode) {
+		ret = write_sql(bp, evbuf, num_to_show, show_all, load_dir);
+		goto out;
+	}
+	int i = 0;
+	while ((ybp_next_event(bp, evbuf) >= 0) && (show_all || i < num_to_show)) {
+		if (filter == NULL || ybp_filter_event(bp, filter, evbuf)) {
+			show_event(bp, evbuf, q_mode, database_limit, NULL, stdout);
+			i+=1;
 		}
 		ybp_reset_event(evbuf);
-		i+=1;
 	}
-	ybp_dispose_event(evbuf);
+	ret = 0;
+out:
+	if (evbuf != NULL)
+		ybp_dispose_event(evbuf);
 	ybp_dispose_binlog_parser(bp);
+	if (fd >= 0)
+		close(fd);
+	ybp_dispose_filter(filter);
+	free(database_limit);
+	return ret;
 }
 
 /* vim: set sts=0 sw=4 ts=4 noexpandtab: */
@@ -12,12 +12,47 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <regex.h>
 #include <sys/types.h>
+#include <time.h>
 
 #define BINLOG_VERSION 4
 
 #define EVENT_HEADER_SIZE 19	/* we tack on extra stuff at the end */
 
+#define YBP_TIME_PROBE_CACHE_SIZE 64
+
+/* Checksum algorithm announced by the FDE (MySQL 5.6.1+) */
+enum ybp_checksum_alg {
+	YBP_CHECKSUM_OFF=0,
+	YBP_CHECKSUM_CRC32=1,
+	YBP_CHECKSUM_UNDEF=255
+};
+#define YBP_CHECKSUM_LEN 4
+
+/* Events can't outgrow the largest max_allowed_packet (1GB) by much */
+#define YBP_DEFAULT_MAX_EVENT_LENGTH (1024U * 1048576U + 65536U)
+#define YBP_MIN_READ_LIMIT 256	/* leaves post-headers and status vars whole */
+
+struct ybp_binlog_parser;
+struct ybp_event;
+struct ybp_decoded_event;
+
+/**
+ * Splits an event up according to the FDE. Returns 0, or -2 if the event
+ * is too short for its layout.
+ **/
+typedef int (*ybp_decoder_fn)(const struct ybp_binlog_parser* restrict, const struct ybp_event* restrict, struct ybp_decoded_event* restrict);
+
+/**
+ * An (offset, timestamp) sample remembered by the time search
+ **/
+struct ybp_time_probe {
+	off64_t		offset;
+	uint32_t	timestamp;
+};
+
 struct ybp_binlog_parser {
 	int			fd;
 	off_t		file_size;
@@ -28,6 +63,24 @@ struct ybp_binlog_parser {
 	uint32_t	master_server_id;
 	time_t		min_timestamp;
 	time_t		max_timestamp;
+	off64_t		first_event_offset;	/* the event after the FDE */
+	uint8_t		checksum_alg;	/* enum ybp_checksum_alg */
+	uint32_t	max_event_length;	/* longer ones are taken for garbage */
+	size_t		read_limit;	/* of each event's body read by next/prev_event */
+	uint8_t		common_header_len;	/* from the FDE; 19 unless a server says otherwise */
+	uint8_t		post_header_len[256];	/* by type code, from the FDE */
+	ybp_decoder_fn	decoders[256];	/* by type code, picked when the FDE is read */
+	off64_t		gtid_set_offset;	/* PREVIOUS_GTIDS / GTID_LIST, or 0 */
+	struct ybp_gtid_index*	gtid_index;
+	struct ybp_bloom_index*	bloom_index;
+	struct ybp_event_index*	event_index;
+	unsigned int	search_fanout;
+	size_t		num_time_probes;
+	struct ybp_time_probe	time_probes[YBP_TIME_PROBE_CACHE_SIZE];
+	off64_t*	boundaries;	/* consecutive event offsets found walking back */
+	size_t		num_boundaries;
+	size_t		boundaries_size;
+	off64_t		boundaries_end;	/* where the last of them ends */
 };
 
 enum ybp_event_types {
@@ -52,12 +105,41 @@ enum ybp_event_types {
 	EXECUTE_LOAD_QUERY_EVENT=18,
 	TABLE_MAP_EVENT=19,
 	PRE_GA_WRITE_ROWS_EVENT=20,
-	PRE_GA_DELETE_ROWS_EVENT=21,
-	WRITE_ROWS_EVENT=22,
-	UPDATE_ROWS_EVENT=23,
-	DELETE_ROWS_EVENT=24,
-	INCIDENT_EVENT=25,
-	HEARTBEAT_LOG_EVENT=26
+	PRE_GA_UPDATE_ROWS_EVENT=21,
+	PRE_GA_DELETE_ROWS_EVENT=22,
+	WRITE_ROWS_EVENT=23,
+	UPDATE_ROWS_EVENT=24,
+	DELETE_ROWS_EVENT=25,
+	INCIDENT_EVENT=26,
+	HEARTBEAT_LOG_EVENT=27,
+	/* MySQL 5.6+ */
+	IGNORABLE_LOG_EVENT=28,
+	ROWS_QUERY_LOG_EVENT=29,
+	WRITE_ROWS_EVENT_V2=30,
+	UPDATE_ROWS_EVENT_V2=31,
+	DELETE_ROWS_EVENT_V2=32,
+	GTID_LOG_EVENT=33,
+	ANONYMOUS_GTID_LOG_EVENT=34,
+	PREVIOUS_GTIDS_LOG_EVENT=35,
+	TRANSACTION_CONTEXT_EVENT=36,
+	VIEW_CHANGE_EVENT=37,
+	XA_PREPARE_LOG_EVENT=38,
+	PARTIAL_UPDATE_ROWS_EVENT=39,
+	TRANSACTION_PAYLOAD_EVENT=40,
+	HEARTBEAT_LOG_EVENT_V2=41,
+	/* MariaDB 5.3+ */
+	ANNOTATE_ROWS_EVENT=160,
+	BINLOG_CHECKPOINT_EVENT=161,
+	MARIADB_GTID_EVENT=162,
+	MARIADB_GTID_LIST_EVENT=163,
+	START_ENCRYPTION_EVENT=164,
+	QUERY_COMPRESSED_EVENT=165,
+	WRITE_ROWS_COMPRESSED_EVENT_V1=166,
+	UPDATE_ROWS_COMPRESSED_EVENT_V1=167,
+	DELETE_ROWS_COMPRESSED_EVENT_V1=168,
+	WRITE_ROWS_COMPRESSED_EVENT=169,
+	UPDATE_ROWS_COMPRESSED_EVENT=170,
+	DELETE_ROWS_COMPRESSED_EVENT=171
 };
 
 #pragma pack(push)
@@ -71,6 +153,7 @@ struct ybp_event {
 	uint16_t	flags;
 	char*		data;
 	off64_t		offset;
+	uint32_t	data_len;	/* how much of the body is in data */
 };
 
 struct ybp_format_description_event {
@@ -111,8 +194,68 @@ struct ybp_rotate_event {
 	uint64_t	next_position;
 	// file name of the next file (not NUL)
 };
+
+struct ybp_gtid_log_event {
+	uint8_t		flags;
+	uint8_t		sid[16];
+	uint64_t	gno;
+	// 5.7+: logical clock type (1), last_committed (8), sequence_number (8)
+};
+
+struct ybp_mariadb_gtid_event {
+	uint64_t	seq_no;
+	uint32_t	domain_id;
+	uint8_t		flags2;
+	// commit id (8) if flags2 & FL_GROUP_COMMIT_ID
+};
 #pragma pack(pop)
 
+/**
+ * A query event's fields, wherever the FDE's header lengths put them. The
+ * pointers are into the event's data and aren't NUL-terminated; the
+ * statement stops short of any checksum.
+ **/
+struct ybp_query_view {
+	uint32_t	thread_id;
+	uint32_t	query_time;
+	uint8_t		db_name_len;
+	uint16_t	error_code;
+	uint16_t	status_var_len;
+	const char*	status_vars;
+	const char*	db_name;
+	const char*	statement;
+	size_t		statement_len;
+};
+
+struct ybp_rotate_view {
+	uint64_t	next_position;
+	const char*	file_name;
+	size_t		file_name_len;
+};
+
+/**
+ * An event split up by the FDE: the type's post-header (after any extra
+ * common header bytes the server writes) and the body after it, up to the
+ * checksum. Query (and EXECUTE_LOAD_QUERY), rotate, XID and INTVAR events
+ * are taken apart too.
+ **/
+struct ybp_decoded_event {
+	const char*	post_header;
+	size_t		post_header_len;
+	const char*	body;
+	size_t		body_len;
+	bool		truncated;	/* the body goes on past what was read */
+	union {
+		struct ybp_query_view	query;
+		struct ybp_rotate_view	rotate;
+		uint64_t	xid;
+		struct {
+			uint8_t		type;
+			uint64_t	value;
+		} intvar;
+	} u;
+};
+
 /**
  * Use this to safely access the data portions of a query event. Note that
  * this involves copying things, so it's pretty slow.
@@ -135,6 +278,110 @@ struct ybp_rotate_event_safe {
 	size_t		file_name_len;
 };
 
+enum ybp_gtid_flavor {
+	YBP_GTID_MYSQL=0,	/* source uuid:transaction number */
+	YBP_GTID_MARIADB=1	/* domain-server-sequence */
+};
+
+#define YBP_GTID_STR_LEN 64
+
+/**
+ * A global transaction id from either MySQL (sid, gno) or MariaDB
+ * (domain_id, server_id, gno). last_committed and sequence_number are the
+ * MySQL 5.7 logical clock, 0 when absent.
+ **/
+struct ybp_gtid {
+	enum ybp_gtid_flavor	flavor;
+	uint8_t		sid[16];
+	uint32_t	domain_id;
+	uint32_t	server_id;
+	uint64_t	gno;
+	uint64_t	last_committed;
+	uint64_t	sequence_number;
+};
+
+struct ybp_gtid_entry {
+	uint64_t	gno;
+	uint64_t	offset;
+};
+
+/* All the transactions seen from one source */
+struct ybp_gtid_source {
+	enum ybp_gtid_flavor	flavor;
+	uint8_t		sid[16];
+	uint32_t	domain_id;
+	uint32_t	server_id;
+	struct ybp_gtid_entry*	entries;
+	size_t		count;
+	size_t		capacity;
+	bool		sorted;
+};
+
+/**
+ * GTID -> offset index covering every event from the first one up to
+ * scanned_to. It grows as the parser reads forward.
+ **/
+struct ybp_gtid_index {
+	struct ybp_gtid_source*	sources;
+	size_t		num_sources;
+	off64_t		scanned_to;
+};
+
+#define YBP_BLOOM_BLOCK_SIZE (16 * 1024 * 1024)
+#define YBP_BLOOM_FILTER_BYTES 8192
+#define YBP_BLOOM_HASHES 4
+
+/**
+ * A Bloom filter of the databases, tables and thread ids touched by the
+ * events that start in each block_size block of a binlog, covering every
+ * event from the first one up to scanned_to. It grows as the parser reads
+ * forward, and can be saved next to the binlog so later searches skip
+ * the blocks (or whole binlogs) that can't hold what they want.
+ **/
+struct ybp_bloom_index {
+	uint32_t	block_size;
+	uint32_t	filter_bytes;
+	uint32_t	fde_timestamp;	/* to tell a reused file name */
+	uint8_t*	filters;	/* filter_bytes per block */
+	size_t		num_blocks;
+	size_t		blocks_size;
+	off64_t		scanned_to;
+};
+
+/**
+ * The headers of every event from the first one up to scanned_to, kept
+ * column by column so scans over one field stay in cache: 13 bytes an
+ * event. An event's length is the distance to the next one (or, for the
+ * last, to scanned_to). Grows as the parser reads forward.
+ **/
+struct ybp_event_index {
+	uint64_t*	offsets;
+	uint32_t*	timestamps;
+	uint8_t*	type_codes;
+	size_t		count;
+	size_t		capacity;
+	off64_t		scanned_to;
+	uint32_t	fde_timestamp;	/* to tell a reused file name */
+};
+
+/**
+ * What to look for in a Bloom index. Leave out (NULL, or -1) what you don't
+ * care about; the rest must all match. table may be "db.table" or just
+ * "table". Names are compared case-insensitively.
+ *
+ * Row events are only indexed through their TABLE_MAP: a rows event that
+ * starts in the block after its map's is only found if the search reads
+ * on past the end of the map's block, as the CLI's -b does. Row events
+ * carry no thread id, so a query naming thread_id never matches them, nor
+ * the table maps before them; it finds the BEGIN and statements of that
+ * thread's transactions, not their row changes.
+ **/
+struct ybp_bloom_query {
+	const char*	db;
+	const char*	table;
+	int64_t		thread_id;
+};
+
 /**
  * Initialize a ybp_binlog_parser. Returns 0 on success, non-zero otherwise.
  *
@@ -181,6 +428,50 @@ void ybp_dispose_binlog_parser(struct ybp_binlog_parser*);
  */
 int ybp_next_event(struct ybp_binlog_parser* restrict, struct ybp_event* restrict);
 
+/**
+ * Step a ybp_binlog_parser back to the event that ends at its current
+ * offset, reading that event into evbuf. A following ybp_next_event will
+ * return the same event again. Rewinding to the file size and calling this
+ * repeatedly gives the tail of the binlog (a partially written last event
+ * is skipped).
+ *
+ * Event boundaries are found by resyncing on a block before the offset and
+ * walking the chain forward to it; they are remembered, so walking back
+ * through a run of events only costs one such search per block.
+ *
+ * Returns 0 if the event is the first one after the FDE, >0 if there are
+ * more before it, -2 if there is nothing before the current offset, and -1
+ * on error.
+ **/
+int ybp_prev_event(struct ybp_binlog_parser* restrict, struct ybp_event* restrict);
+
+/**
+ * Treat events longer than length as garbage (and resync past them). The
+ * default, YBP_DEFAULT_MAX_EVENT_LENGTH, admits anything a server with the
+ * largest max_allowed_packet can write; lower it if what's in the binlog
+ * is known to be small and resyncing should be pickier.
+ **/
+void ybp_set_max_event_length(struct ybp_binlog_parser*, uint32_t length);
+
+/**
+ * Have ybp_next_event and ybp_prev_event read at most limit bytes (but
+ * no fewer than YBP_MIN_READ_LIMIT) of each event's body into memory, so
+ * that huge events cost next to nothing to step over. e->data_len says
+ * how much was read, and ybp_decode_event marks such events truncated.
+ * The indexes that need whole events stop growing at the first truncated
+ * one. 0 (the default) reads everything.
+ **/
+void ybp_set_read_limit(struct ybp_binlog_parser*, size_t limit);
+
+/**
+ * Read up to len bytes of e's body (everything after the common header,
+ * checksum included) from pos on into buf, straight from the binlog, so
+ * however much of e was read into memory. Reading it in chunks streams
+ * through an event of any size. Returns the number of bytes read, 0 past
+ * the end of the body, or -1 on error.
+ **/
+ssize_t ybp_read_event_body(struct ybp_binlog_parser* restrict, const struct ybp_event* restrict, size_t pos, char* restrict buf, size_t len);
+
 /**
  * Initialize an event object. Event objects must live on the heap
  * and must be destroyed with dispose_event().
@@ -248,7 +539,22 @@ const char* ybp_event_type(struct ybp_event*);
 struct ybp_format_description_event* ybp_event_as_fde(struct ybp_event* restrict);
 
 /**
- * Get a safe-to-mess-with query event from an event
+ * Take e apart with the decoder p's FDE picked for its type. The decoded
+ * event points into e. Returns 0 on success, -2 if e is too short for its
+ * layout and -1 if p's FDE can't be read.
+ **/
+int ybp_decode_event(struct ybp_binlog_parser* restrict, struct ybp_event* restrict, struct ybp_decoded_event* restrict);
+
+/**
+ * Like ybp_event_to_safe_qe, but laid out by p's FDE and without the
+ * checksum. Returns NULL if e isn't a (well-formed) query event.
+ **/
+struct ybp_query_event_safe* ybp_decode_safe_qe(struct ybp_binlog_parser* restrict, struct ybp_event* restrict);
+
+/**
+ * Get a safe-to-mess-with query event from an event. This assumes the 5.0
+ * layout and leaves any checksum on the statement; ybp_decode_safe_qe
+ * doesn't.
  **/
 struct ybp_query_event_safe* ybp_event_to_safe_qe(struct ybp_event* restrict);
 
@@ -258,10 +564,18 @@ struct ybp_query_event_safe* ybp_event_to_safe_qe(struct ybp_event* restrict);
 void ybp_dispose_safe_qe(struct ybp_query_event_safe*);
 
 /**
- * Get a safe-to-mess-with rotate event from an event
+ * Get a safe-to-mess-with rotate event from an event. Like
+ * ybp_event_to_safe_qe, this leaves any checksum on the file name;
+ * ybp_decode_safe_re doesn't.
  **/
 struct ybp_rotate_event_safe* ybp_event_to_safe_re(struct ybp_event* restrict);
 
+/**
+ * Like ybp_event_to_safe_re, but laid out by p's FDE and without the
+ * checksum. Returns NULL if e isn't a (well-formed) rotate event.
+ **/
+struct ybp_rotate_event_safe* ybp_decode_safe_re(struct ybp_binlog_parser* restrict, struct ybp_event* restrict);
+
 /**
  * Dispose a structure returned from ybp_event_to_safe_qe
  **/
@@ -282,8 +596,1561 @@ void ybp_dispose_safe_xe(struct ybp_xid_event*);
  **/
 off64_t ybp_nearest_offset(struct ybp_binlog_parser* restrict, off64_t);
 
+/**
+ * Find the first event at or after time target. Interpolates between the
+ * (offset, timestamp) samples it has (falling back to bisection when the
+ * timestamps are too skewed to trust), and remembers every sample it takes
+ * so that later searches on the same parser start from a tight bracket.
+ *
+ * Timestamps in a binlog are only roughly ordered (a long transaction is
+ * stamped with its start time), so this finds an event at the boundary,
+ * which is not necessarily the very first one stamped at or after target.
+ *
+ * Returns the offset, -2 if nothing is that recent, and -1 on error.
+ **/
 off64_t ybp_nearest_time(struct ybp_binlog_parser* restrict, time_t target);
 
+/**
+ * Have ybp_nearest_time take k samples per round instead of one. All k
+ * reads are handed to the kernel up front, so on cold storage they cost
+ * about one round-trip instead of k.
+ **/
+void ybp_set_search_fanout(struct ybp_binlog_parser*, unsigned int k);
+
+/******* slicing ********/
+
+/**
+ * Write a standalone binlog to out_fd: the magic number and FDE of p, the
+ * events from start up to end, and a ROTATE to next_file (or, if that's
+ * NULL, a STOP). start is widened back to the beginning of its transaction
+ * and end forward to the end of one, so the slice replays cleanly.
+ *
+ * The event bodies are copied file-to-file by the kernel; only the headers
+ * are touched afterwards, to rewrite next_position (and patch checksums to
+ * match). out_fd must be a regular file opened O_RDWR, not O_WRONLY: the
+ * headers are patched through a shared mapping of it.
+ *
+ * end may be past the end of the file. Returns the number of events
+ * copied, -2 if there were none in the range, and -1 on error.
+ **/
+off64_t ybp_slice(struct ybp_binlog_parser* restrict p, off64_t start, off64_t end, int out_fd, const char* next_file);
+
+/**
+ * Where the transaction containing the event at offset begins, as ybp_slice
+ * widens its start. Returns -1 on error.
+ **/
+off64_t ybp_transaction_start(struct ybp_binlog_parser* restrict p, off64_t offset);
+
+/******* SQL output ********/
+
+/**
+ * Writes events as SQL that the mysql client can replay, in the same shape
+ * as mysqlbinlog's output. Remembers what the replaying session has been
+ * told, so `use` and the SET statements for session settings are only
+ * repeated when they change.
+ **/
+struct ybp_sql_writer {
+	FILE*		out;
+	struct ybp_binlog_parser*	parser;
+	size_t		checksum_len;
+	uint32_t	written;	/* which of the below we've told the session */
+	char		db[256];
+	uint32_t	timestamp;
+	uint32_t	microseconds;
+	uint32_t	thread_id;
+	uint32_t	flags2;
+	uint64_t	sql_mode;
+	uint16_t	auto_increment_increment;
+	uint16_t	auto_increment_offset;
+	uint16_t	charset_client;
+	uint16_t	collation_connection;
+	uint16_t	collation_server;
+	uint16_t	lc_time_names;
+	uint16_t	collation_database;
+	char		time_zone[64];
+	struct ybp_loads*	loads;	/* if set (after ybp_sql_begin), LOAD DATA is rebuilt there */
+};
+
+/**
+ * Start writing SQL for the events of p to out: the preamble mysqlbinlog
+ * writes, and p's FDE as a BINLOG statement so that row events can be
+ * applied. Give out a big buffer (setvbuf) for throughput.
+ *
+ * Returns 0 on success and -1 on error.
+ **/
+int ybp_sql_begin(struct ybp_sql_writer* restrict, struct ybp_binlog_parser* restrict, FILE* restrict out);
+
+/**
+ * Write one event. Statements, INTVAR/RAND/USER_VAR and XIDs become SQL;
+ * row events become BINLOG statements; LOAD DATA becomes LOAD DATA LOCAL
+ * of the file w->loads rebuilt, if there is one; everything else, GTIDs
+ * included, only gets a comment. The FDE at offset 4 is skipped, since
+ * ybp_sql_begin wrote it already.
+ *
+ * Returns 0 on success and -1 on error.
+ **/
+int ybp_sql_event(struct ybp_sql_writer* restrict, struct ybp_event* restrict);
+
+/**
+ * Finish off, the way mysqlbinlog does. Returns 0 on success and -1 on
+ * error.
+ **/
+int ybp_sql_end(struct ybp_sql_writer*);
+
+/******* sampling ********/
+
+/**
+ * Called for each event a sample turns up; sample says which of the
+ * samples (0 to num_samples - 1) it belongs to. Return non-zero to stop.
+ **/
+typedef int (*ybp_sample_fn)(struct ybp_event* restrict e, unsigned int sample, void* arg);
+
+/**
+ * Look at num_samples random windows of window bytes each, instead of the
+ * whole binlog. fn sees every event that starts inside a window, found by
+ * resyncing at the window's start; windows that run off the end of the
+ * file wrap around to the first event. That makes the chance of an event
+ * being seen by a sample exactly window / ybp_sample_span(p), whatever its
+ * size, so totals scaled up by ybp_sample_span(p) / window are unbiased.
+ *
+ * The same seed gives the same windows. The parser's position is left
+ * alone. Returns 0 on success, the non-zero value fn stopped with, or -1
+ * on error.
+ **/
+int ybp_sample(struct ybp_binlog_parser* restrict p, unsigned int num_samples, off64_t window, unsigned int seed, ybp_sample_fn fn, void* arg);
+
+/**
+ * The number of bytes the sample windows are spread over (everything after
+ * the FDE)
+ **/
+off64_t ybp_sample_span(struct ybp_binlog_parser*);
+
+struct ybp_estimate {
+	double		total;	/* estimated total over the whole binlog */
+	double		total_ci;	/* half-width of its 95% confidence interval */
+	double		share;	/* estimated fraction of the whole */
+	double		share_ci;
+};
+
+/**
+ * Turn per-sample sums into estimates: part[i] is what sample i saw of the
+ * thing being estimated (events of a type, bytes for a database...), and
+ * whole[i] the same measure over everything sample i saw. scale is
+ * ybp_sample_span / window. Totals use the sample mean and its standard
+ * error; shares are ratio estimates, with their error from the usual
+ * linearization, so they are only close to unbiased with few samples.
+ * Needs at least two samples for the intervals, and reports them as
+ * infinite otherwise.
+ **/
+void ybp_sample_estimate(const double* restrict part, const double* restrict whole, unsigned int num_samples, double scale, struct ybp_estimate* restrict out);
+
+/******* searching statements ********/
+
+/**
+ * A compiled statement search: a literal that must appear (found with
+ * memchr/memmem, so most statements are ruled out at memory speed) and
+ * an optional POSIX extended regex that must then match too.
+ **/
+struct ybp_grep {
+	char*		literal;
+	size_t		literal_len;
+	size_t		anchor;	/* literal[anchor] is the byte scanned for when ignoring case */
+	bool		icase;
+	bool		has_regex;
+	regex_t		regex;
+};
+
+/**
+ * Compile a search. Either literal or regex may be NULL, not both. Returns
+ * NULL (having complained) if the regex doesn't compile.
+ **/
+struct ybp_grep* ybp_get_grep(const char* literal, const char* regex, bool icase);
+
+/**
+ * Does the statement (which needn't be NUL-terminated) match?
+ **/
+bool ybp_grep_statement(const struct ybp_grep* restrict, const char* restrict statement, size_t len);
+
+/**
+ * Is e a query event whose statement matches? Looks at the statement
+ * where it lies in the event, without copying it.
+ **/
+bool ybp_grep_event(struct ybp_binlog_parser* restrict, const struct ybp_grep* restrict, struct ybp_event* restrict);
+
+void ybp_dispose_grep(struct ybp_grep*);
+
+/******* statement fingerprints ********/
+
+#define YBP_FINGERPRINT_SHAPE_LEN 512
+#define YBP_FINGERPRINT_SAMPLE_LEN 256
+
+/**
+ * Normalize a statement to its shape: literals become ?, lists of them
+ * (IN lists, VALUES rows) collapse to one ?+ or one row, comments go,
+ * whitespace is squeezed and everything outside backquotes is lowercased.
+ * The shape is never longer than the statement, so out may be statement
+ * itself to normalize in place; otherwise it needs len bytes. Nothing is
+ * allocated. The shape isn't NUL-terminated. Returns its length, and its
+ * 64-bit hash in *hash.
+ **/
+size_t ybp_fingerprint(const char* statement, size_t len, char* out, uint64_t* hash);
+
+enum ybp_fingerprint_measure {
+	YBP_FINGERPRINT_BY_COUNT=0,
+	YBP_FINGERPRINT_BY_BYTES=1
+};
+
+struct ybp_fingerprint_entry {
+	uint64_t	hash;
+	uint64_t	weight;	/* count or bytes, by the table's measure */
+	uint64_t	weight_error;	/* weight may overstate by up to this */
+	uint64_t	count;	/* seen since this shape got its slot */
+	uint64_t	bytes;
+	uint64_t	query_time;	/* summed, in seconds */
+	size_t		heap_pos;
+	char		shape[YBP_FINGERPRINT_SHAPE_LEN];	/* NUL-terminated, maybe cut short */
+	char		sample[YBP_FINGERPRINT_SAMPLE_LEN];	/* the first statement seen of it */
+};
+
+/**
+ * The heaviest statement shapes, by count or by bytes, kept in bounded
+ * memory with the space-saving algorithm: when the table is full, a new
+ * shape takes over the lightest slot and its weight. Any shape heavier
+ * than total / capacity is guaranteed to be in the table, and an entry's
+ * true weight is between weight - weight_error and weight.
+ **/
+struct ybp_fingerprints {
+	enum ybp_fingerprint_measure	measure;
+	size_t		capacity;
+	size_t		num_entries;
+	struct ybp_fingerprint_entry*	entries;
+	size_t*		heap;	/* entry indexes, lightest first */
+	size_t*		slots;	/* hash -> entry index + 1 (0 is empty) */
+	size_t		num_slots;
+	char*		scratch;	/* where statements get normalized */
+	size_t		scratch_size;
+	uint64_t	total_count;
+	uint64_t	total_bytes;
+};
+
+struct ybp_fingerprints* ybp_get_fingerprints(size_t capacity, enum ybp_fingerprint_measure);
+
+/**
+ * Add one statement, from an event length bytes long that took query_time
+ * seconds. Returns 0 on success and -1 on error.
+ **/
+int ybp_fingerprints_add(struct ybp_fingerprints* restrict, const char* restrict statement, size_t len, uint64_t bytes, uint32_t query_time);
+
+/**
+ * Add e, if it's a query event. Returns 1 if it was added, 0 if it
+ * wasn't a query event and -1 on error.
+ **/
+int ybp_fingerprints_observe(struct ybp_fingerprints* restrict, struct ybp_binlog_parser* restrict, struct ybp_event* restrict);
+
+/**
+ * Copy the n heaviest entries, heaviest first, to out. Returns how many
+ * there were.
+ **/
+size_t ybp_fingerprints_top(struct ybp_fingerprints* restrict, struct ybp_fingerprint_entry* restrict out, size_t n);
+
+void ybp_dispose_fingerprints(struct ybp_fingerprints*);
+
+/******* merging several servers' binlogs ********/
+
+/**
+ * Called when a merge source runs out of events. Return a parser for the
+ * next binlog in that source's chain (the merge doesn't own parsers, so
+ * dispose of the old one here if you like), or NULL if the source is done.
+ **/
+typedef struct ybp_binlog_parser* (*ybp_merge_refill_fn)(size_t source, void* arg);
+
+struct ybp_merge_source {
+	struct ybp_binlog_parser*	parser;
+	struct ybp_event*	head;	/* the next event from this source */
+	bool		last;	/* head is the last event in parser */
+};
+
+struct ybp_merge {
+	size_t		num_sources;
+	struct ybp_merge_source*	sources;
+	size_t*		heap;	/* indexes of sources with a head, earliest first */
+	size_t		heap_len;
+	ybp_merge_refill_fn	refill;
+	void*		refill_arg;
+	bool		handed_out;	/* the top source's head is the caller's */
+	bool		failed;	/* a source couldn't be read */
+	size_t		failed_source;
+};
+
+/**
+ * Merge the events of several parsers (typically one per server) into one
+ * stream ordered by (timestamp, server_id, offset). Each source's own order
+ * is kept, and only one event per source is read ahead, so memory doesn't
+ * grow with the number of events. refill may be NULL.
+ **/
+struct ybp_merge* ybp_get_merge(struct ybp_binlog_parser** parsers, size_t num_parsers, ybp_merge_refill_fn refill, void* refill_arg);
+
+/**
+ * Move the next event of the merge into evbuf (inited or reset), and say
+ * which source it came from in *source. Returns 1 if there was one, 0 if
+ * all the sources have run out, and -1 on error. A source whose binlog
+ * can't be read (including one cut short in the middle of an event) is an
+ * error rather than an early end: the call after its last good event
+ * returns -1 with *source set to the broken one. The source's parser
+ * (m->sources[*source].parser) is left alone until the next call, so it
+ * can still be used to decode the event.
+ **/
+int ybp_merge_next(struct ybp_merge* restrict m, struct ybp_event* restrict evbuf, size_t* source);
+
+/**
+ * Clean up a merge. The parsers are left alone.
+ **/
+void ybp_dispose_merge(struct ybp_merge*);
+
+/******* shared-memory event ring (used by ybinlogpd) ********/
+
+#define YBP_RING_MAGIC 0x52504259	/* "YBPR" */
+#define YBP_RING_VERSION 1
+#define YBP_RING_MAX_CONSUMERS 32
+#define YBP_RING_SHM_NAME_LEN 64
+
+/* ybp_ring_hello flags */
+#define YBP_RING_FROM_OLDEST 0x01	/* start at the oldest retained record */
+
+/* ybp_ring_record.rec_flags */
+#define YBP_RING_TRUNCATED 0x01	/* payload was cut to fit the ring */
+
+/**
+ * One reader attached to the ring. read_pos is owned by the consumer, the
+ * rest by the server.
+ **/
+struct ybp_ring_consumer {
+	uint64_t	read_pos;
+	uint32_t	pid;
+	uint8_t		in_use;
+	uint8_t		evicted;
+	uint16_t	pad;
+};
+
+/**
+ * Lives at the start of the shared-memory segment; record space follows.
+ * Positions are monotonically increasing byte counts, masked by
+ * (capacity - 1) to find the physical location.
+ **/
+struct ybp_ring_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	capacity;
+	uint64_t	write_pos;
+	uint64_t	tail_pos;	/* oldest record not yet overwritten */
+	uint64_t	events_published;
+	uint32_t	file_seq;	/* index of the current binlog in the chain */
+	uint32_t	pad;
+	char		file_name[256];
+	struct ybp_ring_consumer consumers[YBP_RING_MAX_CONSUMERS];
+};
+
+/**
+ * A decoded event as stored in the ring. payload_len bytes of event data
+ * follow; the whole record is padded to a multiple of 8 bytes. A record
+ * whose payload_len is UINT32_MAX means "wrap to the start of the ring".
+ **/
+struct ybp_ring_record {
+	uint32_t	record_len;
+	uint32_t	payload_len;
+	uint64_t	offset;
+	uint32_t	file_seq;
+	uint32_t	timestamp;
+	uint32_t	server_id;
+	uint32_t	length;
+	uint32_t	next_position;
+	uint16_t	flags;
+	uint8_t		type_code;
+	uint8_t		rec_flags;
+};
+
+/**
+ * Handshake sent by a consumer over the UNIX socket, and the reply.
+ **/
+struct ybp_ring_hello {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	flags;
+	uint32_t	pid;
+};
+
+struct ybp_ring_welcome {
+	uint32_t	magic;
+	int32_t		slot;	/* < 0 if the server refused us */
+	uint64_t	capacity;
+	char		shm_name[YBP_RING_SHM_NAME_LEN];
+};
+
+/* server side */
+struct ybp_ring {
+	struct ybp_ring_header*	hdr;
+	char*		data;
+	size_t		map_len;
+	char		shm_name[YBP_RING_SHM_NAME_LEN];
+};
+
+/* consumer side */
+struct ybp_ring_client {
+	int			sock;
+	int			slot;
+	struct ybp_ring_header*	hdr;
+	char*		data;
+	size_t		map_len;
+};
+
+/**
+ * Create (and map) a ring in POSIX shared memory. capacity is rounded up
+ * to a power of two. Returns NULL on error.
+ **/
+struct ybp_ring* ybp_ring_create(const char* shm_name, size_t capacity);
+
+/**
+ * Unmap and unlink a ring created with ybp_ring_create
+ **/
+void ybp_ring_dispose(struct ybp_ring*);
+
+/**
+ * Append an event to the ring.
+ *
+ * Returns 1 if the event was published and 0 if some consumer is too far
+ * behind to make room for it (the caller should retry later, or evict the
+ * consumer returned by ybp_ring_slowest).
+ **/
+int ybp_ring_publish(struct ybp_ring* restrict, struct ybp_event* restrict, uint32_t file_seq);
+
+/**
+ * Note that the producer has moved on to a new binlog file
+ **/
+void ybp_ring_set_file(struct ybp_ring*, uint32_t file_seq, const char* file_name);
+
+/**
+ * Claim a consumer slot. Returns the slot, or -1 if they are all in use.
+ **/
+int ybp_ring_add_consumer(struct ybp_ring*, uint32_t pid, uint32_t flags);
+
+void ybp_ring_remove_consumer(struct ybp_ring*, int slot);
+
+/**
+ * Mark a consumer as evicted; it stops holding back the producer.
+ **/
+void ybp_ring_evict_consumer(struct ybp_ring*, int slot);
+
+/**
+ * Return the slot of the active consumer furthest behind, or -1
+ **/
+int ybp_ring_slowest(struct ybp_ring*);
+
+/**
+ * How many bytes of records the consumer in slot has yet to read
+ **/
+uint64_t ybp_ring_lag(struct ybp_ring_header*, int slot);
+
+/**
+ * Attach to a running ybinlogpd through its UNIX socket. Returns NULL on
+ * error.
+ **/
+struct ybp_ring_client* ybp_ring_connect(const char* socket_path, uint32_t flags);
+
+/**
+ * Read the next event from the ring into evbuf (which should be init'd or
+ * reset). file_seq, if non-NULL, is set to the chain index of the binlog
+ * the event came from.
+ *
+ * Returns 1 if an event was read, 0 if the consumer is caught up, and -1
+ * if the consumer has been evicted for being too slow.
+ **/
+int ybp_ring_next(struct ybp_ring_client* restrict, struct ybp_event* restrict, uint32_t* file_seq);
+
+/**
+ * Bytes of records this consumer has yet to read
+ **/
+uint64_t ybp_ring_client_lag(struct ybp_ring_client*);
+
+void ybp_ring_disconnect(struct ybp_ring_client*);
+
+/******* durable consumer checkpoints ********/
+
+#define YBP_CHECKPOINT_FILE_NAME_LEN 4096
+
+/**
+ * Tracks the position after the last complete transaction a consumer has
+ * handled, and periodically makes it durable. Feed it every event with
+ * ybp_checkpoint_observe once you are done with the event.
+ **/
+struct ybp_checkpoint {
+	char*		path;
+	char*		tmp_path;
+	char		file_name[YBP_CHECKPOINT_FILE_NAME_LEN];
+	off64_t		offset;
+	bool		in_transaction;
+	bool		dirty;
+	unsigned int	pending;	/* commits since the last flush */
+	unsigned int	flush_every;
+	unsigned int	flush_interval_ms;
+	struct timespec	last_flush;
+	uint64_t	flushes;
+};
+
+/**
+ * Create a checkpointer writing to path. The position is flushed after
+ * flush_every transactions or flush_interval_ms milliseconds, whichever
+ * comes first (0 disables either trigger). Returns NULL on error.
+ **/
+struct ybp_checkpoint* ybp_get_checkpoint(const char* path, unsigned int flush_every, unsigned int flush_interval_ms);
+
+/**
+ * Tell the checkpointer that the consumer is done with event e, read by p
+ * from the binlog file_name. The position only moves at transaction
+ * boundaries (XID, COMMIT, a statement outside BEGIN, or a rotation);
+ * statements are found through p's FDE, so checksums are left out.
+ *
+ * Returns 1 if this caused a flush, 0 if not, and <0 on error.
+ **/
+int ybp_checkpoint_observe(struct ybp_checkpoint* restrict, struct ybp_binlog_parser* restrict p, const char* restrict file_name, struct ybp_event* restrict);
+
+/**
+ * Atomically replace the checkpoint file with the current position and
+ * fsync it. Returns 0 on success and -1 on error.
+ **/
+int ybp_checkpoint_flush(struct ybp_checkpoint*);
+
+/**
+ * Flush any pending position and clean up
+ **/
+void ybp_dispose_checkpoint(struct ybp_checkpoint*);
+
+/**
+ * Read a checkpoint file. file_name gets the binlog to resume from and
+ * offset the position of the first event to read in it.
+ *
+ * Returns 0 on success, -1 on system errors (including a missing file,
+ * errno is ENOENT) and -2 if the file is malformed.
+ **/
+int ybp_load_checkpoint(const char* restrict path, char* restrict file_name, size_t file_name_len, off64_t* offset);
+
+/******* GTIDs ********/
+
+/**
+ * Decode a GTID_LOG_EVENT, ANONYMOUS_GTID_LOG_EVENT or MariaDB GTID_EVENT.
+ * Returns 0 on success and -1 if e is not a GTID event.
+ **/
+int ybp_event_to_gtid(struct ybp_event* restrict, struct ybp_gtid* restrict);
+
+/**
+ * Parse "3E11FA47-71CA-11E1-9E33-C80AA9429562:23" (MySQL) or "0-1-100"
+ * (MariaDB). Returns 0 on success and -1 if it's neither.
+ **/
+int ybp_parse_gtid(const char* restrict, struct ybp_gtid* restrict);
+
+/**
+ * Format a GTID the way the server does, into a buffer of at least
+ * YBP_GTID_STR_LEN bytes.
+ **/
+void ybp_format_gtid(const struct ybp_gtid* restrict, char* restrict);
+
+/**
+ * Does the GTID set in e (a PREVIOUS_GTIDS_LOG_EVENT or MariaDB
+ * GTID_LIST_EVENT) contain gtid?
+ **/
+bool ybp_gtid_set_contains(struct ybp_event* restrict, const struct ybp_gtid* restrict);
+
+/**
+ * Was gtid executed before this binlog was started, according to the
+ * GTID set at its head? Returns 1 for yes, 0 for no and -1 if the binlog
+ * doesn't have a GTID set.
+ **/
+int ybp_gtid_before_file(struct ybp_binlog_parser* restrict, const struct ybp_gtid* restrict);
+
+/**
+ * Start building a GTID index for this parser. Every GTID event read by
+ * ybp_next_event from the start of the file onward is added to it.
+ * Returns 0 on success, -1 on error.
+ **/
+int ybp_enable_gtid_index(struct ybp_binlog_parser*);
+
+/**
+ * Find the offset of the GTID event that starts transaction gtid. This is a
+ * lookup if the index already covers it, otherwise the index is extended by
+ * scanning forward from where it stops (the parser's position is left
+ * alone). Enables the index if needed.
+ *
+ * Returns the offset, -2 if gtid isn't in this binlog, and -1 on error.
+ **/
+off64_t ybp_find_gtid(struct ybp_binlog_parser* restrict, const struct ybp_gtid* restrict);
+
+/******* Bloom-filter sidecars ********/
+
+/**
+ * Start building a Bloom index for this parser, with filter_bytes of
+ * filter for every block_size bytes of binlog (0 for the defaults). Every
+ * event read by ybp_next_event from the start of the file onward is added
+ * to it. Returns 0 on success, -1 on error.
+ *
+ * Databases come from query events and table maps, thread ids from query
+ * events, and tables from table maps and from the names after INTO,
+ * UPDATE, FROM, JOIN, TABLE and the like in statements. A table only
+ * touched by, say, a stored procedure call won't be found.
+ **/
+int ybp_enable_bloom_index(struct ybp_binlog_parser*, uint32_t block_size, uint32_t filter_bytes);
+
+/**
+ * Read the rest of the binlog into the Bloom index (enabling it with the
+ * defaults if needed), without moving the parser. Returns 0 on success,
+ * -1 on error.
+ **/
+int ybp_extend_bloom_index(struct ybp_binlog_parser*);
+
+/**
+ * Atomically write the parser's Bloom index to path. Returns 0 on success,
+ * -1 on error.
+ **/
+int ybp_save_bloom_index(struct ybp_binlog_parser* restrict, const char* restrict path);
+
+/**
+ * Load a Bloom index saved by ybp_save_bloom_index into the parser, which
+ * carries on from where it stopped. Returns 0 on success, -2 if there is
+ * none or it belongs to some other binlog, and -1 on error.
+ **/
+int ybp_load_bloom_index(struct ybp_binlog_parser* restrict, const char* restrict path);
+
+/**
+ * Could any event starting in the given block match q? Blocks past
+ * scanned_to always could.
+ **/
+bool ybp_bloom_block_may_match(const struct ybp_bloom_index* restrict, size_t block, const struct ybp_bloom_query* restrict q);
+
+/**
+ * Does e itself match q (by the same rules the index is built with)? Row
+ * events carry no names, so they never do; go by their table map.
+ **/
+bool ybp_bloom_event_matches(struct ybp_binlog_parser* restrict, struct ybp_event* restrict e, const struct ybp_bloom_query* restrict q);
+
+/******* event index ********/
+
+/**
+ * Start building an event index for this parser. Every event read by
+ * ybp_next_event from the start of the file onward is added to it.
+ * Returns 0 on success, -1 on error.
+ **/
+int ybp_enable_event_index(struct ybp_binlog_parser*);
+
+/**
+ * Index up to event n (or the end of the file, if n is SIZE_MAX), reading
+ * only headers, without moving the parser. Enables the index if needed.
+ * Call again after ybp_update_bp to pick up what was appended. Returns 0
+ * on success, -1 on error.
+ **/
+int ybp_extend_event_index(struct ybp_binlog_parser*, size_t n);
+
+/**
+ * Atomically write the parser's event index to path. Returns 0 on
+ * success, -1 on error.
+ **/
+int ybp_save_event_index(struct ybp_binlog_parser* restrict, const char* restrict path);
+
+/**
+ * Load an event index saved by ybp_save_event_index into the parser. It
+ * is extended from where it stopped. Returns 0 on success, -2 if there is
+ * none or it belongs to some other binlog, and -1 on error.
+ **/
+int ybp_load_event_index(struct ybp_binlog_parser* restrict, const char* restrict path);
+
+/**
+ * Move the parser to the nth event (counting from 0 at the one after the
+ * FDE), so ybp_next_event reads it. Returns its offset, -2 if there are
+ * not that many events, and -1 on error.
+ **/
+off64_t ybp_seek_event_n(struct ybp_binlog_parser*, size_t n);
+
+/**
+ * The number of the first event at or after offset, or -2 if there is
+ * none. Indexes the whole file if needed.
+ **/
+ssize_t ybp_event_n_at_offset(struct ybp_binlog_parser*, off64_t offset);
+
+/**
+ * The number of the first event from event from on whose timestamp is at
+ * least t, or -2 if there is none. Unlike ybp_nearest_time this doesn't
+ * assume timestamps only go up.
+ **/
+ssize_t ybp_event_n_at_time(struct ybp_binlog_parser*, size_t from, time_t t);
+
+/**
+ * Count the events numbered [first, last) of the given type (or of any
+ * type, if type_code is -1). last may be SIZE_MAX for "to the end".
+ * Returns -1 on error.
+ **/
+ssize_t ybp_count_events(struct ybp_binlog_parser*, size_t first, size_t last, int type_code);
+
+/******* divergence ********/
+
+/**
+ * One transaction, reduced to a hash of what it did: its statements
+ * (and their databases), row images and table maps, and the INTVAR, RAND
+ * and USER_VAR values they depend on. Things that differ from server to
+ * server for the same change are left out: headers (server id, offsets,
+ * next_position), thread ids and execution times, table ids, XIDs and the
+ * GTID events themselves. The GTID, if there was one, is kept alongside.
+ **/
+struct ybp_txn_digest {
+	uint64_t	hash;
+	size_t		file;			/* which binlog of its chain it's in */
+	off64_t		offset;			/* of its first event */
+	off64_t		end;			/* just after its last event */
+	uint32_t	timestamp;		/* of its first event */
+	uint32_t	num_events;
+	bool		has_gtid;
+	bool		complete;		/* false if the binlog stopped partway through */
+	struct ybp_gtid	gtid;
+};
+
+/**
+ * Read the next transaction from the parser's position (which must be
+ * between transactions) into t, skipping the events that belong to no
+ * transaction (FDEs, rotations, GTID sets and the like). evbuf is scratch.
+ * A torn event at the end of the binlog ends it. Returns 1 if t was
+ * filled in, 0 if the binlog has no more, and -1 on error.
+ **/
+int ybp_next_transaction(struct ybp_binlog_parser* restrict, struct ybp_event* restrict evbuf, struct ybp_txn_digest* restrict t);
+
+/**
+ * Called by ybp_find_divergence for each transaction past the common
+ * history that only one side has; side is 0 for chain a, 1 for chain b
+ **/
+typedef void (*ybp_divergence_fn)(int side, const struct ybp_txn_digest* t, void* arg);
+
+struct ybp_divergence {
+	bool	overlap;			/* do the chains share any history at all? */
+	struct ybp_txn_digest	last_common[2];	/* where it ends on each side, if they do */
+	struct ybp_txn_digest	first[2];	/* where each side goes its own way */
+	bool	has_first[2];		/* false if that side has nothing more */
+	size_t	num_extra[2];		/* transactions past the divergence only that side has */
+	size_t	num_shared_after;	/* ...and ones both sides have after all, in any order */
+	unsigned int	probes;		/* lookups made by the binary search */
+	size_t	num_compared;		/* transactions compared one by one */
+};
+
+/**
+ * Find where two chains of binlogs (each given oldest first), such as an
+ * old primary's and the one that took over from it, stop agreeing.
+ *
+ * The start of the shared history is found by looking up the first
+ * transaction of one chain in the other (by GTID if it has one, otherwise
+ * by hash among transactions stamped within a few seconds of it). A
+ * binary search over chain a then looks up transactions the same way to
+ * narrow down where the shared history ends, on the assumption that once
+ * the chains part they stay parted, and the last stretch is compared
+ * transaction by transaction from the last match. Everything after the
+ * divergence is read on both sides and extra is called (if not NULL) for
+ * each transaction only one side has, in chain order, by which time the
+ * rest of out has been filled in.
+ *
+ * The parsers are moved around. Returns 0 on success, -1 on error.
+ **/
+int ybp_find_divergence(struct ybp_binlog_parser** a, size_t num_a, struct ybp_binlog_parser** b, size_t num_b,
+		struct ybp_divergence* out, ybp_divergence_fn extra, void* arg);
+
+/******* row compaction ********/
+
+enum ybp_row_op {
+	YBP_ROW_INSERT=1,
+	YBP_ROW_UPDATE=2,
+	YBP_ROW_DELETE=3
+};
+
+#define YBP_COLUMN_UNSIGNED	0x01
+#define YBP_COLUMN_KEY		0x02	/* part of the key rows are compacted on */
+
+/**
+ * A table's layout as one TABLE_MAP event gave it. The event's post-header
+ * and body are kept in map, and the names point into it.
+ **/
+struct ybp_table_version {
+	uint64_t	name_hash;		/* of the database and table names */
+	uint64_t	map_hash;		/* of the body, which leaves out the table id */
+	unsigned char*	map;
+	size_t		map_len;
+	size_t		post_header_len;
+	const char*	db_name;
+	size_t		db_name_len;
+	const char*	table_name;
+	size_t		table_name_len;
+	size_t		num_columns;
+	const uint8_t*	types;
+	uint16_t*	meta;
+	uint8_t*	flags;			/* YBP_COLUMN_* by column */
+	const char**	names;		/* NULL unless the server sent them */
+	size_t*		name_lens;
+};
+
+/**
+ * The latest image of one row: where it is, not what it is. A free slot
+ * has a key of zero.
+ **/
+struct ybp_row_ref {
+	uint64_t	key[2];			/* 128 bits of hash of the table and key columns */
+	uint64_t	offset;			/* of the rows event the image is in */
+	uint32_t	file;			/* which binlog of the chain that's in */
+	uint32_t	table;			/* index into the compactor's tables */
+	uint32_t	row;			/* where the image starts, from the start of the event */
+	uint32_t	row_len;
+	uint32_t	columns;		/* ...and the bitmap of columns in it */
+	uint8_t		op;				/* enum ybp_row_op */
+};
+
+struct ybp_table_id {
+	uint64_t	id;
+	size_t		table;			/* index into tables + 1 (0 is empty) */
+};
+
+struct ybp_compactor {
+	struct ybp_row_ref*	slots;	/* open addressing, linear probing */
+	size_t		num_slots;		/* a power of two */
+	size_t		max_slots;		/* as many as fit in the memory bound */
+	size_t		num_rows;
+	bool		sorted;			/* slots[0..num_rows) are sorted, and no more can come */
+	struct ybp_table_version*	tables;
+	size_t		num_tables;
+	size_t		tables_size;
+	struct ybp_table_id*	ids;	/* the server's table ids -> tables */
+	size_t		num_ids;
+	size_t		ids_size;		/* a power of two */
+	unsigned char*	key;		/* where key columns are gathered for hashing */
+	size_t		key_size;
+	char*		spill_dir;
+	FILE**		runs;			/* spilled slots, each sorted, oldest first */
+	size_t		num_runs;
+	uint64_t	rows_seen;
+	uint64_t	rows_skipped;	/* ...that were missing a key column */
+	uint64_t	events_skipped;	/* row events we couldn't read, for want of a table map or otherwise */
+};
+
+/**
+ * Keep the latest image of every row that row events (WRITE_ROWS,
+ * UPDATE_ROWS and DELETE_ROWS, v1 and v2) touch, keyed on the primary key
+ * if the table maps carry it (MySQL 8 with binlog_row_metadata=FULL) and
+ * on the first column otherwise. Keys compare byte for byte, so ones that
+ * differ only by collation (case, trailing spaces) are different rows.
+ *
+ * Only offsets are kept, in a hash table of at most max_memory bytes;
+ * when it fills up, it's sorted and spilled to a temporary file in
+ * spill_dir (or $TMPDIR, or /tmp, if that's NULL), and the spills are
+ * merged back together at the end. With binlog_row_image=MINIMAL the
+ * images are only the columns that were set, so that's all that comes
+ * out. Compressed and partial-JSON row events are counted as skipped.
+ **/
+struct ybp_compactor* ybp_get_compactor(size_t max_memory, const char* spill_dir);
+
+/**
+ * Look at an event from the binlog numbered file of a chain. Events have
+ * to come in order: a row event needs its table map first. Returns 0 on
+ * success and -1 on error.
+ **/
+int ybp_compactor_observe(struct ybp_compactor* restrict, struct ybp_binlog_parser* restrict, size_t file, struct ybp_event* restrict);
+
+/**
+ * Write one JSON object per row, ordered by table, with the row's final
+ * image as an object keyed by column name (or "@1", "@2"... where the
+ * names aren't known). The parsers are the chain the events came from,
+ * for reading the images back. The compactor can't observe anything
+ * afterwards. Returns the number of rows written, or -1 on error.
+ **/
+off64_t ybp_compactor_write_json(struct ybp_compactor* restrict, struct ybp_binlog_parser** parsers, size_t num_parsers, FILE* restrict out);
+
+/**
+ * Write a binlog to out_fd that puts back the final state of each row:
+ * the first parser's FDE, then for every table a TABLE_MAP and the final
+ * images as WRITE_ROWS (or DELETE_ROWS for rows that ended up deleted),
+ * in transactions of a bounded size, and a STOP. Rows that existed
+ * before won't apply cleanly over themselves, so replay it into an empty
+ * copy or with slave_exec_mode=IDEMPOTENT. Returns the number of events
+ * written, -2 if the binlogs' headers aren't ones it can write, or -1 on
+ * error.
+ **/
+off64_t ybp_compactor_write_binlog(struct ybp_compactor* restrict, struct ybp_binlog_parser** parsers, size_t num_parsers, int out_fd);
+
+void ybp_dispose_compactor(struct ybp_compactor*);
+
+/******* sessions ********/
+
+/**
+ * One client connection, as told apart by the thread ids on its statements
+ **/
+struct ybp_session {
+	uint32_t	thread_id;
+	bool		in_transaction;
+	uint64_t	num_statements;
+	uint64_t	num_transactions;	/* ended, by COMMIT, ROLLBACK or XID */
+	uint32_t	first_timestamp;
+	uint32_t	last_timestamp;
+	off64_t		last_offset;
+	void*		user;			/* the caller's, e.g. where its output goes */
+	size_t		lru_prev;		/* neighbours in order of use (indexes into sessions) */
+	size_t		lru_next;
+};
+
+/**
+ * Called when a session is dropped to make room for another (and for
+ * every session left when they're disposed of); it'll start afresh if
+ * its thread id comes back
+ **/
+typedef void (*ybp_session_evict_fn)(struct ybp_session* session, void* arg);
+
+struct ybp_sessions {
+	struct ybp_session*	sessions;
+	size_t		num_sessions;
+	size_t		max_sessions;
+	size_t*		slots;			/* thread id -> index into sessions + 1 (0 is empty) */
+	size_t		num_slots;
+	size_t		lru_head;		/* most recently used */
+	size_t		lru_tail;		/* least */
+	uint32_t*	filter;			/* thread ids to follow, sorted; NULL for all of them */
+	size_t		filter_len;
+	struct ybp_event*	context;	/* held back for the statement they go with */
+	size_t		num_context;
+	size_t		context_size;
+	bool		context_delivered;
+	size_t		current;		/* whose events these are: index, or SIZE_MAX for none */
+	bool		current_filtered;	/* ...or they're a thread we aren't following */
+	ybp_session_evict_fn	evict;
+	void*		evict_arg;
+	uint64_t	num_created;
+	uint64_t	num_evicted;
+	uint64_t	events_skipped;	/* belonging to threads filtered out */
+};
+
+/**
+ * Demultiplex statement-based binlogs by client connection, keeping at
+ * most max_sessions sessions and dropping the least recently used.
+ **/
+struct ybp_sessions* ybp_get_sessions(size_t max_sessions, ybp_session_evict_fn evict, void* arg);
+
+/**
+ * Follow only these thread ids. Everything else is skipped having read
+ * no more of each event than its post-header; n of 0 follows them all
+ * again. Returns -1 on error.
+ **/
+int ybp_sessions_filter(struct ybp_sessions* restrict, const uint32_t* restrict thread_ids, size_t n);
+
+/**
+ * Read the next event from p into evbuf, like ybp_next_event, and set
+ * *session to the session it belongs to. Query events carry their thread
+ * id; the events after a statement (table maps, row events, the XID) are
+ * its thread's until another statement comes along. Events that belong
+ * to no session (FDEs, rotations...) come back with *session NULL.
+ *
+ * INTVAR, RAND, USER_VAR and GTID events are held back and never come
+ * back on their own: when a query event does, the ones that went before
+ * it are in s->context[0..s->num_context), valid until the next call.
+ *
+ * Returns 1 if there are more events, 0 if this was the last, and
+ * negative on error.
+ **/
+int ybp_sessions_next(struct ybp_sessions* restrict s, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict evbuf, struct ybp_session** session);
+
+void ybp_dispose_sessions(struct ybp_sessions*);
+
+/******* filter expressions ********/
+
+/**
+ * What a filter test looks at, cheapest first: the common header, the
+ * query post-header, then the query body
+ **/
+enum ybp_filter_field {
+	YBP_FILTER_TYPE,
+	YBP_FILTER_SERVER_ID,
+	YBP_FILTER_TIME,
+	YBP_FILTER_OFFSET,
+	YBP_FILTER_LENGTH,
+	YBP_FILTER_THREAD,
+	YBP_FILTER_ERROR,
+	YBP_FILTER_DB,
+	YBP_FILTER_STMT,
+};
+
+enum ybp_filter_op {
+	YBP_FILTER_AND,
+	YBP_FILTER_OR,
+	YBP_FILTER_NOT,
+	YBP_FILTER_TYPE_IN,		/* type code in types */
+	YBP_FILTER_RANGE,		/* lo <= field <= hi */
+	YBP_FILTER_EQUAL,		/* the text is text */
+	YBP_FILTER_SEARCH,		/* grep matches the text */
+};
+
+/**
+ * One node of a compiled filter. Nodes are kept in prefix order: the
+ * subtree under a node is the size nodes starting with it, so AND, OR and
+ * NOT have their children right after them.
+ **/
+struct ybp_filter_node {
+	uint8_t		op;			/* enum ybp_filter_op */
+	uint8_t		field;		/* enum ybp_filter_field */
+	uint8_t		cost;		/* of the dearest test in the subtree */
+	uint32_t	size;
+	int64_t		lo;
+	int64_t		hi;
+	char*		text;
+	size_t		text_len;
+	struct ybp_grep*	grep;
+	uint8_t		types[32];	/* bitmap of type codes */
+};
+
+struct ybp_filter {
+	struct ybp_filter_node*	nodes;
+	size_t		num_nodes;
+	size_t		nodes_size;
+};
+
+/**
+ * Compile a filter expression such as
+ *
+ *   type in (QUERY, XID) and db = 'foo' and server_id != 3
+ *     and time between 1375210957 and '2013-07-31 00:00:00'
+ *     and stmt ~ 'UPDATE users'
+ *
+ * Fields are type, server_id, time, offset, length, thread, error, db and
+ * stmt; comparisons are =, !=, <, <=, >, >=, between, in (...), ~ (the
+ * statement or database contains the text), ~* (ignoring case) and =~ (it
+ * matches the extended regex). Tests are combined with and, or, not and
+ * parentheses, and within each and/or the ones that only need the event
+ * header are put first. thread, error, db and stmt tests are false for
+ * events other than queries, so `db != 'foo'` holds for XIDs (and `type
+ * != QUERY or db = 'foo'` keeps foo's transaction control events). Strings
+ * are quoted with ' or ", which a backslash or doubling escapes. Returns
+ * NULL (having complained) if the expression doesn't parse.
+ **/
+struct ybp_filter* ybp_get_filter(const char* expr);
+
+/**
+ * Does e pass the filter? Doesn't allocate, and only decodes the query
+ * event if a test needs it.
+ **/
+bool ybp_filter_event(struct ybp_binlog_parser* restrict, const struct ybp_filter* restrict, struct ybp_event* restrict);
+
+void ybp_dispose_filter(struct ybp_filter*);
+
+/******* pipelined decoding ********/
+
+/**
+ * A run of consecutive events read by a pipeline's reader and decoded by
+ * one of its workers. The arrays are batch_size long; the first
+ * num_events are filled in.
+ **/
+struct ybp_pipeline_batch {
+	struct ybp_event*	events;
+	struct ybp_decoded_event*	decoded;
+	bool*		has_decoded;	/* whether decoded[i] could be made */
+	size_t		num_events;
+	uint64_t	seq;
+	off64_t		end_offset;	/* where the reader was after this batch */
+	int			status;		/* 1, 0 if it's the last, negative if reading failed */
+	struct ybp_binlog_parser*	parser;	/* the reader's decode state when it filled this */
+};
+
+/**
+ * A single-producer, single-consumer queue of batches. head and tail are
+ * kept on separate cache lines so the two sides don't fight over one.
+ **/
+struct ybp_pipeline_queue {
+	struct ybp_pipeline_batch**	slots;
+	size_t		mask;
+	char		pad0[64];
+	uint64_t	head;		/* next to push, only moved by the producer */
+	char		pad1[64];
+	uint64_t	tail;		/* next to pop, only moved by the consumer */
+	char		pad2[64];
+};
+
+struct ybp_pipeline {
+	struct ybp_binlog_parser*	parser;	/* only touched by the reader once started */
+	const struct ybp_filter*	filter;
+	bool		follow;
+	size_t		batch_size;
+	unsigned int	num_workers;
+	struct ybp_pipeline_batch*	batches;
+	size_t		num_batches;
+	struct ybp_pipeline_queue	free;		/* consumer -> reader */
+	struct ybp_pipeline_queue*	to_workers;		/* reader -> worker */
+	struct ybp_pipeline_queue*	from_workers;	/* worker -> consumer */
+	pthread_t	reader;
+	pthread_t*	workers;
+	unsigned int	num_started;	/* workers, plus the reader */
+	int			stop;
+	uint64_t	next_seq;	/* the batch the consumer wants next */
+	bool		ended;
+	int			end_status;
+	off64_t		retry_offset;	/* of an event the reader couldn't read yet */
+	off_t		retry_size;		/* of the file then */
+	unsigned int	num_retries;	/* since either changed */
+};
+
+/**
+ * Decode the events of p from its current position on several threads: a
+ * reader groups them into batches of up to batch_size, which go round-robin
+ * to num_workers decoders (each dropping the events filter, if given,
+ * rejects) and come back to ybp_pipeline_next_batch in order. Batches are
+ * handed off through lock-free queues; a partial batch is passed on as soon
+ * as the reader catches up with the end of the binlog, so following a live
+ * one costs at most a poll interval of latency.
+ *
+ * Without follow the pipeline ends at the end of the file; with it, it
+ * waits for more, and for the rest of a half-written event, but gives up
+ * (complaining) on one that stays unreadable for a few seconds after the
+ * file stops growing. Either way it ends after a ROTATE or STOP event. p
+ * belongs to the pipeline until it's disposed of, and filter must outlive
+ * it. Returns NULL (having complained) on failure.
+ **/
+struct ybp_pipeline* ybp_get_pipeline(struct ybp_binlog_parser* restrict p, unsigned int num_workers, size_t batch_size,
+		const struct ybp_filter* restrict filter, bool follow);
+
+/**
+ * Take the next batch, waiting up to timeout_ms (forever if negative) for
+ * it. Returns 1 with *batch set (or NULL on a timeout), 0 once the
+ * pipeline has ended, and negative if reading failed. Batches must be
+ * given back with ybp_pipeline_release_batch, from the same thread.
+ **/
+int ybp_pipeline_next_batch(struct ybp_pipeline* restrict pl, struct ybp_pipeline_batch** restrict batch, int timeout_ms);
+
+void ybp_pipeline_release_batch(struct ybp_pipeline* restrict pl, struct ybp_pipeline_batch* restrict batch);
+
+/**
+ * Stop the threads and free everything but the parser. The reader runs
+ * ahead, so the parser is left past the batches taken: resume from the
+ * end_offset of the last of them.
+ **/
+void ybp_dispose_pipeline(struct ybp_pipeline*);
+
+/******* bulk export ********/
+
+#define YBP_EXPORT_NO_DB UINT16_MAX
+
+enum ybp_export_flags {
+	YBP_EXPORT_STATEMENTS = 0x01,	/* copy query statements into the payload buffer */
+	YBP_EXPORT_BODIES = 0x02,		/* ...and the bodies of every other event */
+};
+
+/**
+ * One event's header, laid out for numpy (a 40-byte record with every
+ * field aligned; see EVENT_RECORD_DTYPE in the Python bindings).
+ * thread_id is 0, and db_id YBP_EXPORT_NO_DB, for events that don't
+ * have them; table maps have a database, but no thread.
+ **/
+struct ybp_event_record {
+	int64_t		offset;
+	uint64_t	payload_offset;	/* into the export's payload buffer */
+	uint32_t	timestamp;
+	uint32_t	server_id;
+	uint32_t	length;
+	uint32_t	thread_id;
+	uint32_t	payload_len;	/* 0 if nothing was copied */
+	uint16_t	db_id;		/* index into db_names */
+	uint8_t		type_code;
+	uint8_t		truncated;	/* the payload stops short of the whole statement or body */
+};
+
+/**
+ * Events in bulk: a record per event and their payloads back to back in
+ * one buffer, rather than an allocation per event. Databases are
+ * numbered in the order they're first seen; past the 65535th they're
+ * left out.
+ **/
+struct ybp_export {
+	int			flags;
+	struct ybp_event_record*	records;
+	size_t		num_records;
+	size_t		records_size;
+	char*		payload;
+	size_t		payload_len;
+	size_t		payload_size;
+	char**		db_names;
+	size_t		num_dbs;
+	uint32_t*	db_slots;	/* open addressing over db_names, index + 1 */
+	size_t		num_db_slots;
+	struct ybp_event	evbuf;
+};
+
+struct ybp_export* ybp_get_export(int flags);
+
+/**
+ * Append the events from p's position on (at most max_events of them, if
+ * that's not 0) to x. Only as much of each event is read as its record
+ * and payload need. The arrays may move while this runs; they stay put
+ * between calls. Returns how many events were added, or -1 on error.
+ **/
+ssize_t ybp_export_events(struct ybp_export* restrict x, struct ybp_binlog_parser* restrict p, size_t max_events);
+
+void ybp_dispose_export(struct ybp_export*);
+
+/******* scanning many binlogs ********/
+
+/**
+ * What a scan works out from the events, kept per thread and merged at
+ * the end, so observe needn't lock anything. init (NULL means zeroing)
+ * and dispose (optional) are called on each state; merge folds one
+ * thread's state into another's, so it should be order-independent.
+ **/
+struct ybp_scan_reducer {
+	size_t		state_size;
+	void		(*init)(void* state, void* arg);
+	int			(*observe)(void* restrict state, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, size_t file, void* arg);
+	void		(*merge)(void* restrict into, void* restrict from, void* arg);
+	void		(*dispose)(void* state, void* arg);
+	void*		arg;
+};
+
+/**
+ * A piece of one binlog: the events starting in [start, end)
+ **/
+struct ybp_scan_task {
+	size_t		file;
+	off64_t		start;
+	off64_t		end;
+};
+
+/**
+ * One thread's queue of tasks. The owner works from the front, where the
+ * biggest are; idle threads steal from the back.
+ **/
+struct ybp_scan_deque {
+	pthread_mutex_t	lock;
+	struct ybp_scan_task*	tasks;
+	size_t		head;
+	size_t		tail;
+};
+
+struct ybp_scan_progress {
+	uint64_t	bytes_done;
+	uint64_t	bytes_total;
+	uint64_t	files_done;
+	uint64_t	num_files;
+	uint64_t	events;
+	double		elapsed;	/* seconds */
+};
+
+typedef void (*ybp_scan_progress_fn)(const struct ybp_scan_progress* progress, void* arg);
+
+struct ybp_scan {
+	char**		paths;
+	off64_t*	sizes;
+	size_t		num_files;
+	unsigned int	num_threads;
+	off64_t		split_size;
+	bool		enforce_server_id;
+	size_t		read_limit;		/* as ybp_set_read_limit, if not 0 */
+	struct ybp_scan_reducer*	reducers;
+	size_t		num_reducers;
+	void**		states;		/* [thread * num_reducers + reducer]; thread 0's hold the results */
+	struct ybp_scan_deque*	deques;
+	uint32_t*	ranges_left;	/* by file */
+	uint64_t	bytes_done;
+	uint64_t	bytes_total;
+	uint64_t	files_done;
+	uint64_t	files_failed;
+	uint64_t	events;
+	unsigned int	num_reported;
+};
+
+/**
+ * Set up a scan of the given binlogs on num_threads threads, with files
+ * bigger than split_size cut into pieces of about that size (each begins
+ * at the first event the resync finds past its start, and the piece
+ * before it ends there too). Returns NULL (having complained) on failure.
+ **/
+struct ybp_scan* ybp_get_scan(const char* const* paths, size_t num_paths, unsigned int num_threads, off64_t split_size);
+
+/**
+ * Have every event of the scan passed to r. Returns the reducer's number,
+ * or -1 on error.
+ **/
+int ybp_scan_add_reducer(struct ybp_scan* restrict s, const struct ybp_scan_reducer* restrict r);
+
+/**
+ * Run the scan, calling progress (if given) from this thread every
+ * interval_ms while it goes and once at the end. Binlogs that can't be
+ * read are complained about and counted in files_failed. Returns 0, or -1
+ * if it couldn't be started.
+ **/
+int ybp_scan_run(struct ybp_scan* restrict s, ybp_scan_progress_fn progress, void* arg, unsigned int interval_ms);
+
+/**
+ * Reducer number r's merged state, once the scan has run
+ **/
+void* ybp_scan_result(struct ybp_scan* s, int r);
+
+void ybp_dispose_scan(struct ybp_scan*);
+
+/******* arrival timeline ********/
+
+/**
+ * Buckets of a log-scaled histogram: values under 4 get one each, and
+ * every power of two above that is split in four, so a bucket is within
+ * 25% of what's in it. Values past the last bucket (about 2^41) land in it.
+ **/
+#define YBP_HISTOGRAM_BUCKETS 160
+
+struct ybp_histogram {
+	uint64_t	counts[YBP_HISTOGRAM_BUCKETS];
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	max;
+};
+
+void ybp_histogram_add(struct ybp_histogram* h, uint64_t value);
+
+/**
+ * The smallest value of the bucket holding the qth quantile (0 to 1), or 0
+ * if h is empty
+ **/
+uint64_t ybp_histogram_quantile(const struct ybp_histogram* h, double q);
+
+/**
+ * The smallest value that goes in bucket b
+ **/
+uint64_t ybp_histogram_bucket_floor(unsigned int b);
+
+/**
+ * Throughput is kept for the last this many seconds
+ **/
+#define YBP_TIMELINE_SECONDS 64
+
+struct ybp_timeline_second {
+	int64_t		second;		/* of arrival, since the epoch */
+	uint64_t	events;
+	uint64_t	bytes;
+	uint64_t	commits;
+};
+
+/**
+ * When the events of a binlog being followed showed up, in fixed memory.
+ * The event timestamp is when the statement started, so an event's delay
+ * is its arrival less its timestamp and (for query events) query_time,
+ * all in microseconds; binlog timestamps are whole seconds, so delays are
+ * only good to a second. Commits are XIDs and the query events that end
+ * a transaction or stand alone.
+ **/
+struct ybp_timeline {
+	struct ybp_histogram	delay;		/* of every event */
+	struct ybp_histogram	commit_gap;	/* between commits' arrivals */
+	struct ybp_timeline_second	seconds[YBP_TIMELINE_SECONDS];	/* by second % YBP_TIMELINE_SECONDS */
+	uint64_t	events;
+	uint64_t	bytes;
+	uint64_t	commits;
+	int64_t		first_arrival;
+	int64_t		last_arrival;
+	int64_t		last_commit;	/* arrival of the last commit, or 0 */
+	int64_t		last_delay;
+	uint32_t	last_timestamp;
+	bool		in_transaction;
+};
+
+struct ybp_timeline_stats {
+	uint64_t	events;
+	uint64_t	bytes;
+	uint64_t	commits;
+	int64_t		last_delay;		/* microseconds */
+	uint64_t	delay_p50;
+	uint64_t	delay_p99;
+	uint64_t	delay_max;
+	uint64_t	commit_gap_p50;
+	uint64_t	commit_gap_p99;
+	uint64_t	commit_gap_max;
+	/* Over the whole seconds before now, up to YBP_TIMELINE_SECONDS - 1 */
+	double		events_per_second;
+	double		bytes_per_second;
+	double		commits_per_second;
+	uint64_t	peak_commits_per_second;
+};
+
+/**
+ * The wall clock, in microseconds since the epoch
+ **/
+int64_t ybp_timeline_now(void);
+
+void ybp_init_timeline(struct ybp_timeline* t);
+
+/**
+ * Note that e showed up at arrival (ybp_timeline_now()). Events read
+ * together may share one arrival, which saves asking the clock for each.
+ **/
+void ybp_timeline_observe(struct ybp_timeline* restrict t, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, int64_t arrival);
+
+void ybp_timeline_stats(const struct ybp_timeline* restrict t, int64_t now, struct ybp_timeline_stats* restrict out);
+
+/**
+ * Write t's counters, stats and histograms to path in the Prometheus text
+ * format, through a temporary file renamed over it so readers never see
+ * half of one. Returns 0, or -1 (having complained) on error.
+ **/
+int ybp_timeline_write(const struct ybp_timeline* restrict t, const char* restrict path);
+
+/******* change-data-capture sink ********/
+
+#define YBP_CDC_MANIFEST "manifest"
+#define YBP_CDC_SUFFIX ".binlog"
+#define YBP_CDC_BUFFER_SIZE (1 << 20)	/* a partition's writes are batched up to this */
+
+struct ybp_cdc_partition {
+	char*		name;		/* db.table, or db for statements naming no table, or _ */
+	uint64_t	hash;
+	int			fd;
+	off64_t		size;		/* of the file, plus what's in buf */
+	off64_t		committed_size;	/* as of the last transaction boundary */
+	unsigned char*	buf;
+	size_t		buf_len;
+	uint64_t	txn;		/* the last transaction written to */
+	bool		dirty;		/* written to since the last fsync */
+};
+
+/**
+ * Routes the events of a binlog chain to a binlog per table in a
+ * directory, so each table's consumer reads only its own. Query events go
+ * by the first table their statement names, table maps by theirs and row
+ * events by their table map; the INTVAR, RAND, USER_VAR and rows-query
+ * events before one go along with it. A transaction's GTID event (MySQL's
+ * or MariaDB's), BEGIN and XID (or COMMIT) are copied to every partition
+ * it touched, so each is a valid binlog of whole transactions, with the
+ * source's FDE.
+ *
+ * Partitions are written through big buffers and fsynced together at
+ * transaction boundaries, every flush_every commits or flush_interval_ms,
+ * after which a manifest of the source position and each partition's
+ * size is replaced. Reopening the directory truncates the partitions back
+ * to the manifest, so resuming from its position writes each transaction
+ * exactly once.
+ **/
+struct ybp_cdc_sink {
+	char*		dir;
+	struct ybp_cdc_partition*	partitions;
+	size_t		num_partitions;
+	size_t		partitions_size;
+	size_t*		slots;		/* open addressing, partition + 1 */
+	size_t		num_slots;
+	size_t*		touched;	/* partitions the current transaction has written to */
+	size_t		num_touched;
+	size_t		touched_size;
+	uint64_t*	table_ids;	/* table id, partition pairs from this transaction's table maps */
+	size_t		num_table_ids;
+	size_t		table_ids_size;
+	unsigned char*	context;	/* whole events waiting for the event they go with */
+	size_t		context_len;
+	size_t		context_size;
+	unsigned char*	begin;		/* the current transaction's BEGIN, if it had one */
+	size_t		begin_len;
+	size_t		begin_size;
+	unsigned char*	gtid;		/* the GTID event of the current transaction, if it had one */
+	size_t		gtid_len;
+	size_t		gtid_size;
+	struct ybp_event	evbuf;	/* scratch, for copying FDEs */
+	uint64_t	txn;
+	bool		in_transaction;
+	int			checksum_alg;	/* of the partitions, or -1 before there are any */
+	char		file_name[YBP_CHECKPOINT_FILE_NAME_LEN];	/* where to resume */
+	off64_t		offset;
+	unsigned int	pending;	/* commits since the last group commit */
+	unsigned int	flush_every;
+	unsigned int	flush_interval_ms;
+	struct timespec	last_flush;
+	uint64_t	events_routed;
+	uint64_t	group_commits;
+};
+
+/**
+ * Open (creating it if need be) the sink in dir. If dir has a manifest,
+ * the partitions are cut back to it and file_name and offset say where to
+ * resume reading; otherwise file_name is empty. Returns NULL (having
+ * complained) on error.
+ **/
+struct ybp_cdc_sink* ybp_get_cdc_sink(const char* dir, unsigned int flush_every, unsigned int flush_interval_ms);
+
+/**
+ * Route e, read by p from the binlog file_name. The events must be read
+ * whole (no read limit). Returns 1 if this made a group commit, 0 if not,
+ * -1 on system errors and -2 if e can't be routed (the chain's binlogs
+ * disagree on checksums, or e was cut short).
+ **/
+int ybp_cdc_sink_observe(struct ybp_cdc_sink* restrict s, struct ybp_binlog_parser* restrict p, const char* restrict file_name, struct ybp_event* restrict e);
+
+/**
+ * Make everything up to the last transaction boundary durable. Returns 0
+ * or -1.
+ **/
+int ybp_cdc_sink_commit(struct ybp_cdc_sink*);
+
+/**
+ * Commit and clean up. Whatever the unfinished transaction wrote is left
+ * past the manifest's sizes, for the next open to cut off.
+ **/
+void ybp_dispose_cdc_sink(struct ybp_cdc_sink*);
+
+/******* LOAD DATA ********/
+
+/**
+ * A file being loaded, as its BEGIN_LOAD_QUERY and APPEND_BLOCK events
+ * come along
+ **/
+struct ybp_load_file {
+	uint32_t	file_id;
+	uint32_t	server_id;
+	int			fd;
+	char*		path;
+	off64_t		size;
+};
+
+/**
+ * A finished load: its EXECUTE_LOAD_QUERY statement, reading the file back
+ * from path with LOAD DATA LOCAL INFILE
+ **/
+struct ybp_load_statement {
+	char*		statement;
+	size_t		statement_len;
+	char		db_name[256];
+	uint32_t	thread_id;
+	char*		path;
+	uint32_t	file_id;
+	off64_t		size;
+};
+
+/**
+ * Puts LOAD DATA files back together in dir. Block payloads are copied
+ * from the binlog to the files by the kernel (copy_file_range, or
+ * sendfile), so give the parser a small read limit (ybp_set_read_limit)
+ * and they're never read into memory at all.
+ **/
+struct ybp_loads {
+	char*		dir;
+	struct ybp_load_file*	files;	/* loads under way */
+	size_t		num_files;
+	size_t		files_size;
+	struct ybp_load_statement	last;
+	uint64_t	loads;
+	uint64_t	bytes;
+};
+
+/**
+ * Returns NULL (having complained) if dir can't be created
+ **/
+struct ybp_loads* ybp_get_loads(const char* dir);
+
+/**
+ * Look at e, read by p. An EXECUTE_LOAD_QUERY_EVENT finishing a load
+ * points *out at its statement (good until the next call) and returns 1.
+ * Otherwise returns 0, or -1 on system errors and -2 on malformed events.
+ * Blocks of loads that began before the parser did are complained about
+ * and skipped; DELETE_FILE_EVENT throws a load away.
+ **/
+int ybp_loads_observe(struct ybp_loads* restrict l, struct ybp_binlog_parser* restrict p, struct ybp_event* restrict e, struct ybp_load_statement** out);
+
+/**
+ * Clean up, leaving the files of loads that never finished where they are
+ **/
+void ybp_dispose_loads(struct ybp_loads*);
+
 /* vim: set sts=0 sw=4 ts=4 noexpandtab: */
 
 #endif /* _YBINLOGP_H_ */
@@ -5,7 +5,14 @@ from ybinlogp.parser import NextEventError
 from ybinlogp.parser import NoEventsAfterTime
 from ybinlogp.parser import NoEventsAfterOffset
 from ybinlogp.parser import EmptyEventError
+from ybinlogp.parser import GTIDNotFound
+from ybinlogp.parser import NoSuchEvent
 from ybinlogp.parser import YBinlogP
+from ybinlogp.parser import YBinlogPConsumer
+from ybinlogp.parser import ConsumerEvicted
 from ybinlogp.parser import EventType
+from ybinlogp.parser import BadCheckpoint
+from ybinlogp.parser import load_checkpoint
+from ybinlogp.parser import fingerprint
 from ybinlogp.version import __version__
 from ybinlogp.version import version_info
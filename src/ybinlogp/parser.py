@@ -11,12 +11,13 @@ import ctypes
 import datetime
 import errno
 import logging
+import os
 import time
 
 
 log = logging.getLogger('ybinlogp')
 
-library = ctypes.CDLL("libybinlogp.so.1", use_errno=True)
+library = ctypes.CDLL("libybinlogp.so.2", use_errno=True)
 
 
 class EventStruct(ctypes.Structure):
@@ -28,10 +29,54 @@ class EventStruct(ctypes.Structure):
 			("next_position", ctypes.c_uint32),
 			("flags", ctypes.c_uint16),
 			("data", ctypes.c_void_p),
-			("offset", ctypes.c_uint64)]
+			("offset", ctypes.c_uint64),
+			("data_len", ctypes.c_uint32)]
 
 	_pack_ = 1
 
+class PipelineBatchStruct(ctypes.Structure):
+	"""Internal data structure for batches of pipelined events"""
+	_fields_ = [("events", ctypes.POINTER(EventStruct)),
+			("decoded", ctypes.c_void_p),
+			("has_decoded", ctypes.POINTER(ctypes.c_bool)),
+			("num_events", ctypes.c_size_t),
+			("seq", ctypes.c_uint64),
+			("end_offset", ctypes.c_longlong),
+			("status", ctypes.c_int),
+			("parser", ctypes.c_void_p)]
+
+class EventRecordStruct(ctypes.Structure):
+	"""One event's header as :func:`YBinlogP.export` lays it out"""
+	_fields_ = [("offset", ctypes.c_int64),
+			("payload_offset", ctypes.c_uint64),
+			("timestamp", ctypes.c_uint32),
+			("server_id", ctypes.c_uint32),
+			("length", ctypes.c_uint32),
+			("thread_id", ctypes.c_uint32),
+			("payload_len", ctypes.c_uint32),
+			("db_id", ctypes.c_uint16),
+			("type_code", ctypes.c_uint8),
+			("truncated", ctypes.c_uint8)]
+
+# The same, for numpy.frombuffer
+EVENT_RECORD_DTYPE = [('offset', '<i8'), ('payload_offset', '<u8'), ('timestamp', '<u4'),
+		('server_id', '<u4'), ('length', '<u4'), ('thread_id', '<u4'), ('payload_len', '<u4'),
+		('db_id', '<u2'), ('type_code', 'u1'), ('truncated', 'u1')]
+
+NO_DB = 0xffff
+
+class ExportStruct(ctypes.Structure):
+	"""Internal data structure for bulk exports (just the fields we read)"""
+	_fields_ = [("flags", ctypes.c_int),
+			("records", ctypes.POINTER(EventRecordStruct)),
+			("num_records", ctypes.c_size_t),
+			("records_size", ctypes.c_size_t),
+			("payload", ctypes.c_void_p),
+			("payload_len", ctypes.c_size_t),
+			("payload_size", ctypes.c_size_t),
+			("db_names", ctypes.POINTER(ctypes.c_char_p)),
+			("num_dbs", ctypes.c_size_t)]
+
 class Event(object):
 	"""User-facing data structure for Events"""
 	__slots__ = 'event_type', 'offset', 'time', 'data'
@@ -101,6 +146,64 @@ class XIDEvent(object):
 	def __str__(self):
 		return "COMMIT xid %d" % self.xid
 
+class GTIDStruct(ctypes.Structure):
+	"""Internal data structure for GTIDs"""
+	_fields_ = [("flavor", ctypes.c_int),
+			("sid", ctypes.c_uint8 * 16),
+			("domain_id", ctypes.c_uint32),
+			("server_id", ctypes.c_uint32),
+			("gno", ctypes.c_uint64),
+			("last_committed", ctypes.c_uint64),
+			("sequence_number", ctypes.c_uint64)]
+
+class GTIDEvent(object):
+	"""User-facing data structure for GTID events, which start a transaction"""
+	__slots__ = 'gtid', 'last_committed', 'sequence_number'
+
+	def __init__(self, gtid, last_committed, sequence_number):
+		self.gtid = gtid
+		self.last_committed = last_committed
+		self.sequence_number = sequence_number
+
+	def __str__(self):
+		return "GTID %s" % self.gtid
+
+GTID_STR_LEN = 64
+
+FINGERPRINT_SHAPE_LEN = 512
+FINGERPRINT_SAMPLE_LEN = 256
+
+class FingerprintEntryStruct(ctypes.Structure):
+	"""Internal data structure for one statement shape's totals"""
+	_fields_ = [("hash", ctypes.c_uint64),
+			("weight", ctypes.c_uint64),
+			("weight_error", ctypes.c_uint64),
+			("count", ctypes.c_uint64),
+			("bytes", ctypes.c_uint64),
+			("query_time", ctypes.c_uint64),
+			("heap_pos", ctypes.c_size_t),
+			("shape", ctypes.c_char * FINGERPRINT_SHAPE_LEN),
+			("sample", ctypes.c_char * FINGERPRINT_SAMPLE_LEN)]
+
+class StatementShape(object):
+	"""User-facing data structure for a statement shape and its totals.
+	weight is the count or bytes the shape was ranked by, which may
+	overstate it by up to weight_error.
+	"""
+	__slots__ = 'shape', 'sample', 'count', 'bytes', 'query_time', 'weight', 'weight_error'
+
+	def __init__(self, entry):
+		self.shape = entry.shape
+		self.sample = entry.sample
+		self.count = entry.count
+		self.bytes = entry.bytes
+		self.query_time = entry.query_time
+		self.weight = entry.weight
+		self.weight_error = entry.weight_error
+
+	def __str__(self):
+		return "%d x %s" % (self.count, self.shape)
+
 _init_bp = library.ybp_get_binlog_parser
 _init_bp.argtypes = [ctypes.c_int]
 _init_bp.restype = ctypes.c_void_p
@@ -113,6 +216,10 @@ _next_event = library.ybp_next_event
 _next_event.argtypes = [ctypes.c_void_p, ctypes.POINTER(EventStruct)]
 _next_event.restype = ctypes.c_int
 
+_prev_event = library.ybp_prev_event
+_prev_event.argtypes = [ctypes.c_void_p, ctypes.POINTER(EventStruct)]
+_prev_event.restype = ctypes.c_int
+
 _reset_event = library.ybp_reset_event
 _reset_event.argtypes = [ctypes.POINTER(EventStruct)]
 _reset_event.restype = None
@@ -141,10 +248,18 @@ _dispose_safe_qe = library.ybp_dispose_safe_qe
 _dispose_safe_qe.argtype = [ctypes.POINTER(QueryEventStruct)]
 _dispose_safe_qe.qestype = None
 
+_decode_safe_qe = library.ybp_decode_safe_qe
+_decode_safe_qe.argtypes = [ctypes.c_void_p, ctypes.POINTER(EventStruct)]
+_decode_safe_qe.restype = ctypes.POINTER(QueryEventStruct)
+
 _event_to_safe_re = library.ybp_event_to_safe_re
 _event_to_safe_re.argtypes = [ctypes.POINTER(EventStruct)]
 _event_to_safe_re.restype = ctypes.POINTER(RotateEventStruct)
 
+_decode_safe_re = library.ybp_decode_safe_re
+_decode_safe_re.argtypes = [ctypes.c_void_p, ctypes.POINTER(EventStruct)]
+_decode_safe_re.restype = ctypes.POINTER(RotateEventStruct)
+
 _dispose_safe_re = library.ybp_dispose_safe_re
 _dispose_safe_re.argtype = [ctypes.POINTER(RotateEventStruct)]
 _dispose_safe_re.restype = None
@@ -157,6 +272,22 @@ _dispose_safe_xe = library.ybp_dispose_safe_xe
 _dispose_safe_xe.argtype = [ctypes.POINTER(XIDEventStruct)]
 _dispose_safe_xe.restype = None
 
+_event_to_gtid = library.ybp_event_to_gtid
+_event_to_gtid.argtypes = [ctypes.POINTER(EventStruct), ctypes.POINTER(GTIDStruct)]
+_event_to_gtid.restype = ctypes.c_int
+
+_parse_gtid = library.ybp_parse_gtid
+_parse_gtid.argtypes = [ctypes.c_char_p, ctypes.POINTER(GTIDStruct)]
+_parse_gtid.restype = ctypes.c_int
+
+_format_gtid = library.ybp_format_gtid
+_format_gtid.argtypes = [ctypes.POINTER(GTIDStruct), ctypes.c_char_p]
+_format_gtid.restype = None
+
+_find_gtid = library.ybp_find_gtid
+_find_gtid.argtypes = [ctypes.c_void_p, ctypes.POINTER(GTIDStruct)]
+_find_gtid.restype = ctypes.c_longlong
+
 # no c_off in ctypes, using c_longlong instead
 _rewind_bp = library.ybp_rewind_bp
 _rewind_bp.argtypes = [ctypes.c_void_p, ctypes.c_longlong]
@@ -174,6 +305,133 @@ _nearest_time = library.ybp_nearest_time
 _nearest_time.argtypes = [ctypes.c_void_p, ctypes.c_long]
 _nearest_time.restype = ctypes.c_longlong
 
+_set_read_limit = library.ybp_set_read_limit
+_set_read_limit.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+_set_read_limit.restype = None
+
+_slice = library.ybp_slice
+_slice.argtypes = [ctypes.c_void_p, ctypes.c_longlong, ctypes.c_longlong, ctypes.c_int, ctypes.c_char_p]
+_slice.restype = ctypes.c_longlong
+
+_read_event_body = library.ybp_read_event_body
+_read_event_body.argtypes = [ctypes.c_void_p, ctypes.POINTER(EventStruct), ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t]
+_read_event_body.restype = ctypes.c_ssize_t
+
+_get_filter = library.ybp_get_filter
+_get_filter.argtypes = [ctypes.c_char_p]
+_get_filter.restype = ctypes.c_void_p
+
+_filter_event = library.ybp_filter_event
+_filter_event.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(EventStruct)]
+_filter_event.restype = ctypes.c_bool
+
+_dispose_filter = library.ybp_dispose_filter
+_dispose_filter.argtypes = [ctypes.c_void_p]
+_dispose_filter.restype = None
+
+_get_pipeline = library.ybp_get_pipeline
+_get_pipeline.argtypes = [ctypes.c_void_p, ctypes.c_uint, ctypes.c_size_t, ctypes.c_void_p, ctypes.c_bool]
+_get_pipeline.restype = ctypes.c_void_p
+
+_pipeline_next_batch = library.ybp_pipeline_next_batch
+_pipeline_next_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.POINTER(PipelineBatchStruct)), ctypes.c_int]
+_pipeline_next_batch.restype = ctypes.c_int
+
+_pipeline_release_batch = library.ybp_pipeline_release_batch
+_pipeline_release_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(PipelineBatchStruct)]
+_pipeline_release_batch.restype = None
+
+_dispose_pipeline = library.ybp_dispose_pipeline
+_dispose_pipeline.argtypes = [ctypes.c_void_p]
+_dispose_pipeline.restype = None
+
+_get_export = library.ybp_get_export
+_get_export.argtypes = [ctypes.c_int]
+_get_export.restype = ctypes.POINTER(ExportStruct)
+
+_export_events = library.ybp_export_events
+_export_events.argtypes = [ctypes.POINTER(ExportStruct), ctypes.c_void_p, ctypes.c_size_t]
+_export_events.restype = ctypes.c_ssize_t
+
+_dispose_export = library.ybp_dispose_export
+_dispose_export.argtypes = [ctypes.POINTER(ExportStruct)]
+_dispose_export.restype = None
+
+EXPORT_STATEMENTS = 0x01
+EXPORT_BODIES = 0x02
+
+_seek_event_n = library.ybp_seek_event_n
+_seek_event_n.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+_seek_event_n.restype = ctypes.c_longlong
+
+_count_events = library.ybp_count_events
+_count_events.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_int]
+_count_events.restype = ctypes.c_ssize_t
+
+SIZE_MAX = ctypes.c_size_t(-1).value
+
+_fingerprint = library.ybp_fingerprint
+_fingerprint.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.POINTER(ctypes.c_uint64)]
+_fingerprint.restype = ctypes.c_size_t
+
+_get_fingerprints = library.ybp_get_fingerprints
+_get_fingerprints.argtypes = [ctypes.c_size_t, ctypes.c_int]
+_get_fingerprints.restype = ctypes.c_void_p
+
+_fingerprints_observe = library.ybp_fingerprints_observe
+_fingerprints_observe.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(EventStruct)]
+_fingerprints_observe.restype = ctypes.c_int
+
+_fingerprints_top = library.ybp_fingerprints_top
+_fingerprints_top.argtypes = [ctypes.c_void_p, ctypes.POINTER(FingerprintEntryStruct), ctypes.c_size_t]
+_fingerprints_top.restype = ctypes.c_size_t
+
+_dispose_fingerprints = library.ybp_dispose_fingerprints
+_dispose_fingerprints.argtypes = [ctypes.c_void_p]
+_dispose_fingerprints.restype = None
+
+FINGERPRINT_BY = {'count': 0, 'bytes': 1}
+
+_ring_connect = library.ybp_ring_connect
+_ring_connect.argtypes = [ctypes.c_char_p, ctypes.c_uint32]
+_ring_connect.restype = ctypes.c_void_p
+
+_ring_next = library.ybp_ring_next
+_ring_next.argtypes = [ctypes.c_void_p, ctypes.POINTER(EventStruct), ctypes.POINTER(ctypes.c_uint32)]
+_ring_next.restype = ctypes.c_int
+
+_ring_client_lag = library.ybp_ring_client_lag
+_ring_client_lag.argtypes = [ctypes.c_void_p]
+_ring_client_lag.restype = ctypes.c_uint64
+
+_ring_disconnect = library.ybp_ring_disconnect
+_ring_disconnect.argtypes = [ctypes.c_void_p]
+_ring_disconnect.restype = None
+
+RING_FROM_OLDEST = 0x01
+
+_get_checkpoint = library.ybp_get_checkpoint
+_get_checkpoint.argtypes = [ctypes.c_char_p, ctypes.c_uint, ctypes.c_uint]
+_get_checkpoint.restype = ctypes.c_void_p
+
+_checkpoint_observe = library.ybp_checkpoint_observe
+_checkpoint_observe.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(EventStruct)]
+_checkpoint_observe.restype = ctypes.c_int
+
+_checkpoint_flush = library.ybp_checkpoint_flush
+_checkpoint_flush.argtypes = [ctypes.c_void_p]
+_checkpoint_flush.restype = ctypes.c_int
+
+_dispose_checkpoint = library.ybp_dispose_checkpoint
+_dispose_checkpoint.argtypes = [ctypes.c_void_p]
+_dispose_checkpoint.restype = None
+
+_load_checkpoint = library.ybp_load_checkpoint
+_load_checkpoint.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(ctypes.c_longlong)]
+_load_checkpoint.restype = ctypes.c_int
+
+CHECKPOINT_FILE_NAME_LEN = 4096
+
 class YBinlogPError(Exception):
 	pass
 
@@ -190,6 +448,9 @@ class YBinlogPSysError(YBinlogPError):
 class NextEventError(YBinlogPSysError):
 	pass
 
+class ConsumerEvicted(YBinlogPError):
+	pass
+
 class NoEventsAfterTime(YBinlogPError):
 	pass
 
@@ -199,6 +460,81 @@ class NoEventsAfterOffset(YBinlogPError):
 class EmptyEventError(YBinlogPError):
 	pass
 
+class GTIDNotFound(YBinlogPError):
+	pass
+
+class NoSuchEvent(YBinlogPError):
+	pass
+
+
+class BadCheckpoint(YBinlogPError):
+	pass
+
+
+def load_checkpoint(path):
+	"""Read a checkpoint written by :class:`YBinlogP`.
+
+	:returns: a (filename, offset) tuple, or None if there is no checkpoint
+	:raises: BadCheckpoint, YBinlogPSysError
+	"""
+	file_name = ctypes.create_string_buffer(CHECKPOINT_FILE_NAME_LEN)
+	offset = ctypes.c_longlong()
+	ret = _load_checkpoint(path, file_name, CHECKPOINT_FILE_NAME_LEN, ctypes.byref(offset))
+	if ret == -1:
+		err = ctypes.get_errno()
+		if err == errno.ENOENT:
+			return None
+		raise YBinlogPSysError(err)
+	elif ret == -2:
+		raise BadCheckpoint(path)
+	return file_name.value, offset.value
+
+
+def fingerprint(statement):
+	"""Normalize a statement to its shape, with literals replaced by ?.
+
+	:returns: a (shape, hash) tuple
+	"""
+	out = ctypes.create_string_buffer(len(statement) + 1)
+	shape_hash = ctypes.c_uint64()
+	length = _fingerprint(statement, len(statement), out, ctypes.byref(shape_hash))
+	return out.raw[:length], shape_hash.value
+
+
+class EventExport(object):
+	"""Events read in bulk by :func:`YBinlogP.export`, held in C until
+	:func:`close`. records is an array of :class:`EventRecordStruct`, which
+	numpy can use as is:
+
+		events = numpy.frombuffer(export.records, dtype=EVENT_RECORD_DTYPE)
+		queries = events[events['type_code'] == 2]
+
+	and payload holds the statements (or bodies) they point into, back to
+	back. db_id indexes databases (NO_DB if there isn't one).
+	"""
+
+	def __init__(self, handle):
+		self._handle = handle
+		x = handle.contents
+		self.records = (EventRecordStruct * x.num_records).from_address(
+				ctypes.addressof(x.records.contents)) if x.num_records else (EventRecordStruct * 0)()
+		self.payload = (ctypes.c_char * x.payload_len).from_address(x.payload) if x.payload_len else (ctypes.c_char * 0)()
+		self.databases = [x.db_names[i] for i in range(x.num_dbs)]
+
+	def __len__(self):
+		return len(self.records)
+
+	def payload_of(self, i):
+		"""The statement or body of the ith event, as a memoryview"""
+		record = self.records[i]
+		return memoryview(self.payload)[record.payload_offset:record.payload_offset + record.payload_len]
+
+	def close(self):
+		if self._handle is not None:
+			self.records = self.payload = None
+			_dispose_export(self._handle)
+			self._handle = None
+
 
 class EventType(object):
 	"""Enumeration of event types."""
@@ -206,12 +542,16 @@ class EventType(object):
 	rotate = "ROTATE_EVENT"
 	query = "QUERY_EVENT"
 	xid = "XID_EVENT"
+	gtid = "GTID_LOG_EVENT"
+	mariadb_gtid = "GTID_EVENT"
 
 
-def build_event(event_buffer):
+def build_event(event_buffer, binlog_parser_handle=None):
 	"""Create an :class:`Event` object from the mysql event.
 
 	:param event_buffer: a mysql event buffer
+	:param binlog_parser_handle: the parser it came from, if any, whose FDE
+	                             says how query events are laid out
 	:returns: :class:`Event` for the event
 	:raises: EmptyEventError
 	"""
@@ -224,14 +564,24 @@ def build_event(event_buffer):
 		raise EmptyEventError()
 
 	if event_type == EventType.query:
-		query_event = _event_to_safe_qe(event_buffer)
+		if binlog_parser_handle is not None:
+			query_event = _decode_safe_qe(binlog_parser_handle, event_buffer)
+			if not query_event:
+				raise EmptyEventError()
+		else:
+			query_event = _event_to_safe_qe(event_buffer)
 		base_event.data = QueryEvent(query_event.contents.db_name,
 		                             query_event.contents.statement,
 		                             query_event.contents.query_time)
 		_dispose_safe_qe(query_event)
 
 	if event_type == EventType.rotate:
-		rotate_event = _event_to_safe_re(event_buffer)
+		if binlog_parser_handle is not None:
+			rotate_event = _decode_safe_re(binlog_parser_handle, event_buffer)
+			if not rotate_event:
+				raise EmptyEventError()
+		else:
+			rotate_event = _event_to_safe_re(event_buffer)
 		base_event.data = RotateEvent(rotate_event.contents.next_position,
 		                              rotate_event.contents.file_name)
 		_dispose_safe_re(rotate_event)
@@ -241,6 +591,14 @@ def build_event(event_buffer):
 		base_event.data = XIDEvent(xid_event.contents.id)
 		_dispose_safe_xe(xid_event)
 
+	if event_type in (EventType.gtid, EventType.mariadb_gtid):
+		gtid = GTIDStruct()
+		if _event_to_gtid(event_buffer, ctypes.byref(gtid)) == 0:
+			gtid_str = ctypes.create_string_buffer(GTID_STR_LEN)
+			_format_gtid(ctypes.byref(gtid), gtid_str)
+			base_event.data = GTIDEvent(gtid_str.value, gtid.last_committed,
+			                            gtid.sequence_number)
+
 	return base_event
 
 
@@ -258,7 +616,9 @@ class YBinlogP(object):
 		bp.clean_up()
 	"""
 
-	def __init__(self, filename, always_update=False, max_retries=3, sleep_interval=0.1):
+	def __init__(self, filename, always_update=False, max_retries=3, sleep_interval=0.1,
+			checkpoint=None, resume=None, checkpoint_every=1000, checkpoint_interval=1.0,
+			read_limit=0, filter=None):
 		"""
 		:param filename: filename of a mysql binary log
 		:type  filename: string
@@ -269,27 +629,81 @@ class YBinlogP(object):
 		:type  max_retries: int
 		:param sleep_interval: seconds to sleep between retries
 		:type  sleep_interval: float
+		:param checkpoint: path of a file to durably record our position in.
+		                   The position only moves once the event that ends a
+		                   transaction has been handled.
+		:type  checkpoint: string
+		:param resume: path of a checkpoint to resume from. If it exists, the
+		               binlog and offset it names replace filename. Defaults
+		               checkpoint to the same path.
+		:type  resume: string
+		:param checkpoint_every: flush the checkpoint after this many transactions
+		:type  checkpoint_every: int
+		:param checkpoint_interval: ...or after this many seconds
+		:type  checkpoint_interval: float
+		:param read_limit: read at most this many bytes of each event (at
+		                   least 256), so statements are cut short but huge
+		                   events cost nothing to step over. 0 reads all.
+		:type  read_limit: int
+		:param filter: only yield the events this expression holds for, e.g.
+		               "type in (QUERY, XID) and db = 'foo'"; see
+		               ybp_get_filter in ybinlogp.h. Other events are
+		               skipped without leaving C.
+		:type  filter: string
 		"""
+		resume_offset = None
+		if resume is not None:
+			if checkpoint is None:
+				checkpoint = resume
+			position = load_checkpoint(resume)
+			if position is not None:
+				filename, resume_offset = position
 		self.filename = filename
 		self._file = open(self.filename, 'r')
 		self.binlog_parser_handle = _init_bp(self._file.fileno())
+		if read_limit:
+			_set_read_limit(self.binlog_parser_handle, read_limit)
+		self.filter_handle = None
+		if filter is not None:
+			self.filter_handle = _get_filter(filter)
+			if not self.filter_handle:
+				raise ValueError("Invalid filter %r" % filter)
 		self.event_buffer = _get_event()
 		self.always_update = always_update
 		self.max_retries = max_retries
 		self.sleep_interval = sleep_interval
+		self.checkpoint_handle = None
+		if checkpoint is not None:
+			self.checkpoint_handle = _get_checkpoint(checkpoint,
+					checkpoint_every, int(checkpoint_interval * 1000))
+			if not self.checkpoint_handle:
+				raise YBinlogPSysError(ctypes.get_errno())
+		if resume_offset is not None:
+			self.seek(resume_offset)
 
 	def _get_next_event(self):
-		_reset_event(self.event_buffer)
-		last = _next_event(self.binlog_parser_handle, self.event_buffer)
-		if last < 0:
-			raise NextEventError(ctypes.get_errno())
-		return build_event(self.event_buffer), last == 0
+		while True:
+			_reset_event(self.event_buffer)
+			last = _next_event(self.binlog_parser_handle, self.event_buffer)
+			if last < 0:
+				raise NextEventError(ctypes.get_errno())
+			if self.filter_handle is None or _filter_event(self.binlog_parser_handle,
+					self.filter_handle, self.event_buffer):
+				return build_event(self.event_buffer, self.binlog_parser_handle), last == 0
+			if last == 0:
+				raise NextEventError(0)
 
 	def close(self):
 		"""Clean up some things that are allocated in C-land. Attempting to
 		use this object after calling this method will break.
 		"""
 		# TODO: should this be a __del__?
+		if self.checkpoint_handle is not None:
+			_dispose_checkpoint(self.checkpoint_handle)
+			self.checkpoint_handle = None
+		if self.filter_handle is not None:
+			_dispose_filter(self.filter_handle)
+			self.filter_handle = None
 		_dispose_bp(self.binlog_parser_handle)
 		self.binlog_parser_handle = None
 		_dispose_event(self.event_buffer)
@@ -306,6 +720,21 @@ class YBinlogP(object):
 		"""
 		return self.filename, _tell_bp(self.binlog_parser_handle)
 
+	def read_body(self, pos, size):
+		"""Read up to size bytes of the body (everything after the common
+		header) of the event last yielded by iterating over the parser, from
+		pos on, straight from the binlog. With read_limit, this is how to get
+		at the rest of a big event a chunk at a time.
+
+		:return: the bytes read; empty past the end of the body
+		:rtype: string
+		"""
+		buf = ctypes.create_string_buffer(size)
+		ret = _read_event_body(self.binlog_parser_handle, self.event_buffer, pos, buf, size)
+		if ret < 0:
+			raise YBinlogPSysError(ctypes.get_errno())
+		return buf.raw[:ret]
+
 	def update(self):
 		"""Update the binlog parser. This just re-stats the underlying file descriptor.
 		Call this if you have reason to believe that the underlying file has changed size
@@ -327,6 +756,8 @@ class YBinlogP(object):
 				event, last = self._get_next_event()
 				current_offset = event.offset
 				yield event
+				if self.checkpoint_handle is not None:
+					self._observe_checkpoint()
 			except EmptyEventError, e:
 				if retries >= self.max_retries:
 					raise
@@ -338,6 +769,78 @@ class YBinlogP(object):
 				else:
 					raise
 
+	def iter_backwards(self):
+		"""Return an iteration over the events before the current position,
+		newest first. Starting from the end of the file, this is the tail of
+		the binlog:
+
+		bp = YBinlogP('/path/to/binlog')
+		bp.seek(os.path.getsize('/path/to/binlog'))
+		last_ten = list(itertools.islice(bp.iter_backwards(), 10))
+
+		Leaves the parser positioned at the last event returned.
+		"""
+		while True:
+			_reset_event(self.event_buffer)
+			ret = _prev_event(self.binlog_parser_handle, self.event_buffer)
+			if ret == -2:
+				return
+			elif ret < 0:
+				raise NextEventError(ctypes.get_errno())
+			yield build_event(self.event_buffer, self.binlog_parser_handle)
+			if ret == 0:
+				return
+
+	def iter_pipelined(self, workers=2, batch_size=256, follow=False, timeout=0.1):
+		"""Like iterating over the parser, but the events are read, decoded
+		and run through the filter on C threads (a reader and `workers`
+		decoders) while Python handles the ones before them. With follow,
+		waits for more at the end of the binlog; either way it stops after
+		a ROTATE or STOP event. Leaves the parser after the last event
+		yielded.
+
+		:param timeout: seconds to wait for events at a time; shorter means
+		                quicker to notice the generator being closed
+		:type  timeout: float
+		"""
+		pipeline = _get_pipeline(self.binlog_parser_handle, workers, batch_size,
+				self.filter_handle, follow)
+		if not pipeline:
+			raise YBinlogPSysError(ctypes.get_errno())
+		batch = ctypes.POINTER(PipelineBatchStruct)()
+		position = None
+		try:
+			while True:
+				ret = _pipeline_next_batch(pipeline, ctypes.byref(batch), int(timeout * 1000))
+				if ret < 0:
+					raise NextEventError(ctypes.get_errno())
+				elif ret == 0:
+					return
+				elif not batch:
+					continue
+				try:
+					for i in xrange(batch.contents.num_events):
+						event_buffer = ctypes.pointer(batch.contents.events[i])
+						event = build_event(event_buffer, batch.contents.parser)
+						position = event.offset + event_buffer.contents.length
+						yield event
+				finally:
+					_pipeline_release_batch(pipeline, batch)
+		finally:
+			_dispose_pipeline(pipeline)
+			if position is not None:
+				self.seek(position)
+
+	def _observe_checkpoint(self):
+		if _checkpoint_observe(self.checkpoint_handle, self.binlog_parser_handle,
+				self.filename, self.event_buffer) < 0:
+			raise YBinlogPSysError(ctypes.get_errno())
+
+	def flush_checkpoint(self):
+		"""Make the position after the last handled transaction durable now"""
+		if _checkpoint_flush(self.checkpoint_handle) < 0:
+			raise YBinlogPSysError(ctypes.get_errno())
+
 	def handle_empty_event(self, exc, current_offset):
 		"""If the empty event is at the start of a file, update and sleep,
 		otherwise return to the previous good offset and try again.
@@ -382,6 +885,129 @@ class YBinlogP(object):
 		else:
 			return offset
 
+	def find_gtid(self, gtid_str):
+		"""Find the offset of the transaction with the given GTID
+		("uuid:number" or "domain-server-sequence"). The GTID index built
+		to answer this is kept, so later lookups are cheap. Usage:
+
+		bp = YBinlogP('/path/to/binlog')
+		bp.seek(bp.find_gtid('3e11fa47-71ca-11e1-9e33-c80aa9429562:23'))
+		"""
+		gtid = GTIDStruct()
+		if _parse_gtid(gtid_str, ctypes.byref(gtid)) < 0:
+			raise ValueError("Invalid GTID %r" % gtid_str)
+		offset = _find_gtid(self.binlog_parser_handle, ctypes.byref(gtid))
+		if offset == -1:
+			raise NextEventError(ctypes.get_errno())
+		elif offset == -2:
+			raise GTIDNotFound(gtid_str)
+		return offset
+
+	def slice(self, path, end=None, next_file=None):
+		"""Write the events from the current position up to end (an
+		offset; the end of the binlog by default), widened to whole
+		transactions, to path as a standalone binlog. It ends with a ROTATE
+		to next_file, or a STOP without one.
+
+		:return: the number of events written; 0 if the range held none
+		:rtype: int
+		"""
+		if end is None:
+			end = os.path.getsize(self.filename)
+		fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_TRUNC, 0644)
+		try:
+			written = _slice(self.binlog_parser_handle, _tell_bp(self.binlog_parser_handle),
+					end, fd, next_file)
+			os.fsync(fd)
+		finally:
+			os.close(fd)
+		if written == -1:
+			raise YBinlogPSysError(ctypes.get_errno())
+		return max(written, 0)
+
+	def seek_event_n(self, n):
+		"""Move to the nth event (counting from 0), so that iteration starts
+		there. The header index built to answer this is kept, so paging
+		around the binlog afterwards is cheap. Usage:
+
+		bp = YBinlogP('/path/to/binlog')
+		bp.seek_event_n(1000)
+		page = list(itertools.islice(bp, 50))
+		"""
+		offset = _seek_event_n(self.binlog_parser_handle, n)
+		if offset == -1:
+			raise NextEventError(ctypes.get_errno())
+		elif offset == -2:
+			raise NoSuchEvent(n)
+		return offset
+
+	def count_events(self, first=0, last=None, event_type_code=-1):
+		"""Count the events numbered [first, last), optionally only those
+		with the given type code.
+		"""
+		count = _count_events(self.binlog_parser_handle, first,
+				SIZE_MAX if last is None else last, event_type_code)
+		if count < 0:
+			raise NextEventError(ctypes.get_errno())
+		return count
+
+	def export(self, max_events=0, statements=True, bodies=False):
+		"""Read on to the end of the binlog (or through max_events events)
+		and return their headers and payloads in bulk as an
+		:class:`EventExport`: 40 bytes an event and one buffer of payloads,
+		rather than an object each. Usage:
+
+		bp = YBinlogP('/path/to/binlog')
+		export = bp.export()
+		print sum(r.length for r in export.records)
+		export.close()
+
+		:param statements: copy query statements into the payload buffer
+		:param bodies: copy the bodies of the other events too
+		"""
+		handle = _get_export((EXPORT_STATEMENTS if statements else 0) |
+				(EXPORT_BODIES if bodies else 0))
+		if not handle:
+			raise YBinlogPSysError(ctypes.get_errno())
+		if _export_events(handle, self.binlog_parser_handle, max_events) < 0:
+			_dispose_export(handle)
+			raise YBinlogPSysError(ctypes.get_errno())
+		return EventExport(handle)
+
+	def top_shapes(self, n=10, by='count', capacity=None):
+		"""Read on to the end of the binlog and return the n heaviest
+		statement shapes, by 'count' or 'bytes', heaviest first. Memory is
+		bounded by capacity shapes (default max(20 * n, 1000)); any shape
+		heavier than the total over capacity is sure to be found. Usage:
+
+		bp = YBinlogP('/path/to/binlog')
+		for shape in bp.top_shapes(5, by='bytes'):
+			print shape.bytes, shape.shape
+		"""
+		if capacity is None:
+			capacity = max(20 * n, 1000)
+		handle = _get_fingerprints(capacity, FINGERPRINT_BY[by])
+		if not handle:
+			raise YBinlogPSysError(ctypes.get_errno())
+		try:
+			while True:
+				_reset_event(self.event_buffer)
+				last = _next_event(self.binlog_parser_handle, self.event_buffer)
+				if last < 0:
+					err = ctypes.get_errno()
+					if err == 0:
+						break
+					raise NextEventError(err)
+				if _fingerprints_observe(handle, self.binlog_parser_handle, self.event_buffer) < 0:
+					raise YBinlogPSysError(ctypes.get_errno())
+				if last == 0:
+					break
+			entries = (FingerprintEntryStruct * n)()
+			found = _fingerprints_top(handle, entries, n)
+			return [StatementShape(entries[i]) for i in range(found)]
+		finally:
+			_dispose_fingerprints(handle)
+
 	def first_offset_after_offset(self, t):
 		"""Find the first valid offset after the given offset. Usage:
 
@@ -399,4 +1025,63 @@ class YBinlogP(object):
 		else:
 			return offset
 
+class YBinlogPConsumer(object):
+	"""Read events published by a running ybinlogpd instead of parsing the
+	binlog ourselves.
+
+	Example usage:
+
+	.. code-block:: python
+
+		consumer = YBinlogPConsumer('/tmp/ybinlogpd.sock')
+		for file_seq, event in consumer:
+			print event
+	"""
+
+	def __init__(self, socket_path, from_oldest=False, sleep_interval=0.1):
+		"""
+		:param socket_path: the UNIX socket ybinlogpd is listening on
+		:type  socket_path: string
+		:param from_oldest: start at the oldest event still in the ring rather
+		                    than at the newest
+		:type  from_oldest: boolean
+		:param sleep_interval: seconds to sleep when there is nothing to read
+		:type  sleep_interval: float
+		"""
+		flags = RING_FROM_OLDEST if from_oldest else 0
+		self.client_handle = _ring_connect(socket_path, flags)
+		if not self.client_handle:
+			raise YBinlogPSysError(ctypes.get_errno())
+		self.event_buffer = _get_event()
+		self.sleep_interval = sleep_interval
+
+	def lag(self):
+		"""Bytes of events published but not yet read by this consumer"""
+		return _ring_client_lag(self.client_handle)
+
+	def close(self):
+		_ring_disconnect(self.client_handle)
+		self.client_handle = None
+		_dispose_event(self.event_buffer)
+		self.event_buffer = None
+
+	def __iter__(self):
+		"""Yield (file_seq, event) tuples forever, where file_seq counts the
+		binlog rotations ybinlogpd has followed.
+		:raises: ConsumerEvicted
+		"""
+		file_seq = ctypes.c_uint32()
+		while True:
+			_reset_event(self.event_buffer)
+			ret = _ring_next(self.client_handle, self.event_buffer, ctypes.byref(file_seq))
+			if ret < 0:
+				raise ConsumerEvicted()
+			elif ret == 0:
+				time.sleep(self.sleep_interval)
+				continue
+			try:
+				yield file_seq.value, build_event(self.event_buffer)
+			except EmptyEventError:
+				continue
+
 # vim: set noexpandtab ts=4 sw=4:
@@ -0,0 +1,504 @@
+/*
+ * ybinlogpd: parse a binlog chain once and fan the events out to any
+ * number of local consumers through a shared-memory ring
+ *
+ * (C) 2010-2011 Yelp, Inc.
+ *
+ * This work is licensed under the ISC/OpenBSD License. The full
+ * contents of that license can be found under license.txt
+ */
+
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debugs.h"
+#include "ybinlogp.h"
+
+#define DEFAULT_SOCKET_PATH "/tmp/ybinlogpd.sock"
+#define DEFAULT_SHM_NAME "/ybinlogpd"
+#define DEFAULT_RING_MB 64
+#define DEFAULT_STALL_SECONDS 30
+#define LAG_REPORT_SECONDS 10
+#define DEFAULT_METRICS_SECONDS 10
+#define POLL_INTERVAL_MS 100
+#define EVENTS_PER_ROUND 1024
+#define HANDSHAKE_SECONDS 5
+
+enum pump_state {
+	PUMP_BUSY,		/* more events are ready */
+	PUMP_IDLE,		/* caught up with the writer */
+	PUMP_BLOCKED,	/* a consumer is holding us back */
+	PUMP_FAILED		/* the binlog can't be read past here */
+};
+
+struct source {
+	char		path[PATH_MAX];
+	char		next_path[PATH_MAX];	/* set while waiting for a rotation */
+	int			fd;
+	struct ybp_binlog_parser* bp;
+	uint32_t	file_seq;
+	struct ybp_timeline	timeline;
+	bool		caught_up;		/* the backlog we started on isn't lag */
+};
+
+/**
+ * A connection that hasn't said hello yet
+ **/
+struct greeting {
+	int			fd;
+	time_t		deadline;
+};
+
+static volatile sig_atomic_t keep_running = 1;
+
+static void handle_signal(int sig)
+{
+	(void) sig;
+	keep_running = 0;
+}
+
+void usage(void) {
+	fprintf(stderr, "ybinlogpd [options] binlog\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Parses binlog (and every binlog it rotates to) once, and publishes the\n");
+	fprintf(stderr, "events to consumers attached through a UNIX socket.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options\n");
+	fprintf(stderr, "\t-h           show this help\n");
+	fprintf(stderr, "\t-o OFFSET    start at the first event after the given offset\n");
+	fprintf(stderr, "\t-s PATH      listen on this UNIX socket (default %s)\n", DEFAULT_SOCKET_PATH);
+	fprintf(stderr, "\t-n NAME      name of the shared memory segment (default %s)\n", DEFAULT_SHM_NAME);
+	fprintf(stderr, "\t-m MB        size of the event ring in MB (default %d)\n", DEFAULT_RING_MB);
+	fprintf(stderr, "\t-S SECONDS   evict a consumer that has blocked us for this long (default %d)\n", DEFAULT_STALL_SECONDS);
+	fprintf(stderr, "\t-M FILE      write event arrival metrics (delay behind the binlog's timestamps,\n");
+	fprintf(stderr, "\t\t\t\tgaps between commits, throughput) to FILE for Prometheus\n");
+	fprintf(stderr, "\t-F SECONDS   with -M, rewrite FILE this often (default %d)\n", DEFAULT_METRICS_SECONDS);
+}
+
+static int open_source(struct source* s, const char* path)
+{
+	int fd;
+	struct ybp_binlog_parser* bp;
+	if ((fd = open(path, O_RDONLY|O_LARGEFILE)) < 0) {
+		return -1;
+	}
+	if ((bp = ybp_get_binlog_parser(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	if (s->bp != NULL) {
+		ybp_dispose_binlog_parser(s->bp);
+		close(s->fd);
+	}
+	memmove(s->path, path, strnlen(path, sizeof(s->path) - 1) + 1);
+	s->fd = fd;
+	s->bp = bp;
+	return 0;
+}
+
+/**
+ * Work out the path of the binlog after the current one. ROTATE events
+ * name it; after a STOP event (or a ROTATE we can't make out) we just bump
+ * the numeric extension.
+ **/
+static void next_binlog_path(struct source* s, struct ybp_event* evbuf, char* out, size_t out_len)
+{
+	char dir[PATH_MAX];
+	char* slash;
+	char* dot;
+	unsigned long seq;
+	int width;
+	strncpy(dir, s->path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	if ((slash = strrchr(dir, '/')) != NULL)
+		*(slash + 1) = '\0';
+	else
+		dir[0] = '\0';
+	if (evbuf->type_code == ROTATE_EVENT) {
+		/* Through the FDE, so a checksum doesn't end up in the name */
+		struct ybp_rotate_event_safe* re = ybp_decode_safe_re(s->bp, evbuf);
+		if (re != NULL) {
+			snprintf(out, out_len, "%s%s", dir, re->file_name);
+			ybp_dispose_safe_re(re);
+			return;
+		}
+	}
+	dot = strrchr(s->path, '.');
+	if (dot == NULL) {
+		snprintf(out, out_len, "%s", s->path);
+		return;
+	}
+	width = strlen(dot + 1);
+	seq = strtoul(dot + 1, NULL, 10);
+	snprintf(out, out_len, "%.*s.%0*lu", (int)(dot - s->path), s->path, width, seq + 1);
+}
+
+/**
+ * Read and publish up to EVENTS_PER_ROUND events. *pending says whether
+ * evbuf still holds an event we couldn't publish last time.
+ **/
+static enum pump_state pump(struct source* s, struct ybp_ring* ring, struct ybp_event* evbuf, bool* pending)
+{
+	/* Whatever this round reads showed up since the last one */
+	int64_t arrival = ybp_timeline_now();
+	int n;
+	for (n = 0; n < EVENTS_PER_ROUND; ++n) {
+		if (s->next_path[0] != '\0') {
+			/* The next file may not exist yet */
+			if (open_source(s, s->next_path) < 0)
+				return PUMP_IDLE;
+			s->next_path[0] = '\0';
+			s->file_seq++;
+			ybp_ring_set_file(ring, s->file_seq, s->path);
+			fprintf(stderr, "ybinlogpd: now reading %s\n", s->path);
+		}
+		if (!*pending) {
+			off64_t offset;
+			int ret;
+			ybp_update_bp(s->bp);
+			offset = ybp_tell_bp(s->bp);
+			if (offset + EVENT_HEADER_SIZE > s->bp->file_size)
+				return PUMP_IDLE;
+			ybp_reset_event(evbuf);
+			ret = ybp_next_event(s->bp, evbuf);
+			/* Headers that don't pass for an event's come back without a body */
+			if (ret >= 0 && evbuf->data == NULL && evbuf->length != EVENT_HEADER_SIZE)
+				ret = -2;
+			if (ret < 0) {
+				/* Probably a half-written event; try again when it's done.
+				 * But if all the bytes it claims are there, it never will be. */
+				ybp_rewind_bp(s->bp, offset);
+				if (offset + (off64_t)evbuf->length <= s->bp->file_size) {
+					fprintf(stderr, "ybinlogpd: the %u-byte event at %lld in %s is unreadable; giving up\n",
+							evbuf->length, (long long)offset, s->path);
+					return PUMP_FAILED;
+				}
+				return PUMP_IDLE;
+			}
+			*pending = true;
+			if (s->caught_up)
+				ybp_timeline_observe(&s->timeline, s->bp, evbuf, arrival);
+		}
+		if (!ybp_ring_publish(ring, evbuf, s->file_seq))
+			return PUMP_BLOCKED;
+		*pending = false;
+		if (evbuf->type_code == ROTATE_EVENT || evbuf->type_code == STOP_EVENT)
+			next_binlog_path(s, evbuf, s->next_path, sizeof(s->next_path));
+	}
+	return PUMP_BUSY;
+}
+
+static int open_listener(const char* socket_path)
+{
+	struct sockaddr_un addr;
+	int fd;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, YBP_RING_MAX_CONSUMERS) < 0) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Take a new connection. Its hello is read once poll says it has come,
+ * so that a client that says nothing can't hold everyone else up.
+ **/
+static void accept_consumer(int listen_fd, struct greeting* greetings)
+{
+	int fd, i;
+	if ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+		perror("accept");
+		return;
+	}
+	for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+		if (greetings[i].fd < 0) {
+			greetings[i].fd = fd;
+			greetings[i].deadline = time(NULL) + HANDSHAKE_SECONDS;
+			return;
+		}
+	}
+	fprintf(stderr, "ybinlogpd: too many handshakes under way, dropping consumer\n");
+	close(fd);
+}
+
+/**
+ * Finish g's handshake, now that it has something to read
+ **/
+static void greet_consumer(struct greeting* g, struct ybp_ring* ring, int* client_fds)
+{
+	struct ybp_ring_hello hello;
+	struct ybp_ring_welcome welcome;
+	int fd = g->fd;
+	ssize_t amt = read(fd, &hello, sizeof(hello));
+	if (amt < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	g->fd = -1;
+	if (amt != sizeof(hello) || hello.magic != YBP_RING_MAGIC || hello.version != YBP_RING_VERSION) {
+		fprintf(stderr, "ybinlogpd: bad handshake, dropping consumer\n");
+		close(fd);
+		return;
+	}
+	memset(&welcome, 0, sizeof(welcome));
+	welcome.magic = YBP_RING_MAGIC;
+	welcome.capacity = ring->hdr->capacity;
+	memcpy(welcome.shm_name, ring->shm_name, sizeof(welcome.shm_name));
+	welcome.slot = ybp_ring_add_consumer(ring, hello.pid, hello.flags);
+	/* A fresh socket's buffer always has room for this */
+	if (write(fd, &welcome, sizeof(welcome)) != sizeof(welcome) || welcome.slot < 0) {
+		ybp_ring_remove_consumer(ring, welcome.slot);
+		close(fd);
+		return;
+	}
+	client_fds[welcome.slot] = fd;
+	fprintf(stderr, "ybinlogpd: consumer %d attached (pid %u)\n", welcome.slot, hello.pid);
+}
+
+static void report_lag(struct source* s, struct ybp_ring* ring, int* client_fds)
+{
+	struct ybp_timeline_stats st;
+	int i;
+	if (s->timeline.events > 0) {
+		ybp_timeline_stats(&s->timeline, ybp_timeline_now(), &st);
+		fprintf(stderr, "ybinlogpd: %.1fs behind the binlog (p99 %.1fs), %.1f commits/s, %.0f events/s\n",
+				st.last_delay / 1e6, st.delay_p99 / 1e6, st.commits_per_second, st.events_per_second);
+	}
+	for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+		if (client_fds[i] < 0)
+			continue;
+		fprintf(stderr, "ybinlogpd: consumer %d (pid %u)%s: %llu bytes behind\n",
+				i,
+				ring->hdr->consumers[i].pid,
+				ring->hdr->consumers[i].evicted ? " [evicted]" : "",
+				(unsigned long long)ybp_ring_lag(ring->hdr, i));
+	}
+}
+
+int main(int argc, char** argv) {
+	int opt, i;
+	const char* socket_path = DEFAULT_SOCKET_PATH;
+	const char* shm_name = DEFAULT_SHM_NAME;
+	long ring_mb = DEFAULT_RING_MB;
+	long stall_seconds = DEFAULT_STALL_SECONDS;
+	long starting_offset = -1;
+	const char* metrics_path = NULL;
+	long metrics_seconds = DEFAULT_METRICS_SECONDS;
+	struct source src;
+	struct ybp_ring* ring;
+	struct ybp_event* evbuf;
+	bool pending = false;
+	int exit_status = 0;
+	int listen_fd;
+	int client_fds[YBP_RING_MAX_CONSUMERS];
+	struct greeting greetings[YBP_RING_MAX_CONSUMERS];
+	time_t stalled_since = 0;
+	time_t last_report = time(NULL);
+	time_t last_metrics = last_report;
+	struct pollfd pfds[2 * YBP_RING_MAX_CONSUMERS + 1];
+	int pfd_slots[2 * YBP_RING_MAX_CONSUMERS + 1];	/* -1 listener, then consumers, then greetings */
+
+	while ((opt = getopt(argc, argv, "ho:s:n:m:S:M:F:")) != -1) {
+		switch (opt) {
+			case 'h':
+				usage();
+				return 0;
+			case 'o':
+				starting_offset = atoll(optarg);
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'n':
+				shm_name = optarg;
+				break;
+			case 'm':
+				ring_mb = atol(optarg);
+				break;
+			case 'S':
+				stall_seconds = atol(optarg);
+				break;
+			case 'M':
+				metrics_path = optarg;
+				break;
+			case 'F':
+				metrics_seconds = atol(optarg);
+				break;
+			case '?':
+				fprintf(stderr, "Unknown argument %c\n", optopt);
+				usage();
+				return 1;
+		}
+	}
+	if (optind >= argc || ring_mb < 1 || metrics_seconds < 1) {
+		usage();
+		return 2;
+	}
+
+	memset(&src, 0, sizeof(src));
+	ybp_init_timeline(&src.timeline);
+	if (open_source(&src, argv[optind]) < 0) {
+		perror("Error opening binlog");
+		return 1;
+	}
+	if (starting_offset >= 0) {
+		off64_t offset = ybp_nearest_offset(src.bp, starting_offset);
+		if (offset < 0) {
+			fprintf(stderr, "Unable to find anything after offset %ld\n", starting_offset);
+			return 1;
+		}
+		ybp_rewind_bp(src.bp, offset);
+	}
+	if ((ring = ybp_ring_create(shm_name, ring_mb * 1048576)) == NULL) {
+		return 1;
+	}
+	ybp_ring_set_file(ring, src.file_seq, src.path);
+	if ((listen_fd = open_listener(socket_path)) < 0) {
+		ybp_ring_dispose(ring);
+		return 1;
+	}
+	if ((evbuf = ybp_get_event()) == NULL) {
+		perror("malloc event");
+		return 1;
+	}
+	for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+		client_fds[i] = -1;
+		greetings[i].fd = -1;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (keep_running) {
+		enum pump_state state = pump(&src, ring, evbuf, &pending);
+		int nfds = 0, timeout;
+		time_t now = time(NULL);
+
+		if (state == PUMP_FAILED) {
+			exit_status = 1;
+			break;
+		}
+
+		if (state == PUMP_IDLE)
+			src.caught_up = true;
+		if (state == PUMP_BLOCKED) {
+			if (stalled_since == 0) {
+				stalled_since = now;
+			}
+			else if (now - stalled_since >= stall_seconds) {
+				int slowest = ybp_ring_slowest(ring);
+				fprintf(stderr, "ybinlogpd: evicting consumer %d, %llu bytes behind\n",
+						slowest,
+						(unsigned long long)ybp_ring_lag(ring->hdr, slowest));
+				ybp_ring_evict_consumer(ring, slowest);
+				stalled_since = 0;
+			}
+		}
+		else {
+			stalled_since = 0;
+		}
+		if (now - last_report >= LAG_REPORT_SECONDS) {
+			report_lag(&src, ring, client_fds);
+			last_report = now;
+		}
+		if (metrics_path != NULL && now - last_metrics >= metrics_seconds) {
+			ybp_timeline_write(&src.timeline, metrics_path);
+			last_metrics = now;
+		}
+
+		pfds[nfds].fd = listen_fd;
+		pfds[nfds].events = POLLIN;
+		pfd_slots[nfds++] = -1;
+		for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+			if (client_fds[i] < 0)
+				continue;
+			pfds[nfds].fd = client_fds[i];
+			pfds[nfds].events = POLLIN;
+			pfd_slots[nfds++] = i;
+		}
+		for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+			if (greetings[i].fd < 0)
+				continue;
+			if (now >= greetings[i].deadline) {
+				fprintf(stderr, "ybinlogpd: no handshake in %ds, dropping consumer\n", HANDSHAKE_SECONDS);
+				close(greetings[i].fd);
+				greetings[i].fd = -1;
+				continue;
+			}
+			pfds[nfds].fd = greetings[i].fd;
+			pfds[nfds].events = POLLIN;
+			pfd_slots[nfds++] = YBP_RING_MAX_CONSUMERS + i;
+		}
+		timeout = (state == PUMP_BUSY) ? 0 : POLL_INTERVAL_MS;
+		if (poll(pfds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < nfds; ++i) {
+			if (!(pfds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+				continue;
+			if (pfd_slots[i] < 0) {
+				accept_consumer(listen_fd, greetings);
+			}
+			else if (pfd_slots[i] >= YBP_RING_MAX_CONSUMERS) {
+				greet_consumer(&greetings[pfd_slots[i] - YBP_RING_MAX_CONSUMERS], ring, client_fds);
+			}
+			else {
+				/* Consumers never talk after the handshake, so anything
+				 * here means they went away */
+				int slot = pfd_slots[i];
+				fprintf(stderr, "ybinlogpd: consumer %d detached\n", slot);
+				ybp_ring_remove_consumer(ring, slot);
+				close(client_fds[slot]);
+				client_fds[slot] = -1;
+			}
+		}
+	}
+
+	for (i = 0; i < YBP_RING_MAX_CONSUMERS; ++i) {
+		if (client_fds[i] >= 0)
+			close(client_fds[i]);
+		if (greetings[i].fd >= 0)
+			close(greetings[i].fd);
+	}
+	close(listen_fd);
+	unlink(socket_path);
+	if (metrics_path != NULL)
+		ybp_timeline_write(&src.timeline, metrics_path);
+	ybp_ring_dispose(ring);
+	ybp_dispose_event(evbuf);
+	ybp_dispose_binlog_parser(src.bp);
+	close(src.fd);
+	return exit_status;
+}
+
+/* vim: set sts=0 sw=4 ts=4 noexpandtab: */
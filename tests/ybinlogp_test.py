@@ -1,8 +1,71 @@
 import datetime
+import json
+import os
+import os.path
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+import zlib
 
 from testify import TestCase, setup, assert_equal
 
-from ybinlogp import YBinlogP, EventType
+from ybinlogp import YBinlogP, YBinlogPConsumer, EventType, GTIDNotFound, NoEventsAfterTime, NextEventError
+from ybinlogp import fingerprint, load_checkpoint
+
+
+def start_ybinlogpd(tmpdir, filename, *args):
+	"""Run ybinlogpd on filename, returning it and its socket once it's up"""
+	socket_path = os.path.join(tmpdir, 'sock')
+	daemon = subprocess.Popen(['build/ybinlogpd', '-s', socket_path,
+			'-n', '/ybinlogpd-test-%d' % os.getpid(), '-m', '1'] + list(args) + [filename],
+			stderr=open(os.devnull, 'w'))
+	for _ in range(100):
+		if os.path.exists(socket_path):
+			break
+		time.sleep(0.05)
+	return daemon, socket_path
+
+
+def stop_ybinlogpd(daemon):
+	daemon.send_signal(signal.SIGTERM)
+	assert_equal(daemon.wait(), 0)
+
+
+def consume(socket_path, n):
+	"""The first n events from the oldest in ybinlogpd's ring"""
+	consumer = YBinlogPConsumer(socket_path, from_oldest=True, sleep_interval=0.01)
+	events = []
+	signal.alarm(10)
+	try:
+		for file_seq, event in consumer:
+			events.append((file_seq, event.offset, event.event_type))
+			if len(events) == n:
+				break
+	finally:
+		signal.alarm(0)
+		consumer.close()
+	return events
+
+
+def checked_events(data):
+	"""The offset and type code of each event in a checksummed binlog,
+	checking that its next position and CRC32 are right"""
+	assert_equal(data[:4], '\xfebin')
+	events = []
+	offset = 4
+	while offset < len(data):
+		type_code, length, next_position = struct.unpack('<xxxxBxxxxIIxx', data[offset:offset + 19])
+		assert_equal(next_position, offset + length)
+		crc, = struct.unpack('<I', data[offset + length - 4:offset + length])
+		assert_equal(zlib.crc32(data[offset:offset + length - 4]) & 0xffffffff, crc)
+		events.append((offset, type_code))
+		offset += length
+	assert_equal(offset, len(data))
+	return events
 
 
 class YBinlogPAcceptanceTestCase(TestCase):
@@ -37,3 +100,641 @@ class YBinlogPAcceptanceTestCase(TestCase):
 		# Event has a timestamp way in the past relative to FDE
 		assert_equal(events[30].time, datetime.datetime(2013, 07, 30, 10, 2, 37))
 
+	def test_iter_backwards(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename)
+		forward = [event.offset for event in parser]
+		parser.seek(os.path.getsize(filename))
+		backward = [event.offset for event in parser.iter_backwards()]
+		parser.close()
+		assert_equal(backward, forward[::-1])
+
+	def test_seek_event_n(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename)
+		forward = [event.offset for event in parser]
+		assert_equal(parser.count_events(), len(forward))
+		parser.seek_event_n(len(forward) - 3)
+		tail = [event.offset for event in parser]
+		parser.seek_event_n(5)
+		middle = parser._get_next_event()[0].offset
+		parser.close()
+		assert_equal(tail, forward[-3:])
+		assert_equal(middle, forward[5])
+
+	def test_top_shapes(self):
+		assert_equal(fingerprint("SELECT * FROM t WHERE id IN (1, 2, 3) AND x = 'a'")[0],
+				'select * from t where id in (?+) and x = ?')
+		parser = YBinlogP('testing/data/mysql-bin.default-path')
+		shapes = parser.top_shapes(2)
+		parser.close()
+		assert_equal([(s.shape, s.count) for s in shapes],
+				[('begin', 10), ('insert into test1 values(?)', 7)])
+		assert_equal(shapes[1].sample, 'INSERT INTO test1 VALUES(1)')
+
+	def test_filter(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename, filter="type = QUERY and db = 'foobar' and stmt ~* 'bananas'")
+		events = list(parser)
+		parser.close()
+		assert_equal([event.data.statement for event in events],
+				['INSERT INTO test2(x) VALUES("Bananas r good")'])
+
+	def test_iter_pipelined(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename)
+		forward = [(event.offset, event.event_type) for event in parser]
+		parser.close()
+		parser = YBinlogP(filename, filter="type in (QUERY, XID)")
+		pipelined = [(event.offset, event.event_type) for event in parser.iter_pipelined(workers=3, batch_size=4)]
+		parser.close()
+		assert_equal(pipelined, [e for e in forward if e[1] in (EventType.query, EventType.xid)])
+
+	def test_iter_pipelined_gives_up(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename)
+		events = list(parser)
+		parser.close()
+		tmpdir = tempfile.mkdtemp()
+		try:
+			# Drop the ROTATE and end on an event claiming more than is there
+			torn = os.path.join(tmpdir, 'mysql-bin.000001')
+			with open(filename, 'rb') as f:
+				data = f.read(events[-1].offset)
+			with open(torn, 'wb') as f:
+				f.write(data + struct.pack('<IBIIIH', 0, 2, 1, 1000, 0, 0))
+			parser = YBinlogP(torn)
+			seen = []
+			try:
+				for event in parser.iter_pipelined(follow=True):
+					seen.append(event.offset)
+				raise AssertionError('followed a stuck binlog forever')
+			except NextEventError:
+				pass
+			parser.close()
+			assert_equal(seen, [e.offset for e in events[:-1]])
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_export(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename)
+		events = list(parser)
+		parser.seek(events[0].offset)
+		export = parser.export()
+		parser.close()
+		assert_equal([r.offset for r in export.records], [e.offset for e in events])
+		queries = [i for i, e in enumerate(events) if e.event_type == EventType.query]
+		assert_equal([export.payload_of(i).tobytes() for i in queries],
+				[events[i].data.statement for i in queries])
+		assert_equal([export.databases[export.records[i].db_id] for i in queries],
+				[events[i].data.db_name for i in queries])
+		export.close()
+
+	def test_checkpoint_resume(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		tmpdir = tempfile.mkdtemp()
+		try:
+			checkpoint = os.path.join(tmpdir, 'checkpoint')
+			parser = YBinlogP(filename, checkpoint=checkpoint, checkpoint_every=1)
+			events = []
+			for event in parser:
+				events.append(event)
+				# Stop in the middle of the third transaction
+				if len(events) == 10:
+					break
+			parser.close()
+
+			# Resuming starts after the last XID we finished handling
+			parser = YBinlogP(filename, resume=checkpoint)
+			resumed = list(parser)
+			parser.close()
+			assert_equal(events[7].event_type, EventType.xid)
+			assert_equal(resumed[0].offset, events[8].offset)
+			assert_equal(len(resumed), 38 - 8)
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_gtid_events(self):
+		filename = 'testing/data/mysql-bin.gtid-crc32'
+		sid = '3e11fa47-71ca-11e1-9e33-c80aa9429562'
+		parser = YBinlogP(filename)
+		events = list(parser)
+		assert_equal(events[0].event_type, 'PREVIOUS_GTIDS_LOG_EVENT')
+		gtids = [event for event in events if event.event_type == EventType.gtid]
+		assert_equal([event.data.gtid for event in gtids], ['%s:%d' % (sid, i) for i in range(1, 10)])
+		assert_equal([event.data.sequence_number for event in gtids], range(1, 10))
+		# The checksum isn't part of the next file's name
+		assert_equal((events[-1].data.file_name, events[-1].data.next_position), ('mysql-bin.000002', 4))
+		assert_equal(parser.find_gtid('%s:5' % sid), gtids[4].offset)
+		parser.seek(parser.find_gtid('%s:9' % sid))
+		assert_equal([event.event_type for event in parser][:3],
+				[EventType.gtid, EventType.query, 'BEGIN_LOAD_QUERY_EVENT'])
+		try:
+			parser.find_gtid('%s:10' % sid)
+			assert False, 'found a GTID that is not there'
+		except GTIDNotFound:
+			pass
+		parser.close()
+
+	def test_bloom_search(self):
+		tmpdir = tempfile.mkdtemp()
+		try:
+			filename = os.path.join(tmpdir, 'mysql-bin.000001')
+			shutil.copy('testing/data/mysql-bin.default-path', filename)
+			subprocess.check_call(['build/ybinlogp', '-I', filename], stderr=open(os.devnull, 'w'))
+			assert os.path.exists(filename + '.ybpbloom')
+			def search(spec):
+				output = subprocess.check_output(['build/ybinlogp', '-q', '-b', spec, filename],
+						stderr=open(os.devnull, 'w'))
+				return [line.split(' ', 2)[2] for line in output.split('\n') if line]
+			assert_equal(search('table=ybinlogp.test1'),
+					['CREATE TABLE test1(x INT AUTO_INCREMENT PRIMARY KEY) ENGINE=InnoDB'] +
+					['INSERT INTO test1 VALUES(%d)' % i for i in range(1, 8)])
+			assert_equal(search('db=foobar,thread=3'), ['CREATE DATABASE foobar',
+					'CREATE TABLE test2(id INT AUTO_INCREMENT PRIMARY KEY, x VARCHAR(255)) ENGINE=InnoDB',
+					'BEGIN', 'INSERT INTO test2(x) VALUES("This is the winter of our discontent")',
+					'BEGIN', 'INSERT INTO test2(x) VALUES("Tomorrow and tomorrow and tomorrow")',
+					'BEGIN', 'INSERT INTO test2(x) VALUES("Bananas r good")'])
+			assert_equal(search('thread=4'), [])
+			assert_equal(search('db=elsewhere'), [])
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_statement_search(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		def search(*args):
+			output = subprocess.check_output(['build/ybinlogp', '-q'] + list(args) + [filename])
+			return [line.split(' ', 1)[1] for line in output.split('\n') if line]
+		assert_equal(search('-g', 'VALUES(4)'), ['INSERT INTO test1 VALUES(4)'])
+		assert_equal(search('-g', 'bananas'), [])
+		assert_equal(search('-g', 'bananas', '-i'), ['INSERT INTO test2(x) VALUES("Bananas r good")'])
+		assert_equal(search('-e', r'VALUES\([24]\)'),
+				['INSERT INTO test1 VALUES(2)', 'INSERT INTO test1 VALUES(4)'])
+		# The literal picks candidates and the regex confirms them
+		assert_equal(search('-g', 'INSERT', '-e', 'winter|tomorrow'),
+				['INSERT INTO test2(x) VALUES("This is the winter of our discontent")',
+				'INSERT INTO test2(x) VALUES("Tomorrow and tomorrow and tomorrow")'])
+		assert_equal(search('-e', r'good"\)$'), ['INSERT INTO test2(x) VALUES("Bananas r good")'])
+
+	def test_divergence(self):
+		filename = 'testing/data/mysql-bin.gtid-crc32'
+		sid = '3e11fa47-71ca-11e1-9e33-c80aa9429562'
+		tmpdir = tempfile.mkdtemp()
+		try:
+			# A replica that stopped in the middle of the INSERT of GTID 6
+			truncated = os.path.join(tmpdir, 'mysql-bin.000001')
+			with open(filename) as f:
+				open(truncated, 'w').write(f.read()[:1469])
+			compare = subprocess.Popen(['build/ybinlogp', '-c', truncated, filename],
+					stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+			output, summary = compare.communicate()
+			assert_equal(compare.returncode, 0)
+			assert_equal(summary.split(',')[:2], ['4 transactions only in the binlogs given', ' 1 only in %s' % truncated])
+			lines = output.split('\n')
+			assert_equal(lines[:2], ['= %s:1052 1500000005 %s:5' % (filename, sid),
+					'= %s:1052 1500000005 %s:5' % (truncated, sid)])
+			assert_equal([line for line in lines if line.startswith('<')],
+					['< %s:%d %d %s:%d' % (filename, 1328 + 276 * i, 1500000006 + i, sid, 6 + i) for i in range(4)])
+			assert_equal([line for line in lines if line.startswith('>')],
+					['> %s:1328 1500000006 %s:6 (incomplete)' % (truncated, sid)])
+			# Nothing to tell between a binlog and itself
+			output = subprocess.check_output(['build/ybinlogp', '-c', filename, filename],
+					stderr=open(os.devnull, 'w'))
+			assert_equal([line[0] for line in output.split('\n') if line], ['=', '='])
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_scan(self):
+		tmpdir = tempfile.mkdtemp()
+		try:
+			shutil.copy('testing/data/mysql-bin.gtid-crc32', os.path.join(tmpdir, 'mysql-bin.000001'))
+			shutil.copy('testing/data/mysql-bin.default-path', os.path.join(tmpdir, 'mysql-bin.000002'))
+			# Not a binlog's name, so not scanned
+			shutil.copy('testing/data/mysql-bin.default-path', os.path.join(tmpdir, 'notes.txt'))
+			for threads in ('1', '2'):
+				output = subprocess.check_output(['build/ybinlogp', '-A', '-j', threads, '-g', 'INSERT', tmpdir],
+						stderr=open(os.devnull, 'w'))
+				lines = output.split('\n')
+				assert_equal(lines[0], '2 binlogs, 0.0 MB')
+				end = lines.index('timestamps: 1375210957 to 1500000009')
+				assert_equal(lines[end + 1], 'server ids: 1337 1')
+				counts = dict((line.split()[0], (int(line.split()[1]), int(line.split()[2]))) for line in lines[2:end])
+				assert_equal(counts.pop('total'), (74, 5080))
+				assert_equal(sum(events for events, _ in counts.values()), 74)
+				assert_equal(counts['GTID_LOG_EVENT'], (9, 585))
+				assert_equal(counts['XID_EVENT'], (17, 487))
+				matches = lines[lines.index('matching events by binlog') + 1:]
+				assert_equal([line.split() for line in matches if line], [
+						['6', os.path.join(tmpdir, 'mysql-bin.000001'), '(first', 'at', '641)'],
+						['10', os.path.join(tmpdir, 'mysql-bin.000002'), '(first', 'at', '394)'],
+						['16', 'in', 'all']])
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_ybinlogpd_metrics(self):
+		tmpdir = tempfile.mkdtemp()
+		try:
+			filename = os.path.join(tmpdir, 'mysql-bin.000001')
+			metrics_path = os.path.join(tmpdir, 'metrics')
+			data = open('testing/data/mysql-bin.gtid-crc32').read()
+			# Up to GTID 5; what's there at startup is backlog, not arrivals
+			open(filename, 'w').write(data[:1052])
+			daemon, socket_path = start_ybinlogpd(tmpdir, filename, '-M', metrics_path, '-F', '1')
+			try:
+				time.sleep(0.5)
+				with open(filename, 'a') as f:
+					f.write(data[1052:2156])
+				# -F 1 rewrites it while running, not only at exit
+				for _ in range(100):
+					rewritten = os.path.exists(metrics_path) and 'ybinlogp_events_total 16\n' in open(metrics_path).read()
+					if rewritten:
+						break
+					time.sleep(0.05)
+			finally:
+				stop_ybinlogpd(daemon)
+			assert_equal(rewritten, True)
+			metrics = dict(line.split() for line in open(metrics_path) if not line.startswith('#'))
+			assert_equal(metrics['ybinlogp_events_total'], '16')
+			assert_equal(metrics['ybinlogp_bytes_total'], '1104')
+			assert_equal(metrics['ybinlogp_commits_total'], '4')
+			assert_equal(metrics['ybinlogp_last_event_timestamp_seconds'], '1500000008')
+			assert_equal(metrics['ybinlogp_arrival_delay_seconds_count'], '16')
+			assert_equal(metrics['ybinlogp_commit_gap_seconds_count'], '3')
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_load_data(self):
+		filename = 'testing/data/mysql-bin.gtid-crc32'
+		tmpdir = tempfile.mkdtemp()
+		try:
+			load_dir = os.path.join(tmpdir, 'loads')
+			statement = "LOAD DATA LOCAL INFILE '%s/SQL_LOAD_MB-1-1-0' INTO TABLE t FIELDS TERMINATED BY ','" % load_dir
+			output = subprocess.check_output(['build/ybinlogp', '-l', load_dir, filename],
+					stderr=open(os.devnull, 'w'))
+			assert_equal(output.split('\n')[1:3], ['use `ybinlogp`;', statement + ';'])
+			assert_equal(os.listdir(load_dir), ['SQL_LOAD_MB-1-1-0'])
+			# BEGIN_LOAD_QUERY's block, then APPEND_BLOCK's
+			assert_equal(open(os.path.join(load_dir, 'SQL_LOAD_MB-1-1-0')).read(), '7,seven\n8,eight\n9,nine\n')
+
+			shutil.rmtree(load_dir)
+			output = subprocess.check_output(['build/ybinlogp', '-s', '-l', load_dir, '-a', 'all', filename])
+			assert_equal(output.count(statement + '\n/*!*/;\n'), 1)
+			assert 'skipped' not in output
+			# Without -l the load can't be replayed
+			output = subprocess.check_output(['build/ybinlogp', '-s', '-a', 'all', filename])
+			assert_equal(output.count("# (LOAD DATA whose file wasn't rebuilt; skipped)"), 1)
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_checkpoint_resume_checksummed(self):
+		filename = 'testing/data/mysql-bin.gtid-crc32'
+		tmpdir = tempfile.mkdtemp()
+		try:
+			checkpoint = os.path.join(tmpdir, 'checkpoint')
+			parser = YBinlogP(filename, checkpoint=checkpoint, checkpoint_every=1)
+			events = []
+			for event in parser:
+				events.append(event)
+				# Stop in the middle of the fifth transaction, after its BEGIN
+				if (event.event_type == EventType.query and
+						event.data.statement.startswith('INSERT INTO t VALUES (3,')):
+					break
+			parser.close()
+			assert_equal(load_checkpoint(checkpoint), (filename, events[-3].offset))
+
+			# The checkpoint is before the GTID, not after the BEGIN
+			parser = YBinlogP(filename, resume=checkpoint)
+			resumed = list(parser)
+			parser.close()
+			assert_equal(events[-4].event_type, EventType.xid)
+			assert_equal(resumed[0].event_type, EventType.gtid)
+			assert_equal(resumed[0].offset, events[-3].offset)
+
+			# Rotations are followed without the checksum in the name
+			assert_equal(load_checkpoint(checkpoint), ('testing/data/mysql-bin.000002', 4))
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_ybinlogpd_fan_out(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename)
+		expected = [(0, event.offset, event.event_type) for event in parser]
+		parser.close()
+		tmpdir = tempfile.mkdtemp()
+		daemon, socket_path = start_ybinlogpd(tmpdir, filename)
+		try:
+			# Neither a client that never says hello...
+			silent = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+			silent.connect(socket_path)
+			# ...nor one that gets the handshake wrong holds anyone up
+			rude = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+			rude.connect(socket_path)
+			rude.sendall('x' * 16)
+			assert_equal(consume(socket_path, len(expected)), expected)
+			assert_equal(consume(socket_path, len(expected)), expected)
+			rude.settimeout(10)
+			assert_equal(rude.recv(64), '')
+			silent.close()
+			rude.close()
+		finally:
+			stop_ybinlogpd(daemon)
+			shutil.rmtree(tmpdir)
+
+	def test_time_search_checksummed(self):
+		filename = 'testing/data/mysql-bin.gtid-crc32'
+		parser = YBinlogP(filename)
+		events = [(int(time.mktime(event.time.timetuple())), event.offset) for event in parser]
+		for t in range(events[0][0], events[-1][0] + 1):
+			expected = min(offset for timestamp, offset in events if timestamp >= t)
+			assert_equal(parser.first_offset_after_time(t), expected)
+			# Probing several places at once finds the same event
+			output = subprocess.check_output(['build/ybinlogp', '-t', str(t), '-p', '4', '-a', '1', filename])
+			assert_equal(output.split('\n')[0], 'BYTE OFFSET %d' % expected)
+		try:
+			parser.first_offset_after_time(events[-1][0] + 1)
+			assert False, 'found an event after the last one'
+		except NoEventsAfterTime:
+			pass
+		parser.seek(events[0][1])
+		shapes = parser.top_shapes(2)
+		parser.close()
+		assert_equal([(s.shape, s.count, s.sample) for s in shapes],
+				[('begin', 7, 'BEGIN'), ('insert into t values (?+)', 6, "INSERT INTO t VALUES (1, 'row 1')")])
+
+	def test_merge_truncated_source(self):
+		tmpdir = tempfile.mkdtemp()
+		try:
+			truncated = os.path.join(tmpdir, 'mysql-bin.truncated')
+			with open('testing/data/mysql-bin.gtid-crc32') as f:
+				# Cut in the middle of the BEGIN after GTID 3
+				open(truncated, 'w').write(f.read()[:600])
+			merge = subprocess.Popen(['build/ybinlogp', '-m', '-a', 'all', truncated,
+					'testing/data/mysql-bin.default-path'],
+					stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+			output, errors = merge.communicate()
+			assert_equal(merge.returncode, 1)
+			assert_equal(errors, 'Error reading %s\n' % truncated)
+			sources = [line.split()[1] for line in output.split('\n') if line.startswith('SOURCE ')]
+			assert_equal(sources.count('mysql-bin.default-path'), 38)
+			assert_equal(sources.count('mysql-bin.truncated'), 6)
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_sql_replay_from_start(self):
+		output = subprocess.check_output(['build/ybinlogp', '-s', '-o', '0', '-a', 'all',
+				'testing/data/mysql-bin.gtid-crc32'])
+		# The FDE is only applied once, by the preamble
+		assert_equal(output.count('# at 4\n'), 1)
+		assert_equal(output.count("BINLOG '\n"), 1)
+		statements = [line for line in output.split('\n')
+				if line.startswith('use ') or line.startswith('CREATE ')]
+		# CREATE DATABASE can't run in the database it creates
+		assert_equal(statements, ['CREATE DATABASE ybinlogp', 'use `ybinlogp`/*!*/;',
+				'CREATE TABLE t (id INT PRIMARY KEY, x VARCHAR(32))'])
+
+	def test_sessions_into_new_dir(self):
+		tmpdir = tempfile.mkdtemp()
+		try:
+			session_dir = os.path.join(tmpdir, 'sessions')
+			subprocess.check_call(['build/ybinlogp', '-R', session_dir, 'testing/data/mysql-bin.gtid-crc32'],
+					stderr=open(os.devnull, 'w'))
+			assert_equal(sorted(os.listdir(session_dir)), ['thread-10.log', 'thread-11.log', 'thread-12.log'])
+			statements = [line.split(None, 1)[1] for line in open(os.path.join(session_dir, 'thread-11.log'))
+					if line.startswith('statement:')]
+			assert_equal(statements, ['BEGIN\n', "INSERT INTO t VALUES (1, 'row 1')\n",
+					'BEGIN\n', "INSERT INTO t VALUES (3, 'row 3')\n",
+					'BEGIN\n', "INSERT INTO t VALUES (5, 'row 5')\n"])
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_default_output_status_vars(self):
+		# Status vars past Q_TABLE_MAP_FOR_UPDATE_CODE, MariaDB's, and one
+		# nobody knows the length of
+		output = subprocess.check_output(['build/ybinlogp', '-o', '0', '-a', 'all',
+				'testing/data/mysql-bin.status-vars'])
+		assert_equal([line for line in output.split('\n') if line.startswith('Q_') or line.startswith('unknown')], [
+				'Q_FLAGS2:           ' + '0' * 32, 'Q_MASTER_DATA_WRITTEN_CODE', 'Q_INVOKER',
+				'Q_UPDATED_DB_NAMES', 'Q_MICROSECONDS', 'Q_EXPLICIT_DEFAULTS_FOR_TIMESTAMP', 'Q_HRNOW', 'Q_XID',
+				'Q_CHARSET:          (33,33,8)',
+				'Q_FLAGS2:           ' + '0' * 32, 'unknown status var 250; not showing the rest'])
+		assert_equal([line for line in output.split('\n') if line.startswith('statement:')],
+				['statement:          CREATE TABLE t (id INT PRIMARY KEY)', 'statement:          DROP TABLE t'])
+
+		output = subprocess.check_output(['build/ybinlogp', '-o', '0', '-a', 'all',
+				'testing/data/mysql-bin.gtid-crc32'])
+		assert_equal(output.count('BYTE OFFSET'), 37)
+		assert_equal(output.count('Q_SQL_MODE:'), 15)
+		assert "statement:          INSERT INTO t VALUES (6, 'row 6')\n" in output
+
+	def test_cdc_resume(self):
+		data = open('testing/data/mysql-bin.gtid-crc32').read()
+		tmpdir = tempfile.mkdtemp()
+		try:
+			filename = os.path.join(tmpdir, 'mysql-bin.000001')
+			whole = os.path.join(tmpdir, 'whole')
+			resumed = os.path.join(tmpdir, 'resumed')
+			def route(to):
+				subprocess.check_call(['build/ybinlogp', '-P', to, filename], stderr=open(os.devnull, 'w'))
+			open(filename, 'w').write(data)
+			route(whole)
+			# Stopped in the middle of the INSERT of GTID 6...
+			open(filename, 'w').write(data[:1469])
+			route(resumed)
+			manifest = open(os.path.join(resumed, 'manifest')).read().split('\n')
+			assert_equal(manifest[1:3], [filename, '1328'])
+			# ...and in the middle of a group commit after that: partitions
+			# written past the manifest, one it doesn't list yet, and a
+			# manifest that was never renamed into place
+			with open(os.path.join(resumed, 'ybinlogp.t.binlog'), 'a') as f:
+				f.write(data[1328:1604])
+			open(os.path.join(resumed, 'ybinlogp.u.binlog'), 'w').write(data[:1000])
+			open(os.path.join(resumed, 'manifest.tmp'), 'w').write('ybinlogp-cdc 1\n')
+			open(filename, 'w').write(data)
+			route(resumed)
+
+			assert_equal(sorted(os.listdir(resumed)), ['manifest', 'ybinlogp.binlog', 'ybinlogp.t.binlog'])
+			for name in ('manifest', 'ybinlogp.binlog', 'ybinlogp.t.binlog'):
+				assert_equal(open(os.path.join(resumed, name)).read(), open(os.path.join(whole, name)).read())
+			partition = os.path.join(resumed, 'ybinlogp.t.binlog')
+			events = checked_events(open(partition).read())
+			# The source's GTID events (33) go along with their transactions
+			assert_equal([type_code for _, type_code in events], [15, 33, 2] + [33, 2, 2, 16] * 6)
+			parser = YBinlogP(partition)
+			events = list(parser)
+			parser.close()
+			statements = [event.data.statement for event in events if event.event_type == EventType.query]
+			gtids = [event.data.gtid for event in events if event.event_type == EventType.gtid]
+			assert_equal(statements[-2:], ['BEGIN', "INSERT INTO t VALUES (6, 'row 6')"])
+			assert_equal(gtids, ['3e11fa47-71ca-11e1-9e33-c80aa9429562:%d' % i for i in range(2, 9)])
+			events = checked_events(open(os.path.join(resumed, 'ybinlogp.binlog')).read())
+			assert_equal([type_code for _, type_code in events], [15, 33, 2])
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_compact_rows(self):
+		filename = 'testing/data/mysql-bin.rows'
+		def compact(filename, *args):
+			process = subprocess.Popen(['build/ybinlogp'] + list(args) + [filename],
+					stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+			output, summary = process.communicate()
+			assert_equal(process.returncode, 0)
+			return sorted(output.split('\n')[:-1]), summary.split('\n')[-2]
+		rows, summary = compact(filename, '-k', '-')
+		assert_equal(summary, '1012 row images read, 0 without their key columns, 0 row events skipped, 0 spills')
+		rows = [json.loads(line) for line in rows]
+		items = dict((row['row']['id'], (row['op'], row['row'])) for row in rows if row['table'] == 'items')
+		assert_equal(sorted((key, op) for key, (op, _) in items.items()), [(1, 'insert'), (2, 'update'),
+				(3, 'delete'), (4, 'update'), (5, 'delete'), (6, 'insert'), (105, 'update')])
+		assert_equal(items[2][1]['name'], u'renamed "two"\n\xff')
+		assert_equal(items[4][1]['price'], '-7.50')
+		assert_equal(items[105][1], {'id': 105, 'name': 'item 105', 'price': '105.25',
+				'ts': '2024-01-02 03:04:05.678', 'flag': 200})
+		counters = dict((row['row']['n'], row['op']) for row in rows if row['table'] == 'counters')
+		assert_equal(sorted(counters), range(1, 1001))
+		assert_equal(sorted(n for n, op in counters.items() if op == 'delete'), [500, 1000])
+
+		# Past 1KB the rows are spilled, and merged back the same
+		spilled, summary = compact(filename, '-z', '1K', '-k', '-')
+		assert summary.endswith(' 1 spills'), summary
+		assert_equal([json.loads(line) for line in spilled], rows)
+
+		tmpdir = tempfile.mkdtemp()
+		try:
+			rewritten = os.path.join(tmpdir, 'mysql-bin.000001')
+			compact(filename, '-z', '1K', '-K', rewritten)
+			events = checked_events(open(rewritten).read())
+			assert_equal(events[-1][1], 3)
+			parser = YBinlogP(rewritten)
+			assert_equal(len(list(parser)), len(events) - 1)
+			parser.close()
+			# It replays to the same rows, as inserts and deletes
+			replayed, _ = compact(rewritten, '-k', '-')
+			assert_equal(sorted((row['table'], row['op'] == 'delete', row['row']) for row in map(json.loads, replayed)),
+					sorted((row['table'], row['op'] == 'delete', row['row']) for row in rows))
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_read_limit(self):
+		filename = 'testing/data/mysql-bin.long-query'
+		statement = 'INSERT INTO test1(x) VALUES ' + ','.join('(%d)' % i for i in range(1000))
+		parser = YBinlogP(filename, read_limit=256)
+		events = []
+		for event in parser:
+			if event.event_type == EventType.query and event.data.db_name == 'ybinlogp':
+				# Cut short, but the rest is there to page through
+				assert_equal(event.data.statement, statement[:len(event.data.statement)])
+				assert len(event.data.statement) < 256, len(event.data.statement)
+				chunks = []
+				while True:
+					chunk = parser.read_body(sum(map(len, chunks)), 1000)
+					if not chunk:
+						break
+					chunks.append(chunk)
+				body = ''.join(chunks)
+				assert_equal(len(chunks), 6)
+				assert_equal(body[-len(statement):], statement)
+				assert_equal(parser.read_body(len(body) - 5, 1000), statement[-5:])
+			events.append(event.event_type)
+		parser.close()
+		# Which doesn't cost the events after it
+		assert_equal(events, [EventType.query, EventType.query, EventType.xid, EventType.rotate])
+
+		output = subprocess.check_output(['build/ybinlogp', '-o', '0', '-a', 'all', '-L', '256', filename])
+		assert 'STATEMENT TRUNCATED after 275 of 5958 bytes of the event\n' in output
+		assert_equal(output.count('BYTE OFFSET'), 5)
+
+	def test_sample(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		sample = lambda path, spec: subprocess.check_output(['build/ybinlogp', '-S', spec, path])
+		output = sample(filename, '4,512,7')
+		assert_equal(output, sample(filename, '4,512,7'))
+		assert_equal(output.split('\n')[0], '31 events in 4 samples of 512 bytes (78.77% of the binlog)')
+		assert 'type QUERY_EVENT ' in output
+
+		data = open(filename).read()
+		tmpdir = tempfile.mkdtemp()
+		try:
+			# A window ending in an event still being written stops short of it
+			torn = os.path.join(tmpdir, 'torn')
+			for cut in (2640, 2660):
+				open(torn, 'w').write(data[:cut])
+				output = sample(torn, '20,1000,7')
+				assert output.split('\n')[0].endswith(' events in 20 samples of 1000 bytes (%.2f%% of the binlog)'
+						% (2000000.0 / (cut - 98))), output
+			# Nothing past the FDE is nothing to divide by
+			open(torn, 'w').write(data[:98])
+			assert_equal(sample(torn, '4,512,7'), 'No events after the FDE to sample\n')
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_slice(self):
+		filename = 'testing/data/mysql-bin.gtid-crc32'
+		sid = '3e11fa47-71ca-11e1-9e33-c80aa9429562'
+		tmpdir = tempfile.mkdtemp()
+		try:
+			# From an INSERT in the third transaction to one in the sixth,
+			# widened to the whole of both
+			sliced = os.path.join(tmpdir, 'mysql-bin.000001')
+			parser = YBinlogP(filename)
+			parser.seek(641)
+			assert_equal(parser.slice(sliced, 1469, 'mysql-bin.000099'), 16)
+			parser.close()
+			events = checked_events(open(sliced).read())
+			assert_equal([type_code for _, type_code in events], [15] + [33, 2, 2, 16] * 4 + [4])
+			parser = YBinlogP(sliced)
+			events = list(parser)
+			parser.close()
+			assert_equal([event.data.gtid for event in events if event.event_type == EventType.gtid],
+					['%s:%d' % (sid, i) for i in range(3, 7)])
+			assert_equal((events[-1].data.file_name, events[-1].data.next_position), ('mysql-bin.000099', 4))
+
+			# The CLI's slices end in a STOP
+			subprocess.check_call(['build/ybinlogp', '-o', '1500', '-O', '2400', '-x', sliced, filename],
+					stderr=open(os.devnull, 'w'))
+			events = checked_events(open(sliced).read())
+			assert_equal([type_code for _, type_code in events], [15] + [33, 2, 2, 16] * 3 + [33, 2, 17, 9, 18, 16, 3])
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_ybinlogpd_follows_checksummed_rotate(self):
+		tmpdir = tempfile.mkdtemp()
+		try:
+			first = os.path.join(tmpdir, 'mysql-bin.000001')
+			shutil.copy('testing/data/mysql-bin.gtid-crc32', first)
+			shutil.copy('testing/data/mysql-bin.default-path', os.path.join(tmpdir, 'mysql-bin.000002'))
+			expected = []
+			for file_seq, name in enumerate(['mysql-bin.000001', 'mysql-bin.000002']):
+				parser = YBinlogP(os.path.join(tmpdir, name))
+				expected.extend((file_seq, event.offset, event.event_type) for event in parser)
+				parser.close()
+			daemon, socket_path = start_ybinlogpd(tmpdir, first)
+			try:
+				# The ROTATE's checksum isn't taken for part of the next name
+				assert_equal(consume(socket_path, len(expected)), expected)
+			finally:
+				stop_ybinlogpd(daemon)
+		finally:
+			shutil.rmtree(tmpdir)
+
+	def test_ybinlogpd_gives_up_on_corrupt_event(self):
+		filename = 'testing/data/mysql-bin.default-path'
+		parser = YBinlogP(filename)
+		events = list(parser)
+		parser.close()
+		tmpdir = tempfile.mkdtemp()
+		try:
+			# All 40 bytes of an event of no known type, where the ROTATE was
+			corrupt = os.path.join(tmpdir, 'mysql-bin.000001')
+			with open(filename, 'rb') as f:
+				data = f.read(events[-1].offset)
+			with open(corrupt, 'wb') as f:
+				f.write(data + struct.pack('<IBIIIH', 0, 0, 1, 40, 0, 0) + '\0' * 21)
+			daemon, _ = start_ybinlogpd(tmpdir, corrupt)
+			signal.alarm(10)
+			try:
+				assert_equal(daemon.wait(), 1)
+			finally:
+				signal.alarm(0)
+		finally:
+			shutil.rmtree(tmpdir)
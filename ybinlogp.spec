@@ -26,7 +26,8 @@ make
 %install
 install -D -m 444 src/ybinlogp.h $RPM_BUILD_ROOT/usr/include/ybinlogp.h
 install -D -m 755 build/ybinlogp $RPM_BUILD_ROOT/usr/sbin/ybinlogp
-install -D -m 555 build/libybinlogp.so.1 $RPM_BUILD_ROOT/usr/lib64/libybinlogp.so.1
+install -D -m 755 build/ybinlogpd $RPM_BUILD_ROOT/usr/sbin/ybinlogpd
+install -D -m 555 build/libybinlogp.so.2 $RPM_BUILD_ROOT/usr/lib64/libybinlogp.so.2
 install -D -m 555 build/libybinlogp.so $RPM_BUILD_ROOT/usr/lib64/libybinlogp.so
 install -D -d src/ybinlogp $RPM_BUILD_ROOT/usr/lib64/python2.6/site-packages/ybinlogp
 
@@ -36,7 +37,8 @@ rm -rf $RPM_BUILD_ROOT
 %files
 /usr/include/ybinlogp.h
 /usr/sbin/ybinlogp
-/usr/lib64/libybinlogp.so.1
+/usr/sbin/ybinlogpd
+/usr/lib64/libybinlogp.so.2
 /usr/lib64/libybinlogp.so
 /usr/lib64/python2.6/site-packages/ybinlogp
 %defattr(-,root,root)